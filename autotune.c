@@ -0,0 +1,340 @@
+#include <includes/common.h>
+#include <includes/autotune.h>
+
+/* Number of timed runs per candidate, the fastest of which is kept */
+#define AUTOTUNE_RUNS 3
+
+static size_t tile_sizes[] = {256, 1024, 4096};
+
+static char* pass_names[] = {"forward", "backward"};
+
+static tuning_entry* entries = NULL;
+static size_t num_entries = 0;
+static size_t entries_capacity = 0;
+
+static char cpu_model[256] = "";
+static char* tuning_filename = NULL;
+
+static pthread_mutex_t tuning_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t time_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Tuning results only hold for the cpu they were measured on */
+static char* get_cpu_model(void) {
+	if(cpu_model[0] != '\0') {
+		return cpu_model;
+	}
+
+	strcpy(cpu_model, "unknown");
+
+	FILE* f = fopen("/proc/cpuinfo", "r");
+	if(!f) {
+		return cpu_model;
+	}
+
+	char line[512];
+	while(fgets(line, sizeof(line), f)) {
+		if(strncmp(line, "model name", 10) != 0) {
+			continue;
+		}
+
+		char* value = strchr(line, ':');
+		if(!value) {
+			continue;
+		}
+
+		/* Skip the separator and whitespace, then strip the newline */
+		value += 1;
+		while(*value == ' ' || *value == '\t') {
+			value += 1;
+		}
+		value[strcspn(value, "\n")] = '\0';
+
+		snprintf(cpu_model, sizeof(cpu_model), "%s", value);
+		break;
+	}
+	fclose(f);
+
+	/* Tabs separate fields in the tuning file */
+	for(int i = 0; cpu_model[i] != '\0'; i += 1) {
+		if(cpu_model[i] == '\t') {
+			cpu_model[i] = ' ';
+		}
+	}
+	return cpu_model;
+}
+
+static tuning_entry* find_entry(kernel_pass pass, size_t input_width, size_t output_width, size_t batch_size) {
+	for(size_t i = 0; i < num_entries; i += 1) {
+		tuning_entry* entry = &entries[i];
+		if(entry->pass == pass && entry->input_width == input_width && entry->output_width == output_width && entry->batch_size == batch_size) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static int add_entry(tuning_entry* entry) {
+
+	/* Grow the table if we need to */
+	if(num_entries == entries_capacity) {
+		size_t new_capacity = entries_capacity ? entries_capacity * 2 : 16;
+		tuning_entry* new_entries = realloc(entries, sizeof(tuning_entry) * new_capacity);
+		if(!new_entries) {
+			error("Failed to grow tuning table\n");
+			return -1;
+		}
+		entries = new_entries;
+		entries_capacity = new_capacity;
+	}
+
+	entries[num_entries] = *entry;
+	num_entries += 1;
+	return 0;
+}
+
+static void save_entry(tuning_entry* entry) {
+	if(!tuning_filename) {
+		return;
+	}
+
+	FILE* f = fopen(tuning_filename, "a");
+	if(!f) {
+		error("Failed to open tuning file\n");
+		return;
+	}
+
+	fprintf(f, "%s\t%s\t%zu\t%zu\t%zu\t%s\t%s\t%zu\n", get_cpu_model(), pass_names[entry->pass], entry->input_width, entry->output_width, entry->batch_size, KERNEL_PRECISION, kernel_variants[entry->choice.variant].name, entry->choice.tile);
+	fclose(f);
+}
+
+static int find_variant(char* name) {
+	for(size_t i = 0; i < num_kernel_variants; i += 1) {
+		if(strcmp(kernel_variants[i].name, name) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+int autotune_load(char* filename) {
+	pthread_mutex_lock(&tuning_lock);
+
+	/* Remember where to save anything we tune from now on */
+	free(tuning_filename);
+	tuning_filename = strdup(filename);
+	if(!tuning_filename) {
+		pthread_mutex_unlock(&tuning_lock);
+		error("Failed to allocate tuning filename\n");
+		return -1;
+	}
+
+	/* A missing file just means nothing has been tuned yet */
+	FILE* f = fopen(filename, "r");
+	if(!f) {
+		pthread_mutex_unlock(&tuning_lock);
+		return 0;
+	}
+
+	char line[1024];
+	while(fgets(line, sizeof(line), f)) {
+		line[strcspn(line, "\n")] = '\0';
+
+		/* Split the line into its tab separated fields */
+		char* fields[8];
+		int num_fields = 0;
+		char* save;
+		char* token = strtok_r(line, "\t", &save);
+		while(token != NULL && num_fields < 8) {
+			fields[num_fields] = token;
+			num_fields += 1;
+			token = strtok_r(NULL, "\t", &save);
+		}
+
+		if(num_fields != 8) {
+			error("Skipping malformed tuning entry\n");
+			continue;
+		}
+
+		/* Ignore entries tuned on other cpus or at other precisions */
+		if(strcmp(fields[0], get_cpu_model()) != 0 || strcmp(fields[5], KERNEL_PRECISION) != 0) {
+			continue;
+		}
+
+		int variant = find_variant(fields[6]);
+		if(variant < 0) {
+			continue;
+		}
+
+		tuning_entry entry;
+		entry.pass = strcmp(fields[1], pass_names[PASS_BACKWARD]) == 0 ? PASS_BACKWARD : PASS_FORWARD;
+		entry.input_width = strtoull(fields[2], NULL, 10);
+		entry.output_width = strtoull(fields[3], NULL, 10);
+		entry.batch_size = strtoull(fields[4], NULL, 10);
+		entry.choice.variant = variant;
+		entry.choice.tile = strtoull(fields[7], NULL, 10);
+
+		if(entry.choice.tile == 0 && kernel_variants[variant].tiled) {
+			continue;
+		}
+
+		/* Later entries win */
+		tuning_entry* existing = find_entry(entry.pass, entry.input_width, entry.output_width, entry.batch_size);
+		if(existing) {
+			*existing = entry;
+			continue;
+		}
+
+		if(add_entry(&entry) != 0) {
+			break;
+		}
+	}
+	fclose(f);
+
+	info("[*] Loaded %zu tuned kernels for %s\n", num_entries, get_cpu_model());
+
+	pthread_mutex_unlock(&tuning_lock);
+	return 0;
+}
+
+void autotune_free(void) {
+	pthread_mutex_lock(&tuning_lock);
+	free(entries);
+	free(tuning_filename);
+	entries = NULL;
+	tuning_filename = NULL;
+	num_entries = 0;
+	entries_capacity = 0;
+	pthread_mutex_unlock(&tuning_lock);
+}
+
+typedef struct {
+	neuron* neurons;
+	size_t num_neurons;
+	double* inputs;
+	size_t num_inputs;
+	double* sums;
+	double* common_terms;
+	double* next_derivatives;
+	double* weight_derivatives;
+} tuning_problem;
+
+static uint64_t time_candidate(kernel_pass pass, tuning_problem* problem, kernel_choice choice) {
+	kernel_variant* variant = &kernel_variants[choice.variant];
+	uint64_t best = UINT64_MAX;
+
+	/* The first run warms the caches and isn't counted */
+	for(int run = 0; run <= AUTOTUNE_RUNS; run += 1) {
+		uint64_t start = time_ns();
+
+		if(pass == PASS_FORWARD) {
+			variant->forward(problem->neurons, 0, problem->num_neurons, problem->inputs, problem->num_inputs, problem->sums, choice.tile);
+		}
+		else {
+			variant->backward(problem->neurons, 0, problem->num_neurons, problem->common_terms, problem->inputs, problem->next_derivatives, problem->weight_derivatives, problem->num_inputs, choice.tile);
+		}
+
+		uint64_t elapsed = time_ns() - start;
+		if(run > 0 && elapsed < best) {
+			best = elapsed;
+		}
+	}
+	return best;
+}
+
+static kernel_choice tune(kernel_pass pass, tuning_problem* problem) {
+	kernel_choice best_choice = {.variant=0, .tile=0};
+
+	/* Small layers aren't worth the time it takes to tune them */
+	if(problem->num_neurons * problem->num_inputs < AUTOTUNE_MIN_WEIGHTS) {
+		return best_choice;
+	}
+
+	pthread_mutex_lock(&tuning_lock);
+
+	tuning_entry* existing = find_entry(pass, problem->num_inputs, problem->num_neurons, 1);
+	if(existing) {
+		best_choice = existing->choice;
+		pthread_mutex_unlock(&tuning_lock);
+		return best_choice;
+	}
+
+	/* Try every variant, and every tile size smaller than the input for the tiled ones */
+	uint64_t best_time = UINT64_MAX;
+	for(size_t v = 0; v < num_kernel_variants; v += 1) {
+		size_t num_tiles = kernel_variants[v].tiled ? sizeof(tile_sizes) / sizeof(size_t) : 1;
+
+		for(size_t t = 0; t < num_tiles; t += 1) {
+			kernel_choice choice = {.variant=v, .tile=kernel_variants[v].tiled ? tile_sizes[t] : 0};
+			if(kernel_variants[v].tiled && choice.tile >= problem->num_inputs) {
+				continue;
+			}
+
+			uint64_t elapsed = time_candidate(pass, problem, choice);
+			if(elapsed < best_time) {
+				best_time = elapsed;
+				best_choice = choice;
+			}
+		}
+	}
+
+	info("[*] Tuned %s kernel for %zux%zu: %s/%zu\n", pass_names[pass], problem->num_inputs, problem->num_neurons, kernel_variants[best_choice.variant].name, best_choice.tile);
+
+	/* Keep the winner for the rest of this run and any future ones */
+	tuning_entry entry = {.pass=pass, .input_width=problem->num_inputs, .output_width=problem->num_neurons, .batch_size=1, .choice=best_choice};
+	if(add_entry(&entry) == 0) {
+		save_entry(&entry);
+	}
+
+	pthread_mutex_unlock(&tuning_lock);
+	return best_choice;
+}
+
+/* Forward candidates sum into a scratch buffer, so the layer is left alone */
+kernel_choice autotune_forward(neuron* neurons, size_t num_neurons, double* inputs, size_t num_inputs) {
+	kernel_choice ret = {.variant=0, .tile=0};
+	if(num_neurons * num_inputs < AUTOTUNE_MIN_WEIGHTS) {
+		return ret;
+	}
+
+	tuning_problem problem = {.neurons=neurons, .num_neurons=num_neurons, .inputs=inputs, .num_inputs=num_inputs};
+	problem.sums = calloc(num_neurons, sizeof(double));
+	if(!problem.sums) {
+		error("Failed to allocate tuning buffers\n");
+		return ret;
+	}
+
+	ret = tune(PASS_FORWARD, &problem);
+
+	free(problem.sums);
+	return ret;
+}
+
+/* Backward candidates run with zero derivatives, which leaves the weight derivatives untouched */
+kernel_choice autotune_backward(neuron* neurons, size_t num_neurons, double* weight_derivatives, double* prev_outputs, size_t num_inputs) {
+	kernel_choice ret = {.variant=0, .tile=0};
+	if(num_neurons * num_inputs < AUTOTUNE_MIN_WEIGHTS) {
+		return ret;
+	}
+
+	tuning_problem problem = {.neurons=neurons, .num_neurons=num_neurons, .inputs=prev_outputs, .num_inputs=num_inputs, .weight_derivatives=weight_derivatives};
+	problem.common_terms = calloc(num_neurons, sizeof(double));
+	problem.next_derivatives = calloc(num_inputs, sizeof(double));
+
+	if(!problem.common_terms || !problem.next_derivatives) {
+		error("Failed to allocate tuning buffers\n");
+		free(problem.common_terms);
+		free(problem.next_derivatives);
+		return ret;
+	}
+
+	ret = tune(PASS_BACKWARD, &problem);
+
+	free(problem.common_terms);
+	free(problem.next_derivatives);
+	return ret;
+}
@@ -0,0 +1,307 @@
+#include <includes/common.h>
+#include <includes/buffers.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+/* From the kernels mempolicy.h, so we don't need libnuma */
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+_Static_assert(sizeof(buffer_header) <= BUFFER_ALIGNMENT, "buffer header has to fit in front of a heap buffer");
+
+static huge_page_mode huge_pages = HUGE_PAGES_TRANSPARENT;
+
+static _Atomic uint64_t num_allocations;
+static _Atomic uint64_t live_bytes;
+static _Atomic uint64_t peak_bytes;
+static _Atomic uint64_t heap_bytes;
+static _Atomic uint64_t mapped_bytes;
+static _Atomic uint64_t explicit_huge_bytes;
+static _Atomic uint64_t transparent_huge_bytes;
+static _Atomic uint64_t huge_fallbacks;
+static _Atomic uint64_t bind_failures;
+
+/* Mapped buffers, which are few and large, so a locked list searched by address is plenty */
+static pthread_mutex_t mapped_lock = PTHREAD_MUTEX_INITIALIZER;
+static buffer_header* mapped_buffers = NULL;
+
+void buffer_set_huge_pages(huge_page_mode mode) {
+	huge_pages = mode;
+}
+
+static void count_allocation(size_t len) {
+	atomic_fetch_add(&num_allocations, 1);
+	uint64_t live = atomic_fetch_add(&live_bytes, len) + len;
+
+	uint64_t peak = atomic_load(&peak_bytes);
+	while(live > peak && !atomic_compare_exchange_weak(&peak_bytes, &peak, live));
+}
+
+/* Prefer a node for a mapping before anything touches it, which the kernel may refuse on machines without NUMA */
+static void bind_to_node(void* mapping, size_t len, int node) {
+	if(node < 0 || node >= BUFFER_MAX_NODES) {
+		return;
+	}
+
+	unsigned long mask = 1UL << node;
+	if(syscall(SYS_mbind, mapping, len, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0) != 0) {
+		atomic_fetch_add(&bind_failures, 1);
+	}
+}
+
+/* The header stays off the mapping, so the first thread to write a page is always the one that uses it */
+static buffer_header* map_buffer(size_t len, int node) {
+	buffer_header* header = malloc(sizeof(buffer_header));
+	if(!header) {
+		return NULL;
+	}
+
+	size_t mapped_len = len;
+	bool huge = mapped_len >= BUFFER_HUGE_PAGE_SIZE && huge_pages != HUGE_PAGES_OFF;
+	bool explicit_huge = false;
+	bool transparent_huge = false;
+	void* mapping = MAP_FAILED;
+
+	/* Huge pages have to be mapped whole */
+	if(huge) {
+		mapped_len = (mapped_len + BUFFER_HUGE_PAGE_SIZE - 1) / BUFFER_HUGE_PAGE_SIZE * BUFFER_HUGE_PAGE_SIZE;
+	}
+
+	/* Reserved huge pages are taken when the mapping is made, so there's no surprise later if they've run out */
+	if(huge && huge_pages == HUGE_PAGES_EXPLICIT) {
+		mapping = mmap(NULL, mapped_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		explicit_huge = mapping != MAP_FAILED;
+		if(!explicit_huge) {
+			atomic_fetch_add(&huge_fallbacks, 1);
+		}
+	}
+
+	if(mapping == MAP_FAILED) {
+
+		/* Transparent huge pages only back aligned ranges, so map a huge page extra and trim it to start on one */
+		size_t map_len = huge ? mapped_len + BUFFER_HUGE_PAGE_SIZE : mapped_len;
+		mapping = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(mapping == MAP_FAILED) {
+			free(header);
+			return NULL;
+		}
+
+		if(huge) {
+			uintptr_t start = (uintptr_t)mapping;
+			uintptr_t aligned = (start + BUFFER_HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(BUFFER_HUGE_PAGE_SIZE - 1);
+			if(aligned > start) {
+				munmap(mapping, aligned - start);
+			}
+			if(start + map_len > aligned + mapped_len) {
+				munmap((void*)(aligned + mapped_len), start + map_len - (aligned + mapped_len));
+			}
+			mapping = (void*)aligned;
+		}
+
+		/* Only a hint, kernels without transparent huge pages keep using small ones */
+		transparent_huge = huge && madvise(mapping, mapped_len, MADV_HUGEPAGE) == 0;
+	}
+
+	bind_to_node(mapping, mapped_len, node);
+
+	header->len = len;
+	header->mapping = mapping;
+	header->mapped_len = mapped_len;
+	header->explicit_huge = explicit_huge;
+	header->transparent_huge = transparent_huge;
+	header->prev = NULL;
+
+	pthread_mutex_lock(&mapped_lock);
+	header->next = mapped_buffers;
+	if(mapped_buffers) {
+		mapped_buffers->prev = header;
+	}
+	mapped_buffers = header;
+	pthread_mutex_unlock(&mapped_lock);
+
+	atomic_fetch_add(&mapped_bytes, mapped_len);
+	if(explicit_huge) {
+		atomic_fetch_add(&explicit_huge_bytes, mapped_len);
+	}
+	if(transparent_huge) {
+		atomic_fetch_add(&transparent_huge_bytes, mapped_len);
+	}
+	return header;
+}
+
+static void* allocate(size_t len, int node, bool zero) {
+	if(len >= BUFFER_MAP_THRESHOLD) {
+		buffer_header* header = map_buffer(len, node);
+		if(!header) {
+			return NULL;
+		}
+		count_allocation(len);
+		return header->mapping;
+	}
+
+	void* memory;
+	if(posix_memalign(&memory, BUFFER_ALIGNMENT, len + BUFFER_ALIGNMENT) != 0) {
+		return NULL;
+	}
+
+	buffer_header* header = memory;
+	header->len = len;
+	header->mapped_len = 0;
+	header->mapping = NULL;
+	atomic_fetch_add(&heap_bytes, len);
+	if(zero) {
+		bzero((char*)header + BUFFER_ALIGNMENT, len);
+	}
+
+	count_allocation(len);
+	return (char*)header + BUFFER_ALIGNMENT;
+}
+
+void* buffer_alloc(size_t len, int node) {
+	return allocate(len, node, false);
+}
+
+void* buffer_calloc(size_t count, size_t size, int node) {
+	if(size && count > SIZE_MAX / size) {
+		return NULL;
+	}
+	return allocate(count * size, node, true);
+}
+
+/* Take a mapped buffers header off the list, NULL if the buffer is on the heap */
+static buffer_header* unlink_mapped(void* buffer) {
+	pthread_mutex_lock(&mapped_lock);
+	buffer_header* header = mapped_buffers;
+	while(header && header->mapping != buffer) {
+		header = header->next;
+	}
+
+	if(header) {
+		if(header->prev) {
+			header->prev->next = header->next;
+		}
+		else {
+			mapped_buffers = header->next;
+		}
+		if(header->next) {
+			header->next->prev = header->prev;
+		}
+	}
+	pthread_mutex_unlock(&mapped_lock);
+	return header;
+}
+
+void buffer_free(void* buffer) {
+	if(!buffer) {
+		return;
+	}
+
+	buffer_header* header = unlink_mapped(buffer);
+	if(!header) {
+		header = (buffer_header*)((char*)buffer - BUFFER_ALIGNMENT);
+		atomic_fetch_sub(&live_bytes, header->len);
+		atomic_fetch_sub(&heap_bytes, header->len);
+		free(header);
+		return;
+	}
+
+	atomic_fetch_sub(&live_bytes, header->len);
+	atomic_fetch_sub(&mapped_bytes, header->mapped_len);
+	if(header->explicit_huge) {
+		atomic_fetch_sub(&explicit_huge_bytes, header->mapped_len);
+	}
+	if(header->transparent_huge) {
+		atomic_fetch_sub(&transparent_huge_bytes, header->mapped_len);
+	}
+	munmap(header->mapping, header->mapped_len);
+	free(header);
+}
+
+void buffer_get_stats(buffer_stats* stats) {
+	stats->allocations = atomic_load(&num_allocations);
+	stats->live_bytes = atomic_load(&live_bytes);
+	stats->peak_bytes = atomic_load(&peak_bytes);
+	stats->heap_bytes = atomic_load(&heap_bytes);
+	stats->mapped_bytes = atomic_load(&mapped_bytes);
+	stats->explicit_huge_bytes = atomic_load(&explicit_huge_bytes);
+	stats->transparent_huge_bytes = atomic_load(&transparent_huge_bytes);
+	stats->huge_fallbacks = atomic_load(&huge_fallbacks);
+	stats->bind_failures = atomic_load(&bind_failures);
+}
+
+/* Ask the kernel which node each page of a mapping is on, pages nothing has touched yet aren't on any */
+#define PLACEMENT_BATCH 512
+
+static void count_pages(buffer_header* header, uint64_t* node_bytes, uint64_t* untouched_bytes) {
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	size_t num_pages = header->mapped_len / page_size;
+
+	void* pages[PLACEMENT_BATCH];
+	int status[PLACEMENT_BATCH];
+
+	for(size_t first = 0; first < num_pages; first += PLACEMENT_BATCH) {
+		size_t count = num_pages - first < PLACEMENT_BATCH ? num_pages - first : PLACEMENT_BATCH;
+		for(size_t i = 0; i < count; i += 1) {
+			pages[i] = (char*)header->mapping + (first + i) * page_size;
+		}
+
+		/* Without nodes to move to, move_pages only reports where each page is */
+		if(syscall(SYS_move_pages, 0, count, pages, NULL, status, 0) != 0) {
+			*untouched_bytes += count * page_size;
+			continue;
+		}
+
+		for(size_t i = 0; i < count; i += 1) {
+			if(status[i] >= 0 && status[i] < BUFFER_MAX_NODES) {
+				node_bytes[status[i]] += page_size;
+			}
+			else {
+				*untouched_bytes += page_size;
+			}
+		}
+	}
+}
+
+/* How much of the process the kernel actually backed with transparent huge pages */
+static uint64_t anon_huge_bytes(void) {
+	FILE* f = fopen("/proc/self/smaps_rollup", "r");
+	if(!f) {
+		return 0;
+	}
+
+	char line[256];
+	uint64_t kilobytes = 0;
+	while(fgets(line, sizeof(line), f)) {
+		if(sscanf(line, "AnonHugePages: %" SCNu64 " kB", &kilobytes) == 1) {
+			break;
+		}
+	}
+	fclose(f);
+	return kilobytes * 1024;
+}
+
+void buffer_print_stats(void) {
+	buffer_stats stats;
+	buffer_get_stats(&stats);
+
+	uint64_t node_bytes[BUFFER_MAX_NODES] = {0};
+	uint64_t untouched_bytes = 0;
+
+	pthread_mutex_lock(&mapped_lock);
+	for(buffer_header* header = mapped_buffers; header; header = header->next) {
+		count_pages(header, node_bytes, &untouched_bytes);
+	}
+	pthread_mutex_unlock(&mapped_lock);
+
+	printf("[*] Buffers: %" PRIu64 " allocations, %" PRIu64 " bytes live (%" PRIu64 " peak), %" PRIu64 " on the heap, %" PRIu64 " mapped\n", stats.allocations, stats.live_bytes, stats.peak_bytes, stats.heap_bytes, stats.mapped_bytes);
+	printf("[*] Huge pages: %" PRIu64 " bytes reserved, %" PRIu64 " bytes advised transparent (%" PRIu64 " backed process wide), %" PRIu64 " fallbacks\n", stats.explicit_huge_bytes, stats.transparent_huge_bytes, anon_huge_bytes(), stats.huge_fallbacks);
+	printf("[*] Mapped pages: %" PRIu64 " bytes untouched, %" PRIu64 " node binding failures\n", untouched_bytes, stats.bind_failures);
+	for(int node = 0; node < BUFFER_MAX_NODES; node += 1) {
+		if(node_bytes[node]) {
+			printf("[*] node %-3d %" PRIu64 " bytes\n", node, node_bytes[node]);
+		}
+	}
+}
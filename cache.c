@@ -0,0 +1,330 @@
+#include <includes/common.h>
+#include <includes/cache.h>
+#include <inttypes.h>
+
+/* The murmur3 finaliser, which spreads every input bit over the whole result */
+static uint64_t mix(uint64_t x) {
+	x ^= x >> 33;
+	x *= 0xFF51AFD7ED558CCDULL;
+	x ^= x >> 33;
+	x *= 0xC4CEB9FE1A85EC53ULL;
+	x ^= x >> 33;
+	return x;
+}
+
+/* Hash the input a double at a time, along with everything else that changes the result */
+static uint64_t hash_input(uint64_t version, double* input, size_t input_len, size_t output_len) {
+	uint64_t hash = mix(version ^ mix(input_len) ^ (output_len << 32));
+
+	for(size_t i = 0; i < input_len; i += 1) {
+		uint64_t bits;
+		memcpy(&bits, &input[i], sizeof(bits));
+
+		hash ^= bits;
+		hash = (hash << 27) | (hash >> 37);
+		hash *= 0x9E3779B97F4A7C15ULL;
+	}
+	return mix(hash);
+}
+
+/* The top bits pick the shard, the bottom bits the bucket */
+static cache_shard* hash_shard(inference_cache* cache, uint64_t hash) {
+	return &cache->shards[hash >> 60];
+}
+
+static void free_shards(inference_cache* cache, int num_shards);
+
+inference_cache* cache_create(size_t budget) {
+	inference_cache* cache = malloc(sizeof(inference_cache));
+	if(!cache) {
+		error("Failed to allocate inference cache\n");
+		return NULL;
+	}
+	bzero(cache, sizeof(inference_cache));
+
+	for(int i = 0; i < CACHE_SHARDS; i += 1) {
+		cache_shard* shard = &cache->shards[i];
+
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->budget = budget / CACHE_SHARDS;
+		shard->num_buckets = CACHE_INITIAL_BUCKETS;
+		shard->buckets = calloc(shard->num_buckets, sizeof(cache_entry*));
+
+		/* Later shards haven't been set up yet, so only free up to this one */
+		if(!shard->buckets) {
+			error("Failed to allocate inference cache buckets\n");
+			free_shards(cache, i + 1);
+			free(cache);
+			return NULL;
+		}
+	}
+
+	atomic_init(&cache->hits, 0);
+	atomic_init(&cache->misses, 0);
+	atomic_init(&cache->insertions, 0);
+	atomic_init(&cache->evictions, 0);
+	return cache;
+}
+
+static void free_entry(cache_entry* entry) {
+	free(entry->input);
+	free(entry->output);
+	free(entry);
+}
+
+static void free_shards(inference_cache* cache, int num_shards) {
+	for(int i = 0; i < num_shards; i += 1) {
+		cache_shard* shard = &cache->shards[i];
+
+		cache_entry* entry = shard->newest;
+		while(entry) {
+			cache_entry* older = entry->older;
+			free_entry(entry);
+			entry = older;
+		}
+
+		free(shard->buckets);
+		pthread_mutex_destroy(&shard->lock);
+	}
+}
+
+void cache_free(inference_cache* cache) {
+	free_shards(cache, CACHE_SHARDS);
+	free(cache);
+}
+
+static void lru_unlink(cache_shard* shard, cache_entry* entry) {
+	if(entry->newer) {
+		entry->newer->older = entry->older;
+	}
+	else {
+		shard->newest = entry->older;
+	}
+
+	if(entry->older) {
+		entry->older->newer = entry->newer;
+	}
+	else {
+		shard->oldest = entry->newer;
+	}
+}
+
+static void lru_push(cache_shard* shard, cache_entry* entry) {
+	entry->newer = NULL;
+	entry->older = shard->newest;
+
+	if(shard->newest) {
+		shard->newest->newer = entry;
+	}
+	shard->newest = entry;
+
+	if(!shard->oldest) {
+		shard->oldest = entry;
+	}
+}
+
+/* Find an entry for exactly this input, the caller holds the shard lock */
+static cache_entry* find_entry(cache_shard* shard, uint64_t hash, uint64_t version, double* input, size_t input_len, size_t output_len) {
+	cache_entry* entry = shard->buckets[hash & (shard->num_buckets - 1)];
+
+	for(; entry; entry = entry->next) {
+		if(entry->hash != hash || entry->version != version || entry->input_len != input_len || entry->output_len != output_len) {
+			continue;
+		}
+
+		/* The hash only narrows it down, the input has to match too */
+		if(memcmp(entry->input, input, input_len * sizeof(double)) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+static void remove_entry(cache_shard* shard, cache_entry* entry) {
+	cache_entry** link = &shard->buckets[entry->hash & (shard->num_buckets - 1)];
+	while(*link != entry) {
+		link = &(*link)->next;
+	}
+	*link = entry->next;
+
+	lru_unlink(shard, entry);
+	shard->num_entries -= 1;
+	shard->used -= entry->size;
+}
+
+/* Double the buckets once a shard has more entries than buckets, keeping chains short */
+static void grow_buckets(cache_shard* shard) {
+	size_t num_buckets = shard->num_buckets * 2;
+	cache_entry** buckets = calloc(num_buckets, sizeof(cache_entry*));
+
+	/* Longer chains still work, so just carry on if we can't */
+	if(!buckets) {
+		return;
+	}
+
+	for(size_t i = 0; i < shard->num_buckets; i += 1) {
+		cache_entry* entry = shard->buckets[i];
+		while(entry) {
+			cache_entry* next = entry->next;
+			cache_entry** bucket = &buckets[entry->hash & (num_buckets - 1)];
+
+			entry->next = *bucket;
+			*bucket = entry;
+			entry = next;
+		}
+	}
+
+	free(shard->buckets);
+	shard->buckets = buckets;
+	shard->num_buckets = num_buckets;
+}
+
+/* Copy out an entry for exactly this input, into output or, when that's NULL, a buffer allocated only once it's a hit */
+static double* lookup(inference_cache* cache, uint64_t version, double* input, size_t input_len, double* output, size_t output_len) {
+	uint64_t hash = hash_input(version, input, input_len, output_len);
+	cache_shard* shard = hash_shard(cache, hash);
+
+	pthread_mutex_lock(&shard->lock);
+
+	cache_entry* entry = find_entry(shard, hash, version, input, input_len, output_len);
+	if(!entry) {
+		pthread_mutex_unlock(&shard->lock);
+		atomic_fetch_add(&cache->misses, 1);
+		return NULL;
+	}
+
+	if(!output) {
+		output = malloc(sizeof(double) * output_len);
+		if(!output) {
+			pthread_mutex_unlock(&shard->lock);
+			error("Failed to allocate output buffer\n");
+			return NULL;
+		}
+	}
+
+	/* Copy the result out while we still hold the lock, then mark it most recently used */
+	memcpy(output, entry->output, sizeof(double) * output_len);
+	lru_unlink(shard, entry);
+	lru_push(shard, entry);
+
+	pthread_mutex_unlock(&shard->lock);
+
+	atomic_fetch_add(&cache->hits, 1);
+	return output;
+}
+
+double* cache_lookup(inference_cache* cache, uint64_t version, double* input, size_t input_len, size_t output_len) {
+	return lookup(cache, version, input, input_len, NULL, output_len);
+}
+
+bool cache_lookup_into(inference_cache* cache, uint64_t version, double* input, size_t input_len, double* output, size_t output_len) {
+	return lookup(cache, version, input, input_len, output, output_len) != NULL;
+}
+
+void cache_insert(inference_cache* cache, uint64_t version, double* input, size_t input_len, double* output, size_t output_len) {
+	uint64_t hash = hash_input(version, input, input_len, output_len);
+	cache_shard* shard = hash_shard(cache, hash);
+
+	size_t size = sizeof(cache_entry) + (input_len + output_len) * sizeof(double);
+
+	/* Results larger than a shard could ever hold aren't worth evicting everything for */
+	if(size > shard->budget) {
+		return;
+	}
+
+	/* Copy everything before taking the lock, so other callers aren't held up by it */
+	cache_entry* new_entry = malloc(sizeof(cache_entry));
+	if(!new_entry) {
+		return;
+	}
+	new_entry->hash = hash;
+	new_entry->version = version;
+	new_entry->input_len = input_len;
+	new_entry->output_len = output_len;
+	new_entry->size = size;
+	new_entry->input = malloc(sizeof(double) * input_len);
+	new_entry->output = malloc(sizeof(double) * output_len);
+
+	if(!new_entry->input || !new_entry->output) {
+		free_entry(new_entry);
+		return;
+	}
+	memcpy(new_entry->input, input, sizeof(double) * input_len);
+	memcpy(new_entry->output, output, sizeof(double) * output_len);
+
+	pthread_mutex_lock(&shard->lock);
+
+	/* Someone else may have got here first with the same input */
+	if(find_entry(shard, hash, version, input, input_len, output_len)) {
+		pthread_mutex_unlock(&shard->lock);
+		free_entry(new_entry);
+		return;
+	}
+
+	/* Evict the least recently used entries until we fit */
+	size_t num_evicted = 0;
+	while(shard->used + size > shard->budget) {
+		cache_entry* oldest = shard->oldest;
+		remove_entry(shard, oldest);
+		free_entry(oldest);
+		num_evicted += 1;
+	}
+
+	cache_entry** bucket = &shard->buckets[hash & (shard->num_buckets - 1)];
+	new_entry->next = *bucket;
+	*bucket = new_entry;
+	lru_push(shard, new_entry);
+
+	shard->num_entries += 1;
+	shard->used += size;
+
+	if(shard->num_entries > shard->num_buckets) {
+		grow_buckets(shard);
+	}
+
+	pthread_mutex_unlock(&shard->lock);
+
+	atomic_fetch_add(&cache->insertions, 1);
+	atomic_fetch_add(&cache->evictions, num_evicted);
+}
+
+double* cache_propogate(inference_cache* cache, execution_context* context, uint64_t version, double* input, size_t input_len, size_t output_len) {
+	double* output = cache_lookup(cache, version, input, input_len, output_len);
+	if(output) {
+		return output;
+	}
+
+	output = propogate_context_forward(context, input, input_len, output_len);
+	if(output) {
+		cache_insert(cache, version, input, input_len, output, output_len);
+	}
+	return output;
+}
+
+void cache_get_stats(inference_cache* cache, cache_stats* stats) {
+	stats->hits = atomic_load(&cache->hits);
+	stats->misses = atomic_load(&cache->misses);
+	stats->insertions = atomic_load(&cache->insertions);
+	stats->evictions = atomic_load(&cache->evictions);
+	stats->entries = 0;
+	stats->bytes = 0;
+
+	for(int i = 0; i < CACHE_SHARDS; i += 1) {
+		cache_shard* shard = &cache->shards[i];
+
+		pthread_mutex_lock(&shard->lock);
+		stats->entries += shard->num_entries;
+		stats->bytes += shard->used;
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+void cache_print_stats(inference_cache* cache) {
+	cache_stats stats;
+	cache_get_stats(cache, &stats);
+
+	uint64_t lookups = stats.hits + stats.misses;
+	double hit_rate = lookups ? (100.0 * stats.hits) / lookups : 0;
+
+	printf("[*] Inference cache: %" PRIu64 " hits, %" PRIu64 " misses (%.1f%% hit rate), %" PRIu64 " evictions, %zu entries in %zu bytes\n", stats.hits, stats.misses, hit_rate, stats.evictions, stats.entries, stats.bytes);
+}
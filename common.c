@@ -24,12 +24,28 @@ double* buf_to_bits(char* buf, size_t* out_size, size_t buf_len) {
 }
 
 
+double* buf_to_bytes(char* buf, size_t* out_size, size_t buf_len) {
+
+	/* Each byte takes up a single double holding its value, for embedding layers */
+	*out_size = buf_len * sizeof(double);
+	double* ret_array = malloc(*out_size);
+	if(!ret_array) {
+		error("Failed to allocate byte array\n");
+		return NULL;
+	}
+
+	for(size_t i = 0; i < buf_len; i += 1) {
+		ret_array[i] = (double)(unsigned char)buf[i];
+	}
+	return ret_array;
+}
+
+
 size_t get_file_size(char* filename) {
 	/* Open the file */
 	FILE* f = fopen(filename, "rb");
 	if(!f) {
 		error("Failed to open file\n");
-		fclose(f);
 		return 0;
 	}
 
@@ -47,7 +63,6 @@ int read_file(char* filename, char** out_buf, size_t* file_len) {
 	FILE* f = fopen(filename, "rb");
 	if(!f) {
 		error("Failed to open file\n");
-		fclose(f);
 		return -1;
 	}
 	
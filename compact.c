@@ -0,0 +1,778 @@
+#include <includes/common.h>
+#include <includes/compact.h>
+#include <stdatomic.h>
+
+#define PROB_SCALE (1 << COMPACT_PROB_BITS)
+
+/* The rANS state is kept between RANS_LOW and RANS_LOW << 8, moving a byte at a time */
+#define RANS_LOW (1u << 23)
+
+#define NUM_SYMBOLS 256
+
+/* Round a double to the nearest half, ties to even, saturating to infinity */
+static uint16_t double_to_half(double value) {
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+
+	uint16_t sign = (bits >> 48) & 0x8000;
+	int exponent = (int)((bits >> 52) & 0x7FF) - 1023 + 15;
+	uint64_t mantissa = bits & 0xFFFFFFFFFFFFFULL;
+
+	/* Infinity and NaN keep their kind */
+	if(((bits >> 52) & 0x7FF) == 0x7FF) {
+		return sign | 0x7C00 | (mantissa ? 0x200 : 0);
+	}
+
+	if(exponent >= 31) {
+		return sign | 0x7C00;
+	}
+
+	/* Too small even for a subnormal */
+	if(exponent < -10) {
+		return sign;
+	}
+
+	/* Subnormals lose the implicit leading bit into the mantissa */
+	int shift = 42;
+	if(exponent <= 0) {
+		mantissa |= 1ULL << 52;
+		shift = 43 - exponent;
+		exponent = 0;
+	}
+
+	uint16_t half = sign | (exponent << 10) | (mantissa >> shift);
+	uint64_t remainder = mantissa & ((1ULL << shift) - 1);
+	uint64_t halfway = 1ULL << (shift - 1);
+
+	/* Rounding up can carry into the exponent, which is still the right answer */
+	if(remainder > halfway || (remainder == halfway && (half & 1))) {
+		half += 1;
+	}
+	return half;
+}
+
+static double half_to_double(uint16_t half) {
+	uint64_t sign = (uint64_t)(half & 0x8000) << 48;
+	uint64_t exponent = (half >> 10) & 0x1F;
+	uint64_t mantissa = half & 0x3FF;
+
+	/* Subnormals are just the mantissa scaled, which is exact */
+	if(exponent == 0) {
+		return (half & 0x8000) ? -(mantissa * 0x1p-24) : mantissa * 0x1p-24;
+	}
+
+	/* Infinity and NaN, or rebias a normal exponent */
+	exponent = exponent == 31 ? 0x7FF : exponent - 15 + 1023;
+
+	uint64_t bits = sign | (exponent << 52) | (mantissa << 42);
+	double value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+/* The top half of the nearest float, rounded to nearest even */
+static uint16_t double_to_bfloat(double value) {
+	float single = value;
+	uint32_t bits;
+	memcpy(&bits, &single, sizeof(bits));
+
+	if(isnan(single)) {
+		return (bits >> 16) | 0x40;
+	}
+	return (bits + 0x7FFF + ((bits >> 16) & 1)) >> 16;
+}
+
+static double bfloat_to_double(uint16_t bfloat) {
+	uint32_t bits = (uint32_t)bfloat << 16;
+	float single;
+	memcpy(&single, &bits, sizeof(single));
+	return single;
+}
+
+/* Every value of a layer, in the order they're written */
+static size_t layer_num_values(neural_network* network, int layer_index) {
+	layer* curr_layer = &network->layers[layer_index];
+	if(layer_index == 0) {
+		return 0;
+	}
+
+	size_t num_rows = layer_rows(curr_layer);
+	size_t num_values = num_rows * layer_row_len(network, layer_index);
+
+	if(row_bias(curr_layer, 0)) {
+		num_values += num_rows;
+	}
+	if(curr_layer->type == LAYER_DENSE && curr_layer->recurrent) {
+		num_values += curr_layer->num_neurons;
+	}
+	return num_values;
+}
+
+/* How many of a layers values are stored as signs, which are always its weights */
+static size_t layer_num_signs(neural_network* network, int layer_index, uint8_t flags) {
+	if(!(flags & COMPACT_SIGNS) || network->layers[layer_index].type != LAYER_BINARY) {
+		return 0;
+	}
+	return layer_rows(&network->layers[layer_index]) * layer_row_len(network, layer_index);
+}
+
+/* Where a layers value at index lives, rows of weights first, then the biases, then the recurrent weights */
+static double* layer_value(neural_network* network, int layer_index, size_t index, size_t* contiguous) {
+	layer* curr_layer = &network->layers[layer_index];
+	size_t num_rows = layer_rows(curr_layer);
+	size_t row_len = layer_row_len(network, layer_index);
+
+	/* The rest of a row always follows on in memory */
+	if(index < num_rows * row_len) {
+		*contiguous = row_len - index % row_len;
+		return &row_weights(curr_layer, index / row_len, row_len)[index % row_len];
+	}
+	index -= num_rows * row_len;
+
+	*contiguous = 1;
+	if(row_bias(curr_layer, 0)) {
+		if(index < num_rows) {
+			return row_bias(curr_layer, index);
+		}
+		index -= num_rows;
+	}
+	return &curr_layer->layer_neurons[index].recurrent_weight;
+}
+
+/* Scale symbol counts to frequencies adding up to PROB_SCALE, keeping every symbol that appears */
+static int normalise_frequencies(uint32_t* counts, size_t total, uint16_t* freqs) {
+	uint32_t sum = 0;
+	int largest = 0;
+
+	for(int s = 0; s < NUM_SYMBOLS; s += 1) {
+		freqs[s] = 0;
+		if(!counts[s]) {
+			continue;
+		}
+
+		freqs[s] = ((uint64_t)counts[s] * PROB_SCALE) / total;
+		if(freqs[s] == 0) {
+			freqs[s] = 1;
+		}
+		sum += freqs[s];
+
+		if(counts[s] > counts[largest]) {
+			largest = s;
+		}
+	}
+
+	/* Rounding leaves the total a little off, which the most common symbol can absorb */
+	if(sum > PROB_SCALE && freqs[largest] <= sum - PROB_SCALE) {
+		return -1;
+	}
+	freqs[largest] += PROB_SCALE - sum;
+	return 0;
+}
+
+/* rANS code a stream into the end of out, returning where the coded bytes start or NULL if they wouldn't fit */
+static uint8_t* rans_encode(uint8_t* in, size_t in_len, uint16_t* freqs, uint8_t* out, size_t out_len) {
+	uint32_t starts[NUM_SYMBOLS];
+	uint32_t start = 0;
+	for(int s = 0; s < NUM_SYMBOLS; s += 1) {
+		starts[s] = start;
+		start += freqs[s];
+	}
+
+	uint8_t* ptr = &out[out_len];
+	uint32_t state = RANS_LOW;
+
+	/* rANS works backwards, so the decoder can go forwards */
+	for(size_t i = in_len; i > 0; i -= 1) {
+		uint8_t symbol = in[i-1];
+		uint32_t freq = freqs[symbol];
+
+		uint32_t max_state = ((RANS_LOW >> COMPACT_PROB_BITS) << 8) * freq;
+		while(state >= max_state) {
+			if(ptr == out) {
+				return NULL;
+			}
+			*--ptr = state & 0xFF;
+			state >>= 8;
+		}
+		state = ((state / freq) << COMPACT_PROB_BITS) + (state % freq) + starts[symbol];
+	}
+
+	if(ptr - out < 4) {
+		return NULL;
+	}
+	ptr -= 4;
+	for(int i = 0; i < 4; i += 1) {
+		ptr[i] = (state >> (i * 8)) & 0xFF;
+	}
+	return ptr;
+}
+
+static int rans_decode(uint8_t* in, size_t in_len, uint16_t* freqs, uint8_t* out, size_t out_len) {
+	uint32_t starts[NUM_SYMBOLS];
+	uint8_t symbols[PROB_SCALE];
+
+	uint32_t start = 0;
+	for(int s = 0; s < NUM_SYMBOLS; s += 1) {
+		if(freqs[s] > PROB_SCALE - start) {
+			return -1;
+		}
+		starts[s] = start;
+		memset(&symbols[start], s, freqs[s]);
+		start += freqs[s];
+	}
+
+	if(start != PROB_SCALE || in_len < 4) {
+		return -1;
+	}
+
+	uint32_t state = in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24);
+	uint8_t* ptr = &in[4];
+	uint8_t* end = &in[in_len];
+
+	for(size_t i = 0; i < out_len; i += 1) {
+		uint32_t slot = state & (PROB_SCALE - 1);
+		uint8_t symbol = symbols[slot];
+
+		out[i] = symbol;
+		state = freqs[symbol] * (state >> COMPACT_PROB_BITS) + slot - starts[symbol];
+
+		while(state < RANS_LOW) {
+			if(ptr == end) {
+				return -1;
+			}
+			state = (state << 8) | *ptr++;
+		}
+	}
+	return 0;
+}
+
+/* Write a stream entropy coded, or as it is if that's smaller */
+static int write_stream(uint8_t* bytes, size_t len, FILE* f) {
+	compact_stream_header header = {.raw_len=len, .coded_len=0};
+
+	uint32_t counts[NUM_SYMBOLS] = {0};
+	for(size_t i = 0; i < len; i += 1) {
+		counts[bytes[i]] += 1;
+	}
+
+	uint16_t freqs[NUM_SYMBOLS];
+	uint8_t* coded = NULL;
+	uint8_t* coded_start = NULL;
+
+	if(len && normalise_frequencies(counts, len, freqs) == 0) {
+		coded = malloc(len);
+		if(!coded) {
+			error("Failed to allocate compression buffer\n");
+			return -1;
+		}
+
+		/* Only worth it if the frequencies pay for themselves */
+		size_t budget = len > sizeof(freqs) ? len - sizeof(freqs) : 0;
+		coded_start = budget ? rans_encode(bytes, len, freqs, coded, budget) : NULL;
+		if(coded_start) {
+			header.coded_len = &coded[budget] - coded_start;
+		}
+	}
+
+	fwrite(&header, sizeof(header), 1, f);
+	if(header.coded_len) {
+		fwrite(freqs, sizeof(freqs), 1, f);
+		fwrite(coded_start, 1, header.coded_len, f);
+	}
+	else {
+		fwrite(bytes, 1, len, f);
+	}
+
+	free(coded);
+	return 0;
+}
+
+/* A bit per weight, set for weights of at least 0, each block coded as one stream */
+static int write_sign_blocks(neural_network* network, int layer_index, size_t num_signs, uint8_t* bytes, FILE* f) {
+	for(size_t first = 0; first < num_signs; first += COMPACT_BLOCK_SIGNS) {
+		size_t block_signs = num_signs - first < COMPACT_BLOCK_SIGNS ? num_signs - first : COMPACT_BLOCK_SIGNS;
+		bzero(bytes, (block_signs + 7) / 8);
+
+		for(size_t i = 0; i < block_signs;) {
+			size_t contiguous;
+			double* value = layer_value(network, layer_index, first + i, &contiguous);
+
+			for(size_t j = 0; j < contiguous && i < block_signs; j += 1, i += 1) {
+				bytes[i / 8] |= (value[j] >= 0) << (i % 8);
+			}
+		}
+
+		if(write_stream(bytes, (block_signs + 7) / 8, f) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* How many streams a block is split into */
+static size_t block_streams(uint8_t flags) {
+	return (flags & COMPACT_SHUFFLE) ? 2 : 1;
+}
+
+static int write_block(neural_network* network, int layer_index, size_t first, size_t num_values, compact_precision precision, uint8_t flags, uint16_t* values, uint8_t* bytes, FILE* f) {
+
+	/* Gather the values, a row at a time where we can */
+	for(size_t i = 0; i < num_values;) {
+		size_t contiguous;
+		double* value = layer_value(network, layer_index, first + i, &contiguous);
+
+		for(size_t j = 0; j < contiguous && i < num_values; j += 1, i += 1) {
+			values[i] = precision == PRECISION_BF16 ? double_to_bfloat(value[j]) : double_to_half(value[j]);
+		}
+	}
+
+	/* Neighbouring weights are often close, so their differences are small */
+	if(flags & COMPACT_DELTA) {
+		for(size_t i = num_values - 1; i > 0; i -= 1) {
+			values[i] -= values[i-1];
+		}
+	}
+
+	/* The high bytes hold the sign and exponent, which code far better on their own */
+	if(flags & COMPACT_SHUFFLE) {
+		for(size_t i = 0; i < num_values; i += 1) {
+			bytes[i] = values[i] & 0xFF;
+			bytes[num_values + i] = values[i] >> 8;
+		}
+		if(write_stream(bytes, num_values, f) != 0 || write_stream(&bytes[num_values], num_values, f) != 0) {
+			return -1;
+		}
+		return 0;
+	}
+
+	for(size_t i = 0; i < num_values; i += 1) {
+		bytes[i*2] = values[i] & 0xFF;
+		bytes[i*2 + 1] = values[i] >> 8;
+	}
+	return write_stream(bytes, num_values * 2, f);
+}
+
+int write_compact_network(neural_network* network, FILE* f, compact_precision precision, uint8_t flags) {
+	compact_file_header header;
+	bzero(&header, sizeof(header));
+	header.magic = COMPACT_MAGIC;
+	header.version = COMPACT_VERSION;
+	header.num_layers = network->num_layers;
+	header.precision = precision;
+
+	/* Only the signs of a binary layers weights are ever used */
+	for(int i = 1; i < network->num_layers; i += 1) {
+		if(network->layers[i].type == LAYER_BINARY) {
+			flags |= COMPACT_SIGNS;
+		}
+	}
+	header.flags = flags;
+
+	fwrite(&header, sizeof(header), 1, f);
+
+	uint16_t* values = malloc(sizeof(uint16_t) * COMPACT_BLOCK_VALUES);
+	uint8_t* bytes = malloc(sizeof(uint16_t) * COMPACT_BLOCK_VALUES);
+	if(!values || !bytes) {
+		error("Failed to allocate compression buffers\n");
+		free(values);
+		free(bytes);
+		return -1;
+	}
+
+	for(int i = 0; i < network->num_layers; i += 1) {
+		layer* curr_layer = &network->layers[i];
+
+		size_t num_signs = layer_num_signs(network, i, flags);
+
+		compact_file_layer file_layer;
+		bzero(&file_layer, sizeof(file_layer));
+		file_layer.num_neurons = curr_layer->num_neurons;
+		file_layer.num_values = layer_num_values(network, i) - num_signs;
+		file_layer.num_blocks = (file_layer.num_values + COMPACT_BLOCK_VALUES - 1) / COMPACT_BLOCK_VALUES;
+		file_layer.kernel_size = curr_layer->conv.kernel_size;
+		file_layer.stride = curr_layer->conv.stride;
+		file_layer.channels = curr_layer->conv.channels;
+		file_layer.dim = curr_layer->embedding.dim;
+		file_layer.activation_index = curr_layer->layer_neurons[0].activation_index;
+		file_layer.type = curr_layer->type;
+		file_layer.recurrent = curr_layer->recurrent;
+
+		/* There's only room for one activation per layer */
+		for(size_t j = 1; j < curr_layer->num_neurons; j += 1) {
+			if(curr_layer->layer_neurons[j].activation_index != file_layer.activation_index) {
+				error("Compact networks need the same activation for every neuron in a layer\n");
+				free(values);
+				free(bytes);
+				return -1;
+			}
+		}
+
+		fwrite(&file_layer, sizeof(file_layer), 1, f);
+
+		if(write_sign_blocks(network, i, num_signs, bytes, f) != 0) {
+			free(values);
+			free(bytes);
+			return -1;
+		}
+
+		for(size_t j = 0; j < file_layer.num_blocks; j += 1) {
+			size_t first = j * COMPACT_BLOCK_VALUES;
+			size_t num_values = file_layer.num_values - first < COMPACT_BLOCK_VALUES ? file_layer.num_values - first : COMPACT_BLOCK_VALUES;
+
+			if(write_block(network, i, num_signs + first, num_values, precision, flags, values, bytes, f) != 0) {
+				free(values);
+				free(bytes);
+				return -1;
+			}
+		}
+	}
+
+	free(values);
+	free(bytes);
+	return 0;
+}
+
+int export_compact_network(neural_network* network, char* filename, compact_precision precision, uint8_t flags) {
+	FILE* f = fopen(filename, "wb");
+	if(!f) {
+		error("Failed to open output file\n");
+		return -1;
+	}
+
+	int ret = write_compact_network(network, f, precision, flags);
+	fclose(f);
+	return ret;
+}
+
+/* A block found while reading the file, decoded once they've all been found */
+typedef struct {
+	int layer_index;
+	size_t first;
+	size_t num_values;
+	bool signs; /* A single stream of a bit per value */
+	char* streams;
+} compact_block;
+
+typedef struct {
+	neural_network* network;
+	compact_block* blocks;
+	compact_precision precision;
+	uint8_t flags;
+	atomic_bool failed;
+} compact_decode;
+
+/* Find the end of a stream, checking it fits in the file and holds as many bytes as we expect */
+static int find_stream(char* file_buf, size_t file_length, size_t* file_offset, size_t raw_len) {
+	if(file_length - *file_offset < sizeof(compact_stream_header)) {
+		error("File malformed: not enough space for stream\n");
+		return -1;
+	}
+
+	/* Streams can end anywhere, so their headers aren't aligned */
+	compact_stream_header header;
+	memcpy(&header, &file_buf[*file_offset], sizeof(header));
+	size_t stream_len = header.coded_len ? sizeof(uint16_t) * NUM_SYMBOLS + header.coded_len : header.raw_len;
+
+	if(header.raw_len != raw_len || file_length - *file_offset - sizeof(compact_stream_header) < stream_len) {
+		error("File malformed: stream doesn't match its layer\n");
+		return -1;
+	}
+
+	*file_offset += sizeof(compact_stream_header) + stream_len;
+	return 0;
+}
+
+static int read_stream(char* stream, uint8_t* out, size_t* stream_len) {
+	compact_stream_header header;
+	memcpy(&header, stream, sizeof(header));
+	uint8_t* data = (uint8_t*)&stream[sizeof(compact_stream_header)];
+
+	if(!header.coded_len) {
+		memcpy(out, data, header.raw_len);
+		*stream_len = sizeof(compact_stream_header) + header.raw_len;
+		return 0;
+	}
+
+	uint16_t freqs[NUM_SYMBOLS];
+	memcpy(freqs, data, sizeof(freqs));
+	*stream_len = sizeof(compact_stream_header) + sizeof(freqs) + header.coded_len;
+
+	if(rans_decode(&data[sizeof(freqs)], header.coded_len, freqs, out, header.raw_len) != 0) {
+		error("File malformed: stream doesn't decode\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Decode blocks straight into the networks weights, each thread taking different blocks */
+static void decode_blocks(size_t start, size_t end, void* arg) {
+	compact_decode* decode = arg;
+
+	uint16_t* values = malloc(sizeof(uint16_t) * COMPACT_BLOCK_VALUES);
+	uint8_t* bytes = malloc(sizeof(uint16_t) * COMPACT_BLOCK_VALUES);
+	if(!values || !bytes) {
+		atomic_store(&decode->failed, true);
+		free(values);
+		free(bytes);
+		return;
+	}
+
+	for(size_t j = start; j < end && !atomic_load(&decode->failed); j += 1) {
+		compact_block* block = &decode->blocks[j];
+		size_t num_values = block->num_values;
+		size_t stream_len;
+
+		if(read_stream(block->streams, bytes, &stream_len) != 0) {
+			atomic_store(&decode->failed, true);
+			break;
+		}
+
+		/* Signs become weights of +-1, which is all a binary layer needs of them */
+		if(block->signs) {
+			for(size_t i = 0; i < num_values;) {
+				size_t contiguous;
+				double* value = layer_value(decode->network, block->layer_index, block->first + i, &contiguous);
+
+				for(size_t k = 0; k < contiguous && i < num_values; k += 1, i += 1) {
+					value[k] = ((bytes[i / 8] >> (i % 8)) & 1) ? 1 : -1;
+				}
+			}
+			continue;
+		}
+
+		if(decode->flags & COMPACT_SHUFFLE) {
+			if(read_stream(&block->streams[stream_len], &bytes[num_values], &stream_len) != 0) {
+				atomic_store(&decode->failed, true);
+				break;
+			}
+			for(size_t i = 0; i < num_values; i += 1) {
+				values[i] = bytes[i] | (bytes[num_values + i] << 8);
+			}
+		}
+		else {
+			for(size_t i = 0; i < num_values; i += 1) {
+				values[i] = bytes[i*2] | (bytes[i*2 + 1] << 8);
+			}
+		}
+
+		if(decode->flags & COMPACT_DELTA) {
+			for(size_t i = 1; i < num_values; i += 1) {
+				values[i] += values[i-1];
+			}
+		}
+
+		/* Scatter them into place, a row at a time where we can */
+		for(size_t i = 0; i < num_values;) {
+			size_t contiguous;
+			double* value = layer_value(decode->network, block->layer_index, block->first + i, &contiguous);
+
+			for(size_t k = 0; k < contiguous && i < num_values; k += 1, i += 1) {
+				value[k] = decode->precision == PRECISION_BF16 ? bfloat_to_double(values[i]) : half_to_double(values[i]);
+			}
+		}
+	}
+
+	free(values);
+	free(bytes);
+}
+
+/* Build a network from a compact image, decoding every layers blocks in parallel */
+neural_network* parse_compact_network(char* file_buf, size_t file_length, load_mode mode) {
+	if(file_length < sizeof(compact_file_header)) {
+		error("File too small\n");
+		return NULL;
+	}
+
+	compact_file_header* header = (compact_file_header*)file_buf;
+	if(header->magic != COMPACT_MAGIC || header->version != COMPACT_VERSION) {
+		error("Wrong file magic\n");
+		return NULL;
+	}
+
+	if(header->precision > PRECISION_BF16 || (header->flags & ~(COMPACT_DELTA | COMPACT_SHUFFLE | COMPACT_SIGNS))) {
+		error("File malformed: unknown encoding\n");
+		return NULL;
+	}
+
+	size_t num_layers = header->num_layers;
+	if(num_layers > (file_length - sizeof(compact_file_header)) / sizeof(compact_file_layer)) {
+		error("File malformed: Not enough space for all layers\n");
+		return NULL;
+	}
+
+	bool* recurrent_layer = malloc(sizeof(bool) * num_layers);
+	size_t* layer_sizes = malloc(sizeof(size_t) * num_layers);
+	layer_spec* layer_specs = calloc(num_layers, sizeof(layer_spec));
+	size_t* file_layer_offsets = malloc(sizeof(size_t) * num_layers);
+
+	if(!recurrent_layer || !layer_sizes || !layer_specs || !file_layer_offsets) {
+		error("Failed to allocate layer buffers\n");
+		free(recurrent_layer);
+		free(layer_sizes);
+		free(layer_specs);
+		free(file_layer_offsets);
+		return NULL;
+	}
+
+	/* Find every layer, skipping over its blocks */
+	size_t file_offset = sizeof(compact_file_header);
+	size_t num_blocks = 0;
+	int ret = 0;
+
+	for(size_t i = 0; i < num_layers && ret == 0; i += 1) {
+		if(file_length - file_offset < sizeof(compact_file_layer)) {
+			error("File malformed: Not enough space for all layers\n");
+			ret = -1;
+			break;
+		}
+
+		/* Layers follow on straight after the last block, so aren't aligned either */
+		file_layer_offsets[i] = file_offset;
+		compact_file_layer curr_file_layer;
+		memcpy(&curr_file_layer, &file_buf[file_offset], sizeof(curr_file_layer));
+
+		recurrent_layer[i] = curr_file_layer.recurrent != 0;
+		layer_sizes[i] = curr_file_layer.num_neurons;
+		layer_specs[i] = (layer_spec){.type=curr_file_layer.type, .kernel_size=curr_file_layer.kernel_size, .stride=curr_file_layer.stride, .channels=curr_file_layer.channels, .dim=curr_file_layer.dim};
+
+		if(curr_file_layer.type > LAYER_BINARY || (i == 0 && curr_file_layer.type != LAYER_DENSE)) {
+			error("File malformed: Unknown layer type\n");
+			ret = -1;
+			break;
+		}
+
+		if(curr_file_layer.num_blocks != (curr_file_layer.num_values + COMPACT_BLOCK_VALUES - 1) / COMPACT_BLOCK_VALUES) {
+			error("File malformed: wrong number of blocks\n");
+			ret = -1;
+			break;
+		}
+
+		/* Binary layers weights come first as signs */
+		size_t num_signs = 0;
+		if((header->flags & COMPACT_SIGNS) && i > 0 && curr_file_layer.type == LAYER_BINARY) {
+			if(layer_sizes[i-1] && curr_file_layer.num_neurons > SIZE_MAX / layer_sizes[i-1]) {
+				error("File malformed: layer is larger than its weights\n");
+				ret = -1;
+				break;
+			}
+			num_signs = curr_file_layer.num_neurons * layer_sizes[i-1];
+		}
+
+		/* A layer stores at least a value per neuron and per input, or per part of its shape, so corrupt sizes can't build huge networks */
+		bool has_rows = curr_file_layer.type == LAYER_DENSE || curr_file_layer.type == LAYER_LSTM || curr_file_layer.type == LAYER_GRU || curr_file_layer.type == LAYER_BINARY;
+		size_t num_values = curr_file_layer.num_values + num_signs;
+		if(i > 0 && ((has_rows && (curr_file_layer.num_neurons > num_values || layer_sizes[i-1] > num_values))
+				|| (curr_file_layer.type == LAYER_CONV1D && (curr_file_layer.channels > num_values || curr_file_layer.kernel_size > num_values))
+				|| (curr_file_layer.type == LAYER_EMBEDDING && curr_file_layer.dim > num_values))) {
+			error("File malformed: layer is larger than its weights\n");
+			ret = -1;
+			break;
+		}
+
+		file_offset += sizeof(compact_file_layer);
+		for(size_t first = 0; first < num_signs && ret == 0; first += COMPACT_BLOCK_SIGNS) {
+			size_t block_signs = num_signs - first < COMPACT_BLOCK_SIGNS ? num_signs - first : COMPACT_BLOCK_SIGNS;
+			ret = find_stream(file_buf, file_length, &file_offset, (block_signs + 7) / 8);
+			num_blocks += 1;
+		}
+
+		for(size_t j = 0; j < curr_file_layer.num_blocks && ret == 0; j += 1) {
+			size_t first = j * COMPACT_BLOCK_VALUES;
+			size_t block_values = curr_file_layer.num_values - first < COMPACT_BLOCK_VALUES ? curr_file_layer.num_values - first : COMPACT_BLOCK_VALUES;
+
+			for(size_t k = 0; k < block_streams(header->flags) && ret == 0; k += 1) {
+				ret = find_stream(file_buf, file_length, &file_offset, block_values * 2 / block_streams(header->flags));
+			}
+		}
+		num_blocks += curr_file_layer.num_blocks;
+	}
+
+	neural_network* network = NULL;
+	if(ret == 0) {
+		init_params params = {.scheme=INIT_NONE};
+		network = init_neural_network(recurrent_layer, layer_sizes, layer_specs, num_layers, &params);
+	}
+
+	free(recurrent_layer);
+	free(layer_sizes);
+	free(layer_specs);
+
+	if(!network) {
+		free(file_layer_offsets);
+		return NULL;
+	}
+	network->inference_only = mode == LOAD_INFERENCE;
+
+	compact_decode decode = {.network=network, .precision=header->precision, .flags=header->flags};
+	atomic_init(&decode.failed, false);
+
+	decode.blocks = malloc(sizeof(compact_block) * (num_blocks ? num_blocks : 1));
+	if(!decode.blocks) {
+		error("Failed to allocate block list\n");
+		free(file_layer_offsets);
+		free_neural_network(network);
+		return NULL;
+	}
+
+	/* Now the network's built, check each layer matches it and note down where its blocks are */
+	size_t block_index = 0;
+	for(size_t i = 0; i < num_layers; i += 1) {
+		compact_file_layer curr_file_layer;
+		memcpy(&curr_file_layer, &file_buf[file_layer_offsets[i]], sizeof(curr_file_layer));
+		layer* curr_layer = &network->layers[i];
+
+		size_t num_signs = layer_num_signs(network, i, header->flags);
+		if(curr_file_layer.num_neurons != curr_layer->num_neurons || curr_file_layer.num_values != layer_num_values(network, i) - num_signs) {
+			error("File malformed: layer doesn't match its shape\n");
+			ret = -1;
+			break;
+		}
+
+		for(size_t j = 0; j < curr_layer->num_neurons; j += 1) {
+			curr_layer->layer_neurons[j].activation_index = curr_file_layer.activation_index;
+		}
+
+		size_t offset = file_layer_offsets[i] + sizeof(compact_file_layer);
+		for(size_t first = 0; first < num_signs; first += COMPACT_BLOCK_SIGNS) {
+			compact_block* block = &decode.blocks[block_index];
+			block->layer_index = i;
+			block->first = first;
+			block->num_values = num_signs - first < COMPACT_BLOCK_SIGNS ? num_signs - first : COMPACT_BLOCK_SIGNS;
+			block->signs = true;
+			block->streams = &file_buf[offset];
+
+			find_stream(file_buf, file_length, &offset, (block->num_values + 7) / 8);
+			block_index += 1;
+		}
+
+		for(size_t j = 0; j < curr_file_layer.num_blocks; j += 1) {
+			compact_block* block = &decode.blocks[block_index];
+			block->layer_index = i;
+			size_t first = j * COMPACT_BLOCK_VALUES;
+			block->first = num_signs + first;
+			block->num_values = curr_file_layer.num_values - first < COMPACT_BLOCK_VALUES ? curr_file_layer.num_values - first : COMPACT_BLOCK_VALUES;
+			block->signs = false;
+			block->streams = &file_buf[offset];
+
+			for(size_t k = 0; k < block_streams(header->flags); k += 1) {
+				find_stream(file_buf, file_length, &offset, block->num_values * 2 / block_streams(header->flags));
+			}
+			block_index += 1;
+		}
+	}
+
+	if(ret == 0 && num_blocks) {
+		thread_pool_parallel_for(thread_pool_global(), num_blocks, 1, decode_blocks, &decode);
+	}
+
+	free(decode.blocks);
+	free(file_layer_offsets);
+
+	if(ret != 0 || atomic_load(&decode.failed)) {
+		free_neural_network(network);
+		return NULL;
+	}
+
+	pack_binary_weights(network);
+	return network;
+}
@@ -0,0 +1,412 @@
+#include <includes/common.h>
+#include <includes/compiler.h>
+#include <inttypes.h>
+
+/* C expressions for each entry in activation_functions, in terms of x */
+static char* compiled_activations[] = {"1 / (1 + exp(-x))"};
+
+#define NUM_COMPILED_ACTIVATIONS (sizeof(compiled_activations) / sizeof(char*))
+
+/* Whether every neuron in a layer shares an activation function */
+static bool uniform_activation(layer* curr_layer) {
+	for(int i = 1; i < curr_layer->num_neurons; i += 1) {
+		if(curr_layer->layer_neurons[i].activation_index != curr_layer->layer_neurons[0].activation_index) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void emit_weights(FILE* f, neural_network* network, int layer_index) {
+	layer* curr_layer = &network->layers[layer_index];
+	size_t num_inputs = network->layers[layer_index-1].num_neurons;
+
+	/* Weights are written as hex floats so they round trip exactly */
+	fprintf(f, "static const double layer_%d_weights[%zu][%zu] __attribute__((aligned(64))) = {\n", layer_index, curr_layer->num_neurons, num_inputs);
+	for(int i = 0; i < curr_layer->num_neurons; i += 1) {
+		fprintf(f, "\t{");
+		for(int j = 0; j < num_inputs; j += 1) {
+			fprintf(f, "%a%s", curr_layer->layer_neurons[i].weights[j], (j + 1 < num_inputs) ? ", " : "");
+		}
+		fprintf(f, "},\n");
+	}
+	fprintf(f, "};\n\n");
+
+	fprintf(f, "static const double layer_%d_bias[%zu] __attribute__((aligned(64))) = {", layer_index, curr_layer->num_neurons);
+	for(int i = 0; i < curr_layer->num_neurons; i += 1) {
+		fprintf(f, "%a%s", curr_layer->layer_neurons[i].bias, (i + 1 < curr_layer->num_neurons) ? ", " : "");
+	}
+	fprintf(f, "};\n\n");
+
+	if(curr_layer->recurrent) {
+		fprintf(f, "static const double layer_%d_recurrent_weights[%zu] __attribute__((aligned(64))) = {", layer_index, curr_layer->num_neurons);
+		for(int i = 0; i < curr_layer->num_neurons; i += 1) {
+			fprintf(f, "%a%s", curr_layer->layer_neurons[i].recurrent_weight, (i + 1 < curr_layer->num_neurons) ? ", " : "");
+		}
+		fprintf(f, "};\n\n");
+	}
+
+	/* Mixed activation layers need to know which function each neuron uses */
+	if(!uniform_activation(curr_layer)) {
+		fprintf(f, "static const unsigned int layer_%d_activations[%zu] = {", layer_index, curr_layer->num_neurons);
+		for(int i = 0; i < curr_layer->num_neurons; i += 1) {
+			fprintf(f, "%u%s", curr_layer->layer_neurons[i].activation_index, (i + 1 < curr_layer->num_neurons) ? ", " : "");
+		}
+		fprintf(f, "};\n\n");
+	}
+}
+
+/* The activation applied to a neurons weighted sum, inlined when the layer is uniform */
+static void activation_call(char* out, size_t out_len, layer* curr_layer, int layer_index, char* neuron_index) {
+	if(uniform_activation(curr_layer)) {
+		snprintf(out, out_len, "activation_%u", curr_layer->layer_neurons[0].activation_index);
+		return;
+	}
+	snprintf(out, out_len, "activate(layer_%d_activations[%s], ", layer_index, neuron_index);
+}
+
+static void emit_layer(FILE* f, neural_network* network, int layer_index) {
+	layer* curr_layer = &network->layers[layer_index];
+	size_t num_inputs = network->layers[layer_index-1].num_neurons;
+	bool uniform = uniform_activation(curr_layer);
+	char activation[128];
+
+	fprintf(f, "static inline void layer_%d_forward(const double* restrict in, double* restrict out%s) {\n", layer_index, curr_layer->recurrent ? ", const double* restrict history" : "");
+
+	/* Small layers are unrolled completely */
+	if(curr_layer->num_neurons * num_inputs <= COMPILER_UNROLL_WEIGHTS) {
+		for(int i = 0; i < curr_layer->num_neurons; i += 1) {
+			char index[32];
+			snprintf(index, sizeof(index), "%d", i);
+			activation_call(activation, sizeof(activation), curr_layer, layer_index, index);
+
+			fprintf(f, "\tout[%d] = %s(layer_%d_bias[%d]", i, activation, layer_index, i);
+			if(curr_layer->recurrent) {
+				fprintf(f, " + layer_%d_recurrent_weights[%d] * history[%d]", layer_index, i, i);
+			}
+			for(int j = 0; j < num_inputs; j += 1) {
+				fprintf(f, " + layer_%d_weights[%d][%d] * in[%d]", layer_index, i, j, j);
+			}
+			fprintf(f, "%s;\n", uniform ? ")" : "))");
+		}
+		fprintf(f, "}\n\n");
+		return;
+	}
+
+	activation_call(activation, sizeof(activation), curr_layer, layer_index, "i");
+
+	fprintf(f, "\tfor(size_t i = 0; i < %zu; i += 1) {\n", curr_layer->num_neurons);
+	fprintf(f, "\t\tdouble sum = layer_%d_bias[i];\n", layer_index);
+	if(curr_layer->recurrent) {
+		fprintf(f, "\t\tsum += layer_%d_recurrent_weights[i] * history[i];\n", layer_index);
+	}
+	fprintf(f, "\t\tfor(size_t j = 0; j < %zu; j += 1) {\n", num_inputs);
+	fprintf(f, "\t\t\tsum += layer_%d_weights[i][j] * in[j];\n", layer_index);
+	fprintf(f, "\t\t}\n");
+	fprintf(f, "\t\tout[i] = %s(sum)%s;\n", activation, uniform ? "" : ")");
+	fprintf(f, "\t}\n");
+	fprintf(f, "}\n\n");
+}
+
+/* Convolutions keep a filter per channel and loop over every position, sharing the filter */
+static void emit_conv_layer(FILE* f, layer* curr_layer, int layer_index) {
+	conv_layer* conv = &curr_layer->conv;
+	size_t row_len = conv->in_channels * conv->kernel_size;
+	bool uniform = uniform_activation(curr_layer);
+	char activation[128];
+
+	fprintf(f, "static const double layer_%d_filters[%zu][%zu] __attribute__((aligned(64))) = {\n", layer_index, conv->channels, row_len);
+	for(int i = 0; i < conv->channels; i += 1) {
+		fprintf(f, "\t{");
+		for(int j = 0; j < row_len; j += 1) {
+			fprintf(f, "%a%s", conv->filters[i * row_len + j], (j + 1 < row_len) ? ", " : "");
+		}
+		fprintf(f, "},\n");
+	}
+	fprintf(f, "};\n\n");
+
+	fprintf(f, "static const double layer_%d_bias[%zu] __attribute__((aligned(64))) = {", layer_index, conv->channels);
+	for(int i = 0; i < conv->channels; i += 1) {
+		fprintf(f, "%a%s", conv->biases[i], (i + 1 < conv->channels) ? ", " : "");
+	}
+	fprintf(f, "};\n\n");
+
+	if(!uniform) {
+		fprintf(f, "static const unsigned int layer_%d_activations[%zu] = {", layer_index, curr_layer->num_neurons);
+		for(int i = 0; i < curr_layer->num_neurons; i += 1) {
+			fprintf(f, "%u%s", curr_layer->layer_neurons[i].activation_index, (i + 1 < curr_layer->num_neurons) ? ", " : "");
+		}
+		fprintf(f, "};\n\n");
+	}
+
+	char index[64];
+	snprintf(index, sizeof(index), "c * %zu + p", conv->width);
+	activation_call(activation, sizeof(activation), curr_layer, layer_index, index);
+
+	fprintf(f, "static inline void layer_%d_forward(const double* restrict in, double* restrict out) {\n", layer_index);
+	fprintf(f, "\tfor(size_t c = 0; c < %zu; c += 1) {\n", conv->channels);
+	fprintf(f, "\t\tfor(size_t p = 0; p < %zu; p += 1) {\n", conv->width);
+	fprintf(f, "\t\t\tdouble sum = layer_%d_bias[c];\n", layer_index);
+	fprintf(f, "\t\t\tfor(size_t ic = 0; ic < %zu; ic += 1) {\n", conv->in_channels);
+	fprintf(f, "\t\t\t\tfor(size_t k = 0; k < %zu; k += 1) {\n", conv->kernel_size);
+	fprintf(f, "\t\t\t\t\tsum += layer_%d_filters[c][ic * %zu + k] * in[ic * %zu + p * %zu + k];\n", layer_index, conv->kernel_size, conv->in_width, conv->stride);
+	fprintf(f, "\t\t\t\t}\n");
+	fprintf(f, "\t\t\t}\n");
+	fprintf(f, "\t\t\tout[%s] = %s(sum)%s;\n", index, activation, uniform ? "" : ")");
+	fprintf(f, "\t\t}\n");
+	fprintf(f, "\t}\n");
+	fprintf(f, "}\n\n");
+}
+
+/* Gated layers keep their last outputs then their cell state in state, and update the cell state in place */
+static void emit_gated_layer(FILE* f, neural_network* network, int layer_index) {
+	layer* curr_layer = &network->layers[layer_index];
+	gated_layer* gated = &curr_layer->gated;
+	size_t num_neurons = curr_layer->num_neurons;
+	size_t num_rows = gated->num_gates * num_neurons;
+	size_t row_len = gated->num_inputs + num_neurons;
+
+	fprintf(f, "static const double layer_%d_weights[%zu][%zu] __attribute__((aligned(64))) = {\n", layer_index, num_rows, row_len);
+	for(size_t i = 0; i < num_rows; i += 1) {
+		fprintf(f, "\t{");
+		for(size_t j = 0; j < row_len; j += 1) {
+			fprintf(f, "%a%s", gated->weights[i * row_len + j], (j + 1 < row_len) ? ", " : "");
+		}
+		fprintf(f, "},\n");
+	}
+	fprintf(f, "};\n\n");
+
+	fprintf(f, "static const double layer_%d_bias[%zu] __attribute__((aligned(64))) = {", layer_index, num_rows);
+	for(size_t i = 0; i < num_rows; i += 1) {
+		fprintf(f, "%a%s", gated->biases[i], (i + 1 < num_rows) ? ", " : "");
+	}
+	fprintf(f, "};\n\n");
+
+	fprintf(f, "static inline void layer_%d_forward(const double* restrict in, double* restrict out, double* restrict state) {\n", layer_index);
+	fprintf(f, "\tdouble gates[%zu][%zu];\n", gated->num_gates, num_neurons);
+	if(curr_layer->type == LAYER_GRU) {
+		fprintf(f, "\tdouble recurrent[%zu];\n", num_neurons);
+	}
+
+	/* Every gate in one pass over the weights */
+	fprintf(f, "\tfor(size_t g = 0; g < %zu; g += 1) {\n", gated->num_gates);
+	fprintf(f, "\t\tfor(size_t i = 0; i < %zu; i += 1) {\n", num_neurons);
+	fprintf(f, "\t\t\tconst double* weights = layer_%d_weights[g * %zu + i];\n", layer_index, num_neurons);
+	fprintf(f, "\t\t\tdouble input_sum = layer_%d_bias[g * %zu + i];\n", layer_index, num_neurons);
+	fprintf(f, "\t\t\tfor(size_t k = 0; k < %zu; k += 1) {\n", gated->num_inputs);
+	fprintf(f, "\t\t\t\tinput_sum += weights[k] * in[k];\n");
+	fprintf(f, "\t\t\t}\n");
+	fprintf(f, "\t\t\tdouble recurrent_sum = 0;\n");
+	fprintf(f, "\t\t\tfor(size_t k = 0; k < %zu; k += 1) {\n", num_neurons);
+	fprintf(f, "\t\t\t\trecurrent_sum += weights[%zu + k] * state[k];\n", gated->num_inputs);
+	fprintf(f, "\t\t\t}\n");
+	if(curr_layer->type == LAYER_GRU) {
+		fprintf(f, "\t\t\tif(g == 2) {\n");
+		fprintf(f, "\t\t\t\tgates[g][i] = input_sum;\n");
+		fprintf(f, "\t\t\t\trecurrent[i] = recurrent_sum;\n");
+		fprintf(f, "\t\t\t\tcontinue;\n");
+		fprintf(f, "\t\t\t}\n");
+	}
+	fprintf(f, "\t\t\tgates[g][i] = input_sum + recurrent_sum;\n");
+	fprintf(f, "\t\t}\n");
+	fprintf(f, "\t}\n\n");
+
+	/* Then the activations, matching propogate_gated_forward */
+	fprintf(f, "\tfor(size_t i = 0; i < %zu; i += 1) {\n", num_neurons);
+	if(curr_layer->type == LAYER_LSTM) {
+		fprintf(f, "\t\tdouble input_gate = 1 / (1 + exp(-gates[0][i]));\n");
+		fprintf(f, "\t\tdouble forget_gate = 1 / (1 + exp(-gates[1][i]));\n");
+		fprintf(f, "\t\tdouble cell_gate = tanh(gates[2][i]);\n");
+		fprintf(f, "\t\tdouble output_gate = 1 / (1 + exp(-gates[3][i]));\n");
+		fprintf(f, "\t\tstate[%zu + i] = forget_gate * state[%zu + i] + input_gate * cell_gate;\n", num_neurons, num_neurons);
+		fprintf(f, "\t\tout[i] = output_gate * tanh(state[%zu + i]);\n", num_neurons);
+	}
+	else {
+		fprintf(f, "\t\tdouble reset_gate = 1 / (1 + exp(-gates[0][i]));\n");
+		fprintf(f, "\t\tdouble update_gate = 1 / (1 + exp(-gates[1][i]));\n");
+		fprintf(f, "\t\tdouble new_gate = tanh(gates[2][i] + reset_gate * recurrent[i]);\n");
+		fprintf(f, "\t\tout[i] = (1 - update_gate) * new_gate + update_gate * state[i];\n");
+	}
+	fprintf(f, "\t}\n");
+	fprintf(f, "}\n\n");
+}
+
+/* Embeddings copy out a row of the table for each input byte */
+static void emit_embedding_layer(FILE* f, neural_network* network, int layer_index) {
+	embedding_layer* embedding = &network->layers[layer_index].embedding;
+
+	fprintf(f, "static const double layer_%d_table[%d][%zu] __attribute__((aligned(64))) = {\n", layer_index, EMBEDDING_ROWS, embedding->dim);
+	for(size_t i = 0; i < EMBEDDING_ROWS; i += 1) {
+		fprintf(f, "\t{");
+		for(size_t j = 0; j < embedding->dim; j += 1) {
+			fprintf(f, "%a%s", embedding->table[i * embedding->dim + j], (j + 1 < embedding->dim) ? ", " : "");
+		}
+		fprintf(f, "},\n");
+	}
+	fprintf(f, "};\n\n");
+
+	fprintf(f, "static inline void layer_%d_forward(const double* restrict in, double* restrict out) {\n", layer_index);
+	fprintf(f, "\tfor(size_t i = 0; i < %zu; i += 1) {\n", network->layers[layer_index-1].num_neurons);
+	fprintf(f, "\t\tsize_t row = in[i] > 0 ? (size_t)in[i] & %d : 0;\n", EMBEDDING_ROWS - 1);
+	fprintf(f, "\t\tmemcpy(&out[i * %zu], layer_%d_table[row], sizeof(layer_%d_table[row]));\n", embedding->dim, layer_index, layer_index);
+	fprintf(f, "\t}\n");
+	fprintf(f, "}\n\n");
+}
+
+/* Binary layers keep their packed signs, and sum them with popcount like propogate_binary_forward */
+static void emit_binary_layer(FILE* f, neural_network* network, int layer_index) {
+	layer* curr_layer = &network->layers[layer_index];
+	binary_layer* binary = &curr_layer->binary;
+	size_t num_inputs = network->layers[layer_index-1].num_neurons;
+
+	fprintf(f, "static const uint64_t layer_%d_signs[%zu][%zu] __attribute__((aligned(64))) = {\n", layer_index, curr_layer->num_neurons, binary->words);
+	for(size_t i = 0; i < curr_layer->num_neurons; i += 1) {
+		fprintf(f, "\t{");
+		for(size_t w = 0; w < binary->words; w += 1) {
+			fprintf(f, "0x%016" PRIx64 "%s", binary->signs[i * binary->words + w], (w + 1 < binary->words) ? ", " : "");
+		}
+		fprintf(f, "},\n");
+	}
+	fprintf(f, "};\n\n");
+
+	fprintf(f, "static const double layer_%d_bias[%zu] __attribute__((aligned(64))) = {", layer_index, curr_layer->num_neurons);
+	for(size_t i = 0; i < curr_layer->num_neurons; i += 1) {
+		fprintf(f, "%a%s", curr_layer->layer_neurons[i].bias, (i + 1 < curr_layer->num_neurons) ? ", " : "");
+	}
+	fprintf(f, "};\n\n");
+
+	fprintf(f, "static inline void layer_%d_forward(const double* restrict in, double* restrict out) {\n", layer_index);
+	fprintf(f, "\tuint64_t bits[%zu] = {0};\n", binary->words);
+	fprintf(f, "\tfor(size_t j = 0; j < %zu; j += 1) {\n", num_inputs);
+	fprintf(f, "\t\tbits[j / 64] |= (uint64_t)(in[j] >= %a) << (j %% 64);\n", BINARY_THRESHOLD);
+	fprintf(f, "\t}\n");
+	fprintf(f, "\tfor(size_t i = 0; i < %zu; i += 1) {\n", curr_layer->num_neurons);
+	fprintf(f, "\t\tint64_t mismatches = 0;\n");
+	fprintf(f, "\t\tfor(size_t w = 0; w < %zu; w += 1) {\n", binary->words);
+	fprintf(f, "\t\t\tmismatches += __builtin_popcountll(layer_%d_signs[i][w] ^ bits[w]);\n", layer_index);
+	fprintf(f, "\t\t}\n");
+	fprintf(f, "\t\tdouble sum = (%zu - 2 * mismatches) * %a + layer_%d_bias[i];\n", num_inputs, binary->scale, layer_index);
+	fprintf(f, "\t\tout[i] = sum >= 0 ? 1 : 0;\n");
+	fprintf(f, "\t}\n");
+	fprintf(f, "}\n\n");
+}
+
+static void emit_activations(FILE* f) {
+	for(int i = 0; i < NUM_COMPILED_ACTIVATIONS; i += 1) {
+		fprintf(f, "static inline double activation_%d(double x) {\n\treturn %s;\n}\n\n", i, compiled_activations[i]);
+	}
+
+	fprintf(f, "static inline double activate(unsigned int index, double x) {\n\tswitch(index) {\n");
+	for(int i = 0; i < NUM_COMPILED_ACTIVATIONS; i += 1) {
+		fprintf(f, "\tcase %d:\n\t\treturn activation_%d(x);\n", i, i);
+	}
+	fprintf(f, "\tdefault:\n\t\treturn x;\n\t}\n}\n\n");
+}
+
+/* The entry point, which chunks the input exactly like propogate_case_forward */
+static void emit_forward(FILE* f, neural_network* network) {
+	size_t num_inputs = network->layers[0].num_neurons;
+	size_t num_outputs = network->layers[network->num_layers-1].num_neurons;
+
+	fprintf(f, "const size_t nn_compiled_input_size = %zu;\n", num_inputs);
+	fprintf(f, "const size_t nn_compiled_output_size = %zu;\n\n", num_outputs);
+
+	fprintf(f, "void nn_compiled_forward(const double* input, size_t input_len, double* output, size_t output_len) {\n");
+
+	/* Every layers outputs, and the history of recurrent layers, live on the stack */
+	for(int i = 0; i < network->num_layers; i += 1) {
+		fprintf(f, "\tdouble layer_%d_outputs[%zu] __attribute__((aligned(64))) = {0};\n", i, network->layers[i].num_neurons);
+		if(network->layers[i].recurrent) {
+			fprintf(f, "\tdouble layer_%d_history[%zu] __attribute__((aligned(64))) = {0};\n", i, network->layers[i].num_neurons);
+		}
+		if(network->layers[i].type == LAYER_LSTM || network->layers[i].type == LAYER_GRU) {
+			fprintf(f, "\tdouble layer_%d_state[%zu] __attribute__((aligned(64))) = {0};\n", i, network->layers[i].num_neurons * 2);
+		}
+	}
+
+	fprintf(f, "\n\twhile(input_len > 0) {\n");
+	fprintf(f, "\t\tsize_t to_add = input_len > %zu ? %zu : input_len;\n", num_inputs, num_inputs);
+	fprintf(f, "\t\tsize_t to_output = output_len > %zu ? %zu : output_len;\n\n", num_outputs, num_outputs);
+	fprintf(f, "\t\tmemcpy(layer_0_outputs, input, to_add * sizeof(double));\n\n");
+
+	for(int i = 1; i < network->num_layers; i += 1) {
+		if(network->layers[i].recurrent) {
+			fprintf(f, "\t\tlayer_%d_forward(layer_%d_outputs, layer_%d_outputs, layer_%d_history);\n", i, i - 1, i, i);
+			continue;
+		}
+		if(network->layers[i].type == LAYER_LSTM || network->layers[i].type == LAYER_GRU) {
+			fprintf(f, "\t\tlayer_%d_forward(layer_%d_outputs, layer_%d_outputs, layer_%d_state);\n", i, i - 1, i, i);
+			continue;
+		}
+		fprintf(f, "\t\tlayer_%d_forward(layer_%d_outputs, layer_%d_outputs);\n", i, i - 1, i);
+	}
+
+	fprintf(f, "\n\t\tmemcpy(output, layer_%zu_outputs, to_output * sizeof(double));\n\n", network->num_layers - 1);
+
+	for(int i = 0; i < network->num_layers; i += 1) {
+		if(network->layers[i].recurrent) {
+			fprintf(f, "\t\tmemcpy(layer_%d_history, layer_%d_outputs, sizeof(layer_%d_history));\n", i, i, i);
+		}
+		if(network->layers[i].type == LAYER_LSTM || network->layers[i].type == LAYER_GRU) {
+			fprintf(f, "\t\tmemcpy(layer_%d_state, layer_%d_outputs, sizeof(layer_%d_outputs));\n", i, i, i);
+		}
+	}
+
+	fprintf(f, "\n\t\tinput += to_add;\n\t\tinput_len -= to_add;\n");
+	fprintf(f, "\t\toutput += to_output;\n\t\toutput_len -= to_output;\n");
+	fprintf(f, "\t}\n}\n");
+}
+
+int compile_neural_network(neural_network* network, char* filename) {
+
+	/* Make sure we know how to write out every activation function */
+	for(int i = 1; i < network->num_layers; i += 1) {
+		for(int j = 0; j < network->layers[i].num_neurons; j += 1) {
+			if(network->layers[i].layer_neurons[j].activation_index >= NUM_COMPILED_ACTIVATIONS) {
+				error("Can't compile unknown activation function\n");
+				return -1;
+			}
+		}
+	}
+
+	/* Open our output file */
+	FILE* f = fopen(filename, "w");
+	if(!f) {
+		error("Failed to open output file\n");
+		return -1;
+	}
+
+	fprintf(f, "/* Generated by nn - do not edit */\n\n");
+	fprintf(f, "#include <stddef.h>\n#include <stdint.h>\n#include <string.h>\n#include <math.h>\n\n");
+
+	emit_activations(f);
+
+	for(int i = 1; i < network->num_layers; i += 1) {
+		if(network->layers[i].type == LAYER_CONV1D) {
+			emit_conv_layer(f, &network->layers[i], i);
+			continue;
+		}
+		if(network->layers[i].type == LAYER_LSTM || network->layers[i].type == LAYER_GRU) {
+			emit_gated_layer(f, network, i);
+			continue;
+		}
+		if(network->layers[i].type == LAYER_EMBEDDING) {
+			emit_embedding_layer(f, network, i);
+			continue;
+		}
+		if(network->layers[i].type == LAYER_BINARY) {
+			emit_binary_layer(f, network, i);
+			continue;
+		}
+		emit_weights(f, network, i);
+		emit_layer(f, network, i);
+	}
+
+	emit_forward(f, network);
+
+	if(fclose(f) != 0) {
+		error("Failed to write compiled network\n");
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,441 @@
+#include <includes/common.h>
+#include <includes/distributed.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define UNIX_PREFIX "unix:"
+
+/* Resolve a peer, either unix:<path> or <host>:<port>, into a socket address */
+static int resolve_peer(char* peer, struct sockaddr_storage* addr, socklen_t* addr_len) {
+	bzero(addr, sizeof(struct sockaddr_storage));
+
+	if(strncmp(peer, UNIX_PREFIX, strlen(UNIX_PREFIX)) == 0) {
+		struct sockaddr_un* unix_addr = (struct sockaddr_un*)addr;
+		char* path = &peer[strlen(UNIX_PREFIX)];
+
+		if(strlen(path) >= sizeof(unix_addr->sun_path)) {
+			error("Unix socket path too long\n");
+			return -1;
+		}
+
+		unix_addr->sun_family = AF_UNIX;
+		strcpy(unix_addr->sun_path, path);
+		*addr_len = sizeof(struct sockaddr_un);
+		return 0;
+	}
+
+	/* Split the host from the port */
+	char* host = strdup(peer);
+	if(!host) {
+		error("Failed to allocate peer host\n");
+		return -1;
+	}
+
+	char* port = strrchr(host, ':');
+	if(!port) {
+		error("Peer isn't formatted as host:port or unix:path\n");
+		free(host);
+		return -1;
+	}
+	*port = '\0';
+	port += 1;
+
+	struct addrinfo hints;
+	bzero(&hints, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	struct addrinfo* result;
+	if(getaddrinfo(host, port, &hints, &result) != 0) {
+		error("Failed to resolve peer\n");
+		free(host);
+		return -1;
+	}
+
+	memcpy(addr, result->ai_addr, result->ai_addrlen);
+	*addr_len = result->ai_addrlen;
+
+	freeaddrinfo(result);
+	free(host);
+	return 0;
+}
+
+static void configure_socket(int fd, struct sockaddr_storage* addr) {
+
+	/* Gradients go out as soon as they're ready */
+	if(addr->ss_family != AF_UNIX) {
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+}
+
+static int listen_on(char* peer) {
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	if(resolve_peer(peer, &addr, &addr_len) != 0) {
+		return -1;
+	}
+
+	int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+	if(fd < 0) {
+		error("Failed to create listening socket\n");
+		return -1;
+	}
+
+	/* Clear out any stale socket file or lingering tcp port */
+	if(addr.ss_family == AF_UNIX) {
+		unlink(((struct sockaddr_un*)&addr)->sun_path);
+	}
+	else {
+		int one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	}
+
+	if(bind(fd, (struct sockaddr*)&addr, addr_len) != 0 || listen(fd, 1) != 0) {
+		error("Failed to listen for the previous rank\n");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int connect_to(char* peer) {
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	if(resolve_peer(peer, &addr, &addr_len) != 0) {
+		return -1;
+	}
+
+	/* The next rank may not be listening yet, so keep trying for a while */
+	for(int attempt = 0; attempt < DISTRIBUTED_CONNECT_ATTEMPTS; attempt += 1) {
+		int fd = socket(addr.ss_family, SOCK_STREAM, 0);
+		if(fd < 0) {
+			error("Failed to create socket\n");
+			return -1;
+		}
+
+		if(connect(fd, (struct sockaddr*)&addr, addr_len) == 0) {
+			configure_socket(fd, &addr);
+			return fd;
+		}
+
+		close(fd);
+		usleep(50000);
+	}
+
+	error("Failed to connect to the next rank\n");
+	return -1;
+}
+
+communicator* distributed_connect(size_t rank, size_t world_size, char** peers) {
+	communicator* comm = malloc(sizeof(communicator));
+	if(!comm) {
+		error("Failed to allocate communicator\n");
+		return NULL;
+	}
+
+	comm->rank = rank;
+	comm->world_size = world_size;
+	comm->listen_fd = -1;
+	comm->next_fd = -1;
+	comm->prev_fd = -1;
+
+	/* A single process has no one to talk to */
+	if(world_size < 2) {
+		return comm;
+	}
+
+	/* Listen first, so the previous rank's connection queues up while we connect to the next */
+	comm->listen_fd = listen_on(peers[rank]);
+	if(comm->listen_fd < 0) {
+		distributed_free(comm);
+		return NULL;
+	}
+
+	comm->next_fd = connect_to(peers[(rank + 1) % world_size]);
+	if(comm->next_fd < 0) {
+		distributed_free(comm);
+		return NULL;
+	}
+
+	comm->prev_fd = accept(comm->listen_fd, NULL, NULL);
+	if(comm->prev_fd < 0) {
+		error("Failed to accept the previous rank\n");
+		distributed_free(comm);
+		return NULL;
+	}
+
+	int one = 1;
+	setsockopt(comm->prev_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	info("[*] Rank %zu of %zu connected\n", rank, world_size);
+	return comm;
+}
+
+void distributed_free(communicator* comm) {
+	if(comm->listen_fd >= 0) {
+		close(comm->listen_fd);
+	}
+	if(comm->next_fd >= 0) {
+		close(comm->next_fd);
+	}
+	if(comm->prev_fd >= 0) {
+		close(comm->prev_fd);
+	}
+	free(comm);
+}
+
+/* Send one buffer to the next rank while receiving another from the previous, so the ring can't deadlock */
+static int exchange(communicator* comm, void* send_buf, size_t send_len, void* recv_buf, size_t recv_len) {
+	size_t sent = 0;
+	size_t received = 0;
+
+	while(sent < send_len || received < recv_len) {
+		struct pollfd fds[2] = {
+			{.fd=comm->next_fd, .events=(sent < send_len) ? POLLOUT : 0},
+			{.fd=comm->prev_fd, .events=(received < recv_len) ? POLLIN : 0},
+		};
+
+		if(poll(fds, 2, -1) < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			error("Failed to poll ring sockets\n");
+			return -1;
+		}
+
+		/* A rank that has finished may hang up once we've nothing left to swap with it */
+		if(sent < send_len && (fds[0].revents & (POLLERR | POLLHUP))) {
+			error("Next rank disconnected\n");
+			return -1;
+		}
+
+		if(fds[0].revents & POLLOUT) {
+			ssize_t ret = send(comm->next_fd, (char*)send_buf + sent, send_len - sent, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if(ret < 0 && errno != EAGAIN && errno != EINTR) {
+				error("Failed to send to the next rank\n");
+				return -1;
+			}
+			sent += ret > 0 ? ret : 0;
+		}
+
+		if(received < recv_len && (fds[1].revents & (POLLIN | POLLHUP))) {
+			ssize_t ret = recv(comm->prev_fd, (char*)recv_buf + received, recv_len - received, MSG_DONTWAIT);
+			if(ret == 0 || (ret < 0 && errno != EAGAIN && errno != EINTR)) {
+				error("Previous rank disconnected\n");
+				return -1;
+			}
+			received += ret > 0 ? ret : 0;
+		}
+	}
+	return 0;
+}
+
+/* Sum buf across every rank, leaving the result on all of them */
+int ring_allreduce(communicator* comm, double* buf, size_t len) {
+	size_t world_size = comm->world_size;
+	size_t rank = comm->rank;
+
+	if(world_size < 2 || len == 0) {
+		return 0;
+	}
+
+	/* The buffer is split into a chunk per rank */
+	#define CHUNK_START(c) ((len * (c)) / world_size)
+	#define CHUNK_LEN(c) (CHUNK_START((c) + 1) - CHUNK_START(c))
+
+	double* recv_buf = malloc(sizeof(double) * (len / world_size + 1));
+	if(!recv_buf) {
+		error("Failed to allocate all reduce buffer\n");
+		return -1;
+	}
+
+	/* Reduce scatter: after world_size - 1 steps we hold the full sum of chunk rank + 1 */
+	for(size_t step = 0; step + 1 < world_size; step += 1) {
+		size_t send_chunk = (rank + world_size - step) % world_size;
+		size_t recv_chunk = (rank + world_size - step - 1) % world_size;
+
+		if(exchange(comm, &buf[CHUNK_START(send_chunk)], CHUNK_LEN(send_chunk) * sizeof(double), recv_buf, CHUNK_LEN(recv_chunk) * sizeof(double)) != 0) {
+			free(recv_buf);
+			return -1;
+		}
+
+		double* chunk = &buf[CHUNK_START(recv_chunk)];
+		for(size_t i = 0; i < CHUNK_LEN(recv_chunk); i += 1) {
+			chunk[i] += recv_buf[i];
+		}
+	}
+
+	/* All gather: pass the finished chunks around the ring */
+	for(size_t step = 0; step + 1 < world_size; step += 1) {
+		size_t send_chunk = (rank + world_size - step + 1) % world_size;
+		size_t recv_chunk = (rank + world_size - step) % world_size;
+
+		if(exchange(comm, &buf[CHUNK_START(send_chunk)], CHUNK_LEN(send_chunk) * sizeof(double), &buf[CHUNK_START(recv_chunk)], CHUNK_LEN(recv_chunk) * sizeof(double)) != 0) {
+			free(recv_buf);
+			return -1;
+		}
+	}
+
+	#undef CHUNK_START
+	#undef CHUNK_LEN
+
+	free(recv_buf);
+	return 0;
+}
+
+/* Sum the number of cases each rank holds, so every rank can agree on how many steps to take */
+size_t distributed_total_cases(communicator* comm, size_t num_cases) {
+	double total = num_cases;
+	if(ring_allreduce(comm, &total, 1) != 0) {
+		return 0;
+	}
+	return total;
+}
+
+/* Count the rows of weights with biases, each of which has a bias and recurrent weight derivative */
+static size_t num_bias_derivatives(neural_network* network) {
+	size_t ret = 0;
+	for(int i = 1; i < network->num_layers; i += 1) {
+		ret += layer_rows(&network->layers[i]) * 2;
+	}
+	return ret;
+}
+
+int distributed_backpropogate_cases(communicator* comm, neural_network* network, test_case* cases, size_t* indices, size_t num_cases, double learn_rate) {
+
+	/* Work out the derivatives for our shard */
+	if(accumulate_derivatives(network, cases, indices, num_cases) != 0) {
+		return -1;
+	}
+
+	/* The weight derivatives are already contiguous, so they go in one all reduce */
+	if(ring_allreduce(comm, network->weight_derivatives, network->num_weights) != 0) {
+		return -1;
+	}
+
+	/* Other ranks can have looked up embedding rows this one didn't */
+	mark_embedding_rows(network);
+
+	/* Pack the bias and recurrent derivatives, along with the number of back propogations, into a second */
+	size_t tail_len = num_bias_derivatives(network) + 1;
+	double* tail = malloc(sizeof(double) * tail_len);
+	if(!tail) {
+		error("Failed to allocate bias derivative buffer\n");
+		return -1;
+	}
+
+	size_t offset = 0;
+	for(int i = 1; i < network->num_layers; i += 1) {
+		for(int j = 0; j < layer_rows(&network->layers[i]); j += 1) {
+			tail[offset] = network->layers[i].training.bias_derivatives[j];
+			tail[offset + 1] = network->layers[i].training.recurrent_weight_derivatives[j];
+			offset += 2;
+		}
+	}
+	tail[offset] = network->num_back_propogations;
+
+	if(ring_allreduce(comm, tail, tail_len) != 0) {
+		free(tail);
+		return -1;
+	}
+
+	offset = 0;
+	for(int i = 1; i < network->num_layers; i += 1) {
+		for(int j = 0; j < layer_rows(&network->layers[i]); j += 1) {
+			network->layers[i].training.bias_derivatives[j] = tail[offset];
+			network->layers[i].training.recurrent_weight_derivatives[j] = tail[offset + 1];
+			offset += 2;
+		}
+	}
+	network->num_back_propogations = tail[offset];
+	free(tail);
+
+	/* Every rank now applies the same update */
+	apply_derivatives(network, learn_rate);
+	return 0;
+}
+
+void distributed_free_peers(char** peers, size_t world_size) {
+	for(size_t i = 0; i < world_size; i += 1) {
+		free(peers[i]);
+	}
+	free(peers);
+}
+
+/* Fork world_size workers talking over unix sockets. Returns 0 in a worker, 1 in the launcher once every worker succeeded */
+int distributed_launch(size_t world_size, size_t* rank, char*** peers) {
+
+	*peers = malloc(sizeof(char*) * world_size);
+	if(!*peers) {
+		error("Failed to allocate peer list\n");
+		return -1;
+	}
+	bzero(*peers, sizeof(char*) * world_size);
+
+	for(size_t i = 0; i < world_size; i += 1) {
+		char peer[108];
+		snprintf(peer, sizeof(peer), UNIX_PREFIX "/tmp/nn-%d-%zu.sock", getpid(), i);
+
+		(*peers)[i] = strdup(peer);
+		if(!(*peers)[i]) {
+			error("Failed to allocate peer\n");
+			distributed_free_peers(*peers, world_size);
+			return -1;
+		}
+	}
+
+	/* Threads don't survive a fork, so let every worker start its own pool */
+	thread_pool_free_global();
+	fflush(stdout);
+
+	pid_t* workers = malloc(sizeof(pid_t) * world_size);
+	if(!workers) {
+		error("Failed to allocate worker list\n");
+		distributed_free_peers(*peers, world_size);
+		return -1;
+	}
+
+	size_t num_started = 0;
+	for(; num_started < world_size; num_started += 1) {
+		pid_t pid = fork();
+		if(pid < 0) {
+			error("Failed to start worker\n");
+			break;
+		}
+
+		if(pid == 0) {
+			free(workers);
+			*rank = num_started;
+			return 0;
+		}
+		workers[num_started] = pid;
+	}
+
+	/* Wait for all our workers */
+	int ret = num_started == world_size ? 1 : -1;
+	for(size_t i = 0; i < num_started; i += 1) {
+		int status;
+		if(waitpid(workers[i], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			error("Worker failed\n");
+			ret = -1;
+		}
+	}
+
+	/* Tidy up the socket files */
+	for(size_t i = 0; i < world_size; i += 1) {
+		unlink(&(*peers)[i][strlen(UNIX_PREFIX)]);
+	}
+
+	free(workers);
+	distributed_free_peers(*peers, world_size);
+	*peers = NULL;
+	return ret;
+}
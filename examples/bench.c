@@ -0,0 +1,132 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <includes/libnn.h>
+
+/* Compare the per call latency of inference in process with running the nn executable for every input */
+
+static double now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+int main(int argc, char** argv) {
+	if(argc < 2) {
+		printf("Usage: %s <layer_sizes> [num_calls] [nn_executable]\n", argv[0]);
+		printf("\te.g. %s 1024,512,64 1000 ./nn\n", argv[0]);
+		return 1;
+	}
+
+	size_t layer_sizes[64];
+	size_t num_layers = 0;
+	for(char* token = strtok(argv[1], ","); token && num_layers < 64; token = strtok(NULL, ",")) {
+		layer_sizes[num_layers++] = strtoull(token, NULL, 10);
+	}
+
+	size_t num_calls = argc > 2 ? strtoull(argv[2], NULL, 10) : 1000;
+	const char* executable = argc > 3 ? argv[3] : "./nn";
+
+	nn_model* model = nn_create(layer_sizes, num_layers, 1);
+	if(!model) {
+		printf("Failed to create network: %s\n", nn_last_error());
+		return 1;
+	}
+
+	/* The executable reads its input as bits of a file, so give every call the same bytes */
+	size_t input_len = nn_input_size(model);
+	size_t output_len = nn_output_size(model);
+	size_t file_len = (input_len + 7) / 8;
+
+	double* inputs = malloc(sizeof(double) * input_len * num_calls);
+	double* outputs = malloc(sizeof(double) * output_len * num_calls);
+	unsigned char* bytes = malloc(file_len);
+	if(!inputs || !outputs || !bytes) {
+		printf("Failed to allocate buffers\n");
+		return 1;
+	}
+
+	srand(1);
+	for(size_t i = 0; i < file_len; i += 1) {
+		bytes[i] = rand();
+	}
+	for(size_t c = 0; c < num_calls; c += 1) {
+		for(size_t i = 0; i < input_len; i += 1) {
+			inputs[c * input_len + i] = (bytes[i / 8] >> (7 - i % 8)) & 1;
+		}
+	}
+
+	nn_context* context = nn_context_create(model);
+	if(!context) {
+		printf("Failed to create context: %s\n", nn_last_error());
+		return 1;
+	}
+
+	/* Warm up, which also tunes the kernels */
+	nn_infer(context, inputs, input_len, outputs, output_len);
+
+	double start = now_ms();
+	for(size_t c = 0; c < num_calls; c += 1) {
+		if(nn_infer(context, &inputs[c * input_len], input_len, &outputs[c * output_len], output_len) != 0) {
+			printf("Inference failed: %s\n", nn_last_error());
+			return 1;
+		}
+	}
+	double single_ms = (now_ms() - start) / num_calls;
+
+	start = now_ms();
+	if(nn_infer_batch(model, inputs, input_len, num_calls, outputs, output_len) != 0) {
+		printf("Batch inference failed: %s\n", nn_last_error());
+		return 1;
+	}
+	double batch_ms = (now_ms() - start) / num_calls;
+
+	printf("nn_infer:       %.4f ms per call\n", single_ms);
+	printf("nn_infer_batch: %.4f ms per input\n", batch_ms);
+
+	/* Each run of the executable loads the network and input again, so a few runs are enough */
+	char model_file[] = "/tmp/nn_bench_XXXXXX";
+	char input_file[] = "/tmp/nn_bench_in_XXXXXX";
+	int model_fd = mkstemp(model_file);
+	int input_fd = mkstemp(input_file);
+	FILE* f = input_fd >= 0 ? fdopen(input_fd, "wb") : NULL;
+	if(model_fd < 0 || !f || nn_export(model, model_file) != 0) {
+		printf("Skipping the executable, failed to write its files\n");
+	} else {
+		fwrite(bytes, 1, file_len, f);
+		fclose(f);
+
+		char command[1024];
+		snprintf(command, sizeof(command), "%s -l %s -f %s -e %zu > /dev/null", executable, model_file, input_file, output_len);
+
+		size_t num_runs = num_calls < 20 ? num_calls : 20;
+		int failed = 0;
+		start = now_ms();
+		for(size_t r = 0; r < num_runs && !failed; r += 1) {
+			failed = system(command) != 0;
+		}
+		double cli_ms = (now_ms() - start) / num_runs;
+
+		if(failed) {
+			printf("Running %s failed\n", executable);
+		} else {
+			printf("%s:  %.4f ms per call (%.0fx nn_infer)\n", executable, cli_ms, cli_ms / single_ms);
+		}
+	}
+
+	if(model_fd >= 0) {
+		close(model_fd);
+		unlink(model_file);
+	}
+	unlink(input_file);
+
+	nn_context_free(context);
+	nn_free(model);
+	nn_shutdown();
+	free(inputs);
+	free(outputs);
+	free(bytes);
+	return 0;
+}
@@ -0,0 +1,346 @@
+#include <includes/common.h>
+#include <includes/sampler.h>
+#include <includes/rng.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+/*
+ * How long training takes to reach a target loss on a few small tasks, rather than how fast a single iteration is.
+ * Every task is trained with each training method from the same starting weights, and the results are printed as
+ * JSON so runs of different builds can be compared.
+ */
+
+#define MAX_LAYERS 8
+
+/* Bits are 0 or 1, and count as right when the output is on the same side of a half */
+#define BIT_THRESHOLD 0.5
+
+typedef struct {
+	const char* name;
+	size_t layer_sizes[MAX_LAYERS];
+	size_t num_layers;
+	layer_type recurrent_type; /* The hidden layers of recurrent tasks, LAYER_DENSE otherwise */
+	double learn_rate;
+	double target_loss;
+	int max_iterations;
+	size_t batch_size; /* For the minibatch and hogwild methods */
+	size_t (*make_cases)(test_case** cases, uint64_t seed);
+} task;
+
+typedef enum {
+	TRAIN_FULL,      /* backpropogate_cases over every case */
+	TRAIN_MINIBATCH, /* backpropogate_batch over shuffled batches */
+	TRAIN_HOGWILD,   /* backpropogate_cases_hogwild over a shuffled epoch */
+	TRAIN_NUM_METHODS,
+} train_method;
+
+static const char* method_names[TRAIN_NUM_METHODS] = {"full", "minibatch", "hogwild"};
+
+typedef struct {
+	bool reached;
+	int iterations; /* To the target, or every iteration if it was never reached */
+	double seconds; /* Spent training, not measuring the loss */
+	double final_loss;
+	double accuracy;
+} task_result;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static test_case* alloc_cases(size_t num_cases, size_t input_len, size_t output_len) {
+	test_case* cases = calloc(num_cases, sizeof(test_case));
+	if(!cases) {
+		return NULL;
+	}
+
+	for(size_t i = 0; i < num_cases; i += 1) {
+		cases[i].input = calloc(input_len, sizeof(double));
+		cases[i].expected_output = calloc(output_len, sizeof(double));
+		cases[i].input_len = input_len;
+		cases[i].output_len = output_len;
+		if(!cases[i].input || !cases[i].expected_output) {
+			test_cases_free(cases, i + 1);
+			free(cases);
+			return NULL;
+		}
+	}
+	return cases;
+}
+
+/* Both inputs against their exclusive or */
+static size_t xor_cases(test_case** cases, uint64_t seed) {
+	*cases = alloc_cases(4, 2, 1);
+	if(!*cases) {
+		return 0;
+	}
+
+	for(size_t i = 0; i < 4; i += 1) {
+		(*cases)[i].input[0] = i & 1;
+		(*cases)[i].input[1] = (i >> 1) & 1;
+		(*cases)[i].expected_output[0] = (i & 1) ^ ((i >> 1) & 1);
+	}
+	return 4;
+}
+
+/* Every 6 bit word against whether it has an odd number of bits set */
+#define PARITY_BITS 6
+
+static size_t parity_cases(test_case** cases, uint64_t seed) {
+	size_t num_cases = 1 << PARITY_BITS;
+	*cases = alloc_cases(num_cases, PARITY_BITS, 1);
+	if(!*cases) {
+		return 0;
+	}
+
+	for(size_t i = 0; i < num_cases; i += 1) {
+		for(int bit = 0; bit < PARITY_BITS; bit += 1) {
+			(*cases)[i].input[bit] = (i >> bit) & 1;
+		}
+		(*cases)[i].expected_output[0] = __builtin_parity(i);
+	}
+	return num_cases;
+}
+
+/* Every byte against its own bits, through a hidden layer as wide as the byte */
+static size_t byte_copy_cases(test_case** cases, uint64_t seed) {
+	*cases = alloc_cases(256, 8, 8);
+	if(!*cases) {
+		return 0;
+	}
+
+	for(size_t i = 0; i < 256; i += 1) {
+		for(int bit = 0; bit < 8; bit += 1) {
+			(*cases)[i].input[bit] = (i >> bit) & 1;
+			(*cases)[i].expected_output[bit] = (i >> bit) & 1;
+		}
+	}
+	return 256;
+}
+
+/* Random bit streams a bit per step, with each step expected to output the bit from lag steps before */
+#define ECHO_STEPS 16
+#define ECHO_CASES 64
+
+/* A lag a step at a time can learn without carrying anything back through time, this one can't */
+#define ECHO_LAG 3
+
+static size_t lagged_echo_cases(test_case** cases, uint64_t seed, int lag) {
+	*cases = alloc_cases(ECHO_CASES, ECHO_STEPS, ECHO_STEPS);
+	if(!*cases) {
+		return 0;
+	}
+
+	for(size_t i = 0; i < ECHO_CASES; i += 1) {
+		for(int step = 0; step < ECHO_STEPS; step += 1) {
+			(*cases)[i].input[step] = rng_uniform(seed, i, step) < 0.5;
+			(*cases)[i].expected_output[step] = step >= lag ? (*cases)[i].input[step-lag] : 0;
+		}
+	}
+	return ECHO_CASES;
+}
+
+static size_t echo_cases(test_case** cases, uint64_t seed) {
+	return lagged_echo_cases(cases, seed, 1);
+}
+
+static size_t echo_lag_cases(test_case** cases, uint64_t seed) {
+	return lagged_echo_cases(cases, seed, ECHO_LAG);
+}
+
+static task tasks[] = {
+	{.name="xor", .layer_sizes={2, 4, 1}, .num_layers=3, .recurrent_type=LAYER_DENSE, .learn_rate=2, .target_loss=0.01, .max_iterations=20000, .batch_size=2, .make_cases=xor_cases},
+	{.name="parity", .layer_sizes={PARITY_BITS, 32, 1}, .num_layers=3, .recurrent_type=LAYER_DENSE, .learn_rate=2, .target_loss=0.02, .max_iterations=20000, .batch_size=8, .make_cases=parity_cases},
+	{.name="byte_copy", .layer_sizes={8, 8, 8}, .num_layers=3, .recurrent_type=LAYER_DENSE, .learn_rate=4, .target_loss=0.01, .max_iterations=5000, .batch_size=16, .make_cases=byte_copy_cases},
+	{.name="echo", .layer_sizes={1, 8, 1}, .num_layers=3, .recurrent_type=LAYER_LSTM, .learn_rate=1, .target_loss=0.01, .max_iterations=5000, .batch_size=8, .make_cases=echo_cases},
+	{.name="echo_lag", .layer_sizes={1, 8, 1}, .num_layers=3, .recurrent_type=LAYER_LSTM, .learn_rate=1, .target_loss=0.01, .max_iterations=5000, .batch_size=8, .make_cases=echo_lag_cases},
+};
+
+#define NUM_TASKS (sizeof(tasks) / sizeof(tasks[0]))
+
+static neural_network* create_network(task* curr_task, uint64_t seed) {
+	bool recurrent[MAX_LAYERS] = {0};
+	layer_spec specs[MAX_LAYERS] = {0};
+
+	for(size_t i = 1; i + 1 < curr_task->num_layers; i += 1) {
+		specs[i].type = curr_task->recurrent_type;
+	}
+
+	init_params params = {.scheme=INIT_XAVIER, .seed=seed};
+	return init_neural_network(recurrent, curr_task->layer_sizes, specs, curr_task->num_layers, &params);
+}
+
+/* The mean squared error of every output, and the fraction of outputs on the right side of the threshold */
+static int measure(neural_network* network, test_case* cases, size_t num_cases, double* loss, double* accuracy) {
+	double total = 0;
+	size_t num_correct = 0;
+	size_t num_outputs = 0;
+
+	for(size_t i = 0; i < num_cases; i += 1) {
+		double* output = propogate_case_forward(network, cases[i].input, cases[i].input_len, cases[i].output_len);
+		if(!output) {
+			return -1;
+		}
+
+		for(size_t j = 0; j < cases[i].output_len; j += 1) {
+			total += pow(output[j] - cases[i].expected_output[j], 2);
+			num_correct += (output[j] >= BIT_THRESHOLD) == (cases[i].expected_output[j] >= BIT_THRESHOLD);
+		}
+		num_outputs += cases[i].output_len;
+		free(output);
+	}
+
+	*loss = total / num_outputs;
+	*accuracy = (double)num_correct / num_outputs;
+	return 0;
+}
+
+static int train(task* curr_task, train_method method, test_case* cases, size_t num_cases, uint64_t seed, task_result* result) {
+	neural_network* network = create_network(curr_task, seed);
+	if(!network) {
+		return -1;
+	}
+
+	sampler* case_sampler = sampler_create(num_cases, SAMPLE_SHUFFLE, seed);
+	if(!case_sampler) {
+		free_neural_network(network);
+		return -1;
+	}
+
+	*result = (task_result){0};
+	uint64_t training_ns = 0;
+
+	for(int i = 0; i < curr_task->max_iterations && !result->reached; i += 1) {
+		uint64_t start_ns = now_ns();
+		size_t* batch;
+		size_t batch_len;
+
+		switch(method) {
+		case TRAIN_FULL:
+			backpropogate_cases(network, cases, num_cases, curr_task->learn_rate);
+			break;
+		case TRAIN_MINIBATCH:
+			sampler_start_epoch(case_sampler);
+			while((batch_len = sampler_next_batch(case_sampler, curr_task->batch_size, &batch)) > 0) {
+				backpropogate_batch(network, cases, batch, batch_len, curr_task->learn_rate);
+			}
+			break;
+		case TRAIN_HOGWILD:
+			sampler_start_epoch(case_sampler);
+			batch_len = sampler_next_batch(case_sampler, num_cases, &batch);
+			backpropogate_cases_hogwild(network, cases, batch, batch_len, curr_task->learn_rate, curr_task->batch_size);
+			break;
+		default:
+			break;
+		}
+
+		training_ns += now_ns() - start_ns;
+		result->iterations = i + 1;
+
+		if(measure(network, cases, num_cases, &result->final_loss, &result->accuracy) != 0) {
+			sampler_free(case_sampler);
+			free_neural_network(network);
+			return -1;
+		}
+		result->reached = result->final_loss <= curr_task->target_loss;
+	}
+
+	result->seconds = training_ns / 1e9;
+
+	sampler_free(case_sampler);
+	free_neural_network(network);
+	return 0;
+}
+
+static void print_layers(task* curr_task) {
+	for(size_t i = 0; i < curr_task->num_layers; i += 1) {
+		printf("%s%zu", i ? "," : "", curr_task->layer_sizes[i]);
+	}
+}
+
+int main(int argc, char** argv) {
+	size_t num_threads = 0;
+	uint64_t seed = 1;
+	char** only_tasks = NULL;
+	int num_only_tasks = 0;
+
+	int opt;
+	while((opt = getopt(argc, argv, "j:s:h")) != -1) {
+		switch(opt) {
+		case 'j':
+			num_threads = strtoull(optarg, NULL, 10);
+			break;
+		case 's':
+			seed = strtoull(optarg, NULL, 10);
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-j threads] [-s seed] [task...]\n", argv[0]);
+			fprintf(stderr, "\tTasks are xor, parity, byte_copy, echo and echo_lag, all of them by default\n");
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+	only_tasks = &argv[optind];
+	num_only_tasks = argc - optind;
+
+	if(thread_pool_init_global(num_threads) != 0) {
+		fprintf(stderr, "Failed to start worker threads\n");
+		return 1;
+	}
+
+	thread_pool* pool = thread_pool_global();
+	printf("{\n");
+	printf("  \"compiler\": \"%s\",\n", __VERSION__);
+	printf("  \"built\": \"%s %s\",\n", __DATE__, __TIME__);
+	printf("  \"threads\": %zu,\n", pool->num_workers);
+	printf("  \"seed\": %" PRIu64 ",\n", seed);
+	printf("  \"results\": [");
+
+	bool first = true;
+	int ret = 0;
+	for(size_t t = 0; t < NUM_TASKS; t += 1) {
+		task* curr_task = &tasks[t];
+
+		bool selected = num_only_tasks == 0;
+		for(int i = 0; i < num_only_tasks; i += 1) {
+			selected = selected || strcmp(only_tasks[i], curr_task->name) == 0;
+		}
+		if(!selected) {
+			continue;
+		}
+
+		test_case* cases;
+		size_t num_cases = curr_task->make_cases(&cases, seed);
+		if(num_cases == 0) {
+			fprintf(stderr, "Failed to allocate %s cases\n", curr_task->name);
+			ret = 1;
+			break;
+		}
+
+		for(int method = 0; method < TRAIN_NUM_METHODS; method += 1) {
+			task_result result;
+			if(train(curr_task, method, cases, num_cases, seed, &result) != 0) {
+				fprintf(stderr, "Failed to train %s with %s\n", curr_task->name, method_names[method]);
+				ret = 1;
+				continue;
+			}
+
+			printf("%s\n    {\"task\": \"%s\", \"method\": \"%s\", \"layers\": \"", first ? "" : ",", curr_task->name, method_names[method]);
+			print_layers(curr_task);
+			printf("\", \"cases\": %zu, \"learn_rate\": %g, \"target_loss\": %g, ", num_cases, curr_task->learn_rate, curr_task->target_loss);
+			printf("\"reached\": %s, \"iterations\": %d, \"seconds\": %.6f, ", result.reached ? "true" : "false", result.iterations, result.seconds);
+			printf("\"final_loss\": %.6g, \"accuracy\": %.4f}", result.final_loss, result.accuracy);
+			first = false;
+			fflush(stdout);
+		}
+
+		test_cases_free(cases, num_cases);
+		free(cases);
+	}
+
+	printf("\n  ]\n}\n");
+
+	thread_pool_free_global();
+	return ret;
+}
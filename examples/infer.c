@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <includes/libnn.h>
+
+/* Load a network and print its outputs for a file, fed in a bit at a time like nn -f does */
+int main(int argc, char** argv) {
+	if(argc < 3) {
+		printf("Usage: %s <network> <input_file> [num_outputs]\n", argv[0]);
+		return 1;
+	}
+
+	nn_model* model = nn_load(argv[1], 0);
+	if(!model) {
+		printf("Failed to load %s: %s\n", argv[1], nn_last_error());
+		return 1;
+	}
+
+	FILE* f = fopen(argv[2], "rb");
+	if(!f) {
+		printf("Failed to open %s\n", argv[2]);
+		nn_free(model);
+		return 1;
+	}
+	fseek(f, 0, SEEK_END);
+	size_t file_len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+
+	unsigned char* buf = malloc(file_len ? file_len : 1);
+	double* input = malloc(sizeof(double) * (file_len ? file_len * 8 : 1));
+	if(!buf || !input || fread(buf, 1, file_len, f) != file_len) {
+		printf("Failed to read %s\n", argv[2]);
+		return 1;
+	}
+	fclose(f);
+
+	/* Most significant bit first */
+	for(size_t i = 0; i < file_len * 8; i += 1) {
+		input[i] = (buf[i / 8] >> (7 - i % 8)) & 1;
+	}
+
+	size_t num_outputs = argc > 3 ? strtoull(argv[3], NULL, 10) : nn_output_size(model);
+	double* output = malloc(sizeof(double) * (num_outputs ? num_outputs : 1));
+
+	nn_context* context = nn_context_create(model);
+	if(!context || !output || nn_infer(context, input, file_len * 8, output, num_outputs) != 0) {
+		printf("Inference failed: %s\n", nn_last_error());
+		return 1;
+	}
+
+	for(size_t i = 0; i < num_outputs; i += 1) {
+		printf("%f\n", output[i]);
+	}
+
+	nn_context_free(context);
+	nn_free(model);
+	nn_shutdown();
+	free(output);
+	free(input);
+	free(buf);
+	return 0;
+}
@@ -0,0 +1,31 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include <includes/kernels.h>
+
+/* Layers with fewer weights than this just use the plain row kernel */
+#define AUTOTUNE_MIN_WEIGHTS 4096
+
+#define KERNEL_PRECISION "f64"
+
+typedef enum {
+	PASS_FORWARD = 0,
+	PASS_BACKWARD = 1,
+} kernel_pass;
+
+/* A tuned kernel for a given layer shape */
+typedef struct {
+	kernel_pass pass;
+	size_t input_width;
+	size_t output_width;
+	size_t batch_size;
+	kernel_choice choice;
+} tuning_entry;
+
+int autotune_load(char* filename);
+void autotune_free(void);
+
+kernel_choice autotune_forward(neuron* neurons, size_t num_neurons, double* inputs, size_t num_inputs);
+kernel_choice autotune_backward(neuron* neurons, size_t num_neurons, double* weight_derivatives, double* prev_outputs, size_t num_inputs);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef BUFFERS_H
+#define BUFFERS_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Every buffer starts on a cache line */
+#define BUFFER_ALIGNMENT 64
+
+/* Buffers at least this large get pages of their own, so they land on the node that uses them rather than wherever the heap was */
+#define BUFFER_MAP_THRESHOLD (64 * 1024)
+
+/* Buffers at least this large are backed by huge pages when they can be */
+#define BUFFER_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+/* Leave each page on the node of the thread that first touches it */
+#define BUFFER_ANY_NODE -1
+
+#define BUFFER_MAX_NODES 64
+
+typedef enum {
+	HUGE_PAGES_OFF = 0,
+	HUGE_PAGES_TRANSPARENT = 1, /* Ask the kernel to back buffers with transparent huge pages */
+	HUGE_PAGES_EXPLICIT = 2,    /* Use reserved huge pages, falling back to transparent ones once they run out */
+} huge_page_mode;
+
+/*
+ * Heap buffers are preceded by a cache line holding their header. Mapped buffers start their mapping, so nothing
+ * touches a page before its users do, and their headers are on a list instead, also used for placement reports.
+ */
+typedef struct buffer_header {
+	size_t len;
+	size_t mapped_len; /* 0 for buffers on the heap */
+	void* mapping; /* Where a mapped buffer starts */
+	bool explicit_huge;
+	bool transparent_huge;
+	struct buffer_header* prev;
+	struct buffer_header* next;
+} buffer_header;
+
+typedef struct {
+	uint64_t allocations;
+	uint64_t live_bytes;
+	uint64_t peak_bytes;
+	uint64_t heap_bytes; /* Live bytes of buffers too small to map */
+	uint64_t mapped_bytes;
+	uint64_t explicit_huge_bytes;
+	uint64_t transparent_huge_bytes; /* Mapped bytes we asked to have transparent huge pages */
+	uint64_t huge_fallbacks; /* Times reserved huge pages weren't available */
+	uint64_t bind_failures; /* Times a buffer couldn't be bound to its node */
+} buffer_stats;
+
+void buffer_set_huge_pages(huge_page_mode mode);
+
+/* Allocate a cache line aligned buffer, preferring node unless it's BUFFER_ANY_NODE */
+void* buffer_alloc(size_t len, int node);
+
+/* Mapped buffers start zeroed and untouched, so clearing them doesn't decide where they're placed */
+void* buffer_calloc(size_t count, size_t size, int node);
+void buffer_free(void* buffer);
+
+void buffer_get_stats(buffer_stats* stats);
+
+/* Print the stats, along with where the pages of every mapped buffer actually are */
+void buffer_print_stats(void);
+
+#endif
@@ -0,0 +1,72 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <includes/nn.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/* Each shard has its own lock, LRU list and share of the budget, so lookups on different threads rarely wait */
+#define CACHE_SHARDS 16
+
+/* Buckets start at this many per shard and double when a shard averages more than one entry each */
+#define CACHE_INITIAL_BUCKETS 64
+
+/* A cached result, on its bucket's chain and its shard's LRU list */
+typedef struct cache_entry {
+	uint64_t hash;
+	uint64_t version;
+	double* input;
+	size_t input_len;
+	double* output;
+	size_t output_len;
+	size_t size; /* Bytes charged against the budget */
+	struct cache_entry* next; /* In the bucket */
+	struct cache_entry* newer;
+	struct cache_entry* older;
+} cache_entry;
+
+typedef struct {
+	pthread_mutex_t lock;
+	cache_entry** buckets;
+	size_t num_buckets;
+	size_t num_entries;
+	cache_entry* newest;
+	cache_entry* oldest;
+	size_t used;
+	size_t budget;
+} cache_shard;
+
+typedef struct {
+	cache_shard shards[CACHE_SHARDS];
+	_Atomic uint64_t hits;
+	_Atomic uint64_t misses;
+	_Atomic uint64_t insertions;
+	_Atomic uint64_t evictions;
+} inference_cache;
+
+typedef struct {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t insertions;
+	uint64_t evictions;
+	size_t entries;
+	size_t bytes;
+} cache_stats;
+
+inference_cache* cache_create(size_t budget);
+void cache_free(inference_cache* cache);
+
+/* version tells apart results from different weights, such as each version published to the registry */
+double* cache_lookup(inference_cache* cache, uint64_t version, double* input, size_t input_len, size_t output_len);
+
+/* Like cache_lookup, but copies a hit into the callers buffer, returning whether it was one */
+bool cache_lookup_into(inference_cache* cache, uint64_t version, double* input, size_t input_len, double* output, size_t output_len);
+void cache_insert(inference_cache* cache, uint64_t version, double* input, size_t input_len, double* output, size_t output_len);
+
+/* propogate_context_forward, returning a cached copy of the output when this input has been seen before */
+double* cache_propogate(inference_cache* cache, execution_context* context, uint64_t version, double* input, size_t input_len, size_t output_len);
+
+void cache_get_stats(inference_cache* cache, cache_stats* stats);
+void cache_print_stats(inference_cache* cache);
+
+#endif
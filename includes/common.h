@@ -3,8 +3,10 @@
 
 #include <includes/test_case.h>
 #include <includes/nn.h>
+#include <includes/thread_pool.h>
 
 double* buf_to_bits(char* buf, size_t* out_size, size_t buf_len);
+double* buf_to_bytes(char* buf, size_t* out_size, size_t buf_len);
 size_t get_file_size(char* filename);
 int read_file(char* filename, char** out_buf, size_t* file_len);
 
@@ -0,0 +1,67 @@
+#ifndef COMPACT_H
+#define COMPACT_H
+
+#include <includes/nn.h>
+
+#define COMPACT_MAGIC 0x434E5553 /* SUNC */
+#define COMPACT_VERSION 1
+
+/* Values are coded in independent blocks of up to this many, so they can be decoded in parallel */
+#define COMPACT_BLOCK_VALUES 32768
+
+/* Symbol frequencies are scaled to add up to 1 << COMPACT_PROB_BITS */
+#define COMPACT_PROB_BITS 12
+
+/* Weights are stored as 16 bit floats of either kind */
+typedef enum {
+	PRECISION_FP16 = 0, /* IEEE half precision, more mantissa but a smaller range */
+	PRECISION_BF16 = 1, /* A truncated float, with the full range of a float */
+} compact_precision;
+
+/* Each value becomes the difference from the one before it */
+#define COMPACT_DELTA 0x1
+
+/* The low and high bytes of the values are coded as separate streams */
+#define COMPACT_SHUFFLE 0x2
+
+/* Binary layers only keep the signs of their weights, set whenever a network has any */
+#define COMPACT_SIGNS 0x4
+
+/* Signs are a bit each, coded in blocks of this many ahead of the layers blocks of values */
+#define COMPACT_BLOCK_SIGNS (COMPACT_BLOCK_VALUES * 8)
+
+typedef struct {
+	uint32_t magic; /* 'SUNC' */
+	uint32_t version;
+	size_t num_layers;
+	uint8_t precision; /* A compact_precision */
+	uint8_t flags;
+} compact_file_header;
+
+/* Every rows weights in row order, then each rows bias, then dense layers recurrent weights, in num_blocks blocks. Binary layers weights are signs when COMPACT_SIGNS is set, and not counted in num_values */
+typedef struct {
+	size_t num_neurons;
+	size_t num_values;
+	size_t num_blocks;
+	size_t kernel_size;
+	size_t stride;
+	size_t channels;
+	size_t dim;
+	uint32_t activation_index;
+	uint8_t type; /* A layer_type */
+	uint8_t recurrent;
+} compact_file_layer;
+
+/* One stream per byte of the values if they're shuffled, or one stream for them all, each followed by its frequencies unless stored */
+typedef struct {
+	uint32_t raw_len;
+	uint32_t coded_len; /* 0 when the stream is stored as it is, as coding wouldn't make it smaller */
+} compact_stream_header;
+
+int export_compact_network(neural_network* network, char* filename, compact_precision precision, uint8_t flags);
+int write_compact_network(neural_network* network, FILE* f, compact_precision precision, uint8_t flags);
+
+/* Called by parse_neural_network for files starting with COMPACT_MAGIC */
+neural_network* parse_compact_network(char* file_buf, size_t file_length, load_mode mode);
+
+#endif
@@ -0,0 +1,11 @@
+#ifndef COMPILER_H
+#define COMPILER_H
+
+#include <includes/nn.h>
+
+/* Layers with at most this many weights are fully unrolled */
+#define COMPILER_UNROLL_WEIGHTS 256
+
+int compile_neural_network(neural_network* network, char* filename);
+
+#endif
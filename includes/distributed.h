@@ -0,0 +1,29 @@
+#ifndef DISTRIBUTED_H
+#define DISTRIBUTED_H
+
+#include <includes/nn.h>
+
+/* How many times to try connecting to the next rank, 50ms apart */
+#define DISTRIBUTED_CONNECT_ATTEMPTS 200
+
+/* A process's place in the ring */
+typedef struct {
+	size_t rank;
+	size_t world_size;
+	int listen_fd;
+	int next_fd; /* We send to rank + 1 */
+	int prev_fd; /* We receive from rank - 1 */
+} communicator;
+
+int distributed_launch(size_t world_size, size_t* rank, char*** peers);
+void distributed_free_peers(char** peers, size_t world_size);
+
+communicator* distributed_connect(size_t rank, size_t world_size, char** peers);
+void distributed_free(communicator* comm);
+
+int ring_allreduce(communicator* comm, double* buf, size_t len);
+
+int distributed_backpropogate_cases(communicator* comm, neural_network* network, test_case* cases, size_t* indices, size_t num_cases, double learn_rate);
+size_t distributed_total_cases(communicator* comm, size_t num_cases);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <includes/nn.h>
+
+/* Adds each neurons weights multiplied by the inputs onto its entry in sums */
+typedef void (*forward_kernel)(neuron* neurons, size_t start, size_t end, double* inputs, size_t num_inputs, double* sums, size_t tile);
+
+/* Accumulates each neurons row of weight_derivatives and its contribution to the previous layers derivatives */
+typedef void (*backward_kernel)(neuron* neurons, size_t start, size_t end, double* common_terms, double* prev_outputs, double* next_derivatives, double* weight_derivatives, size_t num_inputs, size_t tile);
+
+typedef struct {
+	char* name;
+	forward_kernel forward;
+	backward_kernel backward;
+	bool tiled;
+} kernel_variant;
+
+extern kernel_variant kernel_variants[];
+extern size_t num_kernel_variants;
+
+#endif
@@ -0,0 +1,97 @@
+#ifndef LIBNN_H
+#define LIBNN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The C API of libnn.so and libnn.a, for running networks in process rather than through the nn executable.
+ *
+ * Models and contexts are opaque handles. Functions returning int give 0 on success and -1 on failure, and functions
+ * returning a handle give NULL on failure, after which nn_last_error says why. The library never writes to stdout.
+ *
+ * Inputs and outputs are a double per neuron. Networks made from files with nn -g take a 0 or 1 per bit of the file,
+ * and embedding networks a byte value per input. Inputs longer than the input layer are fed through a step at a time,
+ * like the nn executable does, giving an output layers worth of outputs per step.
+ *
+ * Any number of contexts can run inference on the same model at once, from different threads, as long as the model
+ * isn't being trained or freed at the same time. Each context should only be used by one thread at a time.
+ */
+
+/* Bumped whenever the API changes in a way existing callers would notice */
+#define NN_API_VERSION 1
+
+#if defined(__GNUC__)
+#define NN_API __attribute__((visibility("default")))
+#else
+#define NN_API
+#endif
+
+typedef struct nn_model nn_model;
+typedef struct nn_context nn_context;
+typedef struct nn_cache nn_cache;
+
+/* Models loaded without NN_LOAD_TRAINABLE never allocate training state, and can't be trained */
+#define NN_LOAD_TRAINABLE 0x1
+
+/* The NN_API_VERSION the library was built with */
+NN_API int nn_api_version(void);
+
+/* Optionally set the number of worker threads before anything else, otherwise there's one per cpu */
+NN_API int nn_init(size_t num_threads);
+
+/* Stop the worker threads, once every model has been freed */
+NN_API void nn_shutdown(void);
+
+/* Why the last call on this thread failed */
+NN_API const char* nn_last_error(void);
+
+/* Load a SUNN or compact network from a file, or from a copy of one in memory */
+NN_API nn_model* nn_load(const char* filename, int flags);
+NN_API nn_model* nn_load_buffer(const void* buf, size_t len, int flags);
+
+/* A new trainable dense network, with Xavier initialised weights */
+NN_API nn_model* nn_create(const size_t* layer_sizes, size_t num_layers, uint64_t seed);
+NN_API void nn_free(nn_model* model);
+
+NN_API size_t nn_input_size(nn_model* model);
+NN_API size_t nn_output_size(nn_model* model);
+
+/* Save a model as a SUNN file, which nn -l and nn_load can read */
+NN_API int nn_export(nn_model* model, const char* filename);
+
+/* A context holds one callers activations, so it can be reused for every call on that thread */
+NN_API nn_context* nn_context_create(nn_model* model);
+NN_API void nn_context_free(nn_context* context);
+
+/* Run one input through the network from a fresh start, writing output_len outputs. Asking for more outputs than the input has steps for fails */
+NN_API int nn_infer(nn_context* context, const double* input, size_t input_len, double* output, size_t output_len);
+
+/* Run num_inputs inputs of input_len each, spread over the worker threads, writing output_len outputs for each one after the other */
+NN_API int nn_infer_batch(nn_model* model, const double* inputs, size_t input_len, size_t num_inputs, double* outputs, size_t output_len);
+
+/*
+ * A cache of outputs for inputs seen before, which any number of models and threads can share. Entries are kept apart
+ * by model, and training a model leaves its earlier entries to age out rather than ever being returned.
+ */
+NN_API nn_cache* nn_cache_create(size_t budget_bytes);
+NN_API void nn_cache_free(nn_cache* cache);
+
+typedef struct {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t insertions;
+	uint64_t evictions;
+	size_t entries;
+	size_t bytes;
+} nn_cache_info;
+
+NN_API void nn_cache_stats(nn_cache* cache, nn_cache_info* info);
+
+/* nn_infer, copying the outputs from the cache when this model has seen the same input and output_len before */
+NN_API int nn_infer_cached(nn_context* context, nn_cache* cache, const double* input, size_t input_len, double* output, size_t output_len);
+
+/* One step of gradient descent on num_cases cases, each input_len inputs and output_len expected outputs, stored one after the other */
+NN_API int nn_train_step(nn_model* model, const double* inputs, size_t input_len, const double* expected, size_t output_len, size_t num_cases, double learn_rate);
+
+#endif
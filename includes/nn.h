@@ -2,16 +2,21 @@
 #define NN_H
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include <strings.h>
 #include <time.h>
 #include <float.h>
 #include <math.h>
 #include <includes/test_case.h>
 
+/* The library never logs, and keeps errors for nn_last_error rather than printing them */
+#ifndef NN_LIBRARY
 #define DEBUG
 #define INFO
+#endif
 
 /* Allow for debug and info logging */
 
@@ -29,10 +34,12 @@
 
 #define NEURAL_NETWORK_MAGIC 0x4E4E5553 /* SUNN */
 
+#ifdef NN_LIBRARY
+void nn_set_error(const char* message);
+#define error(s) nn_set_error(s)
+#else
 #define error(s) printf("Error on line %d: %s\n", __LINE__, s)
-
-/* Get a random number between 0 and 1 */
-#define uniform_decimal() ((double)rand()/(double)(RAND_MAX))
+#endif
 
 /* Generic activation function */
 typedef double (*activation_func)(double input);
@@ -47,28 +54,154 @@ typedef struct {
 	uint32_t activation_index;
 	double* weights;
 	double bias;
-	double weighted_sum;
-	double output;
 	double recurrent_weight;
-	double recurrent_history;
-	double* weight_derivatives;
-	double bias_derivative;
-	double recurrent_weight_derivative;
 } neuron;
 
+/* Each input to an embedding is a byte value, whose output is its row of the table */
+#define EMBEDDING_ROWS 256
+
+/* A layers training state, indexed by neuron and only allocated once the network is trained */
+typedef struct {
+	double* weight_derivatives; /* A row of the previous layers size per neuron, or a filter per channel */
+	double* bias_derivatives;
+	double* recurrent_weight_derivatives;
+	uint64_t touched_rows[EMBEDDING_ROWS / 64]; /* The embedding rows with derivatives, the rest are all 0 and left alone */
+} layer_training;
+
+
+/* The matrix kernel a layer uses and its column tile size */
+typedef struct {
+	uint32_t variant;
+	size_t tile;
+} kernel_choice;
+
+typedef struct {
+	kernel_choice forward;
+	kernel_choice backward;
+	bool forward_tuned;
+	bool backward_tuned;
+} layer_kernels;
+
+/* How a layer connects to the one before it */
+typedef enum {
+	LAYER_DENSE = 0,  /* Every neuron has its own weight for every previous neuron */
+	LAYER_CONV1D = 1, /* Each channel slides one filter along the previous layer */
+	LAYER_LSTM = 2,   /* Long short-term memory cells */
+	LAYER_GRU = 3,    /* Gated recurrent units */
+	LAYER_EMBEDDING = 4, /* Looks up a learned vector for each input byte, only straight after the input layer */
+	LAYER_BINARY = 5, /* Dense, but with weights and outputs of +-1, summed with XNOR and popcount */
+} layer_type;
+
+/* A 1D convolution, whose outputs are stored channel by channel, each channel width positions long */
+typedef struct {
+	size_t kernel_size;
+	size_t stride;
+	size_t channels;
+	size_t in_channels; /* The previous layer is read as in_channels rows of in_width */
+	size_t in_width;
+	size_t width;
+	double* filters; /* A row of in_channels * kernel_size weights per channel */
+	double* biases; /* Per channel */
+} conv_layer;
+
+/* The input, forget, cell and output gates of an LSTM, or the reset, update and new gates of a GRU */
+#define LSTM_GATES 4
+#define GRU_GATES 3
+
+/* Every gate of a gated layer comes from one matrix product per step over the previous layer and the last outputs */
+typedef struct {
+	size_t num_gates;
+	size_t num_inputs; /* The previous layers size, the last outputs follow it in each row */
+	double* weights; /* A row of num_inputs + num_neurons weights per gate per neuron, gate by gate */
+	double* biases;
+} gated_layer;
+
+typedef struct {
+	size_t dim;
+	double* table; /* EMBEDDING_ROWS rows of dim */
+} embedding_layer;
+
+/* Inputs of at least this much are +1 to a binary layer, and less -1 */
+#define BINARY_THRESHOLD 0.5
+
+/* A binary layers outputs are 1 for +1 and 0 for -1, and its neurons weights are the real valued shadows of the +-1 weights it uses */
+typedef struct {
+	size_t words; /* Per row of signs */
+	double scale; /* Applied to every sum, keeping them within the range the straight through estimator passes */
+	uint64_t* signs; /* A set bit for each weight of at least 0, a row per neuron */
+} binary_layer;
 
 /* Generic neural net layer */
 typedef struct {
 	neuron* layer_neurons;
 	size_t num_neurons;
 	bool recurrent;
+	layer_type type;
+	double* neuron_weights; /* The block every neurons weights are a row of, for dense and binary layers */
+	conv_layer conv; /* Only used by LAYER_CONV1D */
+	gated_layer gated; /* Only used by LAYER_LSTM and LAYER_GRU */
+	embedding_layer embedding; /* Only used by LAYER_EMBEDDING */
+	binary_layer binary; /* Only used by LAYER_BINARY */
+	layer_kernels kernels;
+	layer_training training;
 } layer;
 
-/* Generic neural net */
+/* One callers activations and recurrent state, so many callers can share a networks weights */
 typedef struct {
+	struct neural_network* network;
+	double** outputs; /* Per layer */
+	double** sums; /* Each layers weighted sums, kept for backpropogation */
+	double** history; /* The last outputs of recurrent layers, NULL for the rest, followed by the cell state of gated layers */
+	double** gates; /* The latest gate activations of gated layers, then their new cell state, NULL for the rest */
+	double* block; /* The arena every layers tensors are planned into */
+	size_t block_len; /* In doubles */
+	uint64_t* input_bits; /* The signs of a binary layers inputs, large enough for any of them */
+
+	/* When every input is 0 or 1, the first layer only needs the weights of the set ones */
+	bool binary_inputs;
+	size_t* set_inputs;
+	size_t num_set_inputs;
+
+	/* Backpropogations buffers, in the same arena, per layer - all NULL for contexts that only run inference */
+	double** derivatives;
+	double** common_terms;
+	double** partial_derivatives;
+	double** input_signs;
+
+	/* Training contexts of networks with gated layers keep the arena of each step, and what's carried back between them */
+	double* step_blocks; /* BPTT_STEPS copies of the arena after each steps forward pass, then one after the last steps history */
+	double** carried; /* Per layer, dC/dh then dC/dc passed back a step into gated layers, NULL for the rest */
+} execution_context;
+
+/* Generic neural net */
+typedef struct neural_network {
 	layer* layers;
 	size_t num_layers;
 	int num_back_propogations;
+
+	/* Every neurons weight derivatives, in layer then neuron order */
+	double* weight_derivatives;
+	size_t num_weights;
+
+	/* The rest of each layers training state */
+	double* neuron_training;
+
+	/* Activations used for training and propogate_case_forward */
+	execution_context* context;
+
+	/* Set when the weights live in memory we don't own, which is unmapped with the network if mapping is set */
+	bool shared_weights;
+	void* mapping;
+	size_t mapping_len;
+
+	/* Set for networks loaded only to serve predictions, which never allocate training state */
+	bool inference_only;
+
+	/* Copies sharing our weights, each with its own activations and derivatives, for training on many threads */
+	struct neural_network** replicas;
+	size_t num_replicas;
+	size_t max_replicas; /* 0 for one per worker */
+	struct neural_network* replica_of;
 } neural_network;
 
 
@@ -84,22 +217,115 @@ typedef struct {
 	size_t num_neurons;
 	size_t layer_len;
 	bool recurrent;
+	uint8_t type; /* A layer_type, only set from version 1 */
 } file_layer;
 
+/* Follows a LAYER_CONV1D file_layer, then come the filters and biases. Gated layers follow theirs with their weights then biases */
+typedef struct {
+	size_t kernel_size;
+	size_t stride;
+	size_t channels;
+	uint32_t activation_index;
+} file_conv_layer;
+
+/* Follows a LAYER_EMBEDDING file_layer, then comes the table */
+typedef struct {
+	size_t dim;
+} file_embedding_layer;
+
+
+/* Files before version 1 only have dense layers, and left the version as padding */
+#define NEURAL_NETWORK_VERSION 1
 
 typedef struct {
 	uint32_t magic; /* 'SUNN' */
+	uint32_t version;
 	size_t num_layers;
 } neural_network_file_header;
 
-neural_network* init_neural_network(bool* recurrent_layer, size_t* layer_sizes, size_t num_layers);
+/* How a new networks weights and biases are initialised */
+typedef enum {
+	INIT_NONE = 0,    /* Left for the caller to fill in */
+	INIT_UNIFORM = 1, /* Uniform between 0 and 1 */
+	INIT_XAVIER = 2,  /* Uniform between +-sqrt(6 / (fan_in + fan_out)), zero bias */
+	INIT_HE = 3,      /* Normal with standard deviation sqrt(2 / fan_in), zero bias */
+	INIT_SHARED = 4,  /* No weights are allocated, the caller points them at memory it owns */
+} init_scheme;
+
+typedef struct {
+	init_scheme scheme;
+	uint64_t seed;
+} init_params;
+
+/* The type of a layer, and the shape of convolutional and embedding layers */
+typedef struct {
+	layer_type type;
+	size_t kernel_size;
+	size_t stride;
+	size_t channels;
+	size_t dim;
+} layer_spec;
+
+/* layer_specs can be NULL for an all dense network, convolutional and embedding layers ignore their layer size */
+neural_network* init_neural_network(bool* recurrent_layer, size_t* layer_sizes, layer_spec* layer_specs, size_t num_layers, init_params* params);
+
+/* How many rows of weights a layer has, each with a bias - one per neuron unless the layer shares or gates them */
+size_t layer_rows(layer* curr_layer);
+size_t layer_row_len(neural_network* network, int layer_index);
+double* row_weights(layer* curr_layer, size_t row, size_t row_len);
+double* row_bias(layer* curr_layer, size_t row); /* NULL for rows without a bias */
+
+/* How much history a layer carries between steps, its last outputs then a gated layers cell state */
+size_t layer_history_len(layer* curr_layer);
+
+/* A gated layers context keeps every gates activations, then an LSTMs new cell state or the recurrent half of a GRUs new gate */
+#define GATED_STATE 5
+
+/* Gated layers are backpropogated through this many steps of a case at a time, carrying their derivatives back a step */
+#define BPTT_STEPS 16
+
+/* Gated layers carry their last outputs and cell state between steps like recurrent layers */
+bool is_gated(layer* curr_layer);
+
+/* How many chunks a dense layers backward pass is split into, each summing its own copy of the previous layers derivatives */
+size_t backward_chunks(layer* curr_layer, layer* prev_layer);
+
+/* Bring the packed signs of binary layers up to date, for callers that set their weights directly */
+void pack_binary_weights(neural_network* network);
 void free_neural_network(neural_network* network);
 
-neural_network* import_neural_network(char* filename);
+/* How much of a network to set up when importing it */
+typedef enum {
+	LOAD_TRAINABLE = 0, /* Training state is allocated the first time the network is trained */
+	LOAD_INFERENCE = 1, /* Training state is never allocated, and training fails */
+} load_mode;
+
+neural_network* import_neural_network(char* filename, load_mode mode);
+neural_network* parse_neural_network(char* file_buf, size_t file_length, load_mode mode, bool share_weights);
 void export_neural_network(neural_network* network, char* filename);
+void write_neural_network(neural_network* network, FILE* f);
+
+/* Contexts can each be used by a different thread at once, as long as the network isn't being trained */
+execution_context* create_execution_context(neural_network* network);
+void free_execution_context(execution_context* context);
+double* propogate_context_forward(execution_context* context, double* input, size_t input_len, size_t output_len);
+
+/* Like propogate_context_forward, but carries on from the contexts history rather than resetting it first */
+double* propogate_context_steps(execution_context* context, double* input, size_t input_len, size_t output_len);
+void reset_history(execution_context* context);
+
+/* Like propogate_context_steps, but writes into the callers output buffer */
+void propogate_context_into(execution_context* context, double* input, size_t input_len, double* output, size_t output_len);
 
 double* propogate_case_forward(neural_network* network, double* input, size_t input_len, size_t output_len);
 
 void backpropogate_cases(neural_network* network, test_case* cases, size_t num_cases, double learn_rate);
+void backpropogate_batch(neural_network* network, test_case* cases, size_t* indices, size_t num_indices, double learn_rate);
+int accumulate_derivatives(neural_network* network, test_case* cases, size_t* indices, size_t num_cases);
+void apply_derivatives(neural_network* network, double learn_rate);
+
+/* Note down every embedding row with a derivative, after derivatives were summed in from somewhere else */
+void mark_embedding_rows(neural_network* network);
+void backpropogate_cases_hogwild(neural_network* network, test_case* cases, size_t* indices, size_t num_cases, double learn_rate, size_t batch_size);
 
 #endif
@@ -0,0 +1,54 @@
+#ifndef PERF_H
+#define PERF_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* Most layers we keep a profile for, deeper layers share the last slot */
+#define PERF_MAX_LAYERS 64
+
+typedef enum {
+	PERF_FORWARD = 0,
+	PERF_BACKWARD = 1,
+} perf_pass;
+
+/* Hardware counters, in the order they're read from the group */
+typedef enum {
+	PERF_CYCLES = 0,
+	PERF_INSTRUCTIONS,
+	PERF_CACHE_MISSES,
+	PERF_BRANCH_MISSES,
+	PERF_NUM_COUNTERS,
+} perf_counter;
+
+/* Where a thread's counters and clock stood when it started some work */
+typedef struct {
+	uint64_t ns;
+	uint64_t counters[PERF_NUM_COUNTERS];
+	bool counted;
+} perf_sample;
+
+/* Totals for one pass through one layer, summed over every thread */
+typedef struct {
+	_Atomic uint64_t calls;
+	_Atomic uint64_t wall_ns;
+	_Atomic uint64_t thread_ns;
+	_Atomic uint64_t counters[PERF_NUM_COUNTERS];
+	_Atomic uint64_t flops;
+	_Atomic uint64_t bytes;
+} layer_profile;
+
+extern bool perf_enabled;
+
+int perf_init(void);
+void perf_free(void);
+
+void perf_begin(perf_sample* sample);
+void perf_end(perf_sample* sample, perf_pass pass, size_t layer_index, uint64_t flops, uint64_t bytes);
+void perf_add_wall(perf_sample* sample, perf_pass pass, size_t layer_index);
+
+void perf_print_report(size_t num_layers);
+
+#endif
@@ -0,0 +1,54 @@
+#ifndef PLANNER_H
+#define PLANNER_H
+
+#include <includes/nn.h>
+
+/* Every tensor starts on a cache line, counted in doubles */
+#define PLAN_ALIGNMENT (64 / sizeof(double))
+
+typedef enum {
+	PLAN_INFERENCE = 0, /* A layers activations only live until the next layer has read them */
+	PLAN_TRAINING = 1,  /* Activations live until their layer is backpropogated, and the derivatives passed down reuse their space */
+} plan_mode;
+
+/* What a context keeps for each layer, the last four only when training */
+typedef enum {
+	TENSOR_OUTPUTS,
+	TENSOR_SUMS,
+	TENSOR_HISTORY,
+	TENSOR_GATES,
+	TENSOR_DERIVATIVES,  /* dC/dA of the layers outputs, from the layer after it or the cost */
+	TENSOR_COMMON_TERMS, /* dC/dz of each row, then the recurrent terms of a gated layer */
+	TENSOR_PARTIALS,     /* A copy of the previous layers derivatives per chunk of a dense layer split over workers */
+	TENSOR_INPUT_SIGNS,  /* The previous layers outputs as signs, for binary layers */
+	TENSOR_NUM_KINDS,
+} tensor_kind;
+
+/*
+ * Step 0 sets the inputs and step i runs layer i forward. Training then backpropogates the layers from the last one
+ * down, a step each, and the final step copies the outputs out and updates the history. A tensor is alive from the
+ * step that writes it to the last step that reads it, inclusive.
+ */
+typedef struct {
+	size_t len; /* In doubles, 0 for tensors the layer doesn't have, or for sums taken in place in the layers outputs */
+	size_t first_step;
+	size_t last_step;
+	size_t offset; /* Into the arena, in doubles */
+} planned_tensor;
+
+typedef struct {
+	plan_mode mode;
+	size_t num_layers;
+	planned_tensor* tensors; /* TENSOR_NUM_KINDS per layer, layer by layer */
+	size_t arena_len; /* In doubles */
+	size_t unshared_len; /* What the arena would take if no tensors shared space */
+} execution_plan;
+
+/* Work out when each tensor of a pass is alive, and give each an offset into one arena that only tensors alive at the same time never share */
+execution_plan* plan_execution(neural_network* network, plan_mode mode);
+void plan_free(execution_plan* plan);
+
+planned_tensor* plan_tensor(execution_plan* plan, size_t layer_index, tensor_kind kind);
+void plan_print(execution_plan* plan);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <includes/nn.h>
+#include <stdatomic.h>
+
+#define REGISTRY_MAGIC 0x4745524E /* NREG */
+
+/* Longest model name, leaving room for the prefix and version in the segment name */
+#define REGISTRY_MAX_NAME 200
+
+/* How many times to retry attaching when a new version is published underneath us */
+#define REGISTRY_ATTACH_ATTEMPTS 8
+
+/* Lives in its own small segment, pointing at the segment holding the current version */
+typedef struct {
+	uint32_t magic; /* NREG */
+	_Atomic uint64_t next_version;
+	_Atomic uint64_t current_version;
+} registry_control;
+
+int registry_publish(char* name, neural_network* network, uint64_t* version);
+int registry_remove(char* name);
+
+neural_network* registry_attach(char* name, uint64_t* version);
+int registry_refresh(char* name, neural_network** network, uint64_t* version);
+
+#endif
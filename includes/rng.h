@@ -0,0 +1,15 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+/* Philox4x32-10 counter based generator - every (seed, stream, index) maps to its own random block */
+void philox4x32(uint32_t counter[4], uint64_t key, uint32_t out[4]);
+
+/* Get a random number between 0 and 1 */
+double rng_uniform(uint64_t seed, uint64_t stream, uint64_t index);
+
+/* Get a normally distributed random number with a mean of 0 and standard deviation of 1 */
+double rng_normal(uint64_t seed, uint64_t stream, uint64_t index);
+
+#endif
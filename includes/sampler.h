@@ -0,0 +1,31 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+/* How cases are picked for each epoch */
+typedef enum {
+	SAMPLE_SEQUENTIAL, /* File order */
+	SAMPLE_SHUFFLE, /* A fresh permutation each epoch */
+	SAMPLE_REPLACEMENT, /* Independent draws, so a case may be seen more than once */
+} sample_mode;
+
+/* Hands out case indices, so cases never have to be moved around */
+typedef struct {
+	size_t* indices;
+	size_t num_cases;
+	sample_mode mode;
+	uint64_t seed;
+	size_t epoch;
+	size_t position;
+} sampler;
+
+sampler* sampler_create(size_t num_cases, sample_mode mode, uint64_t seed);
+void sampler_free(sampler* sampler);
+
+void sampler_start_epoch(sampler* sampler);
+size_t sampler_next_batch(sampler* sampler, size_t batch_size, size_t** batch);
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <includes/nn.h>
+
+#define SESSION_MAGIC 0x53535553 /* SUSS */
+#define SESSION_VERSION 1
+
+/* A sequence being fed through a network a chunk at a time, carrying its recurrent history between chunks */
+typedef struct {
+	execution_context* context;
+	double* pending; /* The start of the next step, until a whole step of input has arrived */
+	size_t pending_len;
+	size_t num_steps;
+} inference_session;
+
+/* Followed by the input layers last outputs, then each layers history in layer order, then the pending input */
+typedef struct {
+	uint32_t magic; /* SUSS */
+	uint32_t version;
+	size_t state_len;
+	size_t pending_len;
+	size_t num_steps;
+} session_file_header;
+
+inference_session* session_create(neural_network* network);
+void session_free(inference_session* session);
+
+/* Forget the sequence so far, as if the session was new */
+void session_reset(inference_session* session);
+
+/* Feed the next part of the sequence, giving the outputs of every step it completes one after the other */
+int session_feed(inference_session* session, double* input, size_t input_len, double** output, size_t* output_len);
+
+/* Push through a partial last step, as propogate_context_forward does at the end of its input */
+int session_flush(inference_session* session, double** output, size_t* output_len);
+
+/* Sessions can be saved and restored into any session on the same network */
+void write_session(inference_session* session, FILE* f);
+int export_session(inference_session* session, char* filename);
+int parse_session(inference_session* session, char* file_buf, size_t file_length);
+int import_session(inference_session* session, char* filename);
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include <includes/nn.h>
+#include <includes/sampler.h>
+
+/* Every fifth case is held out to score candidates on, when there are at least this many */
+#define SWEEP_HOLDOUT 5
+
+/* Grids any larger than this are almost certainly a mistake */
+#define SWEEP_MAX_CANDIDATES 65536
+
+/* The hyperparameters a sweep can vary */
+typedef struct {
+	double learn_rate;
+	int num_iterations;
+	size_t batch_size; /* 0 for the whole training set */
+	char* layers; /* As given to -n, or NULL to start from the network given on the command line */
+} sweep_config;
+
+typedef struct {
+	sweep_config config;
+	neural_network* network;
+	double loss; /* Mean squared error per output over the held out cases, NAN if training failed */
+	double seconds;
+} sweep_candidate;
+
+/*
+ * Specs are semicolon separated keys of a, i, batch or n, each with | separated values, e.g. a=0.01|0.1;n=64,32,8|64,8
+ * Every combination is a candidate, or with num_trials set that many are picked at random, when every key but n can
+ * also be a range like a=0.001:0.5, with learning rates drawn log uniformly. Keys left out keep their default.
+ */
+sweep_config* sweep_parse(char* spec, size_t num_trials, uint64_t seed, sweep_config* defaults, size_t* num_configs);
+void sweep_configs_free(sweep_config* configs, size_t num_configs);
+
+/* Train every candidates network at once on the same cases, returning the index of the lowest loss or -1 if all failed */
+int sweep_run(sweep_candidate* candidates, size_t num_candidates, test_case* cases, size_t num_cases, sample_mode sampling, uint64_t seed);
+void sweep_print_results(sweep_candidate* candidates, size_t num_candidates, int best);
+
+#endif
@@ -2,9 +2,12 @@
 #define TEST_CASE_H
 
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdbool.h>
 
 #define TRAINING_DATA_MAGIC 0x5453554B /* SUKT */
+#define TRAINING_DATA_RAW_MAGIC 0x5253554B /* SUKR - inputs are a byte each, for embedding networks, and outputs are packed bits */
 
 /* Generic test case */
 typedef struct {
@@ -21,13 +24,24 @@ typedef struct {
 } file_test_case;
 
 typedef struct {
-	uint32_t magic; /* SUKT */
+	uint32_t magic; /* SUKT or SUKR */
 	size_t num_test_cases;
 } training_data_header;
 
+/* Cases backed by a memory mapped training file */
+typedef struct {
+	test_case* cases;
+	size_t num_cases;
+	char* mapping;
+	size_t mapping_len;
+} mapped_training_data;
+
 void test_case_free(test_case case_to_free);
 void test_cases_free(test_case* cases_to_free, size_t num_cases);
-int export_training_data(char** input_filenames, char** expected_output_filenames, char* output_filename, size_t num_cases);
+int export_training_data(char** input_filenames, char** expected_output_filenames, char* output_filename, size_t num_cases, bool raw_bytes);
 int import_training_data(char* filename, test_case** ret_cases, size_t* num_cases);
+int import_training_data_shard(char* filename, size_t shard, size_t num_shards, test_case** ret_cases, size_t* num_cases);
+mapped_training_data* map_training_data_shard(char* filename, size_t shard, size_t num_shards);
+void unmap_training_data(mapped_training_data* data);
 
 #endif
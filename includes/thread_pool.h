@@ -0,0 +1,87 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/* Generic task and parallel loop body */
+typedef void (*task_func)(void* arg);
+typedef void (*range_func)(size_t start, size_t end, void* arg);
+
+/* A set of tasks which can be waited on together */
+typedef struct {
+	size_t pending;
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+} task_group;
+
+typedef struct {
+	task_func func;
+	void* arg;
+	task_group* group;
+} pool_task;
+
+/* Per worker utilisation statistics */
+typedef struct {
+	uint64_t tasks_run;
+	uint64_t tasks_stolen;
+	uint64_t busy_ns;
+} worker_stats;
+
+struct thread_pool;
+
+/* A worker thread and its double ended task queue */
+typedef struct {
+	pthread_t thread;
+	struct thread_pool* pool;
+	size_t index;
+	int cpu;
+	int node;
+
+	pthread_mutex_t lock;
+	pool_task* tasks;
+	size_t head;
+	size_t num_tasks;
+	size_t capacity;
+
+	worker_stats stats;
+} pool_worker;
+
+/* Work stealing thread pool */
+typedef struct thread_pool {
+	pool_worker* workers;
+	size_t num_workers;
+
+	pthread_mutex_t lock;
+	pthread_cond_t work_available;
+	atomic_size_t num_queued;
+	atomic_size_t next_worker;
+	bool shutdown;
+
+	uint64_t start_ns;
+} thread_pool;
+
+thread_pool* thread_pool_create(size_t num_workers, bool pin_workers);
+void thread_pool_free(thread_pool* pool);
+
+int thread_pool_init_global(size_t num_workers);
+thread_pool* thread_pool_global(void);
+void thread_pool_free_global(void);
+
+size_t thread_pool_default_size(void);
+int thread_pool_current_node(void);
+
+void task_group_init(task_group* group);
+void task_group_destroy(task_group* group);
+void task_group_wait(thread_pool* pool, task_group* group);
+
+int thread_pool_submit(thread_pool* pool, task_group* group, task_func func, void* arg);
+void thread_pool_parallel_for(thread_pool* pool, size_t count, size_t grain, range_func func, void* arg);
+
+void thread_pool_get_stats(thread_pool* pool, size_t worker_index, worker_stats* stats);
+void thread_pool_print_stats(thread_pool* pool);
+
+#endif
@@ -0,0 +1,133 @@
+#include <includes/common.h>
+#include <includes/kernels.h>
+
+/* Plain dot product per neuron */
+static void forward_rows(neuron* neurons, size_t start, size_t end, double* inputs, size_t num_inputs, double* sums, size_t tile) {
+	for(size_t i = start; i < end; i += 1) {
+		double* weights = neurons[i].weights;
+		double sum = 0;
+
+		for(size_t j = 0; j < num_inputs; j += 1) {
+			sum += weights[j] * inputs[j];
+		}
+		sums[i] += sum;
+	}
+}
+
+/* Four neurons at once over a range of inputs, so each input is loaded once per four rows */
+static void forward_block4(neuron* neurons, size_t start, size_t end, double* inputs, double* sums, size_t first_input, size_t last_input) {
+	size_t i = start;
+
+	for(; i + 4 <= end; i += 4) {
+		double* w0 = neurons[i].weights;
+		double* w1 = neurons[i+1].weights;
+		double* w2 = neurons[i+2].weights;
+		double* w3 = neurons[i+3].weights;
+		double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+
+		for(size_t j = first_input; j < last_input; j += 1) {
+			double x = inputs[j];
+			s0 += w0[j] * x;
+			s1 += w1[j] * x;
+			s2 += w2[j] * x;
+			s3 += w3[j] * x;
+		}
+
+		sums[i] += s0;
+		sums[i+1] += s1;
+		sums[i+2] += s2;
+		sums[i+3] += s3;
+	}
+
+	/* Mop up the last few neurons */
+	for(; i < end; i += 1) {
+		double* weights = neurons[i].weights;
+		double sum = 0;
+
+		for(size_t j = first_input; j < last_input; j += 1) {
+			sum += weights[j] * inputs[j];
+		}
+		sums[i] += sum;
+	}
+}
+
+static void forward_rows4(neuron* neurons, size_t start, size_t end, double* inputs, size_t num_inputs, double* sums, size_t tile) {
+	forward_block4(neurons, start, end, inputs, sums, 0, num_inputs);
+}
+
+/* Walk the inputs a tile at a time so the tile stays in cache across every neuron */
+static void forward_tiled(neuron* neurons, size_t start, size_t end, double* inputs, size_t num_inputs, double* sums, size_t tile) {
+	for(size_t first = 0; first < num_inputs; first += tile) {
+		size_t last = first + tile > num_inputs ? num_inputs : first + tile;
+		forward_block4(neurons, start, end, inputs, sums, first, last);
+	}
+}
+
+static void backward_rows(neuron* neurons, size_t start, size_t end, double* common_terms, double* prev_outputs, double* next_derivatives, double* weight_derivatives, size_t num_inputs, size_t tile) {
+	for(size_t i = start; i < end; i += 1) {
+		double common_term = common_terms[i];
+		double* weights = neurons[i].weights;
+		double* row_derivatives = &weight_derivatives[i * num_inputs];
+
+		for(size_t j = 0; j < num_inputs; j += 1) {
+			row_derivatives[j] += common_term * prev_outputs[j];
+			next_derivatives[j] += common_term * weights[j];
+		}
+	}
+}
+
+static void backward_block4(neuron* neurons, size_t start, size_t end, double* common_terms, double* prev_outputs, double* next_derivatives, double* weight_derivatives, size_t num_inputs, size_t first_input, size_t last_input) {
+	size_t i = start;
+
+	for(; i + 4 <= end; i += 4) {
+		double c0 = common_terms[i], c1 = common_terms[i+1], c2 = common_terms[i+2], c3 = common_terms[i+3];
+		double* w0 = neurons[i].weights;
+		double* w1 = neurons[i+1].weights;
+		double* w2 = neurons[i+2].weights;
+		double* w3 = neurons[i+3].weights;
+		double* d0 = &weight_derivatives[i * num_inputs];
+		double* d1 = &weight_derivatives[(i+1) * num_inputs];
+		double* d2 = &weight_derivatives[(i+2) * num_inputs];
+		double* d3 = &weight_derivatives[(i+3) * num_inputs];
+
+		for(size_t j = first_input; j < last_input; j += 1) {
+			double x = prev_outputs[j];
+			d0[j] += c0 * x;
+			d1[j] += c1 * x;
+			d2[j] += c2 * x;
+			d3[j] += c3 * x;
+			next_derivatives[j] += c0 * w0[j] + c1 * w1[j] + c2 * w2[j] + c3 * w3[j];
+		}
+	}
+
+	for(; i < end; i += 1) {
+		double common_term = common_terms[i];
+		double* weights = neurons[i].weights;
+		double* row_derivatives = &weight_derivatives[i * num_inputs];
+
+		for(size_t j = first_input; j < last_input; j += 1) {
+			row_derivatives[j] += common_term * prev_outputs[j];
+			next_derivatives[j] += common_term * weights[j];
+		}
+	}
+}
+
+static void backward_rows4(neuron* neurons, size_t start, size_t end, double* common_terms, double* prev_outputs, double* next_derivatives, double* weight_derivatives, size_t num_inputs, size_t tile) {
+	backward_block4(neurons, start, end, common_terms, prev_outputs, next_derivatives, weight_derivatives, num_inputs, 0, num_inputs);
+}
+
+static void backward_tiled(neuron* neurons, size_t start, size_t end, double* common_terms, double* prev_outputs, double* next_derivatives, double* weight_derivatives, size_t num_inputs, size_t tile) {
+	for(size_t first = 0; first < num_inputs; first += tile) {
+		size_t last = first + tile > num_inputs ? num_inputs : first + tile;
+		backward_block4(neurons, start, end, common_terms, prev_outputs, next_derivatives, weight_derivatives, num_inputs, first, last);
+	}
+}
+
+/* The first variant is the default for layers that aren't tuned */
+kernel_variant kernel_variants[] = {
+	{.name="rows", .forward=forward_rows, .backward=backward_rows, .tiled=false},
+	{.name="rows4", .forward=forward_rows4, .backward=backward_rows4, .tiled=false},
+	{.name="tiled", .forward=forward_tiled, .backward=backward_tiled, .tiled=true},
+};
+
+size_t num_kernel_variants = sizeof(kernel_variants) / sizeof(kernel_variant);
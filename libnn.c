@@ -0,0 +1,366 @@
+#include <includes/common.h>
+#include <includes/autotune.h>
+#include <includes/cache.h>
+#include <includes/libnn.h>
+
+/* The C API, built only into libnn with NN_LIBRARY set */
+
+struct nn_model {
+	neural_network* network;
+	_Atomic uint64_t version; /* Keeps cached outputs apart, changed whenever the weights are */
+};
+
+struct nn_cache {
+	inference_cache* cache;
+};
+
+/* Every model gets versions no other model has had, so a freed models address being reused never finds its entries */
+static _Atomic uint64_t next_version = 1;
+
+struct nn_context {
+	nn_model* model;
+	execution_context* context;
+};
+
+static _Thread_local char last_error[256];
+
+/* Every error() in the library ends up here, without its trailing newline */
+void nn_set_error(const char* message) {
+	snprintf(last_error, sizeof(last_error), "%s", message);
+
+	size_t len = strlen(last_error);
+	while(len > 0 && last_error[len-1] == '\n') {
+		last_error[--len] = '\0';
+	}
+}
+
+const char* nn_last_error(void) {
+	return last_error;
+}
+
+int nn_api_version(void) {
+	return NN_API_VERSION;
+}
+
+int nn_init(size_t num_threads) {
+	if(thread_pool_init_global(num_threads) != 0) {
+		error("Failed to start worker threads");
+		return -1;
+	}
+	return 0;
+}
+
+void nn_shutdown(void) {
+	thread_pool_free_global();
+	autotune_free();
+}
+
+static nn_model* wrap_network(neural_network* network) {
+	if(!network) {
+		return NULL;
+	}
+
+	nn_model* model = malloc(sizeof(nn_model));
+	if(!model) {
+		error("Failed to allocate model");
+		free_neural_network(network);
+		return NULL;
+	}
+
+	model->network = network;
+	atomic_init(&model->version, atomic_fetch_add(&next_version, 1));
+	return model;
+}
+
+static load_mode flags_load_mode(int flags) {
+	return (flags & NN_LOAD_TRAINABLE) ? LOAD_TRAINABLE : LOAD_INFERENCE;
+}
+
+nn_model* nn_load(const char* filename, int flags) {
+	if(!filename) {
+		error("No filename given");
+		return NULL;
+	}
+	return wrap_network(import_neural_network((char*)filename, flags_load_mode(flags)));
+}
+
+nn_model* nn_load_buffer(const void* buf, size_t len, int flags) {
+	if(!buf) {
+		error("No buffer given");
+		return NULL;
+	}
+
+	/* Parsing never keeps hold of the image when it copies the weights, but takes it as writable, so give it a copy */
+	char* copy = malloc(len ? len : 1);
+	if(!copy) {
+		error("Failed to allocate file buffer");
+		return NULL;
+	}
+	memcpy(copy, buf, len);
+
+	neural_network* network = parse_neural_network(copy, len, flags_load_mode(flags), false);
+	free(copy);
+	return wrap_network(network);
+}
+
+nn_model* nn_create(const size_t* layer_sizes, size_t num_layers, uint64_t seed) {
+	if(!layer_sizes || num_layers < 2) {
+		error("A network needs at least an input and output layer");
+		return NULL;
+	}
+
+	size_t* sizes = malloc(sizeof(size_t) * num_layers);
+	bool* recurrent = calloc(num_layers, sizeof(bool));
+	if(!sizes || !recurrent) {
+		error("Failed to allocate layer sizes");
+		free(sizes);
+		free(recurrent);
+		return NULL;
+	}
+
+	for(size_t i = 0; i < num_layers; i += 1) {
+		if(layer_sizes[i] == 0) {
+			error("Layers can't be empty");
+			free(sizes);
+			free(recurrent);
+			return NULL;
+		}
+		sizes[i] = layer_sizes[i];
+	}
+
+	init_params params = {.scheme=INIT_XAVIER, .seed=seed};
+	neural_network* network = init_neural_network(recurrent, sizes, NULL, num_layers, &params);
+
+	free(sizes);
+	free(recurrent);
+	return wrap_network(network);
+}
+
+void nn_free(nn_model* model) {
+	if(!model) {
+		return;
+	}
+	free_neural_network(model->network);
+	free(model);
+}
+
+size_t nn_input_size(nn_model* model) {
+	return model->network->layers[0].num_neurons;
+}
+
+size_t nn_output_size(nn_model* model) {
+	return model->network->layers[model->network->num_layers-1].num_neurons;
+}
+
+int nn_export(nn_model* model, const char* filename) {
+	if(!filename) {
+		error("No filename given");
+		return -1;
+	}
+
+	FILE* f = fopen(filename, "wb");
+	if(!f) {
+		error("Failed to open output file");
+		return -1;
+	}
+
+	write_neural_network(model->network, f);
+
+	if(fclose(f) != 0) {
+		error("Failed to write output file");
+		return -1;
+	}
+	return 0;
+}
+
+nn_context* nn_context_create(nn_model* model) {
+	nn_context* context = malloc(sizeof(nn_context));
+	if(!context) {
+		error("Failed to allocate context");
+		return NULL;
+	}
+
+	context->model = model;
+	context->context = create_execution_context(model->network);
+	if(!context->context) {
+		free(context);
+		return NULL;
+	}
+	return context;
+}
+
+void nn_context_free(nn_context* context) {
+	if(!context) {
+		return;
+	}
+	free_execution_context(context->context);
+	free(context);
+}
+
+/* Every output has to come from a step the input actually fills */
+static int check_lengths(nn_model* model, const double* input, size_t input_len, const double* output, size_t output_len) {
+	if(!input || !output) {
+		error("No input or output buffer given");
+		return -1;
+	}
+
+	if(input_len == 0) {
+		error("Input is empty");
+		return -1;
+	}
+
+	size_t num_inputs = nn_input_size(model);
+	size_t steps = (input_len + num_inputs - 1) / num_inputs;
+	if(output_len > steps * nn_output_size(model)) {
+		error("More outputs asked for than the input has steps for");
+		return -1;
+	}
+	return 0;
+}
+
+int nn_infer(nn_context* context, const double* input, size_t input_len, double* output, size_t output_len) {
+	if(check_lengths(context->model, input, input_len, output, output_len) != 0) {
+		return -1;
+	}
+
+	reset_history(context->context);
+	propogate_context_into(context->context, (double*)input, input_len, output, output_len);
+	return 0;
+}
+
+typedef struct {
+	neural_network* network;
+	const double* inputs;
+	size_t input_len;
+	double* outputs;
+	size_t output_len;
+	atomic_int failed;
+} batch_inference;
+
+/* Each chunk of inputs runs through its own context */
+static void infer_inputs(size_t start, size_t end, void* arg) {
+	batch_inference* batch = arg;
+
+	execution_context* context = create_execution_context(batch->network);
+	if(!context) {
+		atomic_store(&batch->failed, 1);
+		return;
+	}
+
+	for(size_t i = start; i < end; i += 1) {
+		reset_history(context);
+		propogate_context_into(context, (double*)&batch->inputs[i * batch->input_len], batch->input_len, &batch->outputs[i * batch->output_len], batch->output_len);
+	}
+
+	free_execution_context(context);
+}
+
+int nn_infer_batch(nn_model* model, const double* inputs, size_t input_len, size_t num_inputs, double* outputs, size_t output_len) {
+	if(check_lengths(model, inputs, input_len, outputs, output_len) != 0) {
+		return -1;
+	}
+
+	batch_inference batch = {.network=model->network, .inputs=inputs, .input_len=input_len, .outputs=outputs, .output_len=output_len};
+	atomic_init(&batch.failed, 0);
+
+	thread_pool* pool = thread_pool_global();
+	if(!pool) {
+		error("Failed to start worker threads");
+		return -1;
+	}
+
+	/* A chunk per worker, as a context costs as much to set up as a few inferences */
+	size_t num_workers = pool->num_workers ? pool->num_workers : 1;
+	size_t grain = (num_inputs + num_workers - 1) / num_workers;
+	thread_pool_parallel_for(pool, num_inputs, grain ? grain : 1, infer_inputs, &batch);
+
+	if(atomic_load(&batch.failed)) {
+		error("Failed to allocate execution context");
+		return -1;
+	}
+	return 0;
+}
+
+int nn_train_step(nn_model* model, const double* inputs, size_t input_len, const double* expected, size_t output_len, size_t num_cases, double learn_rate) {
+	if(check_lengths(model, inputs, input_len, expected, output_len) != 0) {
+		return -1;
+	}
+
+	if(num_cases == 0) {
+		return 0;
+	}
+
+	/* The cases only point into the callers buffers */
+	test_case* cases = malloc(sizeof(test_case) * num_cases);
+	if(!cases) {
+		error("Failed to allocate cases");
+		return -1;
+	}
+
+	for(size_t i = 0; i < num_cases; i += 1) {
+		cases[i].input = (double*)&inputs[i * input_len];
+		cases[i].input_len = input_len;
+		cases[i].expected_output = (double*)&expected[i * output_len];
+		cases[i].output_len = output_len;
+	}
+
+	int ret = accumulate_derivatives(model->network, cases, NULL, num_cases);
+	if(ret == 0) {
+		apply_derivatives(model->network, learn_rate);
+		atomic_store(&model->version, atomic_fetch_add(&next_version, 1));
+	}
+
+	free(cases);
+	return ret;
+}
+
+nn_cache* nn_cache_create(size_t budget_bytes) {
+	nn_cache* cache = malloc(sizeof(nn_cache));
+	if(!cache) {
+		error("Failed to allocate cache");
+		return NULL;
+	}
+
+	cache->cache = cache_create(budget_bytes);
+	if(!cache->cache) {
+		free(cache);
+		return NULL;
+	}
+	return cache;
+}
+
+void nn_cache_free(nn_cache* cache) {
+	if(!cache) {
+		return;
+	}
+	cache_free(cache->cache);
+	free(cache);
+}
+
+void nn_cache_stats(nn_cache* cache, nn_cache_info* info) {
+	cache_stats stats;
+	cache_get_stats(cache->cache, &stats);
+
+	info->hits = stats.hits;
+	info->misses = stats.misses;
+	info->insertions = stats.insertions;
+	info->evictions = stats.evictions;
+	info->entries = stats.entries;
+	info->bytes = stats.bytes;
+}
+
+int nn_infer_cached(nn_context* context, nn_cache* cache, const double* input, size_t input_len, double* output, size_t output_len) {
+	if(check_lengths(context->model, input, input_len, output, output_len) != 0) {
+		return -1;
+	}
+
+	uint64_t version = atomic_load(&context->model->version);
+	if(cache_lookup_into(cache->cache, version, (double*)input, input_len, output, output_len)) {
+		return 0;
+	}
+
+	reset_history(context->context);
+	propogate_context_into(context->context, (double*)input, input_len, output, output_len);
+	cache_insert(cache->cache, version, (double*)input, input_len, output, output_len);
+	return 0;
+}
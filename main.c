@@ -1,5 +1,18 @@
 #include <includes/common.h>
+#include <includes/autotune.h>
+#include <includes/compiler.h>
+#include <includes/distributed.h>
+#include <includes/sampler.h>
+#include <includes/registry.h>
+#include <includes/perf.h>
+#include <includes/cache.h>
+#include <includes/session.h>
+#include <includes/compact.h>
+#include <includes/sweep.h>
+#include <includes/buffers.h>
+#include <includes/planner.h>
 #include <unistd.h>
+#include <getopt.h>
 
 static size_t count_string_tokens(char* input, char token) {
 	size_t ret = 0;
@@ -16,7 +29,7 @@ static size_t count_string_tokens(char* input, char token) {
 }
 
 
-static neural_network* gen_nn_from_params(char* in_string, bool recursive) {
+static neural_network* gen_nn_from_params(char* in_string, bool recursive, layer_type cell_type, init_params* params) {
 
 	/* Get the number of layers and validate the correctness of this */
 	size_t num_layers = count_string_tokens(in_string, ',') + 1;
@@ -32,6 +45,13 @@ static neural_network* gen_nn_from_params(char* in_string, bool recursive) {
 		return NULL;
 	}
 
+	layer_spec* layer_specs = calloc(num_layers, sizeof(layer_spec));
+	if(!layer_specs) {
+		error("Failed to allocate space for layer sizes array\n");
+		free(layer_sizes);
+		return NULL;
+	}
+
 
 	/* Loop through the string by commas */
 	char* token = strtok(in_string, ",");
@@ -39,11 +59,67 @@ static neural_network* gen_nn_from_params(char* in_string, bool recursive) {
 	int i = 0;
 	while (token != NULL) {
 
+		/* Convolutional layers are given as c<kernel_size>:<stride>:<channels>, their size follows from the last layer */
+		if(token[0] == 'c') {
+			layer_spec* spec = &layer_specs[i];
+			if(i == 0 || sscanf(token, "c%zu:%zu:%zu", &spec->kernel_size, &spec->stride, &spec->channels) != 3 || spec->kernel_size == 0) {
+				error("Invalid convolutional layer for neural network\n");
+				free(layer_sizes);
+				free(layer_specs);
+				return NULL;
+			}
+			spec->type = LAYER_CONV1D;
+			layer_sizes[i] = 0;
+
+			i += 1;
+			token = strtok(NULL, ",");
+			continue;
+		}
+
+		/* Embedding layers are given as e<dim>, their size follows from the input layer */
+		if(token[0] == 'e') {
+			if(i != 1 || sscanf(token, "e%zu", &layer_specs[i].dim) != 1 || layer_specs[i].dim == 0) {
+				error("Invalid embedding layer for neural network\n");
+				free(layer_sizes);
+				free(layer_specs);
+				return NULL;
+			}
+			layer_specs[i].type = LAYER_EMBEDDING;
+			layer_sizes[i] = 0;
+
+			i += 1;
+			token = strtok(NULL, ",");
+			continue;
+		}
+
+		/* LSTM, GRU and binary layers are given as l<size>, g<size> and b<size> */
+		if(token[0] == 'l' || token[0] == 'g') {
+			if(i == 0) {
+				error("The input layer can't be gated\n");
+				free(layer_sizes);
+				free(layer_specs);
+				return NULL;
+			}
+			layer_specs[i].type = token[0] == 'l' ? LAYER_LSTM : LAYER_GRU;
+			token += 1;
+		}
+		else if(token[0] == 'b') {
+			if(i == 0) {
+				error("The input layer can't be binary\n");
+				free(layer_sizes);
+				free(layer_specs);
+				return NULL;
+			}
+			layer_specs[i].type = LAYER_BINARY;
+			token += 1;
+		}
+
 		/* Get each layer size */
 		layer_sizes[i] = atoi(token);
 		if(layer_sizes[i] <= 0) {
 			error("Invalid layer size for neural network\n");
 			free(layer_sizes);
+			free(layer_specs);
 			return NULL;
 		}
 
@@ -56,27 +132,34 @@ static neural_network* gen_nn_from_params(char* in_string, bool recursive) {
 	if(!recursive_array) {
 		error("Failed to allocate space for recursive array\n");
 		free(layer_sizes);
+		free(layer_specs);
 		return NULL;
 	}
 
 	for(int i = 0; i < num_layers; i += 1) {
 		if(i > 0 && i < (num_layers-1) && recursive) {
 			recursive_array[i] = true;
+
+			/* Hidden layers use gated cells in place of a recurrent weight if asked */
+			if(layer_specs[i].type == LAYER_DENSE && cell_type != LAYER_DENSE) {
+				layer_specs[i].type = cell_type;
+			}
 			continue;
 		}
 		recursive_array[i] = false;
 	}
 
 	/* Initialise a new neural net */
-	neural_network* ret = init_neural_network(recursive_array, layer_sizes, num_layers);
+	neural_network* ret = init_neural_network(recursive_array, layer_sizes, layer_specs, num_layers, params);
 	free(layer_sizes);
+	free(layer_specs);
 	free(recursive_array);
 
 	return ret;
 }
 
 
-static void generate_training_data_from_input(char* input_string) {
+static void generate_training_data_from_input(char* input_string, bool raw_bytes) {
 
 	/* Get the number of input cases */
 	size_t num_cases = count_string_tokens(input_string, ',') + 1;
@@ -129,7 +212,7 @@ static void generate_training_data_from_input(char* input_string) {
 	}
 
 
-	export_training_data(input_filenames, output_filenames, "data.td", num_cases);
+	export_training_data(input_filenames, output_filenames, "data.td", num_cases, raw_bytes);
 
 out:
 	if(input_filenames) {
@@ -147,25 +230,387 @@ out:
 	}
 }
 
+/* Train for num_iterations epochs, feeding the cases to the network in the order picked by the sampler */
+static int train_network(neural_network* network, communicator* comm, test_case* cases, size_t num_cases, int num_iterations, double learn_rate, size_t batch_size, size_t hogwild_batch_size, sample_mode sampling, uint64_t seed) {
+	sampler* case_sampler = sampler_create(num_cases, sampling, seed);
+	if(!case_sampler) {
+		return -1;
+	}
+
+	/* Distributed ranks must take the same number of steps, even when their shards differ in size */
+	size_t steps_per_epoch = 1;
+	if(comm && batch_size) {
+		size_t total_cases = distributed_total_cases(comm, num_cases);
+		size_t largest_shard = (total_cases + comm->world_size - 1) / comm->world_size;
+		steps_per_epoch = (largest_shard + batch_size - 1) / batch_size;
+	}
+
+	size_t* batch;
+	size_t batch_len;
+
+	for(int i = 0; i < num_iterations; i += 1) {
+		sampler_start_epoch(case_sampler);
+
+		if(comm) {
+			for(size_t step = 0; step < steps_per_epoch; step += 1) {
+
+				/* Smaller shards wrap round into their next epoch */
+				batch_len = sampler_next_batch(case_sampler, batch_size, &batch);
+				if(batch_len == 0) {
+					sampler_start_epoch(case_sampler);
+					batch_len = sampler_next_batch(case_sampler, batch_size, &batch);
+				}
+
+				if(distributed_backpropogate_cases(comm, network, cases, batch, batch_len, learn_rate) != 0) {
+					sampler_free(case_sampler);
+					return -1;
+				}
+			}
+			continue;
+		}
+
+		if(hogwild_batch_size) {
+			backpropogate_cases_hogwild(network, cases, case_sampler->indices, num_cases, learn_rate, hogwild_batch_size);
+			continue;
+		}
+
+		while((batch_len = sampler_next_batch(case_sampler, batch_size, &batch)) > 0) {
+			backpropogate_batch(network, cases, batch, batch_len, learn_rate);
+		}
+	}
+
+	sampler_free(case_sampler);
+	return 0;
+}
+
+/* Read in a file to propogate, as a byte per input for embedding networks and a bit otherwise */
+static double* read_network_input(neural_network* network, char* filename, size_t* input_len) {
+	char* input_data;
+	size_t input_data_len;
+	if(read_file(filename, &input_data, &input_data_len) != 0) {
+		return NULL;
+	}
+
+	double* input;
+	if(network->num_layers > 1 && network->layers[1].type == LAYER_EMBEDDING) {
+		input = buf_to_bytes(input_data, input_len, input_data_len);
+	}
+	else {
+		input = buf_to_bits(input_data, input_len, input_data_len);
+	}
+	free(input_data);
+
+	*input_len /= sizeof(double);
+	return input;
+}
+
+/* Propogate each of a comma separated list of input files through a cache, returning their outputs one after the other */
+static double* propogate_cached_inputs(neural_network* network, char* in_string, uint64_t version, size_t cache_budget, size_t output_len, size_t* num_outputs) {
+	*num_outputs = count_string_tokens(in_string, ',') + 1;
+
+	double* outputs = malloc(sizeof(double) * output_len * *num_outputs);
+	if(!outputs) {
+		error("Failed to allocate output buffer\n");
+		return NULL;
+	}
+
+	inference_cache* cache = cache_create(cache_budget);
+	if(!cache) {
+		free(outputs);
+		return NULL;
+	}
+
+	execution_context* context = create_execution_context(network);
+	if(!context) {
+		cache_free(cache);
+		free(outputs);
+		return NULL;
+	}
+
+	size_t i = 0;
+	for(char* token = strtok(in_string, ","); token != NULL && i < *num_outputs; token = strtok(NULL, ",")) {
+		size_t input_len;
+		double* input = read_network_input(network, token, &input_len);
+		if(!input) {
+			break;
+		}
+
+		double* output = cache_propogate(cache, context, version, input, input_len, output_len);
+		free(input);
+		if(!output) {
+			break;
+		}
+
+		memcpy(&outputs[i * output_len], output, sizeof(double) * output_len);
+		free(output);
+		i += 1;
+	}
+
+	cache_print_stats(cache);
+	free_execution_context(context);
+	cache_free(cache);
+
+	/* Don't save a partial set of outputs */
+	if(i != *num_outputs) {
+		free(outputs);
+		return NULL;
+	}
+	return outputs;
+}
+
+/* Carry on the sequence saved in a session file, returning the outputs of the steps this input completes */
+static double* propogate_session_input(neural_network* network, char* session_file, double* input, size_t input_len, size_t output_len) {
+	inference_session* session = session_create(network);
+	if(!session) {
+		return NULL;
+	}
+
+	/* A missing file starts a new sequence */
+	if(access(session_file, F_OK) == 0 && import_session(session, session_file) != 0) {
+		session_free(session);
+		return NULL;
+	}
+
+	double* steps_output;
+	size_t steps_output_len;
+	if(session_feed(session, input, input_len, &steps_output, &steps_output_len) != 0) {
+		session_free(session);
+		return NULL;
+	}
+
+	/* Steps still waiting on more input have no outputs yet */
+	double* output = calloc(output_len, sizeof(double));
+	if(output && steps_output) {
+		memcpy(output, steps_output, sizeof(double) * (steps_output_len < output_len ? steps_output_len : output_len));
+	}
+	free(steps_output);
+
+	info("[*] Session is %zu steps in, with %zu inputs pending\n", session->num_steps, session->pending_len);
+	export_session(session, session_file);
+	session_free(session);
+	return output;
+}
+
+/* Train a network per sweep candidate on one copy of the training data, returning the best of them */
+static neural_network* sweep_networks(char* spec, size_t num_trials, char* network_file, bool recurrent, layer_type cell_type, init_params* params, char* training_data_file, bool map_training_data, sweep_config* defaults, sample_mode sampling) {
+	size_t num_candidates;
+	sweep_config* configs = sweep_parse(spec, num_trials, params->seed, defaults, &num_candidates);
+	if(!configs) {
+		return NULL;
+	}
+
+	sweep_candidate* candidates = calloc(num_candidates, sizeof(sweep_candidate));
+	if(!candidates) {
+		error("Failed to allocate sweep candidates\n");
+		sweep_configs_free(configs, num_candidates);
+		return NULL;
+	}
+
+	/* Candidates with the same layers start from the same weights, so only their hyperparameters differ */
+	size_t num_made = 0;
+	for(; num_made < num_candidates; num_made += 1) {
+		candidates[num_made].config = configs[num_made];
+
+		char* layers = configs[num_made].layers ? strdup(configs[num_made].layers) : NULL;
+		if(layers) {
+			candidates[num_made].network = gen_nn_from_params(layers, recurrent, cell_type, params);
+			free(layers);
+		}
+		else if(network_file) {
+			candidates[num_made].network = import_neural_network(network_file, LOAD_TRAINABLE);
+		}
+		else {
+			error("Sweeps need a network to start from with -l, or layers with -n or n=\n");
+		}
+
+		if(!candidates[num_made].network) {
+			break;
+		}
+	}
+
+	neural_network* ret = NULL;
+	test_case* training_data = NULL;
+	mapped_training_data* mapped_data = NULL;
+	size_t num_test_cases = 0;
+
+	if(num_made < num_candidates) {
+		goto out;
+	}
+
+	/* Every candidate trains on the one copy */
+	if(map_training_data) {
+		mapped_data = map_training_data_shard(training_data_file, 0, 1);
+		if(!mapped_data) {
+			goto out;
+		}
+		training_data = mapped_data->cases;
+		num_test_cases = mapped_data->num_cases;
+	}
+	else if(import_training_data_shard(training_data_file, 0, 1, &training_data, &num_test_cases) != 0) {
+		goto out;
+	}
+
+	int best = sweep_run(candidates, num_candidates, training_data, num_test_cases, sampling, params->seed);
+	sweep_print_results(candidates, num_candidates, best);
+
+	if(best >= 0) {
+		ret = candidates[best].network;
+		candidates[best].network = NULL;
+	}
+
+	if(mapped_data) {
+		unmap_training_data(mapped_data);
+	}
+	else {
+		test_cases_free(training_data, num_test_cases);
+		free(training_data);
+	}
+
+out:
+	for(size_t i = 0; i < num_made; i += 1) {
+		if(candidates[i].network) {
+			free_neural_network(candidates[i].network);
+		}
+	}
+	free(candidates);
+	sweep_configs_free(configs, num_candidates);
+	return ret;
+}
+
+/* Parse a compact precision, followed by any comma separated encoding options */
+static int parse_compact_options(char* in_string, compact_precision* precision, uint8_t* flags) {
+	*flags = COMPACT_SHUFFLE;
+
+	char* token = strtok(in_string, ",");
+	if(token && strcmp(token, "fp16") == 0) {
+		*precision = PRECISION_FP16;
+	}
+	else if(token && strcmp(token, "bf16") == 0) {
+		*precision = PRECISION_BF16;
+	}
+	else {
+		error("Unknown compact precision\n");
+		return -1;
+	}
+
+	for(token = strtok(NULL, ","); token != NULL; token = strtok(NULL, ",")) {
+		if(strcmp(token, "delta") == 0) {
+			*flags |= COMPACT_DELTA;
+		}
+		else if(strcmp(token, "noshuffle") == 0) {
+			*flags &= ~COMPACT_SHUFFLE;
+		}
+		else {
+			error("Unknown compact option\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
 static void print_usage(char** argv) {
 	printf("Usage: %s [options]\n", argv[0]);
 	printf("\t-h\tPrint the help dialog\n");
 	printf("\t-l <network>\tLoad a network from a file\n");
 	printf("\t-n <layer_sizes>\tCreate a new network - layer sizes should be comma deliminated\n");
 	printf("\t-r <layer_sizes>\tCreate a new recurrent network - layer sizes should be comma deliminated\n");
+	printf("\t\tA layer size of c<kernel_size>:<stride>:<channels> makes a 1D convolutional layer, which is never recurrent\n");
+	printf("\t\tPrefixing a layer size with l or g makes an LSTM or GRU layer\n");
+	printf("\t\tA second layer of e<dim> makes an embedding, which takes input bytes rather than bits\n");
+	printf("\t\tPrefixing a layer size with b makes a binary layer, with +-1 weights and outputs summed by XNOR and popcount, which is never recurrent\n");
 	printf("\t-s <filepath>\tSave the network to a file\n");
-	printf("\t-f <input>\tLoad input data from a file\n");
+	printf("\t-f <input>\tLoad input data from a file, or comma deliminated files with --cache\n");
 	printf("\t-e <output_length>\tLength of output data\n");
 	printf("\t-t <test_cases>\tTrain the network using test cases from a file\n");
 	printf("\t-o <output>\tSave network output to a file\n");
 	printf("\t-g <case_files>\tGenerate test cases from files, in the form input=output, input=output - saved as data.td\n");
+	printf("\t--generate-raw <case_files>\tLike -g, but keeps the inputs as bytes for embedding networks\n");
 	printf("\t-a <learn_rate>\tSet a custom learning rate for back propogation default (0.05)\n");
 	printf("\t-i <num_iterations>\tSet a custom number of back propogation iterations (default 100)\n");
+	printf("\t-j <num_threads>\tSet the number of worker threads (default one per cpu)\n");
+	printf("\t-u\tPrint per worker thread utilisation when finished\n");
+	printf("\t-c <source_file>\tCompile the network into standalone C inference code\n");
+	printf("\t-k <tuning_file>\tLoad tuned kernels from a file, saving any newly tuned layers to it\n");
+	printf("\t--seed <seed>\tSeed used to initialise new networks (default the current time)\n");
+	printf("\t--hogwild <batch_size>\tTrain without synchronising threads, updating the weights after every batch\n");
+	printf("\t--batch <batch_size>\tUpdate the weights after every batch of test cases rather than once per iteration\n");
+	printf("\t--shuffle\tVisit the test cases in a different random order every iteration, seeded by --seed\n");
+	printf("\t--replacement\tPick test cases at random with replacement, seeded by --seed\n");
+	printf("\t--mmap\tMap the test cases file into memory rather than copying it\n");
+	printf("\t--publish <name>\tPublish the network to shared memory, replacing any earlier version\n");
+	printf("\t--attach <name>\tUse the latest network published under a name, sharing its weights\n");
+	printf("\t--unpublish <name>\tRemove a published network\n");
+	printf("\t--cache <megabytes>\tReuse the outputs of inputs seen before, keeping at most this much, and print the hit rate when finished\n");
+	printf("\t--session <state_file>\tCarry on the sequence saved in a file with the -f input rather than starting a new one, saving where it got to\n");
+	printf("\t--compact <precision>\tSave with -s as a compressed network with fp16 or bf16 weights, optionally followed by ,delta to code the differences between weights or ,noshuffle - binary layers only keep the signs of their weights\n");
+	printf("\t--perf-counters\tPrint hardware counters and timings for each layer when finished\n");
+	printf("\t--distributed <num_workers>\tTrain with a number of worker processes on this machine, each taking a shard of the test cases\n");
+	printf("\t--rank <rank>\tJoin a distributed training run as the given rank (rank 0 saves the results)\n");
+	printf("\t--peers <addresses>\tComma separated host:port or unix:path address of every rank, in rank order\n");
+	printf("\t--init <scheme>\tInitialise new networks with uniform, xavier or he weights (default xavier)\n");
+	printf("\t--sweep <spec>\tTrain a network per combination of hyperparameters at once on the -t training data, carrying on with the lowest loss on every fifth case, which none train on\n");
+	printf("\t\tSpecs are semicolon separated keys with | separated values, from a (learn rate), i (iterations), batch and n (layer sizes), e.g. \"a=0.01|0.1;n=64,32,8|64,8\"\n");
+	printf("\t--sweep-random <num_trials>\tPick this many --sweep candidates at random rather than every combination, seeded by --seed - values other than layer sizes can then be ranges like a=0.001:0.5\n");
+	printf("\t--huge-pages <mode>\tBack large weight, derivative and activation buffers with off, transparent (the default) or explicit reserved huge pages, falling back to transparent ones\n");
+	printf("\t--buffer-stats\tPrint how much memory the buffers use, how much is on huge pages and which NUMA node their pages are on when finished\n");
+	printf("\t--memory-plan\tPrint where each layers activations go in the arena for inference and for training, and how much reusing the space of dead ones saves\n");
+	printf("\t--cell <cell>\tMake the hidden layers of -r networks lstm or gru layers rather than giving each neuron a recurrent weight\n");
 
 }
 
+/* Options without a short form */
+enum {
+	OPTION_SEED = 256,
+	OPTION_INIT,
+	OPTION_HOGWILD,
+	OPTION_DISTRIBUTED,
+	OPTION_RANK,
+	OPTION_PEERS,
+	OPTION_BATCH,
+	OPTION_SHUFFLE,
+	OPTION_REPLACEMENT,
+	OPTION_MMAP,
+	OPTION_PUBLISH,
+	OPTION_ATTACH,
+	OPTION_UNPUBLISH,
+	OPTION_PERF_COUNTERS,
+	OPTION_CELL,
+	OPTION_GENERATE_RAW,
+	OPTION_CACHE,
+	OPTION_SESSION,
+	OPTION_COMPACT,
+	OPTION_SWEEP,
+	OPTION_SWEEP_RANDOM,
+	OPTION_HUGE_PAGES,
+	OPTION_BUFFER_STATS,
+	OPTION_MEMORY_PLAN,
+};
+
+/* Split a comma separated list of addresses into an array */
+static char** parse_peers(char* in_string, size_t* num_peers) {
+	*num_peers = count_string_tokens(in_string, ',') + 1;
+
+	char** peers = malloc(sizeof(char*) * *num_peers);
+	if(!peers) {
+		error("Failed to allocate peer list\n");
+		return NULL;
+	}
+	bzero(peers, sizeof(char*) * *num_peers);
+
+	char* token = strtok(in_string, ",");
+	for(size_t i = 0; i < *num_peers && token != NULL; i += 1) {
+		peers[i] = strdup(token);
+		if(!peers[i]) {
+			error("Failed to allocate peer\n");
+			distributed_free_peers(peers, *num_peers);
+			return NULL;
+		}
+		token = strtok(NULL, ",");
+	}
+	return peers;
+}
+
 int main(int argc, char** argv) {
-	srand(time(NULL));
 
 	int ret = 0;
 	
@@ -174,9 +619,15 @@ int main(int argc, char** argv) {
 	char* network_out_file = NULL;
 	char* input_data_file = NULL;
 	char* output_data_file = NULL;
+	char* compiled_file = NULL;
 
+	char* training_data_file = NULL;
 	test_case* training_data = NULL;
+	mapped_training_data* mapped_data = NULL;
+	bool map_training_data = false;
 	size_t num_test_cases = 0;
+	size_t batch_size = 0;
+	sample_mode sampling = SAMPLE_SEQUENTIAL;
 
 	size_t output_len = 0;
 
@@ -184,40 +635,86 @@ int main(int argc, char** argv) {
 	double learn_rate = 0.05;
 
 	double* output = NULL;
+	size_t num_outputs = 0;
+	size_t cache_budget = 0;
+	char* session_file = NULL;
+	bool compact_output = false;
+	compact_precision compact_format = PRECISION_FP16;
+	uint8_t compact_flags = 0;
+
+	bool print_utilisation = false;
+	bool print_buffer_stats = false;
+	bool print_memory_plan = false;
+
+	char* sweep_spec = NULL;
+	size_t num_sweep_trials = 0;
+
+	char* network_file = NULL;
+	char* attach_name = NULL;
+	uint64_t attach_version = 0;
+	char* publish_name = NULL;
+	char* new_network_layers = NULL;
+	bool new_network_recurrent = false;
+	layer_type new_network_cell = LAYER_DENSE;
+	init_params params = {.scheme=INIT_XAVIER, .seed=time(NULL)};
+	size_t hogwild_batch_size = 0;
+	size_t num_threads = 0;
+
+	size_t num_local_workers = 0;
+	size_t rank = 0;
+	size_t world_size = 1;
+	char** peers = NULL;
+	communicator* comm = NULL;
+
+	struct option long_options[] = {
+		{"seed", required_argument, NULL, OPTION_SEED},
+		{"init", required_argument, NULL, OPTION_INIT},
+		{"hogwild", required_argument, NULL, OPTION_HOGWILD},
+		{"distributed", required_argument, NULL, OPTION_DISTRIBUTED},
+		{"rank", required_argument, NULL, OPTION_RANK},
+		{"peers", required_argument, NULL, OPTION_PEERS},
+		{"batch", required_argument, NULL, OPTION_BATCH},
+		{"shuffle", no_argument, NULL, OPTION_SHUFFLE},
+		{"replacement", no_argument, NULL, OPTION_REPLACEMENT},
+		{"mmap", no_argument, NULL, OPTION_MMAP},
+		{"publish", required_argument, NULL, OPTION_PUBLISH},
+		{"attach", required_argument, NULL, OPTION_ATTACH},
+		{"unpublish", required_argument, NULL, OPTION_UNPUBLISH},
+		{"perf-counters", no_argument, NULL, OPTION_PERF_COUNTERS},
+		{"cell", required_argument, NULL, OPTION_CELL},
+		{"generate-raw", required_argument, NULL, OPTION_GENERATE_RAW},
+		{"cache", required_argument, NULL, OPTION_CACHE},
+		{"session", required_argument, NULL, OPTION_SESSION},
+		{"compact", required_argument, NULL, OPTION_COMPACT},
+		{"sweep", required_argument, NULL, OPTION_SWEEP},
+		{"sweep-random", required_argument, NULL, OPTION_SWEEP_RANDOM},
+		{"huge-pages", required_argument, NULL, OPTION_HUGE_PAGES},
+		{"buffer-stats", no_argument, NULL, OPTION_BUFFER_STATS},
+		{"memory-plan", no_argument, NULL, OPTION_MEMORY_PLAN},
+		{NULL, 0, NULL, 0},
+	};
 
 	/* Read in all the options */
 	int opt;
-	while ((opt = getopt(argc, argv, "l:n:r:s:e:f:t:o:a:i:g:h")) != -1) {
+	while ((opt = getopt_long(argc, argv, "l:n:r:s:e:f:t:o:a:i:g:j:uk:c:h", long_options, NULL)) != -1) {
 		switch(opt) {
 		case 'l':
-			if(network) {
+			if(network_file || new_network_layers || attach_name) {
 				error("You cannot load multiple networks at once\n");
 				return 0;
 			}
-			network = import_neural_network(optarg);
-			if(!network) {
-				return 0;
-			}
+			network_file = optarg;
 			break;
 		case 'n':
-			if(network) {
-				error("You cannot load multiple networks at once\n");
-				return 0;
-			}
-			network = gen_nn_from_params(optarg, false);
-			if(!network) {
-				return 0;
-			}
-			break;
 		case 'r':
-			if(network) {
+			if(network_file || new_network_layers || attach_name) {
 				error("You cannot load multiple networks at once\n");
 				return 0;
 			}
-			network = gen_nn_from_params(optarg, true);
-			if(!network) {
-				return 0;
-			}
+
+			/* New networks are created once we know how to initialise them */
+			new_network_layers = optarg;
+			new_network_recurrent = opt == 'r';
 			break;
 		case 's':
 			network_out_file = optarg;
@@ -233,10 +730,7 @@ int main(int argc, char** argv) {
 			input_data_file = optarg;
 			break;
 		case 't':
-			ret = import_training_data(optarg, &training_data, &num_test_cases);
-			if(ret != 0) {
-				return 0;
-			}
+			training_data_file = optarg;
 			break;
 		case 'o':
 			output_data_file = optarg;
@@ -248,23 +742,310 @@ int main(int argc, char** argv) {
 			num_iterations = atoi(optarg);
 			break;
 		case 'g':
-			generate_training_data_from_input(optarg);
+			generate_training_data_from_input(optarg, false);
+			return 0;
+		case 'j':
+			num_threads = atoi(optarg);
+			if(atoi(optarg) <= 0 || thread_pool_init_global(num_threads) != 0) {
+				error("Invalid number of threads\n");
+				return 0;
+			}
+			break;
+		case 'u':
+			print_utilisation = true;
+			break;
+		case 'c':
+			compiled_file = optarg;
+			break;
+		case 'k':
+			if(autotune_load(optarg) != 0) {
+				return 0;
+			}
+			break;
+		case OPTION_SEED:
+			params.seed = strtoull(optarg, NULL, 0);
+			break;
+		case OPTION_INIT:
+			if(strcmp(optarg, "uniform") == 0) {
+				params.scheme = INIT_UNIFORM;
+			}
+			else if(strcmp(optarg, "xavier") == 0) {
+				params.scheme = INIT_XAVIER;
+			}
+			else if(strcmp(optarg, "he") == 0) {
+				params.scheme = INIT_HE;
+			}
+			else {
+				error("Unknown initialisation scheme\n");
+				return 0;
+			}
+			break;
+		case OPTION_HOGWILD:
+			hogwild_batch_size = atoi(optarg);
+			if(hogwild_batch_size == 0) {
+				error("Invalid hogwild batch size\n");
+				return 0;
+			}
+			break;
+		case OPTION_DISTRIBUTED:
+			num_local_workers = atoi(optarg);
+			if(num_local_workers == 0) {
+				error("Invalid number of workers\n");
+				return 0;
+			}
+			break;
+		case OPTION_RANK:
+			rank = atoi(optarg);
+			break;
+		case OPTION_PEERS:
+			if(peers) {
+				distributed_free_peers(peers, world_size);
+			}
+			peers = parse_peers(optarg, &world_size);
+			if(!peers) {
+				return 0;
+			}
+			break;
+		case OPTION_BATCH:
+			batch_size = atoi(optarg);
+			if(batch_size == 0) {
+				error("Invalid batch size\n");
+				return 0;
+			}
+			break;
+		case OPTION_SHUFFLE:
+			sampling = SAMPLE_SHUFFLE;
+			break;
+		case OPTION_REPLACEMENT:
+			sampling = SAMPLE_REPLACEMENT;
+			break;
+		case OPTION_MMAP:
+			map_training_data = true;
+			break;
+		case OPTION_PUBLISH:
+			publish_name = optarg;
+			break;
+		case OPTION_ATTACH:
+			if(network_file || new_network_layers || attach_name) {
+				error("You cannot load multiple networks at once\n");
+				return 0;
+			}
+			attach_name = optarg;
+			break;
+		case OPTION_UNPUBLISH:
+			registry_remove(optarg);
+			return 0;
+		case OPTION_PERF_COUNTERS:
+			perf_init();
+			break;
+		case OPTION_GENERATE_RAW:
+			generate_training_data_from_input(optarg, true);
 			return 0;
+		case OPTION_CACHE:
+			cache_budget = atof(optarg) * 1024 * 1024;
+			if(cache_budget == 0) {
+				error("Invalid cache size\n");
+				return 0;
+			}
+			break;
+		case OPTION_SESSION:
+			session_file = optarg;
+			break;
+		case OPTION_COMPACT:
+			if(parse_compact_options(optarg, &compact_format, &compact_flags) != 0) {
+				return 0;
+			}
+			compact_output = true;
+			break;
+		case OPTION_SWEEP:
+			sweep_spec = optarg;
+			break;
+		case OPTION_SWEEP_RANDOM:
+			num_sweep_trials = atoi(optarg);
+			if(atoi(optarg) <= 0) {
+				error("Invalid number of sweep trials\n");
+				return 0;
+			}
+			break;
+		case OPTION_HUGE_PAGES:
+			if(strcmp(optarg, "off") == 0) {
+				buffer_set_huge_pages(HUGE_PAGES_OFF);
+			}
+			else if(strcmp(optarg, "transparent") == 0) {
+				buffer_set_huge_pages(HUGE_PAGES_TRANSPARENT);
+			}
+			else if(strcmp(optarg, "explicit") == 0) {
+				buffer_set_huge_pages(HUGE_PAGES_EXPLICIT);
+			}
+			else {
+				error("Unknown huge page mode\n");
+				return 0;
+			}
+			break;
+		case OPTION_BUFFER_STATS:
+			print_buffer_stats = true;
+			break;
+		case OPTION_MEMORY_PLAN:
+			print_memory_plan = true;
+			break;
+		case OPTION_CELL:
+			if(strcmp(optarg, "lstm") == 0) {
+				new_network_cell = LAYER_LSTM;
+			}
+			else if(strcmp(optarg, "gru") == 0) {
+				new_network_cell = LAYER_GRU;
+			}
+			else {
+				error("Unknown recurrent cell\n");
+				return 0;
+			}
+			break;
 		case 'h':
 		default:
 			print_usage(argv);
 			return 0;
 		}
 	}
+
+	if(num_sweep_trials && !sweep_spec) {
+		error("--sweep-random needs a --sweep spec\n");
+		return 0;
+	}
+
+	/* Sweeps train their own networks, then the best carries on as if it had been loaded */
+	if(sweep_spec) {
+		if(!training_data_file || attach_name || hogwild_batch_size || num_local_workers || peers) {
+			error("Sweeps need -t training data, and can't be attached, hogwild or distributed\n");
+			return 0;
+		}
+
+		sweep_config defaults = {.learn_rate=learn_rate, .num_iterations=num_iterations, .batch_size=batch_size, .layers=new_network_layers};
+		network = sweep_networks(sweep_spec, num_sweep_trials, network_file, new_network_recurrent, new_network_cell, &params, training_data_file, map_training_data, &defaults, sampling);
+		if(!network) {
+			return 0;
+		}
+		network_file = NULL;
+		new_network_layers = NULL;
+		training_data_file = NULL;
+	}
+
+	/* Networks we aren't going to train skip all their training state */
+	if(network_file) {
+		network = import_neural_network(network_file, training_data_file ? LOAD_TRAINABLE : LOAD_INFERENCE);
+		if(!network) {
+			return 0;
+		}
+	}
+
+	/* Published networks are shared read only, so can't be trained */
+	if(attach_name) {
+		if(training_data_file) {
+			error("Attached networks can't be trained\n");
+			return 0;
+		}
+
+		network = registry_attach(attach_name, &attach_version);
+		if(!network) {
+			return 0;
+		}
+	}
+
+	if(new_network_layers) {
+		network = gen_nn_from_params(new_network_layers, new_network_recurrent, new_network_cell, &params);
+		if(!network) {
+			return 0;
+		}
+	}
+
 	if(!network) {
 		error("No neural network loaded\n");
 		return 0;
 	}
 
+	/* Start our local workers, which all carry on from here with the same network */
+	if(num_local_workers > 1) {
+		if(peers) {
+			error("Local workers can't be combined with --peers\n");
+			free_neural_network(network);
+			return 0;
+		}
+
+		ret = distributed_launch(num_local_workers, &rank, &peers);
+		if(ret != 0) {
+			free_neural_network(network);
+			return ret < 0 ? 1 : 0;
+		}
+		world_size = num_local_workers;
+	}
+
+	if(world_size > 1) {
+		if(rank >= world_size) {
+			error("Rank is outside of the peer list\n");
+			free_neural_network(network);
+			return 1;
+		}
+
+		/* Share the cpus between the workers on this machine unless told otherwise */
+		if(!num_threads && num_local_workers > 1) {
+			size_t default_size = thread_pool_default_size() / world_size;
+			thread_pool_init_global(default_size ? default_size : 1);
+		}
+
+		comm = distributed_connect(rank, world_size, peers);
+		distributed_free_peers(peers, world_size);
+		if(!comm) {
+			free_neural_network(network);
+			return 1;
+		}
+	}
+
+	/* Load our share of the training data */
+	if(training_data_file && map_training_data) {
+		mapped_data = map_training_data_shard(training_data_file, rank, world_size);
+		if(!mapped_data) {
+			free_neural_network(network);
+			return comm ? 1 : 0;
+		}
+		training_data = mapped_data->cases;
+		num_test_cases = mapped_data->num_cases;
+	}
+	else if(training_data_file) {
+		ret = import_training_data_shard(training_data_file, rank, world_size, &training_data, &num_test_cases);
+		if(ret != 0) {
+			free_neural_network(network);
+			return comm ? 1 : 0;
+		}
+	}
+
 	/* If we have training data, train the network */
 	if(training_data) {
-		for(int i = 0; i < num_iterations; i += 1) {
-			backpropogate_cases(network, training_data, num_test_cases, learn_rate);
+		ret = train_network(network, comm, training_data, num_test_cases, num_iterations, learn_rate, batch_size, hogwild_batch_size, sampling, params.seed + rank);
+
+		if(mapped_data) {
+			unmap_training_data(mapped_data);
+		}
+		else {
+			test_cases_free(training_data, num_test_cases);
+			free(training_data);
+		}
+
+		if(ret != 0) {
+			if(comm) {
+				distributed_free(comm);
+			}
+			free_neural_network(network);
+			return comm ? 1 : 0;
+		}
+	}
+
+	/* Every rank finishes with the same network, so only the first carries on */
+	if(comm) {
+		distributed_free(comm);
+		if(rank != 0) {
+			free_neural_network(network);
+			thread_pool_free_global();
+			autotune_free();
+			return 0;
 		}
 	}
 
@@ -276,24 +1057,34 @@ int main(int argc, char** argv) {
 			return 0;
 		}
 
-		char* input_data;
-		size_t input_data_len;
-		ret = read_file(input_data_file, &input_data, &input_data_len);
-		if(ret != 0) {
+		/* Cached results assume every input starts a new sequence */
+		if(cache_budget && session_file) {
 			free_neural_network(network);
+			error("Sessions can't be combined with --cache\n");
 			return 0;
 		}
 
-		size_t input_len;
-		double* input = buf_to_bits(input_data, &input_len, input_data_len);
-		free(input_data);
-		if(!input) {
-			free_neural_network(network);
-			return 0;
+		/* Without a cache there's only the one input to score */
+		if(cache_budget) {
+			output = propogate_cached_inputs(network, input_data_file, attach_version, cache_budget, output_len, &num_outputs);
 		}
+		else {
+			size_t input_len;
+			double* input = read_network_input(network, input_data_file, &input_len);
+			if(!input) {
+				free_neural_network(network);
+				return 0;
+			}
 
-		input_len /= sizeof(double);
-		output = propogate_case_forward(network, input, input_len, output_len);
+			if(session_file) {
+				output = propogate_session_input(network, session_file, input, input_len, output_len);
+			}
+			else {
+				output = propogate_case_forward(network, input, input_len, output_len);
+			}
+			free(input);
+			num_outputs = 1;
+		}
 	}
 
 	/* If we have somewhere to save the output, save it */
@@ -305,26 +1096,67 @@ int main(int argc, char** argv) {
 			free_neural_network(network);
 			return 0;
 		}
-		char byte = 0;
-		for(int i = 0; i < output_len; i += 1) {
-			byte |= ((int)output[i]) << (7 - (i % 8));
-			if(i % 8 == 0) {
-				fwrite(&byte, sizeof(char), 1, f);
-				byte = 0;
+		for(size_t j = 0; j < num_outputs; j += 1) {
+			char byte = 0;
+			for(int i = 0; i < output_len; i += 1) {
+				byte |= ((int)output[j*output_len + i]) << (7 - (i % 8));
+				if(i % 8 == 0) {
+					fwrite(&byte, sizeof(char), 1, f);
+					byte = 0;
+				}
 			}
 		}
 		fclose(f);
 	}
 
 	/* If we should export the network, do that */
-	if(network_out_file) {
+	if(network_out_file && compact_output) {
+		export_compact_network(network, network_out_file, compact_format, compact_flags);
+	}
+	else if(network_out_file) {
 		export_neural_network(network, network_out_file);
 	}
 
+	/* If we should compile the network, do that */
+	if(compiled_file) {
+		compile_neural_network(network, compiled_file);
+	}
+
+	/* If we should share the network with other processes, do that */
+	if(publish_name) {
+		registry_publish(publish_name, network, NULL);
+	}
+
 	if(output) {
 		free(output);
 	}
 
+	if(print_utilisation) {
+		thread_pool_print_stats(thread_pool_global());
+	}
+
+	if(print_memory_plan) {
+		for(int mode = PLAN_INFERENCE; mode <= PLAN_TRAINING; mode += 1) {
+			execution_plan* plan = plan_execution(network, mode);
+			if(plan) {
+				plan_print(plan);
+				plan_free(plan);
+			}
+		}
+	}
+
+	/* While the network is still around, so its pages can be found */
+	if(print_buffer_stats) {
+		buffer_print_stats();
+	}
+
+	if(perf_enabled) {
+		perf_print_report(network->num_layers);
+		perf_free();
+	}
+
 	free_neural_network(network);
+	thread_pool_free_global();
+	autotune_free();
 	return 0;
 }
@@ -1,4 +1,11 @@
 #include <includes/common.h>
+#include <includes/autotune.h>
+#include <includes/rng.h>
+#include <includes/perf.h>
+#include <includes/compact.h>
+#include <includes/buffers.h>
+#include <includes/planner.h>
+#include <sys/mman.h>
 
 
 /* Implementation of the sigmoid function */
@@ -14,7 +21,317 @@ static double sigmoid_derivative(double input) {
 
 activation_function activation_functions[] = {(activation_function){.activation=sigmoid_function, .activation_derivative=sigmoid_derivative}};
 
-neural_network* init_neural_network(bool* recurrent_layer, size_t* layer_sizes, size_t num_layers) {
+typedef struct {
+	layer* curr_layer;
+	size_t num_weights;
+	double scale;
+} layer_update;
+
+/* Contexts made on different threads may try to tune the same layer */
+static pthread_mutex_t kernel_tuning_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The smallest amount of weights worth handing to another thread */
+#define PARALLEL_WEIGHT_GRAIN 16384
+
+/* Binary inputs with more than this fraction set are quicker through the full matrix kernels */
+#define BINARY_INPUT_DENSITY 0.5
+
+static size_t neuron_grain(size_t num_weights) {
+	return num_weights >= PARALLEL_WEIGHT_GRAIN ? 1 : PARALLEL_WEIGHT_GRAIN / (num_weights + 1);
+}
+
+typedef struct {
+	layer* curr_layer;
+	size_t layer_index;
+	size_t fan_in;
+	size_t fan_out;
+	init_params* params;
+} layer_init;
+
+/* Pick a starting value for weight index of a neuron, where the index one past the last weight is the bias */
+static double initial_value(layer_init* init, size_t neuron_index, size_t index) {
+	init_params* params = init->params;
+
+	/* Each neuron gets its own stream, so the result doesn't depend on which thread filled it */
+	uint64_t stream = ((uint64_t)init->layer_index << 32) | neuron_index;
+	bool bias = index == init->fan_in;
+
+	switch(params->scheme) {
+	case INIT_XAVIER:
+		if(bias) {
+			return 0;
+		}
+		return (rng_uniform(params->seed, stream, index) * 2 - 1) * sqrt(6.0 / (init->fan_in + init->fan_out));
+	case INIT_HE:
+		if(bias) {
+			return 0;
+		}
+		return rng_normal(params->seed, stream, index) * sqrt(2.0 / init->fan_in);
+	case INIT_UNIFORM:
+		return rng_uniform(params->seed, stream, index);
+	default:
+		return 0;
+	}
+}
+
+/*
+ * Neurons weights start on a cache line, and are never a whole number of pages apart. Otherwise once huge pages make
+ * the block physically contiguous, the rows a kernel reads together all compete for the same cache sets.
+ */
+static size_t neuron_row_stride(size_t fan_in) {
+	size_t stride = (fan_in + 7) / 8 * 8;
+	if((stride * sizeof(double)) % 4096 == 0) {
+		stride += 8;
+	}
+	return stride;
+}
+
+/* Dense and binary layers keep a row of weights in each neuron */
+static bool has_neuron_weights(layer* curr_layer) {
+	return curr_layer->type == LAYER_DENSE || curr_layer->type == LAYER_BINARY;
+}
+
+static void init_neurons(size_t start, size_t end, void* arg) {
+	layer_init* init = arg;
+
+	/* Setup the neurons */
+	for(size_t j = start; j < end; j += 1) {
+		neuron* curr_neuron = &init->curr_layer->layer_neurons[j];
+
+		/* Set the activation function index */
+		curr_neuron->activation_index = 0;
+
+		/* Only dense and binary layers with a previous layer have weights of their own */
+		if(init->layer_index == 0 || !has_neuron_weights(init->curr_layer)) {
+			continue;
+		}
+
+		/* Shared weights are pointed at by the caller */
+		if(init->params->scheme == INIT_SHARED) {
+			continue;
+		}
+
+		/* Each neuron has a row of the layers weights, which is first touched here by the thread that will likely use it */
+		curr_neuron->weights = &init->curr_layer->neuron_weights[j * neuron_row_stride(init->fan_in)];
+
+		if(init->params->scheme == INIT_NONE) {
+			continue;
+		}
+
+		/* Set our bias and randomise all the weights */
+		curr_neuron->bias = initial_value(init, j, init->fan_in);
+		for(size_t k = 0; k < init->fan_in; k += 1) {
+			curr_neuron->weights[k] = initial_value(init, j, k);
+		}
+	}
+}
+
+/* Work out a convolutional layers shape from the layer before it */
+static int init_conv_shape(layer* curr_layer, layer* prev_layer, layer_spec* spec) {
+	conv_layer* conv = &curr_layer->conv;
+
+	conv->kernel_size = spec->kernel_size;
+	conv->stride = spec->stride;
+	conv->channels = spec->channels;
+
+	/* Stacked convolutions read the channels of the one before, anything else is a single channel */
+	conv->in_channels = prev_layer->type == LAYER_CONV1D ? prev_layer->conv.channels : 1;
+	conv->in_width = prev_layer->num_neurons / conv->in_channels;
+
+	if(conv->stride == 0 || conv->channels == 0 || conv->kernel_size > conv->in_width) {
+		return -1;
+	}
+
+	conv->width = (conv->in_width - conv->kernel_size) / conv->stride + 1;
+	curr_layer->num_neurons = conv->channels * conv->width;
+	return 0;
+}
+
+/* Allocate and initialise a block of weight rows each with a bias if biases is set, like a filter per channel, with a stream per row like a neuron */
+static int init_weight_rows(layer_init* init, size_t num_rows, double** weights, double** biases) {
+
+	/* Shared rows are pointed at by the caller */
+	if(init->params->scheme == INIT_SHARED) {
+		return 0;
+	}
+
+	*weights = buffer_alloc(sizeof(double) * num_rows * init->fan_in, BUFFER_ANY_NODE);
+	if(!*weights) {
+		return -1;
+	}
+
+	/* Embedding tables have no biases */
+	if(biases) {
+		*biases = buffer_alloc(sizeof(double) * num_rows, BUFFER_ANY_NODE);
+		if(!*biases) {
+			return -1;
+		}
+	}
+
+	if(init->params->scheme == INIT_NONE) {
+		return 0;
+	}
+
+	for(size_t r = 0; r < num_rows; r += 1) {
+		if(biases) {
+			(*biases)[r] = initial_value(init, r, init->fan_in);
+		}
+		for(size_t k = 0; k < init->fan_in; k += 1) {
+			(*weights)[r * init->fan_in + k] = initial_value(init, r, k);
+		}
+	}
+	return 0;
+}
+
+/* Set a range of a binary layers rows of signs from their weights */
+static void pack_binary_rows(layer* curr_layer, size_t start, size_t end, size_t row_len) {
+	binary_layer* binary = &curr_layer->binary;
+
+	for(size_t i = start; i < end; i += 1) {
+		double* weights = curr_layer->layer_neurons[i].weights;
+		uint64_t* signs = &binary->signs[i * binary->words];
+
+		/* Each word is stored whole, as hogwild training repacks rows while others read them. The bits past the end of the row stay clear, as do the inputs, so they always match */
+		for(size_t w = 0; w < binary->words; w += 1) {
+			uint64_t word = 0;
+			for(size_t j = w * 64; j < row_len && j < (w + 1) * 64; j += 1) {
+				word |= (uint64_t)(weights[j] >= 0) << (j % 64);
+			}
+			signs[w] = word;
+		}
+	}
+}
+
+void pack_binary_weights(neural_network* network) {
+	for(int i = 1; i < network->num_layers; i += 1) {
+		layer* curr_layer = &network->layers[i];
+		if(curr_layer->type == LAYER_BINARY) {
+			pack_binary_rows(curr_layer, 0, curr_layer->num_neurons, network->layers[i-1].num_neurons);
+		}
+	}
+}
+
+static int init_layer_rows(layer_init* init) {
+	layer* curr_layer = init->curr_layer;
+
+	switch(curr_layer->type) {
+	case LAYER_CONV1D:
+		return init_weight_rows(init, curr_layer->conv.channels, &curr_layer->conv.filters, &curr_layer->conv.biases);
+	case LAYER_LSTM:
+	case LAYER_GRU:
+		if(init_weight_rows(init, layer_rows(curr_layer), &curr_layer->gated.weights, &curr_layer->gated.biases) != 0) {
+			return -1;
+		}
+
+		/* LSTMs start off remembering, so early training can see past the last step */
+		if(curr_layer->type == LAYER_LSTM && (init->params->scheme == INIT_XAVIER || init->params->scheme == INIT_HE)) {
+			for(size_t j = 0; j < curr_layer->num_neurons; j += 1) {
+				curr_layer->gated.biases[curr_layer->num_neurons + j] = 1;
+			}
+		}
+		return 0;
+	case LAYER_EMBEDDING:
+		return init_weight_rows(init, EMBEDDING_ROWS, &curr_layer->embedding.table, NULL);
+	case LAYER_BINARY:
+		curr_layer->binary.words = (init->fan_in + 63) / 64;
+		curr_layer->binary.scale = 1 / sqrt(init->fan_in);
+		curr_layer->binary.signs = buffer_calloc(curr_layer->num_neurons * curr_layer->binary.words, sizeof(uint64_t), BUFFER_ANY_NODE);
+		if(!curr_layer->binary.signs) {
+			return -1;
+		}
+
+		/* Loaded weights are packed once they've been filled in */
+		if(init->params->scheme != INIT_NONE && init->params->scheme != INIT_SHARED) {
+			pack_binary_rows(curr_layer, 0, curr_layer->num_neurons, init->fan_in);
+		}
+		return 0;
+	default:
+		return 0;
+	}
+}
+
+/* Dense layers have a row of weights per neuron, convolutional layers a filter per channel shared by every position, gated layers a row per gate per neuron */
+size_t layer_rows(layer* curr_layer) {
+	switch(curr_layer->type) {
+	case LAYER_CONV1D:
+		return curr_layer->conv.channels;
+	case LAYER_LSTM:
+	case LAYER_GRU:
+		return curr_layer->gated.num_gates * curr_layer->num_neurons;
+	case LAYER_EMBEDDING:
+		return EMBEDDING_ROWS;
+	default:
+		return curr_layer->num_neurons;
+	}
+}
+
+size_t layer_row_len(neural_network* network, int layer_index) {
+	layer* curr_layer = &network->layers[layer_index];
+	switch(curr_layer->type) {
+	case LAYER_CONV1D:
+		return curr_layer->conv.in_channels * curr_layer->conv.kernel_size;
+	case LAYER_LSTM:
+	case LAYER_GRU:
+		return curr_layer->gated.num_inputs + curr_layer->num_neurons;
+	case LAYER_EMBEDDING:
+		return curr_layer->embedding.dim;
+	default:
+		return network->layers[layer_index-1].num_neurons;
+	}
+}
+
+double* row_weights(layer* curr_layer, size_t row, size_t row_len) {
+	switch(curr_layer->type) {
+	case LAYER_CONV1D:
+		return &curr_layer->conv.filters[row * row_len];
+	case LAYER_LSTM:
+	case LAYER_GRU:
+		return &curr_layer->gated.weights[row * row_len];
+	case LAYER_EMBEDDING:
+		return &curr_layer->embedding.table[row * row_len];
+	default:
+		return curr_layer->layer_neurons[row].weights;
+	}
+}
+
+/* NULL for rows without a bias */
+double* row_bias(layer* curr_layer, size_t row) {
+	switch(curr_layer->type) {
+	case LAYER_CONV1D:
+		return &curr_layer->conv.biases[row];
+	case LAYER_LSTM:
+	case LAYER_GRU:
+		return &curr_layer->gated.biases[row];
+	case LAYER_EMBEDDING:
+		return NULL;
+	default:
+		return &curr_layer->layer_neurons[row].bias;
+	}
+}
+
+bool is_gated(layer* curr_layer) {
+	return curr_layer->type == LAYER_LSTM || curr_layer->type == LAYER_GRU;
+}
+
+size_t backward_chunks(layer* curr_layer, layer* prev_layer) {
+	thread_pool* pool = thread_pool_global();
+	size_t chunk_size = neuron_grain(prev_layer->num_neurons);
+	size_t num_chunks = (curr_layer->num_neurons + chunk_size - 1) / chunk_size;
+
+	if(!pool || num_chunks > pool->num_workers) {
+		num_chunks = pool ? pool->num_workers : 1;
+	}
+	return num_chunks;
+}
+
+size_t layer_history_len(layer* curr_layer) {
+	if(is_gated(curr_layer)) {
+		return curr_layer->num_neurons * 2;
+	}
+	return curr_layer->recurrent ? curr_layer->num_neurons : 0;
+}
+
+neural_network* init_neural_network(bool* recurrent_layer, size_t* layer_sizes, layer_spec* layer_specs, size_t num_layers, init_params* params) {
 
 
 	/* Allocate our neural network */
@@ -26,68 +343,132 @@ neural_network* init_neural_network(bool* recurrent_layer, size_t* layer_sizes,
 
 	/* Set the number of layers */
 	network->num_layers = num_layers;
+	network->num_back_propogations = 0;
+
+	/* Replicas are only made when we train on multiple threads */
+	network->replicas = NULL;
+	network->num_replicas = 0;
+	network->max_replicas = 0;
+	network->replica_of = NULL;
+	network->context = NULL;
+	network->shared_weights = params->scheme == INIT_SHARED;
+	network->mapping = NULL;
+	network->mapping_len = 0;
+
+	/* Training state is only allocated once we train */
+	network->weight_derivatives = NULL;
+	network->neuron_training = NULL;
+	network->inference_only = false;
 	
-	/* Allocate space for them */
+	/* Allocate space for them, cleared so a partially built network can be freed */
 	network->layers = malloc(sizeof(layer) * num_layers);
 	if(!network->layers) {
 		error("Failed to allocate neural network layers.");
+		free(network);
 		return NULL;
 	}
+	bzero(network->layers, sizeof(layer) * num_layers);
+
+	/* Work out every layers shape first, as a convolutions size depends on the layer before it */
+	for(int i = 0; i < num_layers; i += 1) {
+		layer* network_layer = &network->layers[i];
+
+		/* Set the number of neurons in each layer and whether it's recurrent */
+		network_layer->num_neurons = layer_sizes[i];
+		network_layer->recurrent = recurrent_layer[i];
+		network_layer->type = i > 0 && layer_specs ? layer_specs[i].type : LAYER_DENSE;
+
+		/* Gated layers have their own recurrence in place of the recurrent weight */
+		if(is_gated(network_layer)) {
+			network_layer->recurrent = false;
+			network_layer->gated.num_gates = network_layer->type == LAYER_LSTM ? LSTM_GATES : GRU_GATES;
+			network_layer->gated.num_inputs = network->layers[i-1].num_neurons;
+		}
+
+		/* An embedding has a vector for every input */
+		if(network_layer->type == LAYER_EMBEDDING) {
+			network_layer->recurrent = false;
+			network_layer->embedding.dim = layer_specs[i].dim;
+			network_layer->num_neurons = network->layers[i-1].num_neurons * layer_specs[i].dim;
+
+			if(i != 1 || layer_specs[i].dim == 0) {
+				error("Embeddings have to follow the input layer.");
+				free(network->layers);
+				free(network);
+				return NULL;
+			}
+		}
+
+		/* Binary layers are never recurrent, their outputs are only ever signs */
+		if(network_layer->type == LAYER_BINARY) {
+			network_layer->recurrent = false;
+		}
+
+		if(network_layer->type == LAYER_CONV1D) {
+			network_layer->recurrent = false;
+
+			if(init_conv_shape(network_layer, &network->layers[i-1], &layer_specs[i]) != 0) {
+				error("Convolution doesn't fit the previous layer.");
+				free(network->layers);
+				free(network);
+				return NULL;
+			}
+		}
+	}
+
+	network->num_weights = 0;
+	for(int i = 1; i < num_layers; i += 1) {
+		network->num_weights += layer_rows(&network->layers[i]) * layer_row_len(network, i);
+	}
 
 	/* Loop through each layer */
 	for(int i = 0; i < num_layers; i += 1) {
 
 		layer* network_layer = &network->layers[i];
+		size_t num_neurons = network_layer->num_neurons;
 
 		/* Allocate room for the neurons in each layer */
-		network_layer->layer_neurons = malloc(sizeof(neuron) * layer_sizes[i]);
+		network_layer->layer_neurons = malloc(sizeof(neuron) * num_neurons);
 
 		if(!network_layer->layer_neurons) {
 			error("Failed to allocate neural network neurons.");
+			free_neural_network(network);
 			return NULL;
 		}
 
 		/* Clear the neurons */
-		bzero(network_layer->layer_neurons, sizeof(neuron) * layer_sizes[i]);
+		bzero(network_layer->layer_neurons, sizeof(neuron) * num_neurons);
 
-		/* Setup the neurons */
-		for(int j = 0; j < layer_sizes[i]; j += 1) {
-			neuron* curr_neuron = &network_layer->layer_neurons[j];
+		/* Kernels are picked the first time the layer is used */
+		bzero(&network_layer->kernels, sizeof(layer_kernels));
 
-			/* Set the activation function index */
-			curr_neuron->activation_index = 0;
+		/* Setup the neurons across the thread pool */
+		layer_init init = {.curr_layer=network_layer, .layer_index=i, .params=params};
+		init.fan_in = i > 0 ? layer_row_len(network, i) : 0;
+		init.fan_out = i + 1 < num_layers ? network->layers[i+1].num_neurons : num_neurons;
 
-			/* If this layer has a previous layer */
-			if(i > 0) {
-				/* Set our bias */
-				curr_neuron->bias = uniform_decimal();
-
-				/* Allocate an array for the neurons weights */
-				curr_neuron->weights = malloc(sizeof(double) * layer_sizes[i-1]);
-				if(!curr_neuron->weights) {
-					error("Failed to allocate neuron weights.");
-					return NULL;
-				}
-
-				/* Allocate an array for the neurons weight derivatives */
-				curr_neuron->weight_derivatives = malloc(sizeof(double) * layer_sizes[i-1]);
-				if(!curr_neuron->weight_derivatives) {
-					error("Failed to allocate neuron weight derivatives.");
-					return NULL;
-				}
-
-				for(int k = 0; k < layer_sizes[i-1]; k += 1) {
+		/* A filter's fan out is the weights each input feeds, one per channel and kernel offset */
+		if(network_layer->type == LAYER_CONV1D) {
+			init.fan_out = network_layer->conv.channels * network_layer->conv.kernel_size;
+		}
 
-					/* Randomise all the weights */
-					curr_neuron->weights[k] = uniform_decimal();
-				}
+		/* Dense and binary layers keep their neurons weights in one block, unless the caller points them elsewhere */
+		if(i > 0 && has_neuron_weights(network_layer) && params->scheme != INIT_SHARED) {
+			network_layer->neuron_weights = buffer_alloc(sizeof(double) * num_neurons * neuron_row_stride(init.fan_in), BUFFER_ANY_NODE);
+			if(!network_layer->neuron_weights) {
+				error("Failed to allocate neuron weights.");
+				free_neural_network(network);
+				return NULL;
 			}
 		}
 
-		/* Set the number of neurons in each layer and whether it's recurrent */
-		network_layer->num_neurons = layer_sizes[i];
-		network_layer->recurrent = recurrent_layer[i];
+		thread_pool_parallel_for(thread_pool_global(), num_neurons, neuron_grain(init.fan_in), init_neurons, &init);
 
+		if(init_layer_rows(&init) != 0) {
+			error("Failed to allocate neuron weights.");
+			free_neural_network(network);
+			return NULL;
+		}
 	}
 
 	return network;
@@ -96,19 +477,29 @@ neural_network* init_neural_network(bool* recurrent_layer, size_t* layer_sizes,
 
 void free_neural_network(neural_network* network) {
 
+	/* Free any replicas we've trained with */
+	for(size_t i = 0; i < network->num_replicas; i += 1) {
+		free_neural_network(network->replicas[i]);
+	}
+	free(network->replicas);
+
 	/* Loop through all the layers */
 	for(int i = 0; i < network->num_layers; i += 1) {
 		layer* curr_layer = &network->layers[i];
 
-		/* Loop through all the neurons */
-		for(int j = 0; j < curr_layer->num_neurons; j += 1) {
-			neuron* curr_neuron = &curr_layer->layer_neurons[j];
+		/* Deallocate the weights, unless they belong to the network we replicate or someone else */
+		if(!network->replica_of && !network->shared_weights) {
+			buffer_free(curr_layer->neuron_weights);
+			buffer_free(curr_layer->conv.filters);
+			buffer_free(curr_layer->conv.biases);
+			buffer_free(curr_layer->gated.weights);
+			buffer_free(curr_layer->gated.biases);
+			buffer_free(curr_layer->embedding.table);
+		}
 
-			/* Deallocate the neurons weights */
-			if(curr_neuron->weights != NULL) {
-				free(curr_neuron->weights);
-				free(curr_neuron->weight_derivatives);
-			}
+		/* Every network packs its own signs, even of weights it doesn't own, but replicas share them */
+		if(!network->replica_of) {
+			buffer_free(curr_layer->binary.signs);
 		}
 
 		/* Free the neurons for this layer */
@@ -116,11 +507,19 @@ void free_neural_network(neural_network* network) {
 	}
 
 	/* Free the network layers and the network */
+	if(network->context) {
+		free_execution_context(network->context);
+	}
+	if(network->mapping) {
+		munmap(network->mapping, network->mapping_len);
+	}
+	buffer_free(network->weight_derivatives);
+	buffer_free(network->neuron_training);
 	free(network->layers);
 	free(network);
 }
 
-neural_network* import_neural_network(char* filename) {
+neural_network* import_neural_network(char* filename, load_mode mode) {
 	size_t file_length;
 	char* file_buf;
 
@@ -130,20 +529,132 @@ neural_network* import_neural_network(char* filename) {
 		return NULL;
 	}
 
+	neural_network* network = parse_neural_network(file_buf, file_length, mode, false);
+	free(file_buf);
+	return network;
+}
+
+/* Fill in a convolutional layers filters and biases from the file_conv_layer at file_offset */
+static int parse_conv_layer(neural_network* network, int layer_index, char* file_buf, size_t file_length, size_t file_offset) {
+	layer* curr_layer = &network->layers[layer_index];
+	conv_layer* conv = &curr_layer->conv;
+	file_conv_layer* curr_file_conv = (file_conv_layer*)&file_buf[file_offset];
+	file_layer* curr_file_layer = (file_layer*)&file_buf[file_offset - sizeof(file_layer)];
+
+	/* The shape we worked out has to be the one that was saved */
+	if(curr_file_layer->num_neurons != curr_layer->num_neurons) {
+		error("File malformed: convolution size doesn't match its shape\n");
+		return -1;
+	}
+
+	size_t num_filter_weights = conv->channels * layer_row_len(network, layer_index);
+	size_t end_offset = file_offset + sizeof(file_conv_layer) + (num_filter_weights + conv->channels) * sizeof(double);
+
+	if(end_offset > file_length || end_offset > file_offset - sizeof(file_layer) + curr_file_layer->layer_len) {
+		error("File malformed: not enough space for filters\n");
+		return -1;
+	}
+
+	/* Every position uses its channels activation */
+	for(size_t j = 0; j < curr_layer->num_neurons; j += 1) {
+		curr_layer->layer_neurons[j].activation_index = curr_file_conv->activation_index;
+	}
+
+	/* copy over our filters, or use them in place */
+	double* filters = (double*)&file_buf[file_offset + sizeof(file_conv_layer)];
+	if(network->shared_weights) {
+		conv->filters = filters;
+		conv->biases = &filters[num_filter_weights];
+	}
+	else {
+		memcpy(conv->filters, filters, num_filter_weights * sizeof(double));
+		memcpy(conv->biases, &filters[num_filter_weights], conv->channels * sizeof(double));
+	}
+	return 0;
+}
+
+/* Fill in an embedding layers table from the file_embedding_layer at file_offset */
+static int parse_embedding_layer(neural_network* network, int layer_index, char* file_buf, size_t file_length, size_t file_offset) {
+	embedding_layer* embedding = &network->layers[layer_index].embedding;
+	file_layer* curr_file_layer = (file_layer*)&file_buf[file_offset - sizeof(file_layer)];
+
+	/* The size we worked out has to be the one that was saved */
+	if(curr_file_layer->num_neurons != network->layers[layer_index].num_neurons) {
+		error("File malformed: embedding size doesn't match its inputs\n");
+		return -1;
+	}
+
+	size_t num_weights = EMBEDDING_ROWS * embedding->dim;
+	size_t end_offset = file_offset + sizeof(file_embedding_layer) + num_weights * sizeof(double);
+
+	if(end_offset > file_length || end_offset > file_offset - sizeof(file_layer) + curr_file_layer->layer_len) {
+		error("File malformed: not enough space for embedding table\n");
+		return -1;
+	}
+
+	/* copy over our table, or use it in place */
+	double* table = (double*)&file_buf[file_offset + sizeof(file_embedding_layer)];
+	if(network->shared_weights) {
+		embedding->table = table;
+	}
+	else {
+		memcpy(embedding->table, table, num_weights * sizeof(double));
+	}
+	return 0;
+}
+
+/* Fill in a gated layers weights and biases, which start at file_offset */
+static int parse_gated_layer(neural_network* network, int layer_index, char* file_buf, size_t file_length, size_t file_offset) {
+	layer* curr_layer = &network->layers[layer_index];
+	gated_layer* gated = &curr_layer->gated;
+	file_layer* curr_file_layer = (file_layer*)&file_buf[file_offset - sizeof(file_layer)];
+
+	size_t num_rows = layer_rows(curr_layer);
+	size_t num_weights = num_rows * layer_row_len(network, layer_index);
+	size_t end_offset = file_offset + (num_weights + num_rows) * sizeof(double);
+
+	if(end_offset > file_length || end_offset > file_offset - sizeof(file_layer) + curr_file_layer->layer_len) {
+		error("File malformed: not enough space for gate weights\n");
+		return -1;
+	}
+
+	/* copy over our weights, or use them in place */
+	double* weights = (double*)&file_buf[file_offset];
+	if(network->shared_weights) {
+		gated->weights = weights;
+		gated->biases = &weights[num_weights];
+	}
+	else {
+		memcpy(gated->weights, weights, num_weights * sizeof(double));
+		memcpy(gated->biases, &weights[num_weights], num_rows * sizeof(double));
+	}
+	return 0;
+}
+
+/* Build a network from a SUNN image, either copying the weights or pointing straight at them */
+neural_network* parse_neural_network(char* file_buf, size_t file_length, load_mode mode, bool share_weights) {
+
 	/* Verify we can fit a file header at least */
 	if(file_length < sizeof(neural_network_file_header)) {
 		error("File too small\n");
-		free(file_buf);
 		return NULL;
 	}
 
 	/* Get our file header */
 	neural_network_file_header* header = (neural_network_file_header*)file_buf;
 
+	/* Compact images have to be decoded, so can never be used in place */
+	if(header->magic == COMPACT_MAGIC) {
+		if(share_weights) {
+			error("Compact networks can't share their weights\n");
+			return NULL;
+		}
+		return parse_compact_network(file_buf, file_length, mode);
+	}
+
 	/* Verify the magic */
 	if(header->magic != NEURAL_NETWORK_MAGIC) {
 		error("Wrong file magic\n");
-		free(file_buf);
 		return NULL;
 	}
 
@@ -151,14 +662,12 @@ neural_network* import_neural_network(char* filename) {
 	bool* recurrent_layer = malloc(sizeof(bool) * header->num_layers);
 	if(!recurrent_layer) {
 		error("Failed to allocate recurrent layer buffer\n");
-		free(file_buf);
 		return NULL;
 	}
 
 	size_t* layer_sizes = malloc(sizeof(size_t) * header->num_layers);
 	if(!layer_sizes) {
 		error("Failed to allocate recurrent layer buffer\n");
-		free(file_buf);
 		free(recurrent_layer);
 		return NULL;
 	}
@@ -166,12 +675,22 @@ neural_network* import_neural_network(char* filename) {
 	size_t* file_layer_offsets = malloc(sizeof(size_t) * header->num_layers);
 	if(!file_layer_offsets) {
 		error("Failed to allocate recurrent layer buffer\n");
-		free(file_buf);
 		free(recurrent_layer);
 		free(layer_sizes);
 		return NULL;
 	}
 
+	layer_spec* layer_specs = calloc(header->num_layers, sizeof(layer_spec));
+	if(!layer_specs) {
+		error("Failed to allocate recurrent layer buffer\n");
+		free(recurrent_layer);
+		free(layer_sizes);
+		free(file_layer_offsets);
+		return NULL;
+	}
+
+	/* Older files never set the layer type */
+	bool typed_layers = header->version >= 1 && header->version <= NEURAL_NETWORK_VERSION;
 
 	size_t file_offset = sizeof(neural_network_file_header);
 
@@ -183,7 +702,7 @@ neural_network* import_neural_network(char* filename) {
 			free(recurrent_layer);
 			free(layer_sizes);
 			free(file_layer_offsets);
-			free(file_buf);
+			free(layer_specs);
 			return NULL;
 		}
 
@@ -196,23 +715,64 @@ neural_network* import_neural_network(char* filename) {
 		recurrent_layer[i] = curr_file_layer->recurrent;
 		layer_sizes[i] = curr_file_layer->num_neurons;
 
+		/* Convolutions keep their shape straight after the layer header */
+		if(typed_layers && i > 0 && curr_file_layer->type == LAYER_CONV1D) {
+			if(file_offset + sizeof(file_layer) + sizeof(file_conv_layer) > file_length) {
+				error("File malformed: Not enough space for convolution\n");
+				free(recurrent_layer);
+				free(layer_sizes);
+				free(file_layer_offsets);
+				free(layer_specs);
+				return NULL;
+			}
+
+			file_conv_layer* curr_file_conv = (file_conv_layer*)&file_buf[file_offset + sizeof(file_layer)];
+			layer_specs[i] = (layer_spec){.type=LAYER_CONV1D, .kernel_size=curr_file_conv->kernel_size, .stride=curr_file_conv->stride, .channels=curr_file_conv->channels};
+		}
+		else if(typed_layers && i > 0 && (curr_file_layer->type == LAYER_LSTM || curr_file_layer->type == LAYER_GRU || curr_file_layer->type == LAYER_BINARY)) {
+			layer_specs[i].type = curr_file_layer->type;
+		}
+		else if(typed_layers && i > 0 && curr_file_layer->type == LAYER_EMBEDDING) {
+			if(file_offset + sizeof(file_layer) + sizeof(file_embedding_layer) > file_length) {
+				error("File malformed: Not enough space for embedding\n");
+				free(recurrent_layer);
+				free(layer_sizes);
+				free(file_layer_offsets);
+				free(layer_specs);
+				return NULL;
+			}
+
+			file_embedding_layer* curr_file_embedding = (file_embedding_layer*)&file_buf[file_offset + sizeof(file_layer)];
+			layer_specs[i] = (layer_spec){.type=LAYER_EMBEDDING, .dim=curr_file_embedding->dim};
+		}
+		else if(typed_layers && curr_file_layer->type != LAYER_DENSE) {
+			error("File malformed: Unknown layer type\n");
+			free(recurrent_layer);
+			free(layer_sizes);
+			free(file_layer_offsets);
+			free(layer_specs);
+			return NULL;
+		}
+
 		/* Move onto the next layer */
 		file_offset += curr_file_layer->layer_len;
 	}
 
-	/* Initialise a neural network with our settings */
-	neural_network* network = init_neural_network(recurrent_layer, layer_sizes, header->num_layers);
+	/* Initialise a neural network with our settings, the weights come from the file */
+	init_params params = {.scheme=share_weights ? INIT_SHARED : INIT_NONE};
+	neural_network* network = init_neural_network(recurrent_layer, layer_sizes, layer_specs, header->num_layers, &params);
 
 	/* Free our settings arrays */
 	free(recurrent_layer);
 	free(layer_sizes);
+	free(layer_specs);
 
 	if(!network) {
 			error("Failed to allocate neural network\n");
 			free(file_layer_offsets);
-			free(file_buf);
 			return NULL;
 	}
+	network->inference_only = mode == LOAD_INFERENCE;
 
 	/* Loop through each layer except the first (as weights and biases in this layer are irrelivant) */
 	for(int i = 1; i < header->num_layers; i += 1) {
@@ -220,6 +780,33 @@ neural_network* import_neural_network(char* filename) {
 
 		size_t file_offset = file_layer_offsets[i] + sizeof(file_layer);
 
+		if(curr_layer->type == LAYER_CONV1D) {
+			if(parse_conv_layer(network, i, file_buf, file_length, file_offset) != 0) {
+				free(file_layer_offsets);
+				free_neural_network(network);
+				return NULL;
+			}
+			continue;
+		}
+
+		if(curr_layer->type == LAYER_EMBEDDING) {
+			if(parse_embedding_layer(network, i, file_buf, file_length, file_offset) != 0) {
+				free(file_layer_offsets);
+				free_neural_network(network);
+				return NULL;
+			}
+			continue;
+		}
+
+		if(is_gated(curr_layer)) {
+			if(parse_gated_layer(network, i, file_buf, file_length, file_offset) != 0) {
+				free(file_layer_offsets);
+				free_neural_network(network);
+				return NULL;
+			}
+			continue;
+		}
+
 		for(int j = 0; j < curr_layer->num_neurons; j += 1) {
 
 			size_t end_offset = file_offset + sizeof(file_neuron);
@@ -228,7 +815,6 @@ neural_network* import_neural_network(char* filename) {
 			if(end_offset > file_length) {
 				error("File malformed: not enough space for all neurons\n");
 				free(file_layer_offsets);
-				free(file_buf);
 				free_neural_network(network);
 				return NULL;
 			}
@@ -237,7 +823,6 @@ neural_network* import_neural_network(char* filename) {
 			if(i < (header->num_layers - 1) && end_offset > file_layer_offsets[i + 1]) {
 				error("File malformed: neurons go past end of layer\n");
 				free(file_layer_offsets);
-				free(file_buf);
 				free_neural_network(network);
 				return NULL;
 			}
@@ -255,7 +840,6 @@ neural_network* import_neural_network(char* filename) {
 			if(curr_file_neuron->num_weights != network->layers[i-1].num_neurons) {
 				error("File malformed: number of weights not equal to the number of neurons\n");
 				free(file_layer_offsets);
-				free(file_buf);
 				free_neural_network(network);
 				return NULL;
 			}
@@ -267,7 +851,6 @@ neural_network* import_neural_network(char* filename) {
 			if(end_offset > (file_offset + curr_file_neuron->neuron_len)) {
 				error("File malformed: neuron overwriting next neuron\n");
 				free(file_layer_offsets);
-				free(file_buf);
 				free_neural_network(network);
 				return NULL;
 			}
@@ -276,7 +859,6 @@ neural_network* import_neural_network(char* filename) {
 			if(end_offset > file_length) {
 				error("File malformed: not enough space for neuron weights\n");
 				free(file_layer_offsets);
-				free(file_buf);
 				free_neural_network(network);
 				return NULL;
 			}
@@ -285,20 +867,25 @@ neural_network* import_neural_network(char* filename) {
 			if(i < (header->num_layers - 1) && end_offset > file_layer_offsets[i + 1]) {
 				error("File malformed: neuron weights go past end of layer\n");
 				free(file_layer_offsets);
-				free(file_buf);
 				free_neural_network(network);
 				return NULL;
 			}
 
-			/* copy over our weights */
+			/* copy over our weights, or use them in place */
 			double* weights = (double*)&file_buf[file_offset + sizeof(file_neuron)];
-			memcpy(curr_neuron->weights, weights, curr_file_neuron->num_weights * sizeof(double));
+			if(share_weights) {
+				curr_neuron->weights = weights;
+			}
+			else {
+				memcpy(curr_neuron->weights, weights, curr_file_neuron->num_weights * sizeof(double));
+			}
 
 			file_offset += curr_file_neuron->neuron_len;
 		}
 	}
 
-	free(file_buf);
+	pack_binary_weights(network);
+
 	free(file_layer_offsets);
 	return network;
 }
@@ -313,9 +900,66 @@ void export_neural_network(neural_network* network, char* filename) {
 		return;
 	}
 
+	write_neural_network(network, f);
+	fclose(f);
+}
+
+/* Convolutions are written as their shape, then every filter, then the biases */
+static void write_conv_layer(neural_network* network, int layer_index, file_layer* layer, FILE* f) {
+	conv_layer* conv = &network->layers[layer_index].conv;
+	size_t num_filter_weights = conv->channels * layer_row_len(network, layer_index);
+
+	file_conv_layer conv_header;
+	bzero(&conv_header, sizeof(conv_header));
+	conv_header.kernel_size = conv->kernel_size;
+	conv_header.stride = conv->stride;
+	conv_header.channels = conv->channels;
+	conv_header.activation_index = network->layers[layer_index].layer_neurons[0].activation_index;
+
+	layer->layer_len = sizeof(file_layer) + sizeof(file_conv_layer) + (num_filter_weights + conv->channels) * sizeof(double);
+
+	fwrite(layer, sizeof(file_layer), 1, f);
+	fwrite(&conv_header, sizeof(file_conv_layer), 1, f);
+	fwrite(conv->filters, sizeof(double), num_filter_weights, f);
+	fwrite(conv->biases, sizeof(double), conv->channels, f);
+}
+
+/* Embeddings are written as their width, then the table */
+static void write_embedding_layer(neural_network* network, int layer_index, file_layer* layer, FILE* f) {
+	embedding_layer* embedding = &network->layers[layer_index].embedding;
+
+	file_embedding_layer embedding_header;
+	bzero(&embedding_header, sizeof(embedding_header));
+	embedding_header.dim = embedding->dim;
+
+	layer->layer_len = sizeof(file_layer) + sizeof(file_embedding_layer) + EMBEDDING_ROWS * embedding->dim * sizeof(double);
+
+	fwrite(layer, sizeof(file_layer), 1, f);
+	fwrite(&embedding_header, sizeof(file_embedding_layer), 1, f);
+	fwrite(embedding->table, sizeof(double), EMBEDDING_ROWS * embedding->dim, f);
+}
+
+/* Gated layers are written as every gates weights, then their biases */
+static void write_gated_layer(neural_network* network, int layer_index, file_layer* layer, FILE* f) {
+	gated_layer* gated = &network->layers[layer_index].gated;
+	size_t num_rows = layer_rows(&network->layers[layer_index]);
+	size_t num_weights = num_rows * layer_row_len(network, layer_index);
+
+	layer->layer_len = sizeof(file_layer) + (num_weights + num_rows) * sizeof(double);
+
+	fwrite(layer, sizeof(file_layer), 1, f);
+	fwrite(gated->weights, sizeof(double), num_weights, f);
+	fwrite(gated->biases, sizeof(double), num_rows, f);
+}
+
+/* Write a network out as a SUNN image */
+void write_neural_network(neural_network* network, FILE* f) {
+
 	/* Start by setting up our file header */
 	neural_network_file_header header;
+	bzero(&header, sizeof(header));
 	header.magic = NEURAL_NETWORK_MAGIC;
+	header.version = NEURAL_NETWORK_VERSION;
 	header.num_layers = network->num_layers;
 
 	/* Write the header to the file */
@@ -327,8 +971,25 @@ void export_neural_network(neural_network* network, char* filename) {
 		layer* curr_layer = &network->layers[i];
 
 		file_layer layer;
+		bzero(&layer, sizeof(layer));
 		layer.num_neurons = curr_layer->num_neurons;
 		layer.recurrent = curr_layer->recurrent;
+		layer.type = curr_layer->type;
+
+		if(curr_layer->type == LAYER_CONV1D) {
+			write_conv_layer(network, i, &layer, f);
+			continue;
+		}
+
+		if(is_gated(curr_layer)) {
+			write_gated_layer(network, i, &layer, f);
+			continue;
+		}
+
+		if(curr_layer->type == LAYER_EMBEDDING) {
+			write_embedding_layer(network, i, &layer, f);
+			continue;
+		}
 
 		/* Calculate the size of all our neurons */
 		size_t neuron_len = sizeof(file_neuron);
@@ -348,6 +1009,7 @@ void export_neural_network(neural_network* network, char* filename) {
 			/* Get the neuron we're working with, and the position of our new neuron in the array */
 			neuron* curr_neuron = &curr_layer->layer_neurons[j];
 			file_neuron neuron_header;
+			bzero(&neuron_header, sizeof(neuron_header));
 
 			/* Define bias and recurrent weight */
 			neuron_header.bias = curr_neuron->bias;
@@ -379,27 +1041,261 @@ void export_neural_network(neural_network* network, char* filename) {
 		}
 	}
 
-	fclose(f);
 }
 
-static void reset_history(neural_network* network) {
+/* Where a planned tensor went in a contexts arena, NULL if the layer doesn't have it */
+static double* planned_buffer(execution_context* context, execution_plan* plan, int layer_index, tensor_kind kind) {
+	planned_tensor* tensor = plan_tensor(plan, layer_index, kind);
+	return tensor->len ? &context->block[tensor->offset] : NULL;
+}
 
-	/* Loop through the network layers */
+/* Lay a contexts activations, and a training contexts derivatives, out in one arena as planned, reusing the space of tensors no longer needed */
+static execution_context* create_planned_context(neural_network* network, plan_mode mode) {
+	execution_context* context = malloc(sizeof(execution_context));
+	if(!context) {
+		error("Failed to allocate execution context\n");
+		return NULL;
+	}
+	context->network = network;
+
+	execution_plan* plan = plan_execution(network, mode);
+	if(!plan) {
+		free(context);
+		return NULL;
+	}
+
+	/* Binary layers pack their inputs into words, large enough for any of them */
+	size_t input_words = 1;
 	for(int i = 0; i < network->num_layers; i += 1) {
-		layer* curr_layer = &network->layers[i];
+		if(network->layers[i].type == LAYER_BINARY && network->layers[i].binary.words > input_words) {
+			input_words = network->layers[i].binary.words;
+		}
+	}
 
-		/* Ignore if this isn't a recurrent layer */
-		if(!curr_layer->recurrent) {
-			continue;
+	context->outputs = malloc(sizeof(double*) * network->num_layers);
+	context->sums = malloc(sizeof(double*) * network->num_layers);
+	context->history = malloc(sizeof(double*) * network->num_layers);
+	context->gates = malloc(sizeof(double*) * network->num_layers);
+
+	context->derivatives = NULL;
+	context->common_terms = NULL;
+	context->partial_derivatives = NULL;
+	context->input_signs = NULL;
+	bool training = mode == PLAN_TRAINING;
+	if(training) {
+		context->derivatives = malloc(sizeof(double*) * network->num_layers);
+		context->common_terms = malloc(sizeof(double*) * network->num_layers);
+		context->partial_derivatives = malloc(sizeof(double*) * network->num_layers);
+		context->input_signs = malloc(sizeof(double*) * network->num_layers);
+	}
+
+	/* Only gated layers are backpropogated through time, so only their networks need each steps arena */
+	size_t carried_len = 0;
+	for(int i = 0; i < network->num_layers; i += 1) {
+		if(is_gated(&network->layers[i])) {
+			carried_len += network->layers[i].num_neurons * 2;
 		}
+	}
+	context->step_blocks = NULL;
+	context->carried = NULL;
+	bool through_time = training && carried_len > 0;
+
+	/*
+	 * Activations and derivatives are written by whichever workers run each layer, so they're placed by who made the
+	 * context. Replicas are made by the caller but trained with on a worker, so theirs are left to the first touch.
+	 */
+	int node = network->replica_of ? BUFFER_ANY_NODE : thread_pool_current_node();
+	context->block = buffer_calloc(plan->arena_len, sizeof(double), node);
+	context->block_len = plan->arena_len;
+	if(through_time) {
+		context->step_blocks = buffer_calloc(plan->arena_len * (BPTT_STEPS + 1) + carried_len, sizeof(double), node);
+		context->carried = malloc(sizeof(double*) * network->num_layers);
+	}
+	context->set_inputs = malloc(sizeof(size_t) * network->layers[0].num_neurons);
+	context->binary_inputs = false;
+	context->num_set_inputs = 0;
+	context->input_bits = buffer_calloc(input_words, sizeof(uint64_t), node);
+
+	bool failed = !context->outputs || !context->sums || !context->history || !context->gates || !context->block || !context->set_inputs || !context->input_bits;
+	if(training) {
+		failed = failed || !context->derivatives || !context->common_terms || !context->partial_derivatives || !context->input_signs;
+	}
+	if(through_time) {
+		failed = failed || !context->step_blocks || !context->carried;
+	}
 
-		/* Loop through all the neurons */
-		for(int j = 0; j < curr_layer->num_neurons; j += 1) {
+	if(failed) {
+		error("Failed to allocate execution context buffers\n");
+		plan_free(plan);
+		free_execution_context(context);
+		return NULL;
+	}
+
+	for(int i = 0; i < network->num_layers; i += 1) {
+		context->outputs[i] = planned_buffer(context, plan, i, TENSOR_OUTPUTS);
+
+		/* Sums taken in place share their outputs */
+		context->sums[i] = planned_buffer(context, plan, i, TENSOR_SUMS);
+		if(!context->sums[i]) {
+			context->sums[i] = context->outputs[i];
+		}
+
+		context->history[i] = planned_buffer(context, plan, i, TENSOR_HISTORY);
+		context->gates[i] = planned_buffer(context, plan, i, TENSOR_GATES);
+
+		if(training) {
+			context->derivatives[i] = planned_buffer(context, plan, i, TENSOR_DERIVATIVES);
+			context->common_terms[i] = planned_buffer(context, plan, i, TENSOR_COMMON_TERMS);
+			context->partial_derivatives[i] = planned_buffer(context, plan, i, TENSOR_PARTIALS);
+			context->input_signs[i] = planned_buffer(context, plan, i, TENSOR_INPUT_SIGNS);
+		}
+	}
+
+	/* What's carried back goes after the steps, so restoring a step never touches it */
+	if(through_time) {
+		double* carried = &context->step_blocks[plan->arena_len * (BPTT_STEPS + 1)];
+		for(int i = 0; i < network->num_layers; i += 1) {
+			context->carried[i] = NULL;
+			if(is_gated(&network->layers[i])) {
+				context->carried[i] = carried;
+				carried += network->layers[i].num_neurons * 2;
+			}
+		}
+	}
+	plan_free(plan);
+
+	/* Pick the fastest kernel for each layer shape now, so forward passes never change the network */
+	pthread_mutex_lock(&kernel_tuning_lock);
+	for(int i = 1; i < network->num_layers; i += 1) {
+		layer* curr_layer = &network->layers[i];
+		if(!curr_layer->kernels.forward_tuned && curr_layer->type == LAYER_DENSE) {
+			curr_layer->kernels.forward = autotune_forward(curr_layer->layer_neurons, curr_layer->num_neurons, context->outputs[i-1], network->layers[i-1].num_neurons);
+			curr_layer->kernels.forward_tuned = true;
+		}
+	}
+	pthread_mutex_unlock(&kernel_tuning_lock);
+
+	return context;
+}
+
+/* Contexts made for callers only ever run inference */
+execution_context* create_execution_context(neural_network* network) {
+	return create_planned_context(network, PLAN_INFERENCE);
+}
+
+void free_execution_context(execution_context* context) {
+	free(context->outputs);
+	free(context->sums);
+	free(context->history);
+	free(context->gates);
+	free(context->derivatives);
+	free(context->common_terms);
+	free(context->partial_derivatives);
+	free(context->input_signs);
+	free(context->carried);
+	buffer_free(context->step_blocks);
+	buffer_free(context->block);
+	free(context->set_inputs);
+	buffer_free(context->input_bits);
+	free(context);
+}
+
+/* The network keeps a context of its own for training and single caller inference, planned for training unless it never can be */
+static int ensure_context(neural_network* network) {
+	if(network->context) {
+		return 0;
+	}
+
+	network->context = create_planned_context(network, network->inference_only ? PLAN_INFERENCE : PLAN_TRAINING);
+	return network->context ? 0 : -1;
+}
+
+/* Allocate everything needed to train, the first time the network is trained */
+static int ensure_training_state(neural_network* network) {
+	if(network->weight_derivatives) {
+		return 0;
+	}
+
+	if(network->inference_only) {
+		error("Network was loaded for inference only\n");
+		return -1;
+	}
+
+	/* Training runs through the networks own context */
+	if(ensure_context(network) != 0) {
+		return -1;
+	}
+
+	size_t num_rows = 0;
+	for(int i = 1; i < network->num_layers; i += 1) {
+		num_rows += layer_rows(&network->layers[i]);
+	}
+
+	/* One block for every weight derivative, so they can be reduced in a few large operations */
+	network->weight_derivatives = buffer_calloc(network->num_weights, sizeof(double), BUFFER_ANY_NODE);
+
+	/* And one for each rows bias derivative and recurrent weight derivative */
+	network->neuron_training = buffer_calloc(num_rows * 2, sizeof(double), BUFFER_ANY_NODE);
+
+	if(!network->weight_derivatives || !network->neuron_training) {
+		error("Failed to allocate training state\n");
+		buffer_free(network->weight_derivatives);
+		buffer_free(network->neuron_training);
+		network->weight_derivatives = NULL;
+		network->neuron_training = NULL;
+		return -1;
+	}
+
+	size_t weight_offset = 0;
+	size_t row_offset = 0;
+
+	for(int i = 1; i < network->num_layers; i += 1) {
+		layer_training* training = &network->layers[i].training;
+		size_t layer_rows_len = layer_rows(&network->layers[i]);
+
+		training->weight_derivatives = &network->weight_derivatives[weight_offset];
+		training->bias_derivatives = &network->neuron_training[row_offset];
+		training->recurrent_weight_derivatives = &network->neuron_training[num_rows + row_offset];
+		bzero(training->touched_rows, sizeof(training->touched_rows));
+
+		weight_offset += layer_rows_len * layer_row_len(network, i);
+		row_offset += layer_rows_len;
+	}
+	return 0;
+}
+
+static void reset_neuron_derivatives(size_t start, size_t end, void* arg) {
+	layer_update* update = arg;
+	layer_training* training = &update->curr_layer->training;
 
-			/* Zero the recurrent_history */
-			curr_layer->layer_neurons[j].recurrent_history = 0;
+	/* Zero the weight derivatives */
+	bzero(&training->weight_derivatives[start * update->num_weights], (end - start) * update->num_weights * sizeof(double));
+
+	/* Loop through all the rows of weights */
+	for(size_t j = start; j < end; j += 1) {
+
+		/* Zero the bias derivative */
+		training->bias_derivatives[j] = 0;
+
+		/* Zero the recurrent history derivative */
+		training->recurrent_weight_derivatives[j] = 0;
+	}
+}
+
+static bool row_touched(layer_training* training, size_t row) {
+	return (training->touched_rows[row / 64] >> (row % 64)) & 1;
+}
+
+/* Only the rows of an embedding looked up since the last reset have derivatives to zero */
+static void reset_touched_rows(layer_update* update) {
+	layer_training* training = &update->curr_layer->training;
+
+	for(size_t row = 0; row < EMBEDDING_ROWS; row += 1) {
+		if(row_touched(training, row)) {
+			bzero(&training->weight_derivatives[row * update->num_weights], update->num_weights * sizeof(double));
 		}
 	}
+	bzero(training->touched_rows, sizeof(training->touched_rows));
 }
 
 static void reset_derivatives(neural_network* network) {
@@ -409,125 +1305,434 @@ static void reset_derivatives(neural_network* network) {
 
 	/* Loop through the network layers */
 	for(int i = 1; i < network->num_layers; i += 1) {
-		layer* curr_layer = &network->layers[i];
+		layer_update update = {.curr_layer=&network->layers[i], .num_weights=layer_row_len(network, i)};
 
-		/* Loop through all the neurons */
-		for(int j = 0; j < curr_layer->num_neurons; j += 1) {
+		if(update.curr_layer->type == LAYER_EMBEDDING) {
+			reset_touched_rows(&update);
+			continue;
+		}
 
+		/* Split the neurons between the thread pool */
+		thread_pool_parallel_for(thread_pool_global(), layer_rows(update.curr_layer), neuron_grain(update.num_weights), reset_neuron_derivatives, &update);
+	}
+}
 
-			/* Zero the weight derivatives */
-			bzero(curr_layer->layer_neurons[j].weight_derivatives, network->layers[i-1].num_neurons * sizeof(double));
 
-			/* Zero the bias derivative */
-			curr_layer->layer_neurons[j].bias_derivative = 0;
 
-			/* Zero the recurrent history derivative */
-			curr_layer->layer_neurons[j].recurrent_weight_derivative = 0;
+void reset_history(execution_context* context) {
+	neural_network* network = context->network;
 
+	/* Zero the history of every recurrent layer */
+	for(int i = 0; i < network->num_layers; i += 1) {
+		if(context->history[i]) {
+			bzero(context->history[i], sizeof(double) * layer_history_len(&network->layers[i]));
 		}
 	}
 }
 
-
-
-static void set_layer_outputs(double* inputs, size_t input_len, layer* layer) {
+static void set_layer_outputs(double* inputs, size_t input_len, double* outputs) {
 	info("[*] Network inputs: ");
 	for(int i = 0; i < input_len; i += 1) {
-		layer->layer_neurons[i].output = inputs[i];
+		outputs[i] = inputs[i];
 		info("%f ", inputs[i]);
 	}
 		info("\n");
 }
 
-static double* get_layer_outputs(layer* layer) {
+/* Inputs from buf_to_bits are all exactly 0 or 1, in which case note down which are set for the first layer */
+static void find_set_inputs(execution_context* context) {
+	size_t num_inputs = context->network->layers[0].num_neurons;
+	double* inputs = context->outputs[0];
 
-	/* Allocate an array for the outputs */
-	double* ret = malloc(sizeof(double) * layer->num_neurons);
-	if(!ret) {
-		error("Failed to allocate output buffer.");
-		return NULL;
+	context->binary_inputs = false;
+	context->num_set_inputs = 0;
+
+	/* Only dense layers can sum columns of weights */
+	if(context->network->num_layers < 2 || context->network->layers[1].type != LAYER_DENSE) {
+		return;
 	}
 
-	/* Fill the array */
-	for(int i = 0; i < layer->num_neurons; i += 1) {
-		ret[i] = layer->layer_neurons[i].output;
+	for(size_t j = 0; j < num_inputs; j += 1) {
+		if(inputs[j] == 1) {
+			context->set_inputs[context->num_set_inputs] = j;
+			context->num_set_inputs += 1;
+		}
+		else if(inputs[j] != 0) {
+			return;
+		}
 	}
 
-	/* Return the array */
-	return ret;
+	context->binary_inputs = context->num_set_inputs <= num_inputs * BINARY_INPUT_DENSITY;
 }
 
-static void update_history(neural_network* network) {
+static void update_history(execution_context* context) {
+	neural_network* network = context->network;
 
-	/* Loop through the network layers */
+	/* Each recurrent layers history becomes its latest outputs */
 	for(int i = 0; i < network->num_layers; i += 1) {
-		layer* curr_layer = &network->layers[i];
+		size_t num_neurons = network->layers[i].num_neurons;
+		if(context->history[i]) {
+			memcpy(context->history[i], context->outputs[i], sizeof(double) * num_neurons);
+		}
 
-		/* Ignore if this isn't a recurrent layer */
-		if(!curr_layer->recurrent) {
-			continue;
+		/* And an LSTMs cell state becomes its new one */
+		if(network->layers[i].type == LAYER_LSTM) {
+			memcpy(&context->history[i][num_neurons], &context->gates[i][num_neurons * LSTM_GATES], sizeof(double) * num_neurons);
 		}
+	}
+}
 
-		/* Loop through all the neurons */
-		for(int j = 0; j < curr_layer->num_neurons; j += 1) {
+typedef struct {
+	layer* input;
+	layer* output;
+	double* inputs;
+	double* sums;
+	double* outputs;
+	double* history;
+	double* gates;
+	size_t layer_index;
+	size_t* set_inputs; /* Only set for binary inputs to the first layer */
+	size_t num_set_inputs;
+	uint64_t* input_bits; /* The signs of the inputs to a binary layer */
+} layer_pass;
+
+/* Sum the weights of the set inputs, four neurons at a time so each index is loaded once per four rows */
+static void propogate_set_inputs(neuron* neurons, size_t start, size_t end, size_t* set_inputs, size_t num_set_inputs, double* sums) {
+	size_t i = start;
+
+	for(; i + 4 <= end; i += 4) {
+		double* w0 = neurons[i].weights;
+		double* w1 = neurons[i+1].weights;
+		double* w2 = neurons[i+2].weights;
+		double* w3 = neurons[i+3].weights;
+		double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+
+		for(size_t j = 0; j < num_set_inputs; j += 1) {
+			size_t input = set_inputs[j];
+			s0 += w0[input];
+			s1 += w1[input];
+			s2 += w2[input];
+			s3 += w3[input];
+		}
 
-			/* Update the recurrent_history */
-			curr_layer->layer_neurons[j].recurrent_history = curr_layer->layer_neurons[j].output;
+		sums[i] += s0;
+		sums[i+1] += s1;
+		sums[i+2] += s2;
+		sums[i+3] += s3;
+	}
+
+	for(; i < end; i += 1) {
+		double* weights = neurons[i].weights;
+		double sum = 0;
+
+		for(size_t j = 0; j < num_set_inputs; j += 1) {
+			sum += weights[set_inputs[j]];
 		}
+		sums[i] += sum;
 	}
 }
 
-static void propogate_layer_forward(layer* input, layer* output) {
+static void propogate_neurons_forward(size_t start, size_t end, void* arg) {
+	layer_pass* pass = arg;
+	layer* output = pass->output;
+	double* sums = pass->sums;
 
-	/* Loop all the output neurons */
-	for(int i = 0; i < output->num_neurons; i += 1) {
+	perf_sample sample;
+	if(perf_enabled) {
+		perf_begin(&sample);
+	}
 
-		/* Get the current neuron in our network */
+	/* Set each weighted sum to our bias value */
+	for(size_t i = start; i < end; i += 1) {
 		neuron* curr_neuron = &output->layer_neurons[i];
-
-		/* Set weighted sum to our bias value */
-		curr_neuron->weighted_sum = curr_neuron->bias;
+		sums[i] = curr_neuron->bias;
 
 		/* Add our recurrent layer if this is a recurrent layer */
 		if(output->recurrent) {
-			curr_neuron->weighted_sum += curr_neuron->recurrent_weight * curr_neuron->recurrent_history;
+			sums[i] += curr_neuron->recurrent_weight * pass->history[i];
+		}
+	}
+
+	/* Binary inputs only add the weights of the set ones, otherwise add the weighted outputs of the previous layer using our layers kernel */
+	if(pass->set_inputs) {
+		propogate_set_inputs(output->layer_neurons, start, end, pass->set_inputs, pass->num_set_inputs, sums);
+	}
+	else {
+		kernel_choice kernel = output->kernels.forward;
+		kernel_variants[kernel.variant].forward(output->layer_neurons, start, end, pass->inputs, pass->input->num_neurons, sums, kernel.tile);
+	}
+
+	/* Set our outputs based on the activation function */
+	for(size_t i = start; i < end; i += 1) {
+		neuron* curr_neuron = &output->layer_neurons[i];
+		pass->outputs[i] = activation_functions[curr_neuron->activation_index].activation(sums[i]);
+	}
+
+	/* A multiply and add per weight, each weight read once */
+	if(perf_enabled) {
+		uint64_t num_weights = (end - start) * (pass->set_inputs ? pass->num_set_inputs : pass->input->num_neurons);
+		perf_end(&sample, PERF_FORWARD, pass->layer_index, num_weights * 2, num_weights * sizeof(double));
+	}
+}
+
+/* Direct convolution, each output is its channels filter applied at its position */
+static void propogate_conv_forward(size_t start, size_t end, void* arg) {
+	layer_pass* pass = arg;
+	layer* output = pass->output;
+	conv_layer* conv = &output->conv;
+	size_t row_len = conv->in_channels * conv->kernel_size;
+
+	perf_sample sample;
+	if(perf_enabled) {
+		perf_begin(&sample);
+	}
+
+	for(size_t i = start; i < end; i += 1) {
+		size_t channel = i / conv->width;
+		double* filter = &conv->filters[channel * row_len];
+		double* window = &pass->inputs[(i % conv->width) * conv->stride];
+
+		double sum = conv->biases[channel];
+		for(size_t ic = 0; ic < conv->in_channels; ic += 1) {
+			for(size_t k = 0; k < conv->kernel_size; k += 1) {
+				sum += filter[ic * conv->kernel_size + k] * window[ic * conv->in_width + k];
+			}
+		}
+
+		pass->sums[i] = sum;
+		pass->outputs[i] = activation_functions[output->layer_neurons[i].activation_index].activation(sum);
+	}
+
+	/* A multiply and add per filter weight at every position, the filters themselves stay in cache */
+	if(perf_enabled) {
+		uint64_t num_weights = (end - start) * row_len;
+		perf_end(&sample, PERF_FORWARD, pass->layer_index, num_weights * 2, num_weights * sizeof(double));
+	}
+}
+
+/* The table row for an input byte value, anything out of range is treated as a byte */
+static size_t embedding_row(double input) {
+	return input > 0 ? (size_t)input & (EMBEDDING_ROWS - 1) : 0;
+}
+
+/* Copy each inputs row of the table, in place of a multiply per weight */
+static void propogate_embedding_forward(size_t start, size_t end, void* arg) {
+	layer_pass* pass = arg;
+	embedding_layer* embedding = &pass->output->embedding;
+
+	perf_sample sample;
+	if(perf_enabled) {
+		perf_begin(&sample);
+	}
+
+	for(size_t i = start; i < end; i += 1) {
+		double* row = &embedding->table[embedding_row(pass->inputs[i]) * embedding->dim];
+
+		memcpy(&pass->sums[i * embedding->dim], row, sizeof(double) * embedding->dim);
+		memcpy(&pass->outputs[i * embedding->dim], row, sizeof(double) * embedding->dim);
+	}
+
+	/* No arithmetic, just a row read per input */
+	if(perf_enabled) {
+		perf_end(&sample, PERF_FORWARD, pass->layer_index, 0, (end - start) * embedding->dim * sizeof(double));
+	}
+}
+
+/* Pack the signs of a binary layers inputs into bits, in the same order as its rows of signs */
+static void pack_binary_inputs(double* inputs, size_t num_inputs, uint64_t* bits, size_t words) {
+	bzero(bits, sizeof(uint64_t) * words);
+	for(size_t j = 0; j < num_inputs; j += 1) {
+		bits[j / 64] |= (uint64_t)(inputs[j] >= BINARY_THRESHOLD) << (j % 64);
+	}
+}
+
+/* A matching sign adds one and a mismatched one takes one away, so a row sums to its length less twice its mismatches */
+static void propogate_binary_forward(size_t start, size_t end, void* arg) {
+	layer_pass* pass = arg;
+	binary_layer* binary = &pass->output->binary;
+	int64_t num_inputs = pass->input->num_neurons;
+
+	perf_sample sample;
+	if(perf_enabled) {
+		perf_begin(&sample);
+	}
+
+	for(size_t i = start; i < end; i += 1) {
+		uint64_t* signs = &binary->signs[i * binary->words];
+
+		int64_t mismatches = 0;
+		for(size_t w = 0; w < binary->words; w += 1) {
+			mismatches += __builtin_popcountll(signs[w] ^ pass->input_bits[w]);
+		}
+
+		double sum = (num_inputs - 2 * mismatches) * binary->scale + pass->output->layer_neurons[i].bias;
+		pass->sums[i] = sum;
+		pass->outputs[i] = sum >= 0 ? 1 : 0;
+	}
+
+	/* An XOR and popcount per word of weights */
+	if(perf_enabled) {
+		uint64_t num_words = (end - start) * binary->words;
+		perf_end(&sample, PERF_FORWARD, pass->layer_index, num_words * 2, num_words * sizeof(uint64_t));
+	}
+}
+
+/* Every gate of a range of gated neurons in one pass over the weights, then their activations in another */
+static void propogate_gated_forward(size_t start, size_t end, void* arg) {
+	layer_pass* pass = arg;
+	layer* output = pass->output;
+	gated_layer* gated = &output->gated;
+	size_t num_neurons = output->num_neurons;
+	size_t row_len = gated->num_inputs + num_neurons;
+	double* gates = pass->gates;
+	double* last_outputs = pass->history;
+
+	perf_sample sample;
+	if(perf_enabled) {
+		perf_begin(&sample);
+	}
+
+	/* Each gate row reads the previous layer then the last outputs */
+	for(size_t g = 0; g < gated->num_gates; g += 1) {
+		for(size_t i = start; i < end; i += 1) {
+			size_t row = g * num_neurons + i;
+			double* weights = &gated->weights[row * row_len];
+
+			double input_sum = gated->biases[row];
+			for(size_t k = 0; k < gated->num_inputs; k += 1) {
+				input_sum += weights[k] * pass->inputs[k];
+			}
+
+			double recurrent_sum = 0;
+			double* recurrent_weights = &weights[gated->num_inputs];
+			for(size_t k = 0; k < num_neurons; k += 1) {
+				recurrent_sum += recurrent_weights[k] * last_outputs[k];
+			}
+
+			/* A GRUs new gate only sees as much of the last outputs as its reset gate lets through, so keep them apart */
+			if(output->type == LAYER_GRU && g == 2) {
+				gates[row] = input_sum;
+				gates[3 * num_neurons + i] = recurrent_sum;
+				continue;
+			}
+			gates[row] = input_sum + recurrent_sum;
 		}
+	}
+
+	if(output->type == LAYER_LSTM) {
+		double* cell = &last_outputs[num_neurons];
+		double* new_cell = &gates[4 * num_neurons];
 
-		/* Loop through all the previous layers neurons */
-		for(int j = 0; j < input->num_neurons; j += 1) {
+		for(size_t i = start; i < end; i += 1) {
+			double input_gate = sigmoid_function(gates[i]);
+			double forget_gate = sigmoid_function(gates[num_neurons + i]);
+			double cell_gate = tanh(gates[2 * num_neurons + i]);
+			double output_gate = sigmoid_function(gates[3 * num_neurons + i]);
 
-			/* Add the weighted output to our sum */
-			curr_neuron->weighted_sum += curr_neuron->weights[j] * input->layer_neurons[j].output;
+			new_cell[i] = forget_gate * cell[i] + input_gate * cell_gate;
+			pass->sums[i] = new_cell[i];
+			pass->outputs[i] = output_gate * tanh(new_cell[i]);
+
+			gates[i] = input_gate;
+			gates[num_neurons + i] = forget_gate;
+			gates[2 * num_neurons + i] = cell_gate;
+			gates[3 * num_neurons + i] = output_gate;
+		}
+	}
+	else {
+		for(size_t i = start; i < end; i += 1) {
+			double reset_gate = sigmoid_function(gates[i]);
+			double update_gate = sigmoid_function(gates[num_neurons + i]);
+			double new_gate = tanh(gates[2 * num_neurons + i] + reset_gate * gates[3 * num_neurons + i]);
+
+			pass->sums[i] = new_gate;
+			pass->outputs[i] = (1 - update_gate) * new_gate + update_gate * last_outputs[i];
+
+			gates[i] = reset_gate;
+			gates[num_neurons + i] = update_gate;
+			gates[2 * num_neurons + i] = new_gate;
 		}
+	}
+
+	/* A multiply and add per weight, each weight read once */
+	if(perf_enabled) {
+		uint64_t num_weights = (end - start) * gated->num_gates * row_len;
+		perf_end(&sample, PERF_FORWARD, pass->layer_index, num_weights * 2, num_weights * sizeof(double));
+	}
+}
+
+static void propogate_layer_forward(execution_context* context, int layer_index) {
+	layer_pass pass = {.input=&context->network->layers[layer_index-1], .output=&context->network->layers[layer_index]};
+	pass.inputs = context->outputs[layer_index-1];
+	pass.sums = context->sums[layer_index];
+	pass.outputs = context->outputs[layer_index];
+	pass.history = context->history[layer_index];
+	pass.gates = context->gates[layer_index];
+	pass.layer_index = layer_index;
+	pass.set_inputs = layer_index == 1 && context->binary_inputs ? context->set_inputs : NULL;
+	pass.num_set_inputs = context->num_set_inputs;
+	pass.input_bits = context->input_bits;
+
+	perf_sample sample;
+	if(perf_enabled) {
+		perf_begin(&sample);
+	}
+
+	/* Wide layers have their output neurons split across the thread pool, narrow ones stay on this thread */
+	if(pass.output->type == LAYER_CONV1D) {
+		thread_pool_parallel_for(thread_pool_global(), pass.output->num_neurons, neuron_grain(layer_row_len(context->network, layer_index)), propogate_conv_forward, &pass);
+	}
+	else if(pass.output->type == LAYER_EMBEDDING) {
+		thread_pool_parallel_for(thread_pool_global(), pass.input->num_neurons, neuron_grain(pass.output->embedding.dim), propogate_embedding_forward, &pass);
+	}
+	else if(is_gated(pass.output)) {
+		thread_pool_parallel_for(thread_pool_global(), pass.output->num_neurons, neuron_grain(layer_rows(pass.output) / pass.output->num_neurons * layer_row_len(context->network, layer_index)), propogate_gated_forward, &pass);
+	}
+	else if(pass.output->type == LAYER_BINARY) {
+
+		/* Each input is only packed once, and every row reads its words - a word does the work of 64 weights */
+		pack_binary_inputs(pass.inputs, pass.input->num_neurons, pass.input_bits, pass.output->binary.words);
+		thread_pool_parallel_for(thread_pool_global(), pass.output->num_neurons, neuron_grain(pass.output->binary.words), propogate_binary_forward, &pass);
+	}
+	else {
+		thread_pool_parallel_for(thread_pool_global(), pass.output->num_neurons, neuron_grain(pass.input->num_neurons), propogate_neurons_forward, &pass);
+	}
 
-		/* Set our output based on the activation function */
-		curr_neuron->output = activation_functions[curr_neuron->activation_index].activation(curr_neuron->weighted_sum);
+	if(perf_enabled) {
+		perf_add_wall(&sample, PERF_FORWARD, layer_index);
 	}
 }
 
-static void propogate_forward(neural_network* neural_net) {
+static void propogate_forward(execution_context* context) {
+	neural_network* neural_net = context->network;
 
 	/* Propogate through all our network layers */
-	for(int i = 0; i < (neural_net->num_layers-1); i += 1) {
-		propogate_layer_forward(&neural_net->layers[i], &neural_net->layers[i+1]);
+	for(int i = 1; i < neural_net->num_layers; i += 1) {
+		propogate_layer_forward(context, i);
 	}
 
-	debug("[!] First output neuron: %f\n", neural_net->layers[neural_net->num_layers-1].layer_neurons[0].output);
+	debug("[!] First output neuron: %f\n", context->outputs[neural_net->num_layers-1][0]);
 #ifdef INFO
+	double* outputs = context->outputs[neural_net->num_layers-1];
 	info("[*] Output neurons: ");
 	for(int i = 0; i < neural_net->layers[neural_net->num_layers-1].num_neurons; i += 1) {
-		info("%f ", neural_net->layers[neural_net->num_layers-1].layer_neurons[i].output);
+		info("%f ", outputs[i]);
 
 	}
 	info("\n");
 #endif
 }
 
-double* propogate_case_forward(neural_network* network, double* input, size_t input_len, size_t output_len) {
-
+/* Run an input through the network using a callers own context, which is safe alongside other contexts */
+double* propogate_context_forward(execution_context* context, double* input, size_t input_len, size_t output_len) {
 
 	/* Reset the networks history */
-	reset_history(network);
+	reset_history(context);
+
+	return propogate_context_steps(context, input, input_len, output_len);
+}
+
+double* propogate_context_steps(execution_context* context, double* input, size_t input_len, size_t output_len) {
 
 	/* Allocate an output buffer */
 	double* output = malloc(output_len * sizeof(double));
@@ -536,6 +1741,12 @@ double* propogate_case_forward(neural_network* network, double* input, size_t in
 		return NULL;
 	}
 
+	propogate_context_into(context, input, input_len, output, output_len);
+	return output;
+}
+
+void propogate_context_into(execution_context* context, double* input, size_t input_len, double* output, size_t output_len) {
+	neural_network* network = context->network;
 
 	size_t input_offset = 0;
 	size_t output_offset = 0;
@@ -545,34 +1756,23 @@ double* propogate_case_forward(neural_network* network, double* input, size_t in
 
 		/* Calculate the amount to add and the amount to output on this forward pass */
 		size_t num_input_neurons = network->layers[0].num_neurons;
-		size_t num_output_neurons = network->layers[0].num_neurons;
+		size_t num_output_neurons = network->layers[network->num_layers-1].num_neurons;
 
 		size_t to_add = (input_len > num_input_neurons) ? num_input_neurons : input_len;
 		size_t to_output = (output_len > num_output_neurons) ? num_output_neurons : output_len;
 
 		/* Set out layer outputs */
-		set_layer_outputs(&input[input_offset], to_add, &network->layers[0]);
+		set_layer_outputs(&input[input_offset], to_add, context->outputs[0]);
+		find_set_inputs(context);
 
 		/* Propogate the network */
-		propogate_forward(network);
-
-		/* Get the output */
-		double* iteration_outputs = get_layer_outputs(&network->layers[network->num_layers-1]);
-
-		if(!iteration_outputs) {
-			free(output);
-			error("Failed to get iteration outputs.");
-			return NULL;
-		}
+		propogate_forward(context);
 
 		/* Copy to the output buffer */
-		memcpy(&output[output_offset], iteration_outputs, to_output * sizeof(double));
-
-		/* Free the un-needed outputs */
-		free(iteration_outputs);
+		memcpy(&output[output_offset], context->outputs[network->num_layers-1], to_output * sizeof(double));
 
 		/* Propogate the network history */
-		update_history(network);
+		update_history(context);
 
 		/* Update our variables */
 		input_len -= to_add;
@@ -581,119 +1781,690 @@ double* propogate_case_forward(neural_network* network, double* input, size_t in
 		output_len -= to_output;
 		output_offset += to_output;
 	}
-
-	return output;
 }
 
-static double cost(double value, double expected) {
-	return pow(value - expected, 2);
+double* propogate_case_forward(neural_network* network, double* input, size_t input_len, size_t output_len) {
+	if(ensure_context(network) != 0) {
+		return NULL;
+	}
+	return propogate_context_forward(network->context, input, input_len, output_len);
 }
 
 static double cost_derivative(double value, double expected) {
 	return 2 * (value - expected);
 }
 
+/* Only logged, so left out of builds without debug logging */
+#ifdef DEBUG
+static double cost(double value, double expected) {
+	return pow(value - expected, 2);
+}
+
 static double network_cost(neural_network* network, double* expected) {
 	layer* output_layer = &network->layers[network->num_layers - 1];
+	double* outputs = network->context->outputs[network->num_layers - 1];
 
 	double ret = 0;
 
 	/* Calculate the cost for the whole output layer */
 	for(int i = 0; i < output_layer->num_neurons; i += 1) {
-		ret += cost(output_layer->layer_neurons[i].output, expected[i]);
+		ret += cost(outputs[i], expected[i]);
 	}
 
 	/* Average the cost */
 	return ret / output_layer->num_neurons;
 }
+#endif
 
-static void backpropogate_layer(neural_network* network, int layer_index, double* neuron_derivatives) {
+typedef struct {
+	layer* curr_layer;
+	layer* prev_layer;
+	double* sums;
+	double* history;
+	double* neuron_derivatives;
+	double* common_terms;
+	double* recurrent_terms; /* A GRUs new gate sees less of the last outputs than the previous layer */
+	double* gates;
+	double* prev_outputs;
+	double* partial_derivatives;
+	double* next_layer_derivatives;
+	size_t chunk_size;
+	size_t num_chunks;
+	size_t layer_index;
+	size_t* set_inputs; /* Only set for binary inputs to the first layer */
+	size_t num_set_inputs;
+	double* input_signs; /* A binary layers inputs as +-1, times its scale */
+	double* carried; /* dCn/dh then dCn/dc from the step after, replaced with this steps for the step before */
+} layer_backward_pass;
+
+static void backpropogate_neuron_chunks(size_t start, size_t end, void* arg) {
+	layer_backward_pass* pass = arg;
+	layer* curr_layer = pass->curr_layer;
+	layer* prev_layer = pass->prev_layer;
+	layer_training* training = &curr_layer->training;
+
+	for(size_t chunk = start; chunk < end; chunk += 1) {
+		perf_sample sample;
+		if(perf_enabled) {
+			perf_begin(&sample);
+		}
 
-	/* Base case: we don't need to propogate the input layer. */
-	if(layer_index == 0) {
-		return;
-	}
+		/* Each chunk sums its contribution to the previous layers derivatives separately */
+		double* next_layer_derivatives = &pass->partial_derivatives[chunk * prev_layer->num_neurons];
+		bzero(next_layer_derivatives, sizeof(double) * prev_layer->num_neurons);
 
-	/* Get the current and previous network layer */
-	layer* curr_layer = &network->layers[layer_index];
-	layer* prev_layer = &network->layers[layer_index-1];
+		size_t first_neuron = chunk * pass->chunk_size;
+		size_t last_neuron = first_neuron + pass->chunk_size > curr_layer->num_neurons ? curr_layer->num_neurons : first_neuron + pass->chunk_size;
 
-	/* Create and zero an array for the next layers derivatives */
-	double* next_layer_derivatives = malloc(sizeof(double) * prev_layer->num_neurons);
-	if(!next_layer_derivatives) {
-		error("Failed to allocate next layer derivatives\n");
-		return;
-	}
+		/* Calculate the common derivative term - dCn/dz, where z is the weighted sum of each neuron */
+		for(size_t i = first_neuron; i < last_neuron; i += 1) {
+			neuron* curr_neuron = &curr_layer->layer_neurons[i];
+			pass->common_terms[i] = pass->neuron_derivatives[i] * activation_functions[curr_neuron->activation_index].activation_derivative(pass->sums[i]);
+		}
 
-	bzero(next_layer_derivatives, sizeof(double) * prev_layer->num_neurons);
+		/* Calculate dCn/dWj (the common term multiplied by the previous layers output) and each neurons contribution to dCn/dAj */
+		if(pass->set_inputs) {
 
-	/* Loop through all the neurons in our layer */
-	for(int i = 0; i < curr_layer->num_neurons; i += 1) {
-		neuron* curr_neuron = &curr_layer->layer_neurons[i];
+			/* Unset inputs have no derivative, and nothing needs the inputs own derivatives */
+			for(size_t i = first_neuron; i < last_neuron; i += 1) {
+				double* row_derivatives = &training->weight_derivatives[i * prev_layer->num_neurons];
+				for(size_t j = 0; j < pass->num_set_inputs; j += 1) {
+					row_derivatives[pass->set_inputs[j]] += pass->common_terms[i];
+				}
+			}
+		}
+		else {
+			kernel_choice kernel = curr_layer->kernels.backward;
+			kernel_variants[kernel.variant].backward(curr_layer->layer_neurons, first_neuron, last_neuron, pass->common_terms, pass->prev_outputs, next_layer_derivatives, training->weight_derivatives, prev_layer->num_neurons, kernel.tile);
+		}
 
-		/* Calculate the common derivative term - dCn/dz, where z is the weighted sum of our current neuron */
-		double common_derivative_term = neuron_derivatives[i];
-		common_derivative_term *= activation_functions[curr_neuron->activation_index].activation_derivative(curr_neuron->weighted_sum);
+		for(size_t i = first_neuron; i < last_neuron; i += 1) {
 
-		/* Loop through the previous layers neurons */
-		for(int j = 0; j < prev_layer->num_neurons; j += 1) {
+			/* Calculate the current neurons bias derivative - dCn/db */
+			training->bias_derivatives[i] += 1 * pass->common_terms[i];
 
-			/* First calculate  dCn/dWj, which is just the common derivative term multiplied by the previous layers output */
-			curr_neuron->weight_derivatives[j] += common_derivative_term * prev_layer->layer_neurons[j].output;
+			/* If this is a recurrent network calculate the derivative for the recurrent weight - dCn/dWh */
+			if(curr_layer->recurrent) {
+				training->recurrent_weight_derivatives[i] += pass->common_terms[i] * pass->history[i];
+			}
+		}
 
-			/* Next, work out this neurons contribution to the previous neurons derivative dCn/dAj */
-			next_layer_derivatives[j] += common_derivative_term * curr_neuron->weights[j];
+		/* Two multiply and adds per weight, reading the weight and reading and writing its derivative */
+		if(perf_enabled) {
+			uint64_t num_weights = (last_neuron - first_neuron) * (pass->set_inputs ? pass->num_set_inputs : prev_layer->num_neurons);
+			perf_end(&sample, PERF_BACKWARD, pass->layer_index, num_weights * 4, num_weights * sizeof(double) * 3);
 		}
+	}
+}
 
-		/* Calculate the current neurons bias derivative - dCn/db */
-		curr_neuron->bias_derivative += 1 * common_derivative_term;
+static void reduce_partial_derivatives(size_t start, size_t end, void* arg) {
+	layer_backward_pass* pass = arg;
+	size_t num_prev_neurons = pass->prev_layer->num_neurons;
 
-		/* If this is a recurrent network calculate the derivative for the recurrent weight - dCn/dWh */
-		if(curr_layer->recurrent) {
-			curr_neuron->recurrent_weight_derivative += common_derivative_term * curr_neuron->recurrent_history;
+	/* Sum every chunks contribution to each of the previous layers neurons */
+	for(size_t j = start; j < end; j += 1) {
+		double sum = 0;
+		for(size_t chunk = 0; chunk < pass->num_chunks; chunk += 1) {
+			sum += pass->partial_derivatives[chunk * num_prev_neurons + j];
 		}
+		pass->next_layer_derivatives[j] = sum;
+	}
+}
+
+static void backpropogate_layer(neural_network* network, int layer_index, double* neuron_derivatives);
+
+/* Each channels filter derivatives, summed over every position it was applied at */
+static void backpropogate_conv_filters(size_t start, size_t end, void* arg) {
+	layer_backward_pass* pass = arg;
+	conv_layer* conv = &pass->curr_layer->conv;
+	layer_training* training = &pass->curr_layer->training;
+	size_t row_len = conv->in_channels * conv->kernel_size;
 
+	perf_sample sample;
+	if(perf_enabled) {
+		perf_begin(&sample);
 	}
 
-	/* Propogate the previous layer and free our derivatives buffer */
-	backpropogate_layer(network, layer_index - 1, next_layer_derivatives);
-	free(next_layer_derivatives);
+	for(size_t c = start; c < end; c += 1) {
+		double* filter_derivatives = &training->weight_derivatives[c * row_len];
 
-}
+		for(size_t p = 0; p < conv->width; p += 1) {
+			double common_term = pass->common_terms[c * conv->width + p];
+			double* window = &pass->prev_outputs[p * conv->stride];
 
+			/* dCn/db and dCn/dWj, as for a dense neuron */
+			training->bias_derivatives[c] += common_term;
+			for(size_t ic = 0; ic < conv->in_channels; ic += 1) {
+				for(size_t k = 0; k < conv->kernel_size; k += 1) {
+					filter_derivatives[ic * conv->kernel_size + k] += common_term * window[ic * conv->in_width + k];
+				}
+			}
+		}
+	}
 
-static void backpropogate_network(neural_network* network, double* expected_output) {
-	
-	/* To initialise the back propogation we need to create a neuron_derivatives array, which contains DCn/DA */
-	layer* output_layer = &network->layers[network->num_layers - 1];
-	
-	double* input_derivatives = malloc(sizeof(double) * output_layer->num_neurons);
-	if(!input_derivatives) {
-		error("Failed to allocate input derivatives\n");
-		return;
+	/* A multiply and add per filter weight at every position */
+	if(perf_enabled) {
+		uint64_t num_weights = (end - start) * conv->width * row_len;
+		perf_end(&sample, PERF_BACKWARD, pass->layer_index, num_weights * 2, num_weights * sizeof(double));
 	}
+}
 
-	/* Get the derivative of the cost function with respect to the activation function for each output neuron */
-	for(int i = 0; i < output_layer->num_neurons; i += 1) {
-		input_derivatives[i] = cost_derivative(output_layer->layer_neurons[i].output, expected_output[i]);
+/* Gather dCn/dAj for each previous neuron from every output whose window covers it, so no two threads write the same value */
+static void backpropogate_conv_inputs(size_t start, size_t end, void* arg) {
+	layer_backward_pass* pass = arg;
+	conv_layer* conv = &pass->curr_layer->conv;
+	size_t row_len = conv->in_channels * conv->kernel_size;
+	uint64_t num_weights = 0;
+
+	perf_sample sample;
+	if(perf_enabled) {
+		perf_begin(&sample);
 	}
 
+	for(size_t j = start; j < end; j += 1) {
+		size_t ic = j / conv->in_width;
+		size_t x = j % conv->in_width;
+		double sum = 0;
 
-	/* Start backpropogation */
-	backpropogate_layer(network, network->num_layers - 1, input_derivatives);
+		for(size_t k = 0; k < conv->kernel_size && k <= x; k += 1) {
+
+			/* Only positions on the stride read this input with filter weight k */
+			if((x - k) % conv->stride != 0 || (x - k) / conv->stride >= conv->width) {
+				continue;
+			}
+			size_t p = (x - k) / conv->stride;
+
+			for(size_t c = 0; c < conv->channels; c += 1) {
+				sum += pass->common_terms[c * conv->width + p] * conv->filters[c * row_len + ic * conv->kernel_size + k];
+			}
+			num_weights += conv->channels;
+		}
+		pass->next_layer_derivatives[j] = sum;
+	}
+
+	/* A multiply and add per filter weight covering each input */
+	if(perf_enabled) {
+		perf_end(&sample, PERF_BACKWARD, pass->layer_index, num_weights * 2, num_weights * sizeof(double));
+	}
+}
+
+static void backpropogate_conv_layer(neural_network* network, int layer_index, double* neuron_derivatives) {
+	layer_backward_pass pass;
+	pass.curr_layer = &network->layers[layer_index];
+	pass.prev_layer = &network->layers[layer_index-1];
+	pass.prev_outputs = network->context->outputs[layer_index-1];
+	pass.sums = network->context->sums[layer_index];
+	pass.layer_index = layer_index;
+
+	conv_layer* conv = &pass.curr_layer->conv;
+	size_t row_len = conv->in_channels * conv->kernel_size;
+
+	pass.common_terms = network->context->common_terms[layer_index];
+	pass.next_layer_derivatives = network->context->derivatives[layer_index-1];
+
+	perf_sample sample;
+	if(perf_enabled) {
+		perf_begin(&sample);
+	}
+
+	/* Calculate the common derivative term - dCn/dz, where z is the weighted sum of each output */
+	for(size_t i = 0; i < pass.curr_layer->num_neurons; i += 1) {
+		neuron* curr_neuron = &pass.curr_layer->layer_neurons[i];
+		pass.common_terms[i] = neuron_derivatives[i] * activation_functions[curr_neuron->activation_index].activation_derivative(pass.sums[i]);
+	}
+
+	thread_pool* pool = thread_pool_global();
+	thread_pool_parallel_for(pool, conv->channels, neuron_grain(row_len * conv->width), backpropogate_conv_filters, &pass);
+	thread_pool_parallel_for(pool, pass.prev_layer->num_neurons, neuron_grain(conv->channels * conv->kernel_size), backpropogate_conv_inputs, &pass);
+
+	if(perf_enabled) {
+		perf_add_wall(&sample, PERF_BACKWARD, layer_index);
+	}
+
+	/* Propogate the previous layer */
+	backpropogate_layer(network, layer_index - 1, pass.next_layer_derivatives);
+}
+
+/*
+ * Work out dCn/dz for every gate row. The derivatives carried back from the step after add to the outputs and cell
+ * state, and the part of them that flows straight through to the last outputs and cell state is carried on, the
+ * rest is added through the recurrent weights once the terms are known.
+ */
+static void gated_common_terms(layer_backward_pass* pass) {
+	layer* curr_layer = pass->curr_layer;
+	size_t num_neurons = curr_layer->num_neurons;
+	double* gates = pass->gates;
+	double* terms = pass->common_terms;
+	double* carried = pass->carried;
+
+	if(curr_layer->type == LAYER_LSTM) {
+		double* cell = &pass->history[num_neurons];
+
+		for(size_t i = 0; i < num_neurons; i += 1) {
+			double input_gate = gates[i];
+			double forget_gate = gates[num_neurons + i];
+			double cell_gate = gates[2 * num_neurons + i];
+			double output_gate = gates[3 * num_neurons + i];
+			double new_cell = tanh(gates[4 * num_neurons + i]);
+			double output_derivative = pass->neuron_derivatives[i] + (carried ? carried[i] : 0);
+
+			/* dCn/dc through the output and from the next step, then back through each gate */
+			double cell_derivative = output_derivative * output_gate * (1 - new_cell * new_cell) + (carried ? carried[num_neurons + i] : 0);
+
+			terms[i] = cell_derivative * cell_gate * input_gate * (1 - input_gate);
+			terms[num_neurons + i] = cell_derivative * cell[i] * forget_gate * (1 - forget_gate);
+			terms[2 * num_neurons + i] = cell_derivative * input_gate * (1 - cell_gate * cell_gate);
+			terms[3 * num_neurons + i] = output_derivative * new_cell * output_gate * (1 - output_gate);
+
+			/* The last cell state only reaches the new one through the forget gate */
+			if(carried) {
+				carried[i] = 0;
+				carried[num_neurons + i] = cell_derivative * forget_gate;
+			}
+		}
+		memcpy(pass->recurrent_terms, terms, sizeof(double) * num_neurons * LSTM_GATES);
+		return;
+	}
+
+	for(size_t i = 0; i < num_neurons; i += 1) {
+		double reset_gate = gates[i];
+		double update_gate = gates[num_neurons + i];
+		double new_gate = gates[2 * num_neurons + i];
+		double output_derivative = pass->neuron_derivatives[i] + (carried ? carried[i] : 0);
+
+		/* The output mixes the new gate with the last output by the update gate */
+		double new_term = output_derivative * (1 - update_gate) * (1 - new_gate * new_gate);
+
+		terms[i] = new_term * gates[3 * num_neurons + i] * reset_gate * (1 - reset_gate);
+		terms[num_neurons + i] = output_derivative * (pass->history[i] - new_gate) * update_gate * (1 - update_gate);
+		terms[2 * num_neurons + i] = new_term;
+
+		if(carried) {
+			carried[i] = output_derivative * update_gate;
+		}
+
+		pass->recurrent_terms[i] = terms[i];
+		pass->recurrent_terms[num_neurons + i] = terms[num_neurons + i];
+		pass->recurrent_terms[2 * num_neurons + i] = new_term * reset_gate;
+	}
+}
+
+/* dCn/dWj and dCn/db for a range of gate rows, each row only written by one thread */
+static void backpropogate_gate_rows(size_t start, size_t end, void* arg) {
+	layer_backward_pass* pass = arg;
+	gated_layer* gated = &pass->curr_layer->gated;
+	layer_training* training = &pass->curr_layer->training;
+	size_t num_neurons = pass->curr_layer->num_neurons;
+	size_t row_len = gated->num_inputs + num_neurons;
+
+	perf_sample sample;
+	if(perf_enabled) {
+		perf_begin(&sample);
+	}
+
+	for(size_t row = start; row < end; row += 1) {
+		double* weight_derivatives = &training->weight_derivatives[row * row_len];
+		double input_term = pass->common_terms[row];
+		double recurrent_term = pass->recurrent_terms[row];
+
+		for(size_t k = 0; k < gated->num_inputs; k += 1) {
+			weight_derivatives[k] += input_term * pass->prev_outputs[k];
+		}
+		for(size_t k = 0; k < num_neurons; k += 1) {
+			weight_derivatives[gated->num_inputs + k] += recurrent_term * pass->history[k];
+		}
+		training->bias_derivatives[row] += input_term;
+	}
 
-	/* Free our input derivatives */
-	free(input_derivatives);
+	/* A multiply and add per weight, reading and writing its derivative */
+	if(perf_enabled) {
+		uint64_t num_weights = (end - start) * row_len;
+		perf_end(&sample, PERF_BACKWARD, pass->layer_index, num_weights * 2, num_weights * sizeof(double) * 2);
+	}
+}
+
+/* Gather dCn/dAj for a range of previous neurons from every gate row, then dCn/dh of the last outputs through the recurrent weights */
+static void backpropogate_gate_inputs(size_t start, size_t end, void* arg) {
+	layer_backward_pass* pass = arg;
+	gated_layer* gated = &pass->curr_layer->gated;
+	size_t num_rows = layer_rows(pass->curr_layer);
+	size_t row_len = gated->num_inputs + pass->curr_layer->num_neurons;
+
+	perf_sample sample;
+	if(perf_enabled) {
+		perf_begin(&sample);
+	}
+
+	for(size_t j = start; j < end; j += 1) {
+		double* terms = j < gated->num_inputs ? pass->common_terms : pass->recurrent_terms;
+		double sum = 0;
+		for(size_t row = 0; row < num_rows; row += 1) {
+			sum += terms[row] * gated->weights[row * row_len + j];
+		}
+
+		if(j < gated->num_inputs) {
+			pass->next_layer_derivatives[j] = sum;
+		}
+		else {
+			pass->carried[j - gated->num_inputs] += sum;
+		}
+	}
+
+	if(perf_enabled) {
+		uint64_t num_weights = (end - start) * num_rows;
+		perf_end(&sample, PERF_BACKWARD, pass->layer_index, num_weights * 2, num_weights * sizeof(double));
+	}
+}
+
+static void backpropogate_gated_layer(neural_network* network, int layer_index, double* neuron_derivatives) {
+	layer_backward_pass pass;
+	pass.curr_layer = &network->layers[layer_index];
+	pass.prev_layer = &network->layers[layer_index-1];
+	pass.neuron_derivatives = neuron_derivatives;
+	pass.layer_index = layer_index;
+	pass.prev_outputs = network->context->outputs[layer_index-1];
+	pass.history = network->context->history[layer_index];
+	pass.gates = network->context->gates[layer_index];
+
+	size_t num_rows = layer_rows(pass.curr_layer);
+	size_t row_len = layer_row_len(network, layer_index);
+
+	pass.common_terms = network->context->common_terms[layer_index];
+	pass.next_layer_derivatives = network->context->derivatives[layer_index-1];
+	pass.recurrent_terms = &pass.common_terms[num_rows];
+	pass.carried = network->context->carried ? network->context->carried[layer_index] : NULL;
+
+	perf_sample sample;
+	if(perf_enabled) {
+		perf_begin(&sample);
+	}
+
+	gated_common_terms(&pass);
+
+	/* The last outputs take their derivatives from the recurrent weights, after the previous layers */
+	size_t num_columns = pass.prev_layer->num_neurons + (pass.carried ? pass.curr_layer->num_neurons : 0);
+
+	thread_pool* pool = thread_pool_global();
+	thread_pool_parallel_for(pool, num_rows, neuron_grain(row_len), backpropogate_gate_rows, &pass);
+	thread_pool_parallel_for(pool, num_columns, neuron_grain(num_rows), backpropogate_gate_inputs, &pass);
+
+	if(perf_enabled) {
+		perf_add_wall(&sample, PERF_BACKWARD, layer_index);
+	}
+
+	/* Propogate the previous layer */
+	backpropogate_layer(network, layer_index - 1, pass.next_layer_derivatives);
+}
+
+/* Only the rows looked up on this step get a derivative, and there's nothing to pass back to the input */
+static void backpropogate_embedding_layer(neural_network* network, int layer_index, double* neuron_derivatives) {
+	layer* curr_layer = &network->layers[layer_index];
+	embedding_layer* embedding = &curr_layer->embedding;
+	double* inputs = network->context->outputs[layer_index-1];
+
+	perf_sample sample;
+	if(perf_enabled) {
+		perf_begin(&sample);
+	}
+
+	/* Inputs can repeat a byte, so this stays on one thread */
+	for(size_t i = 0; i < network->layers[layer_index-1].num_neurons; i += 1) {
+		size_t row = embedding_row(inputs[i]);
+		double* row_derivatives = &curr_layer->training.weight_derivatives[row * embedding->dim];
+		curr_layer->training.touched_rows[row / 64] |= 1ULL << (row % 64);
+
+		for(size_t k = 0; k < embedding->dim; k += 1) {
+			row_derivatives[k] += neuron_derivatives[i * embedding->dim + k];
+		}
+	}
+
+	if(perf_enabled) {
+		uint64_t num_weights = curr_layer->num_neurons;
+		perf_end(&sample, PERF_BACKWARD, layer_index, num_weights, num_weights * sizeof(double) * 3);
+		perf_add_wall(&sample, PERF_BACKWARD, layer_index);
+	}
+}
+
+/* dCn/dWj and dCn/db for a range of binary rows, passing straight through the sign of each weight */
+static void backpropogate_binary_rows(size_t start, size_t end, void* arg) {
+	layer_backward_pass* pass = arg;
+	layer_training* training = &pass->curr_layer->training;
+	size_t num_inputs = pass->prev_layer->num_neurons;
+
+	perf_sample sample;
+	if(perf_enabled) {
+		perf_begin(&sample);
+	}
+
+	size_t num_rows = 0;
+	for(size_t i = start; i < end; i += 1) {
+		double common_term = pass->common_terms[i];
+
+		/* Rows whose sums were outside the estimators range have nothing to add */
+		if(common_term == 0) {
+			continue;
+		}
+
+		double* row_derivatives = &training->weight_derivatives[i * num_inputs];
+		for(size_t j = 0; j < num_inputs; j += 1) {
+			row_derivatives[j] += common_term * pass->input_signs[j];
+		}
+		training->bias_derivatives[i] += common_term;
+		num_rows += 1;
+	}
+
+	/* A multiply and add per weight of the rows that had a derivative */
+	if(perf_enabled) {
+		uint64_t num_weights = num_rows * num_inputs;
+		perf_end(&sample, PERF_BACKWARD, pass->layer_index, num_weights * 2, num_weights * sizeof(double) * 2);
+	}
+}
+
+/* Gather dCn/dAj for a range of previous neurons from the signs of every row */
+static void backpropogate_binary_inputs(size_t start, size_t end, void* arg) {
+	layer_backward_pass* pass = arg;
+	binary_layer* binary = &pass->curr_layer->binary;
+
+	/* An input of 1 stands for +1 and 0 for -1, so each is worth twice its sign */
+	double input_scale = 2 * binary->scale;
+
+	for(size_t j = start; j < end; j += 1) {
+		double sum = 0;
+		for(size_t i = 0; i < pass->curr_layer->num_neurons; i += 1) {
+			uint64_t sign = (binary->signs[i * binary->words + j / 64] >> (j % 64)) & 1;
+			sum += sign ? pass->common_terms[i] : -pass->common_terms[i];
+		}
+		pass->next_layer_derivatives[j] = sum * input_scale;
+	}
+}
+
+/* The sign of a sum has no useful derivative, so it's passed straight through while the sum is within +-1 */
+static void backpropogate_binary_layer(neural_network* network, int layer_index, double* neuron_derivatives) {
+	layer_backward_pass pass;
+	pass.curr_layer = &network->layers[layer_index];
+	pass.prev_layer = &network->layers[layer_index-1];
+	pass.layer_index = layer_index;
+	pass.sums = network->context->sums[layer_index];
+
+	binary_layer* binary = &pass.curr_layer->binary;
+	double* prev_outputs = network->context->outputs[layer_index-1];
+
+	pass.common_terms = network->context->common_terms[layer_index];
+	pass.input_signs = network->context->input_signs[layer_index];
+	pass.next_layer_derivatives = network->context->derivatives[layer_index-1];
+
+	perf_sample sample;
+	if(perf_enabled) {
+		perf_begin(&sample);
+	}
+
+	/* An output of 1 or 0 is half the sign of the sum plus a half */
+	for(size_t i = 0; i < pass.curr_layer->num_neurons; i += 1) {
+		pass.common_terms[i] = fabs(pass.sums[i]) <= 1 ? neuron_derivatives[i] * 0.5 : 0;
+	}
+
+	/* The weights only ever see their inputs signs */
+	for(size_t j = 0; j < pass.prev_layer->num_neurons; j += 1) {
+		pass.input_signs[j] = prev_outputs[j] >= BINARY_THRESHOLD ? binary->scale : -binary->scale;
+	}
+
+	thread_pool* pool = thread_pool_global();
+	thread_pool_parallel_for(pool, pass.curr_layer->num_neurons, neuron_grain(pass.prev_layer->num_neurons), backpropogate_binary_rows, &pass);
+
+	/* The input layer has no use for its derivatives */
+	if(layer_index > 1) {
+		thread_pool_parallel_for(pool, pass.prev_layer->num_neurons, neuron_grain(pass.curr_layer->num_neurons), backpropogate_binary_inputs, &pass);
+	}
+
+	if(perf_enabled) {
+		perf_add_wall(&sample, PERF_BACKWARD, layer_index);
+	}
+
+	/* Propogate the previous layer */
+	backpropogate_layer(network, layer_index - 1, pass.next_layer_derivatives);
+}
+
+static void backpropogate_layer(neural_network* network, int layer_index, double* neuron_derivatives) {
+
+	/* Base case: we don't need to propogate the input layer. */
+	if(layer_index == 0) {
+		return;
+	}
+
+	/* Convolutions share their filters, so they have passes of their own */
+	if(network->layers[layer_index].type == LAYER_CONV1D) {
+		backpropogate_conv_layer(network, layer_index, neuron_derivatives);
+		return;
+	}
+
+	/* Embeddings only look up rows */
+	if(network->layers[layer_index].type == LAYER_EMBEDDING) {
+		backpropogate_embedding_layer(network, layer_index, neuron_derivatives);
+		return;
+	}
+
+	/* Binary layers sum signs rather than weights */
+	if(network->layers[layer_index].type == LAYER_BINARY) {
+		backpropogate_binary_layer(network, layer_index, neuron_derivatives);
+		return;
+	}
+
+	/* As do gated layers, whose gates share one matrix */
+	if(is_gated(&network->layers[layer_index])) {
+		backpropogate_gated_layer(network, layer_index, neuron_derivatives);
+		return;
+	}
+
+	/* Get the current and previous network layer */
+	layer_backward_pass pass;
+	pass.curr_layer = &network->layers[layer_index];
+	pass.prev_layer = &network->layers[layer_index-1];
+	pass.neuron_derivatives = neuron_derivatives;
+	pass.layer_index = layer_index;
+
+	/* The activations from the forward pass */
+	pass.prev_outputs = network->context->outputs[layer_index-1];
+	pass.sums = network->context->sums[layer_index];
+	pass.history = network->context->history[layer_index];
+	pass.set_inputs = layer_index == 1 && network->context->binary_inputs ? network->context->set_inputs : NULL;
+	pass.num_set_inputs = network->context->num_set_inputs;
+
+	/* Wide layers are split into a chunk of neurons per worker, narrow ones are a single chunk on this thread */
+	thread_pool* pool = thread_pool_global();
+	pass.num_chunks = backward_chunks(pass.curr_layer, pass.prev_layer);
+
+	/* A pool that's grown since the context was planned has no room planned for more chunks, so use just the one */
+	if(pass.num_chunks > 1 && !network->context->partial_derivatives[layer_index]) {
+		pass.num_chunks = 1;
+	}
+	pass.chunk_size = (pass.curr_layer->num_neurons + pass.num_chunks - 1) / pass.num_chunks;
+
+	pass.next_layer_derivatives = network->context->derivatives[layer_index-1];
+	pass.common_terms = network->context->common_terms[layer_index];
+
+	/* With a single chunk we can sum straight into the next layers derivatives */
+	pass.partial_derivatives = pass.num_chunks > 1 ? network->context->partial_derivatives[layer_index] : pass.next_layer_derivatives;
+
+	/* Pick the fastest kernel for this layer shape */
+	if(!pass.curr_layer->kernels.backward_tuned) {
+		pass.curr_layer->kernels.backward = autotune_backward(pass.curr_layer->layer_neurons, pass.curr_layer->num_neurons, pass.curr_layer->training.weight_derivatives, pass.prev_outputs, pass.prev_layer->num_neurons);
+		pass.curr_layer->kernels.backward_tuned = true;
+	}
+
+	perf_sample sample;
+	if(perf_enabled) {
+		perf_begin(&sample);
+	}
+
+	thread_pool_parallel_for(pool, pass.num_chunks, 1, backpropogate_neuron_chunks, &pass);
+
+	if(pass.num_chunks > 1) {
+		if(!pass.set_inputs) {
+			thread_pool_parallel_for(pool, pass.prev_layer->num_neurons, PARALLEL_WEIGHT_GRAIN / pass.num_chunks, reduce_partial_derivatives, &pass);
+		}
+	}
+
+	if(perf_enabled) {
+		perf_add_wall(&sample, PERF_BACKWARD, layer_index);
+	}
+
+	/* Propogate the previous layer */
+	backpropogate_layer(network, layer_index - 1, pass.next_layer_derivatives);
+
+}
+
+
+static void backpropogate_network(neural_network* network, double* expected_output) {
+	
+	/* To initialise the back propogation we need to create a neuron_derivatives array, which contains DCn/DA */
+	layer* output_layer = &network->layers[network->num_layers - 1];
+	double* outputs = network->context->outputs[network->num_layers - 1];
+	
+	double* input_derivatives = network->context->derivatives[network->num_layers - 1];
+
+	/* Get the derivative of the cost function with respect to the activation function for each output neuron */
+	for(int i = 0; i < output_layer->num_neurons; i += 1) {
+		input_derivatives[i] = cost_derivative(outputs[i], expected_output[i]);
+	}
+
+
+	/* Start backpropogation */
+	backpropogate_layer(network, network->num_layers - 1, input_derivatives);
 
 	/* Increment the number of back propogations */
 	network->num_back_propogations += 1;
 
 }
 
+/* Backpropogate a window of kept steps from the last to the first, so gated layers can carry their derivatives back through it */
+static void backpropogate_steps(neural_network* network, double* expected_output, size_t* step_outputs, size_t num_steps) {
+	execution_context* context = network->context;
+	size_t block_size = sizeof(double) * context->block_len;
+	double* last_block = &context->step_blocks[context->block_len * BPTT_STEPS];
+
+	/* Keep the history the last step left, for the next window to carry on from */
+	memcpy(last_block, context->block, block_size);
+
+	/* Nothing comes back from after the window, which is where it's truncated */
+	for(int i = 0; i < network->num_layers; i += 1) {
+		if(context->carried[i]) {
+			bzero(context->carried[i], sizeof(double) * network->layers[i].num_neurons * 2);
+		}
+	}
+
+	for(size_t step = num_steps; step-- > 0;) {
+		memcpy(context->block, &context->step_blocks[context->block_len * step], block_size);
+		find_set_inputs(context);
+		backpropogate_network(network, &expected_output[step_outputs[step]]);
+	}
+
+	memcpy(context->block, last_block, block_size);
+}
+
 static void backpropogate_case(neural_network* network, test_case* test_case) {
 
 	/* Reset the networks history */
-	reset_history(network);
+	reset_history(network->context);
 
 	size_t input_offset = 0;
 	size_t output_offset = 0;
@@ -701,22 +2472,27 @@ static void backpropogate_case(neural_network* network, test_case* test_case) {
 	size_t input_len = test_case->input_len;
 	size_t output_len = test_case->output_len;
 
+	/* Where each kept step expects its outputs, when backpropogating through time */
+	size_t step_outputs[BPTT_STEPS];
+	size_t num_steps = 0;
+
 
 	/* While the input hasn't been pushed through */
 	while(input_len > 0) {
 
 		/* Calculate the amount to add and the amount to output on this forward pass */
 		size_t num_input_neurons = network->layers[0].num_neurons;
-		size_t num_output_neurons = network->layers[0].num_neurons;
+		size_t num_output_neurons = network->layers[network->num_layers-1].num_neurons;
 
 		size_t to_add = (input_len > num_input_neurons) ? num_input_neurons : input_len;
 		size_t to_output = (output_len > num_output_neurons) ? num_output_neurons : output_len;
 
 		/* Set out layer outputs */
-		set_layer_outputs(&test_case->input[input_offset], to_add, &network->layers[0]);
+		set_layer_outputs(&test_case->input[input_offset], to_add, network->context->outputs[0]);
+		find_set_inputs(network->context);
 
 		/* Propogate the network forward */
-		propogate_forward(network);
+		propogate_forward(network->context);
 
 #ifdef INFO
 		info("[*] Expected output: ");
@@ -727,11 +2503,18 @@ static void backpropogate_case(neural_network* network, test_case* test_case) {
 #endif
 		debug("[!] Case Cost: %f\n", network_cost(network, &test_case->expected_output[output_offset]));
 
-		/* Backpropogate */
-		backpropogate_network(network, &test_case->expected_output[output_offset]);
+		/* Backpropogate now, or keep the step to backpropogate with the rest of its window */
+		if(network->context->step_blocks) {
+			memcpy(&network->context->step_blocks[network->context->block_len * num_steps], network->context->block, sizeof(double) * network->context->block_len);
+			step_outputs[num_steps] = output_offset;
+			num_steps += 1;
+		}
+		else {
+			backpropogate_network(network, &test_case->expected_output[output_offset]);
+		}
 
 		/* Propogate the network history */
-		update_history(network);
+		update_history(network->context);
 
 		/* Update our variables */
 		input_len -= to_add;
@@ -739,41 +2522,408 @@ static void backpropogate_case(neural_network* network, test_case* test_case) {
 
 		output_len -= to_output;
 		output_offset += to_output;
+
+		if(num_steps == BPTT_STEPS || (num_steps > 0 && input_len == 0)) {
+			backpropogate_steps(network, test_case->expected_output, step_outputs, num_steps);
+			num_steps = 0;
+		}
 	}
 }
 
-void backpropogate_cases(neural_network* network, test_case* cases, size_t num_cases, double learn_rate) {
+/* Shadow weights past +-1 would never change sign again, so they're clipped after every update and the row repacked */
+static void update_binary_row(layer* curr_layer, size_t row, size_t row_len) {
+	double* weights = curr_layer->layer_neurons[row].weights;
+	for(size_t k = 0; k < row_len; k += 1) {
+		weights[k] = weights[k] > 1 ? 1 : (weights[k] < -1 ? -1 : weights[k]);
+	}
+	pack_binary_rows(curr_layer, row, row + 1, row_len);
+}
+
+static void update_neurons(size_t start, size_t end, void* arg) {
+	layer_update* update = arg;
+	layer_training* training = &update->curr_layer->training;
+
+	/* Loop through each row of weights we've been given */
+	for(size_t j = start; j < end; j += 1) {
+		double* weights = row_weights(update->curr_layer, j, update->num_weights);
+		double* weight_derivatives = &training->weight_derivatives[j * update->num_weights];
+
+		/* Loop through all the weights */
+		for(int k = 0; k < update->num_weights; k += 1) {
+
+			/* Nudge them by the negative of the average derivative, multiplied by the learn rate */
+			weights[k] -= weight_derivatives[k] * update->scale;
+		}
+
+		/* Nudge the bias and recurrent_weight by the negative of the average derivative, multiplied by the learn rate */
+		double* bias = row_bias(update->curr_layer, j);
+		if(bias) {
+			*bias -= training->bias_derivatives[j] * update->scale;
+		}
+		if(update->curr_layer->type == LAYER_DENSE) {
+			update->curr_layer->layer_neurons[j].recurrent_weight -= training->recurrent_weight_derivatives[j] * update->scale;
+		}
+		if(update->curr_layer->type == LAYER_BINARY) {
+			update_binary_row(update->curr_layer, j, update->num_weights);
+		}
+	}
+}
+
+static neural_network* create_replica(neural_network* network) {
+
+	/* Allocate our replica, cleared so a partially built replica can be freed */
+	neural_network* replica = malloc(sizeof(neural_network));
+	if(!replica) {
+		error("Failed to allocate network replica\n");
+		return NULL;
+	}
+	bzero(replica, sizeof(neural_network));
+
+	replica->replica_of = network;
+	replica->num_layers = network->num_layers;
+	replica->num_weights = network->num_weights;
+	replica->inference_only = network->inference_only;
+
+	replica->layers = malloc(sizeof(layer) * network->num_layers);
+	if(!replica->layers) {
+		error("Failed to allocate replica layers\n");
+		free(replica);
+		return NULL;
+	}
+	bzero(replica->layers, sizeof(layer) * network->num_layers);
+
+	for(int i = 0; i < network->num_layers; i += 1) {
+		layer* curr_layer = &network->layers[i];
+		layer* replica_layer = &replica->layers[i];
+
+		replica_layer->layer_neurons = malloc(sizeof(neuron) * curr_layer->num_neurons);
+		if(!replica_layer->layer_neurons) {
+			error("Failed to allocate replica neurons\n");
+			free_neural_network(replica);
+			return NULL;
+		}
+
+		/* Start with a copy of every neuron, which shares its weights array with the original */
+		memcpy(replica_layer->layer_neurons, curr_layer->layer_neurons, sizeof(neuron) * curr_layer->num_neurons);
+		replica_layer->num_neurons = curr_layer->num_neurons;
+		replica_layer->recurrent = curr_layer->recurrent;
+		replica_layer->type = curr_layer->type;
+		replica_layer->conv = curr_layer->conv;
+		replica_layer->gated = curr_layer->gated;
+		replica_layer->embedding = curr_layer->embedding;
+		replica_layer->binary = curr_layer->binary;
+		replica_layer->kernels = curr_layer->kernels;
+	}
+
+	/* Each replica needs its own weighted sums and derivatives */
+	if(ensure_training_state(replica) != 0) {
+		free_neural_network(replica);
+		return NULL;
+	}
+
+	return replica;
+}
+
+/* Make sure we've got at least num_replicas replicas to train with */
+static int ensure_replicas(neural_network* network, size_t num_replicas) {
+	if(network->num_replicas >= num_replicas) {
+		return 0;
+	}
+
+	neural_network** replicas = realloc(network->replicas, sizeof(neural_network*) * num_replicas);
+	if(!replicas) {
+		error("Failed to allocate network replicas\n");
+		return -1;
+	}
+	network->replicas = replicas;
+
+	while(network->num_replicas < num_replicas) {
+		replicas[network->num_replicas] = create_replica(network);
+		if(!replicas[network->num_replicas]) {
+			return -1;
+		}
+		network->num_replicas += 1;
+	}
+	return 0;
+}
+
+/* Bring a replicas biases and recurrent weights up to date, its weights are shared so always are */
+static void sync_replica(neural_network* replica) {
+	neural_network* network = replica->replica_of;
+
+	for(int i = 1; i < network->num_layers; i += 1) {
+		for(int j = 0; j < network->layers[i].num_neurons; j += 1) {
+			neuron* curr_neuron = &network->layers[i].layer_neurons[j];
+			neuron* replica_neuron = &replica->layers[i].layer_neurons[j];
+
+			replica_neuron->bias = curr_neuron->bias;
+			replica_neuron->recurrent_weight = curr_neuron->recurrent_weight;
+		}
+	}
+}
+
+/* The i'th case to train on, in sampler order when we have one */
+static test_case* training_case(test_case* cases, size_t* indices, size_t i) {
+	return indices ? &cases[indices[i]] : &cases[i];
+}
+
+typedef struct {
+	neural_network* network;
+	test_case* cases;
+	size_t* indices;
+	size_t num_cases;
+	size_t num_replicas;
+	double learn_rate;
+	size_t batch_size;
+} replica_training;
+
+/* Each replica gets a contiguous share of the cases, so the result is independent of scheduling */
+static void replica_case_range(replica_training* training, size_t replica_index, size_t* first, size_t* last) {
+	*first = (training->num_cases * replica_index) / training->num_replicas;
+	*last = (training->num_cases * (replica_index + 1)) / training->num_replicas;
+}
+
+static void accumulate_replicas(size_t start, size_t end, void* arg) {
+	replica_training* training = arg;
+
+	for(size_t r = start; r < end; r += 1) {
+		neural_network* replica = training->network->replicas[r];
+
+		sync_replica(replica);
+		reset_derivatives(replica);
+
+		size_t first, last;
+		replica_case_range(training, r, &first, &last);
+
+		for(size_t i = first; i < last; i += 1) {
+			backpropogate_case(replica, training_case(training->cases, training->indices, i));
+		}
+	}
+}
+
+typedef struct {
+	neural_network* network;
+	size_t layer_index;
+	size_t num_replicas;
+} replica_reduction;
+
+static void reduce_replica_derivatives(size_t start, size_t end, void* arg) {
+	replica_reduction* reduction = arg;
+	neural_network* network = reduction->network;
+	size_t num_weights = layer_row_len(network, reduction->layer_index);
+
+	layer_training* training = &network->layers[reduction->layer_index].training;
+	bool embedding = network->layers[reduction->layer_index].type == LAYER_EMBEDDING;
+
+	for(size_t j = start; j < end; j += 1) {
+		if(embedding && !row_touched(training, j)) {
+			continue;
+		}
+		double* weight_derivatives = &training->weight_derivatives[j * num_weights];
+
+		/* Sum the replicas in order so the result doesn't depend on the thread count */
+		for(size_t r = 0; r < reduction->num_replicas; r += 1) {
+			layer_training* replica_training = &network->replicas[r]->layers[reduction->layer_index].training;
+			double* replica_derivatives = &replica_training->weight_derivatives[j * num_weights];
+
+			for(size_t k = 0; k < num_weights; k += 1) {
+				weight_derivatives[k] += replica_derivatives[k];
+			}
+			training->bias_derivatives[j] += replica_training->bias_derivatives[j];
+			training->recurrent_weight_derivatives[j] += replica_training->recurrent_weight_derivatives[j];
+		}
+	}
+}
+
+/* How many replicas to split a set of cases over */
+static size_t num_training_replicas(neural_network* network, size_t num_cases) {
+	thread_pool* pool = thread_pool_global();
+	size_t num_workers = pool ? pool->num_workers : 1;
+
+	/* Networks trained alongside others only get their share of the workers */
+	if(network->max_replicas && network->max_replicas < num_workers) {
+		num_workers = network->max_replicas;
+	}
+	return num_cases < num_workers ? num_cases : num_workers;
+}
+
+int accumulate_derivatives(neural_network* network, test_case* cases, size_t* indices, size_t num_cases) {
+
+	/* Training state is only allocated when it's first needed */
+	if(ensure_training_state(network) != 0) {
+		return -1;
+	}
 
 	/* Reset the networks backpropogation variables */
 	reset_derivatives(network);
 
-	/* Backpropogate every case */
-	for(int i = 0; i < num_cases; i += 1) {
-		backpropogate_case(network, &cases[i]);
+	size_t num_replicas = num_training_replicas(network, num_cases);
+
+	/* With a single worker (or case) backpropogate every case on the network itself */
+	if(num_replicas < 2 || ensure_replicas(network, num_replicas) != 0) {
+		for(int i = 0; i < num_cases; i += 1) {
+			backpropogate_case(network, training_case(cases, indices, i));
+		}
+		return 0;
+	}
+
+	/* Otherwise split the cases between replicas, then sum their derivatives */
+	replica_training training = {.network=network, .cases=cases, .indices=indices, .num_cases=num_cases, .num_replicas=num_replicas};
+	thread_pool_parallel_for(thread_pool_global(), num_replicas, 1, accumulate_replicas, &training);
+
+	for(int i = 1; i < network->num_layers; i += 1) {
+		replica_reduction reduction = {.network=network, .layer_index=i, .num_replicas=num_replicas};
+
+		/* An embedding row has derivatives if any replica looked it up */
+		for(size_t r = 0; r < num_replicas && network->layers[i].type == LAYER_EMBEDDING; r += 1) {
+			for(size_t w = 0; w < EMBEDDING_ROWS / 64; w += 1) {
+				network->layers[i].training.touched_rows[w] |= network->replicas[r]->layers[i].training.touched_rows[w];
+			}
+		}
+
+		thread_pool_parallel_for(thread_pool_global(), layer_rows(&network->layers[i]), neuron_grain(layer_row_len(network, i) * num_replicas), reduce_replica_derivatives, &reduction);
+	}
+
+	for(size_t r = 0; r < num_replicas; r += 1) {
+		network->num_back_propogations += network->replicas[r]->num_back_propogations;
+	}
+	return 0;
+}
+
+void apply_derivatives(neural_network* network, double learn_rate) {
+
+	/* Nothing to apply if we've never accumulated anything */
+	if(!network->weight_derivatives) {
+		return;
 	}
 
 	debug("[!] Number of back propogations steps: %d\n", network->num_back_propogations);
 
 	/* Loop through each layer of the network, expect the input layer */
+	for(int i = 1; i < network->num_layers; i += 1) {
+		layer_update update = {.curr_layer=&network->layers[i], .num_weights=layer_row_len(network, i), .scale=learn_rate / network->num_back_propogations};
+
+		/* A batch only looks up a few rows of an embedding, so only they're updated */
+		if(update.curr_layer->type == LAYER_EMBEDDING) {
+			for(size_t row = 0; row < EMBEDDING_ROWS; row += 1) {
+				if(row_touched(&update.curr_layer->training, row)) {
+					update_neurons(row, row + 1, &update);
+				}
+			}
+			continue;
+		}
+
+		/* Split the neurons between the thread pool */
+		thread_pool_parallel_for(thread_pool_global(), layer_rows(update.curr_layer), neuron_grain(update.num_weights), update_neurons, &update);
+	}
+}
+
+void mark_embedding_rows(neural_network* network) {
+	for(int i = 1; i < network->num_layers; i += 1) {
+		layer* curr_layer = &network->layers[i];
+		if(curr_layer->type != LAYER_EMBEDDING) {
+			continue;
+		}
+
+		for(size_t row = 0; row < EMBEDDING_ROWS; row += 1) {
+			double* row_derivatives = &curr_layer->training.weight_derivatives[row * curr_layer->embedding.dim];
+			for(size_t k = 0; k < curr_layer->embedding.dim; k += 1) {
+				if(row_derivatives[k] != 0) {
+					curr_layer->training.touched_rows[row / 64] |= 1ULL << (row % 64);
+					break;
+				}
+			}
+		}
+	}
+}
+
+void backpropogate_cases(neural_network* network, test_case* cases, size_t num_cases, double learn_rate) {
+	backpropogate_batch(network, cases, NULL, num_cases, learn_rate);
+}
+
+/* Train on the cases picked out by indices, or the first num_indices cases in order if indices is NULL */
+void backpropogate_batch(neural_network* network, test_case* cases, size_t* indices, size_t num_indices, double learn_rate) {
+	if(accumulate_derivatives(network, cases, indices, num_indices) != 0) {
+		return;
+	}
+	apply_derivatives(network, learn_rate);
+}
+
+/* Apply a replicas derivatives straight to the shared weights, with no locking and skipping zero derivatives */
+static void apply_hogwild_update(neural_network* replica, double scale) {
+	neural_network* network = replica->replica_of;
+
 	for(int i = 1; i < network->num_layers; i += 1) {
 		layer* curr_layer = &network->layers[i];
+		size_t num_weights = layer_row_len(network, i);
 
-		/* Loop through each neuron of the network */
-		for(int j = 0; j < curr_layer->num_neurons; j += 1) {
-			neuron* curr_neuron = &curr_layer->layer_neurons[j];
+		layer_training* training = &replica->layers[i].training;
 
-			/* Loop through all the weights */
-			for(int k = 0; k < network->layers[i-1].num_neurons; k += 1) {
+		for(int j = 0; j < layer_rows(curr_layer); j += 1) {
+			if(curr_layer->type == LAYER_EMBEDDING && !row_touched(training, j)) {
+				continue;
+			}
+			double* weights = row_weights(curr_layer, j, num_weights);
+			double* weight_derivatives = &training->weight_derivatives[j * num_weights];
 
-				/* Nudge them by the negative of the average derivative, multiplied by the learn rate */
-				curr_neuron->weights[k] -= (curr_neuron->weight_derivatives[k] / network->num_back_propogations) * learn_rate;
+			for(size_t k = 0; k < num_weights; k += 1) {
+				double derivative = weight_derivatives[k];
+				if(derivative != 0) {
+					weights[k] -= derivative * scale;
+				}
 			}
 
-			/* Nudge the bias and recurrent_weight by the negative of the average derivative, multiplied by the learn rate */
-			curr_neuron->bias -= (curr_neuron->bias_derivative / network->num_back_propogations) * learn_rate;
-			curr_neuron->recurrent_weight -= (curr_neuron->recurrent_weight_derivative / network->num_back_propogations) * learn_rate;
+			double* bias = row_bias(curr_layer, j);
+			if(bias) {
+				*bias -= training->bias_derivatives[j] * scale;
+			}
+			if(curr_layer->type == LAYER_DENSE) {
+				curr_layer->layer_neurons[j].recurrent_weight -= training->recurrent_weight_derivatives[j] * scale;
+			}
+			if(curr_layer->type == LAYER_BINARY) {
+				update_binary_row(curr_layer, j, num_weights);
+			}
+		}
+	}
+}
+
+static void hogwild_replicas(size_t start, size_t end, void* arg) {
+	replica_training* training = arg;
+
+	for(size_t r = start; r < end; r += 1) {
+		neural_network* replica = training->network->replicas[r];
+
+		size_t first, last;
+		replica_case_range(training, r, &first, &last);
+
+		/* Update the shared weights after every batch, without waiting for any other replica */
+		for(size_t batch = first; batch < last; batch += training->batch_size) {
+			size_t batch_end = batch + training->batch_size > last ? last : batch + training->batch_size;
 
+			sync_replica(replica);
+			reset_derivatives(replica);
+
+			for(size_t i = batch; i < batch_end; i += 1) {
+				backpropogate_case(replica, training_case(training->cases, training->indices, i));
+			}
+
+			apply_hogwild_update(replica, training->learn_rate / replica->num_back_propogations);
 		}
 	}
+}
+
+void backpropogate_cases_hogwild(neural_network* network, test_case* cases, size_t* indices, size_t num_cases, double learn_rate, size_t batch_size) {
+
+	if(batch_size == 0) {
+		batch_size = 1;
+	}
+
+	/* Every worker gets a replica, even with a single worker we still update per batch */
+	size_t num_replicas = num_training_replicas(network, num_cases);
+	if(num_replicas == 0 || ensure_replicas(network, num_replicas) != 0) {
+		return;
+	}
 
+	replica_training training = {.network=network, .cases=cases, .indices=indices, .num_cases=num_cases, .num_replicas=num_replicas, .learn_rate=learn_rate, .batch_size=batch_size};
+	thread_pool_parallel_for(thread_pool_global(), num_replicas, 1, hogwild_replicas, &training);
 }
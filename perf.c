@@ -0,0 +1,199 @@
+#include <includes/common.h>
+#include <includes/perf.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+bool perf_enabled = false;
+
+/* Whether hardware counters can be used, otherwise we only keep time */
+static bool counters_available = false;
+
+static layer_profile profiles[2][PERF_MAX_LAYERS];
+
+static uint64_t counter_configs[PERF_NUM_COUNTERS] = {
+	PERF_COUNT_HW_CPU_CYCLES,
+	PERF_COUNT_HW_INSTRUCTIONS,
+	PERF_COUNT_HW_CACHE_MISSES,
+	PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+/* Each thread opens its own counter group the first time it does any profiled work */
+static _Thread_local int thread_group_fd = -1;
+static _Thread_local bool thread_group_tried = false;
+
+/* Every counter we've opened, so they can be closed when we're done */
+static pthread_mutex_t fds_lock = PTHREAD_MUTEX_INITIALIZER;
+static int* open_fds = NULL;
+static size_t num_open_fds = 0;
+
+static uint64_t time_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int open_counter(uint64_t config, int group_fd) {
+	struct perf_event_attr attr;
+	bzero(&attr, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.config = config;
+	attr.read_format = PERF_FORMAT_GROUP;
+
+	/* User space only, so unprivileged processes can count too */
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+static void remember_fd(int fd) {
+	pthread_mutex_lock(&fds_lock);
+	int* fds = realloc(open_fds, sizeof(int) * (num_open_fds + 1));
+	if(fds) {
+		open_fds = fds;
+		open_fds[num_open_fds] = fd;
+		num_open_fds += 1;
+	}
+	pthread_mutex_unlock(&fds_lock);
+}
+
+/* Open a counter group for the calling thread, returning the leaders fd */
+static int open_group(void) {
+	int fds[PERF_NUM_COUNTERS];
+
+	for(int i = 0; i < PERF_NUM_COUNTERS; i += 1) {
+		fds[i] = open_counter(counter_configs[i], i == 0 ? -1 : fds[0]);
+		if(fds[i] < 0) {
+			for(int j = 0; j < i; j += 1) {
+				close(fds[j]);
+			}
+			return -1;
+		}
+	}
+
+	for(int i = 0; i < PERF_NUM_COUNTERS; i += 1) {
+		remember_fd(fds[i]);
+	}
+
+	ioctl(fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+	ioctl(fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	return fds[0];
+}
+
+static int thread_group(void) {
+	if(!thread_group_tried) {
+		thread_group_tried = true;
+		thread_group_fd = open_group();
+	}
+	return thread_group_fd;
+}
+
+static bool read_counters(uint64_t counters[PERF_NUM_COUNTERS]) {
+	int fd = thread_group();
+	if(fd < 0) {
+		return false;
+	}
+
+	/* With PERF_FORMAT_GROUP we get the number of counters followed by each value */
+	uint64_t values[PERF_NUM_COUNTERS + 1];
+	if(read(fd, values, sizeof(values)) != sizeof(values)) {
+		return false;
+	}
+
+	memcpy(counters, &values[1], sizeof(uint64_t) * PERF_NUM_COUNTERS);
+	return true;
+}
+
+/* Start profiling, checking whether this machine will give us hardware counters */
+int perf_init(void) {
+	bzero(profiles, sizeof(profiles));
+
+	counters_available = thread_group() >= 0;
+	if(!counters_available) {
+		info("[*] Hardware performance counters unavailable, only timing layers\n");
+	}
+
+	perf_enabled = true;
+	return 0;
+}
+
+void perf_free(void) {
+	perf_enabled = false;
+
+	pthread_mutex_lock(&fds_lock);
+	for(size_t i = 0; i < num_open_fds; i += 1) {
+		close(open_fds[i]);
+	}
+	free(open_fds);
+	open_fds = NULL;
+	num_open_fds = 0;
+	pthread_mutex_unlock(&fds_lock);
+}
+
+static layer_profile* get_profile(perf_pass pass, size_t layer_index) {
+	return &profiles[pass][layer_index < PERF_MAX_LAYERS ? layer_index : PERF_MAX_LAYERS - 1];
+}
+
+void perf_begin(perf_sample* sample) {
+	sample->counted = counters_available && read_counters(sample->counters);
+	sample->ns = time_ns();
+}
+
+/* Add the work this thread has done since perf_begin to a layers totals */
+void perf_end(perf_sample* sample, perf_pass pass, size_t layer_index, uint64_t flops, uint64_t bytes) {
+	uint64_t now = time_ns();
+	layer_profile* profile = get_profile(pass, layer_index);
+
+	atomic_fetch_add(&profile->thread_ns, now - sample->ns);
+	atomic_fetch_add(&profile->flops, flops);
+	atomic_fetch_add(&profile->bytes, bytes);
+
+	uint64_t counters[PERF_NUM_COUNTERS];
+	if(sample->counted && read_counters(counters)) {
+		for(int i = 0; i < PERF_NUM_COUNTERS; i += 1) {
+			atomic_fetch_add(&profile->counters[i], counters[i] - sample->counters[i]);
+		}
+	}
+}
+
+/* Add the wall clock time of a whole pass through a layer, from the thread that started it */
+void perf_add_wall(perf_sample* sample, perf_pass pass, size_t layer_index) {
+	layer_profile* profile = get_profile(pass, layer_index);
+	atomic_fetch_add(&profile->calls, 1);
+	atomic_fetch_add(&profile->wall_ns, time_ns() - sample->ns);
+}
+
+void perf_print_report(size_t num_layers) {
+	static char* pass_names[] = {"forward", "backward"};
+
+	printf("[*] layer  pass      calls     wall(ms)   cycles       instructions  ipc    cache-miss   branch-miss  gflop/s  gb/s\n");
+
+	for(int pass = 0; pass < 2; pass += 1) {
+		for(size_t i = 1; i < num_layers && i < PERF_MAX_LAYERS; i += 1) {
+			layer_profile* profile = get_profile(pass, i);
+			uint64_t calls = atomic_load(&profile->calls);
+			if(calls == 0) {
+				continue;
+			}
+
+			/* Rates are over wall clock time, so they reflect every thread working on the layer together */
+			double wall_ns = atomic_load(&profile->wall_ns);
+			double gflops = wall_ns ? atomic_load(&profile->flops) / wall_ns : 0;
+			double gbytes = wall_ns ? atomic_load(&profile->bytes) / wall_ns : 0;
+
+			if(!counters_available) {
+				printf("[*] %-6zu %-9s %-9lu %-10.3f %-12s %-13s %-6s %-12s %-12s %-8.3f %.3f\n", i, pass_names[pass], calls, wall_ns / 1e6, "-", "-", "-", "-", "-", gflops, gbytes);
+				continue;
+			}
+
+			uint64_t cycles = atomic_load(&profile->counters[PERF_CYCLES]);
+			uint64_t instructions = atomic_load(&profile->counters[PERF_INSTRUCTIONS]);
+			double ipc = cycles ? (double)instructions / cycles : 0;
+
+			printf("[*] %-6zu %-9s %-9lu %-10.3f %-12lu %-13lu %-6.2f %-12lu %-12lu %-8.3f %.3f\n", i, pass_names[pass], calls, wall_ns / 1e6, cycles, instructions, ipc, atomic_load(&profile->counters[PERF_CACHE_MISSES]), atomic_load(&profile->counters[PERF_BRANCH_MISSES]), gflops, gbytes);
+		}
+	}
+}
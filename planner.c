@@ -0,0 +1,228 @@
+#include <includes/common.h>
+#include <includes/planner.h>
+
+static const char* kind_names[TENSOR_NUM_KINDS] = {"outputs", "sums", "history", "gates", "derivs", "common", "partials", "signs"};
+
+static size_t aligned_len(size_t len) {
+	return (len + PLAN_ALIGNMENT - 1) / PLAN_ALIGNMENT * PLAN_ALIGNMENT;
+}
+
+planned_tensor* plan_tensor(execution_plan* plan, size_t layer_index, tensor_kind kind) {
+	return &plan->tensors[layer_index * TENSOR_NUM_KINDS + kind];
+}
+
+static void set_tensor(execution_plan* plan, size_t layer_index, tensor_kind kind, size_t len, size_t first_step, size_t last_step) {
+	planned_tensor* tensor = plan_tensor(plan, layer_index, kind);
+	tensor->len = len;
+	tensor->first_step = first_step;
+	tensor->last_step = last_step;
+}
+
+/* Fill in how long each tensor lives for when only running forward */
+static void plan_inference(execution_plan* plan, neural_network* network) {
+	size_t end_step = network->num_layers;
+
+	for(size_t i = 0; i < network->num_layers; i += 1) {
+		layer* curr_layer = &network->layers[i];
+		size_t num_neurons = curr_layer->num_neurons;
+		size_t history_len = layer_history_len(curr_layer);
+		size_t gates_len = is_gated(curr_layer) ? num_neurons * GATED_STATE : 0;
+
+		/* History is carried between passes, so it's never shared */
+		set_tensor(plan, i, TENSOR_HISTORY, history_len, 0, end_step);
+
+		/* Inputs that don't fill the input layer leave the rest as they were, and sessions save them, so they're kept too */
+		if(i == 0) {
+			set_tensor(plan, i, TENSOR_OUTPUTS, num_neurons, 0, end_step);
+			continue;
+		}
+
+		/* Outputs are read by the next layer, the last layers by the caller, and recurrent layers become their history at the end */
+		bool read_at_end = i == network->num_layers - 1 || history_len > 0;
+		set_tensor(plan, i, TENSOR_OUTPUTS, num_neurons, i, read_at_end ? end_step : i + 1);
+
+		/* Each output only reads its own sum, and nothing reads sums after that without backpropogation, so they're summed in place */
+		set_tensor(plan, i, TENSOR_SUMS, 0, i, i);
+		plan->unshared_len += aligned_len(num_neurons);
+
+		/* An LSTMs new cell state is at the end of its gates, so they're kept until it's moved into its history */
+		set_tensor(plan, i, TENSOR_GATES, gates_len, i, curr_layer->type == LAYER_LSTM ? end_step : i);
+	}
+}
+
+/* Fill in how long each tensor lives for when backpropogating after the forward pass */
+static void plan_training(execution_plan* plan, neural_network* network) {
+	size_t num_layers = network->num_layers;
+	size_t end_step = num_layers * 2 - 1;
+
+	for(size_t i = 0; i < num_layers; i += 1) {
+		layer* curr_layer = &network->layers[i];
+		size_t num_neurons = curr_layer->num_neurons;
+		size_t history_len = layer_history_len(curr_layer);
+		size_t gates_len = is_gated(curr_layer) ? num_neurons * GATED_STATE : 0;
+
+		/* Layers are backpropogated last first, starting straight after the forward pass */
+		size_t backward_step = end_step - i;
+		size_t next_backward_step = i == num_layers - 1 ? backward_step : backward_step - 1;
+
+		set_tensor(plan, i, TENSOR_HISTORY, history_len, 0, end_step);
+
+		if(i == 0) {
+			set_tensor(plan, i, TENSOR_OUTPUTS, num_neurons, 0, end_step);
+
+			/* Whatever the first layer passes down is never read, but it still needs somewhere to go */
+			set_tensor(plan, i, TENSOR_DERIVATIVES, num_neurons, next_backward_step, next_backward_step);
+			continue;
+		}
+
+		/* Outputs are read again by the next layers backward pass, the last layers by the cost, and recurrent ones at the end */
+		set_tensor(plan, i, TENSOR_OUTPUTS, num_neurons, i, history_len > 0 ? end_step : next_backward_step);
+		set_tensor(plan, i, TENSOR_SUMS, num_neurons, i, backward_step);
+		set_tensor(plan, i, TENSOR_GATES, gates_len, i, curr_layer->type == LAYER_LSTM ? end_step : backward_step);
+
+		/* The derivatives of a layers outputs are written by the layer after it, and read by its own backward pass */
+		set_tensor(plan, i, TENSOR_DERIVATIVES, num_neurons, next_backward_step, backward_step);
+
+		layer* prev_layer = &network->layers[i-1];
+		size_t common_len = num_neurons;
+		size_t partials_len = 0;
+		size_t signs_len = 0;
+
+		if(curr_layer->type == LAYER_EMBEDDING) {
+			common_len = 0;
+		}
+		else if(is_gated(curr_layer)) {
+			common_len = layer_rows(curr_layer) * 2;
+		}
+		else if(curr_layer->type == LAYER_BINARY) {
+			signs_len = prev_layer->num_neurons;
+		}
+		else if(curr_layer->type == LAYER_DENSE) {
+			size_t num_chunks = backward_chunks(curr_layer, prev_layer);
+			partials_len = num_chunks > 1 ? prev_layer->num_neurons * num_chunks : 0;
+		}
+
+		set_tensor(plan, i, TENSOR_COMMON_TERMS, common_len, backward_step, backward_step);
+		set_tensor(plan, i, TENSOR_PARTIALS, partials_len, backward_step, backward_step);
+		set_tensor(plan, i, TENSOR_INPUT_SIGNS, signs_len, backward_step, backward_step);
+	}
+}
+
+static bool lifetimes_overlap(planned_tensor* a, planned_tensor* b) {
+	return a->first_step <= b->last_step && b->first_step <= a->last_step;
+}
+
+/* Largest first, ties in layer order so a plan never changes between runs */
+static int compare_tensors(const void* a, const void* b) {
+	planned_tensor* first = *(planned_tensor**)a;
+	planned_tensor* second = *(planned_tensor**)b;
+
+	if(first->len != second->len) {
+		return first->len < second->len ? 1 : -1;
+	}
+	return first < second ? -1 : first > second;
+}
+
+/* Greedy by size, each tensor goes at the lowest offset clear of every larger one alive at the same time */
+static int place_tensors(execution_plan* plan) {
+	size_t num_tensors = plan->num_layers * TENSOR_NUM_KINDS;
+	planned_tensor** order = malloc(sizeof(planned_tensor*) * num_tensors);
+	if(!order) {
+		error("Failed to allocate execution plan\n");
+		return -1;
+	}
+
+	for(size_t i = 0; i < num_tensors; i += 1) {
+		order[i] = &plan->tensors[i];
+	}
+	qsort(order, num_tensors, sizeof(planned_tensor*), compare_tensors);
+
+	for(size_t i = 0; i < num_tensors; i += 1) {
+		planned_tensor* tensor = order[i];
+		size_t len = aligned_len(tensor->len);
+		plan->unshared_len += len;
+
+		if(len == 0) {
+			tensor->offset = 0;
+			continue;
+		}
+
+		/* Step past whatever is in the way until nothing is, which only ever moves the offset up */
+		size_t offset = 0;
+		bool moved = true;
+		while(moved) {
+			moved = false;
+			for(size_t j = 0; j < i; j += 1) {
+				planned_tensor* placed = order[j];
+				size_t placed_end = placed->offset + aligned_len(placed->len);
+				if(placed->len && lifetimes_overlap(tensor, placed) && offset < placed_end && placed->offset < offset + len) {
+					offset = placed_end;
+					moved = true;
+				}
+			}
+		}
+
+		tensor->offset = offset;
+		if(offset + len > plan->arena_len) {
+			plan->arena_len = offset + len;
+		}
+	}
+
+	free(order);
+	return 0;
+}
+
+execution_plan* plan_execution(neural_network* network, plan_mode mode) {
+	execution_plan* plan = malloc(sizeof(execution_plan));
+	if(!plan) {
+		error("Failed to allocate execution plan\n");
+		return NULL;
+	}
+
+	plan->mode = mode;
+	plan->num_layers = network->num_layers;
+	plan->arena_len = 0;
+	plan->unshared_len = 0;
+	plan->tensors = calloc(network->num_layers * TENSOR_NUM_KINDS, sizeof(planned_tensor));
+	if(!plan->tensors) {
+		error("Failed to allocate execution plan\n");
+		free(plan);
+		return NULL;
+	}
+
+	if(mode == PLAN_TRAINING) {
+		plan_training(plan, network);
+	}
+	else {
+		plan_inference(plan, network);
+	}
+
+	if(place_tensors(plan) != 0) {
+		plan_free(plan);
+		return NULL;
+	}
+
+	debug("[!] %s plan needs %zu doubles, %zu without reuse\n", mode == PLAN_TRAINING ? "Training" : "Inference", plan->arena_len, plan->unshared_len);
+	return plan;
+}
+
+void plan_free(execution_plan* plan) {
+	if(!plan) {
+		return;
+	}
+	free(plan->tensors);
+	free(plan);
+}
+
+void plan_print(execution_plan* plan) {
+	printf("[*] %s plan: %zu bytes of activations, %zu without reuse\n", plan->mode == PLAN_TRAINING ? "Training" : "Inference", plan->arena_len * sizeof(double), plan->unshared_len * sizeof(double));
+	printf("[*] layer  tensor    len       steps      offset\n");
+	for(size_t i = 0; i < plan->num_layers; i += 1) {
+		for(int kind = 0; kind < TENSOR_NUM_KINDS; kind += 1) {
+			planned_tensor* tensor = plan_tensor(plan, i, kind);
+			if(tensor->len) {
+				printf("[*] %-5zu  %-8s  %-8zu  %3zu - %-4zu  %zu\n", i, kind_names[kind], tensor->len, tensor->first_step, tensor->last_step, tensor->offset);
+			}
+		}
+	}
+}
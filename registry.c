@@ -0,0 +1,272 @@
+#include <includes/common.h>
+#include <includes/registry.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Names are used in shm segment names, so they can't have slashes in */
+static int check_name(char* name) {
+	if(strlen(name) == 0 || strlen(name) > REGISTRY_MAX_NAME || strchr(name, '/')) {
+		error("Invalid model name\n");
+		return -1;
+	}
+	return 0;
+}
+
+static void control_segment_name(char* out, size_t out_len, char* name) {
+	snprintf(out, out_len, "/nn-%s", name);
+}
+
+static void model_segment_name(char* out, size_t out_len, char* name, uint64_t version) {
+	snprintf(out, out_len, "/nn-%s.%" PRIu64, name, version);
+}
+
+/* Map a models control segment, creating it if asked */
+static registry_control* map_control(char* name, bool create) {
+	char segment[256];
+	control_segment_name(segment, sizeof(segment), name);
+
+	int fd = shm_open(segment, create ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+	if(fd < 0) {
+		if(!create && errno == ENOENT) {
+			error("No model published with that name\n");
+		}
+		else {
+			error("Failed to open registry control segment\n");
+		}
+		return NULL;
+	}
+
+	/* Whoever creates it first sizes it, which leaves it zeroed */
+	if(create && ftruncate(fd, sizeof(registry_control)) != 0) {
+		error("Failed to size registry control segment\n");
+		close(fd);
+		return NULL;
+	}
+
+	/* A publisher can have created it without sizing it yet, and reading past the end of it would fault */
+	struct stat control_stat;
+	if(!create && (fstat(fd, &control_stat) != 0 || control_stat.st_size < (off_t)sizeof(registry_control))) {
+		error("Registry control segment isn't ready\n");
+		close(fd);
+		return NULL;
+	}
+
+	registry_control* control = mmap(NULL, sizeof(registry_control), create ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(control == MAP_FAILED) {
+		error("Failed to map registry control segment\n");
+		return NULL;
+	}
+
+	/* A new segment is still zeroed, anything else that isn't ours is left alone */
+	if(create && control->magic == 0) {
+		control->magic = REGISTRY_MAGIC;
+	}
+	if(control->magic != REGISTRY_MAGIC) {
+		if(control->magic == 0) {
+			error("Registry control segment isn't ready\n");
+		}
+		else {
+			error("Registry control segment isn't a model registry\n");
+		}
+		munmap(control, sizeof(registry_control));
+		return NULL;
+	}
+	return control;
+}
+
+/* Load a network into a new read only segment, then make it the current version */
+int registry_publish(char* name, neural_network* network, uint64_t* version) {
+	if(check_name(name) != 0) {
+		return -1;
+	}
+
+	registry_control* control = map_control(name, true);
+	if(!control) {
+		return -1;
+	}
+
+	/* Every publisher gets its own version, so they never write the same segment */
+	uint64_t new_version = atomic_fetch_add(&control->next_version, 1) + 1;
+
+	char segment[256];
+	model_segment_name(segment, sizeof(segment), name, new_version);
+
+	/* Read only for everyone, our descriptor can still write it */
+	int fd = shm_open(segment, O_RDWR | O_CREAT | O_EXCL, 0444);
+	if(fd < 0) {
+		error("Failed to create model segment\n");
+		munmap(control, sizeof(registry_control));
+		return -1;
+	}
+
+	FILE* f = fdopen(fd, "wb");
+	if(!f) {
+		error("Failed to open model segment\n");
+		close(fd);
+		shm_unlink(segment);
+		munmap(control, sizeof(registry_control));
+		return -1;
+	}
+
+	write_neural_network(network, f);
+	if(fclose(f) != 0) {
+		error("Failed to write model segment\n");
+		shm_unlink(segment);
+		munmap(control, sizeof(registry_control));
+		return -1;
+	}
+
+	/* Swap it in, unless someone has published something newer in the meantime */
+	uint64_t old_version = atomic_load(&control->current_version);
+	while(old_version < new_version && !atomic_compare_exchange_weak(&control->current_version, &old_version, new_version));
+
+	if(old_version > new_version) {
+		info("[*] Model %s version %" PRIu64 " was superseded before it was published\n", name, new_version);
+		shm_unlink(segment);
+		munmap(control, sizeof(registry_control));
+		return -1;
+	}
+
+	/* Processes still using the old version keep their mapping until they let go of it */
+	if(old_version != 0) {
+		model_segment_name(segment, sizeof(segment), name, old_version);
+		shm_unlink(segment);
+	}
+
+	info("[*] Published model %s version %" PRIu64 "\n", name, new_version);
+	munmap(control, sizeof(registry_control));
+
+	if(version) {
+		*version = new_version;
+	}
+	return 0;
+}
+
+/* Unlink a model, anyone attached keeps their copy */
+int registry_remove(char* name) {
+	if(check_name(name) != 0) {
+		return -1;
+	}
+
+	registry_control* control = map_control(name, false);
+	if(!control) {
+		return -1;
+	}
+
+	char segment[256];
+	model_segment_name(segment, sizeof(segment), name, atomic_load(&control->current_version));
+	shm_unlink(segment);
+	munmap(control, sizeof(registry_control));
+
+	control_segment_name(segment, sizeof(segment), name);
+	if(shm_unlink(segment) != 0) {
+		error("Failed to remove model\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Map one version of a model, with the networks weights pointing straight into the mapping */
+static neural_network* attach_version(char* name, uint64_t version) {
+	char segment[256];
+	model_segment_name(segment, sizeof(segment), name, version);
+
+	int fd = shm_open(segment, O_RDONLY, 0);
+	if(fd < 0) {
+		return NULL;
+	}
+
+	struct stat segment_stat;
+	if(fstat(fd, &segment_stat) != 0) {
+		error("Failed to stat model segment\n");
+		close(fd);
+		return NULL;
+	}
+
+	void* mapping = mmap(NULL, segment_stat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(mapping == MAP_FAILED) {
+		error("Failed to map model segment\n");
+		return NULL;
+	}
+
+	/* The weights are read only, so the network can only ever be used for inference */
+	neural_network* network = parse_neural_network(mapping, segment_stat.st_size, LOAD_INFERENCE, true);
+	if(!network) {
+		munmap(mapping, segment_stat.st_size);
+		return NULL;
+	}
+
+	network->mapping = mapping;
+	network->mapping_len = segment_stat.st_size;
+	return network;
+}
+
+neural_network* registry_attach(char* name, uint64_t* version) {
+	if(check_name(name) != 0) {
+		return NULL;
+	}
+
+	registry_control* control = map_control(name, false);
+	if(!control) {
+		return NULL;
+	}
+
+	/* The version we read can be unlinked before we open it, in which case try the newer one */
+	neural_network* network = NULL;
+	uint64_t current_version = 0;
+
+	for(int i = 0; i < REGISTRY_ATTACH_ATTEMPTS && !network; i += 1) {
+		current_version = atomic_load(&control->current_version);
+		if(current_version == 0) {
+			break;
+		}
+		network = attach_version(name, current_version);
+	}
+	munmap(control, sizeof(registry_control));
+
+	if(!network) {
+		error("Failed to attach to model\n");
+		return NULL;
+	}
+
+	if(version) {
+		*version = current_version;
+	}
+	return network;
+}
+
+/* Swap *network for the newest version if it's changed since version, returning 1 if it was swapped - nothing else can be using the old network */
+int registry_refresh(char* name, neural_network** network, uint64_t* version) {
+	if(check_name(name) != 0) {
+		return -1;
+	}
+
+	registry_control* control = map_control(name, false);
+	if(!control) {
+		return -1;
+	}
+
+	uint64_t current_version = atomic_load(&control->current_version);
+	munmap(control, sizeof(registry_control));
+
+	if(current_version == *version) {
+		return 0;
+	}
+
+	uint64_t new_version;
+	neural_network* new_network = registry_attach(name, &new_version);
+	if(!new_network) {
+		return -1;
+	}
+
+	free_neural_network(*network);
+	*network = new_network;
+	*version = new_version;
+	return 1;
+}
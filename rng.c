@@ -0,0 +1,60 @@
+#include <includes/common.h>
+#include <includes/rng.h>
+
+#define PHILOX_M0 0xD2511F53
+#define PHILOX_M1 0xCD9E8D57
+#define PHILOX_W0 0x9E3779B9
+#define PHILOX_W1 0xBB67AE85
+#define PHILOX_ROUNDS 10
+
+void philox4x32(uint32_t counter[4], uint64_t key, uint32_t out[4]) {
+	uint32_t ctr[4] = {counter[0], counter[1], counter[2], counter[3]};
+	uint32_t k[2] = {(uint32_t)key, (uint32_t)(key >> 32)};
+
+	for(int round = 0; round < PHILOX_ROUNDS; round += 1) {
+
+		/* Multiply, then mix the high halves with the rest of the counter and the key */
+		uint64_t p0 = (uint64_t)PHILOX_M0 * ctr[0];
+		uint64_t p1 = (uint64_t)PHILOX_M1 * ctr[2];
+
+		uint32_t next[4];
+		next[0] = (uint32_t)(p1 >> 32) ^ ctr[1] ^ k[0];
+		next[1] = (uint32_t)p1;
+		next[2] = (uint32_t)(p0 >> 32) ^ ctr[3] ^ k[1];
+		next[3] = (uint32_t)p0;
+
+		memcpy(ctr, next, sizeof(ctr));
+
+		/* Bump the key between rounds */
+		k[0] += PHILOX_W0;
+		k[1] += PHILOX_W1;
+	}
+
+	memcpy(out, ctr, sizeof(ctr));
+}
+
+static void random_block(uint64_t seed, uint64_t stream, uint64_t index, uint32_t out[4]) {
+	uint32_t counter[4] = {(uint32_t)index, (uint32_t)(index >> 32), (uint32_t)stream, (uint32_t)(stream >> 32)};
+	philox4x32(counter, seed, out);
+}
+
+/* Build a double with 53 random bits from two words */
+static double to_unit_interval(uint32_t a, uint32_t b) {
+	return ((a >> 5) * 67108864.0 + (b >> 6)) / 9007199254740992.0;
+}
+
+double rng_uniform(uint64_t seed, uint64_t stream, uint64_t index) {
+	uint32_t block[4];
+	random_block(seed, stream, index, block);
+	return to_unit_interval(block[0], block[1]);
+}
+
+double rng_normal(uint64_t seed, uint64_t stream, uint64_t index) {
+	uint32_t block[4];
+	random_block(seed, stream, index, block);
+
+	/* Box-Muller, keeping u1 away from zero */
+	double u1 = 1.0 - to_unit_interval(block[0], block[1]);
+	double u2 = to_unit_interval(block[2], block[3]);
+	return sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+}
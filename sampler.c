@@ -0,0 +1,77 @@
+#include <includes/common.h>
+#include <includes/sampler.h>
+#include <includes/rng.h>
+
+sampler* sampler_create(size_t num_cases, sample_mode mode, uint64_t seed) {
+	sampler* ret = malloc(sizeof(sampler));
+	if(!ret) {
+		error("Failed to allocate sampler\n");
+		return NULL;
+	}
+
+	ret->indices = malloc(sizeof(size_t) * (num_cases ? num_cases : 1));
+	if(!ret->indices) {
+		error("Failed to allocate sampler indices\n");
+		free(ret);
+		return NULL;
+	}
+
+	ret->num_cases = num_cases;
+	ret->mode = mode;
+	ret->seed = seed;
+	ret->epoch = 0;
+
+	/* Nothing is handed out until the first epoch starts */
+	ret->position = num_cases;
+	return ret;
+}
+
+void sampler_free(sampler* sampler) {
+	free(sampler->indices);
+	free(sampler);
+}
+
+/* Pick the next epochs order, each epoch drawing from its own random stream so runs are reproducible */
+void sampler_start_epoch(sampler* sampler) {
+	size_t n = sampler->num_cases;
+
+	switch(sampler->mode) {
+	case SAMPLE_SHUFFLE:
+
+		/* Fisher-Yates, working down from the end */
+		for(size_t i = 0; i < n; i += 1) {
+			sampler->indices[i] = i;
+		}
+		for(size_t i = n; i > 1; i -= 1) {
+			size_t j = rng_uniform(sampler->seed, sampler->epoch, i) * i;
+			size_t tmp = sampler->indices[i-1];
+			sampler->indices[i-1] = sampler->indices[j];
+			sampler->indices[j] = tmp;
+		}
+		break;
+	case SAMPLE_REPLACEMENT:
+		for(size_t i = 0; i < n; i += 1) {
+			sampler->indices[i] = rng_uniform(sampler->seed, sampler->epoch, i) * n;
+		}
+		break;
+	case SAMPLE_SEQUENTIAL:
+	default:
+		for(size_t i = 0; i < n; i += 1) {
+			sampler->indices[i] = i;
+		}
+		break;
+	}
+
+	sampler->epoch += 1;
+	sampler->position = 0;
+}
+
+/* Point batch at up to batch_size indices, returning how many there are, or 0 once the epoch is over */
+size_t sampler_next_batch(sampler* sampler, size_t batch_size, size_t** batch) {
+	size_t remaining = sampler->num_cases - sampler->position;
+	size_t len = (batch_size == 0 || batch_size > remaining) ? remaining : batch_size;
+
+	*batch = &sampler->indices[sampler->position];
+	sampler->position += len;
+	return len;
+}
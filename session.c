@@ -0,0 +1,209 @@
+#include <includes/common.h>
+#include <includes/session.h>
+
+inference_session* session_create(neural_network* network) {
+	inference_session* session = malloc(sizeof(inference_session));
+	if(!session) {
+		error("Failed to allocate session\n");
+		return NULL;
+	}
+
+	session->context = create_execution_context(network);
+	session->pending = malloc(sizeof(double) * network->layers[0].num_neurons);
+	session->pending_len = 0;
+	session->num_steps = 0;
+
+	if(!session->context || !session->pending) {
+		error("Failed to allocate session state\n");
+		session_free(session);
+		return NULL;
+	}
+	return session;
+}
+
+void session_free(inference_session* session) {
+	if(session->context) {
+		free_execution_context(session->context);
+	}
+	free(session->pending);
+	free(session);
+}
+
+void session_reset(inference_session* session) {
+	neural_network* network = session->context->network;
+
+	reset_history(session->context);
+	bzero(session->context->outputs[0], sizeof(double) * network->layers[0].num_neurons);
+	session->pending_len = 0;
+	session->num_steps = 0;
+}
+
+int session_feed(inference_session* session, double* input, size_t input_len, double** output, size_t* output_len) {
+	neural_network* network = session->context->network;
+	size_t step_len = network->layers[0].num_neurons;
+	size_t num_output_neurons = network->layers[network->num_layers-1].num_neurons;
+
+	*output = NULL;
+	*output_len = 0;
+
+	/* Steps have to line up with the sequence as a whole, so the pending input starts the first one */
+	size_t total_len = session->pending_len + input_len;
+	size_t num_steps = total_len / step_len;
+	size_t steps_len = num_steps * step_len;
+
+	if(num_steps) {
+		double* steps = input;
+		if(session->pending_len) {
+			steps = malloc(sizeof(double) * steps_len);
+			if(!steps) {
+				error("Failed to allocate session input\n");
+				return -1;
+			}
+			memcpy(steps, session->pending, sizeof(double) * session->pending_len);
+			memcpy(&steps[session->pending_len], input, sizeof(double) * (steps_len - session->pending_len));
+		}
+
+		*output = propogate_context_steps(session->context, steps, steps_len, num_steps * num_output_neurons);
+
+		if(steps != input) {
+			free(steps);
+		}
+		if(!*output) {
+			return -1;
+		}
+
+		*output_len = num_steps * num_output_neurons;
+		session->num_steps += num_steps;
+		session->pending_len = 0;
+	}
+
+	/* Keep the start of the next step for the next call, which is always the end of this input */
+	size_t remaining = total_len - steps_len;
+	memcpy(&session->pending[session->pending_len], &input[input_len - (remaining - session->pending_len)], sizeof(double) * (remaining - session->pending_len));
+	session->pending_len = remaining;
+	return 0;
+}
+
+int session_flush(inference_session* session, double** output, size_t* output_len) {
+	neural_network* network = session->context->network;
+	size_t num_output_neurons = network->layers[network->num_layers-1].num_neurons;
+
+	*output = NULL;
+	*output_len = 0;
+
+	if(!session->pending_len) {
+		return 0;
+	}
+
+	*output = propogate_context_steps(session->context, session->pending, session->pending_len, num_output_neurons);
+	if(!*output) {
+		return -1;
+	}
+
+	*output_len = num_output_neurons;
+	session->num_steps += 1;
+	session->pending_len = 0;
+	return 0;
+}
+
+/* The input layers last outputs matter too, a partial step leaves the rest of them as they were */
+static size_t session_state_len(neural_network* network) {
+	size_t state_len = network->layers[0].num_neurons;
+	for(int i = 0; i < network->num_layers; i += 1) {
+		state_len += layer_history_len(&network->layers[i]);
+	}
+	return state_len;
+}
+
+void write_session(inference_session* session, FILE* f) {
+	execution_context* context = session->context;
+	neural_network* network = context->network;
+
+	session_file_header header;
+	bzero(&header, sizeof(header));
+	header.magic = SESSION_MAGIC;
+	header.version = SESSION_VERSION;
+	header.state_len = session_state_len(network);
+	header.pending_len = session->pending_len;
+	header.num_steps = session->num_steps;
+	fwrite(&header, sizeof(header), 1, f);
+
+	fwrite(context->outputs[0], sizeof(double), network->layers[0].num_neurons, f);
+	for(int i = 0; i < network->num_layers; i += 1) {
+		if(context->history[i]) {
+			fwrite(context->history[i], sizeof(double), layer_history_len(&network->layers[i]), f);
+		}
+	}
+	fwrite(session->pending, sizeof(double), session->pending_len, f);
+}
+
+int export_session(inference_session* session, char* filename) {
+	FILE* f = fopen(filename, "wb");
+	if(!f) {
+		error("Failed to open session file\n");
+		return -1;
+	}
+
+	write_session(session, f);
+	fclose(f);
+	return 0;
+}
+
+int parse_session(inference_session* session, char* file_buf, size_t file_length) {
+	execution_context* context = session->context;
+	neural_network* network = context->network;
+
+	if(file_length < sizeof(session_file_header)) {
+		error("Session file malformed: too short\n");
+		return -1;
+	}
+
+	session_file_header* header = (session_file_header*)file_buf;
+	if(header->magic != SESSION_MAGIC || header->version != SESSION_VERSION) {
+		error("Session file malformed: bad magic\n");
+		return -1;
+	}
+
+	/* A session only makes sense on a network with the same shape */
+	if(header->state_len != session_state_len(network) || header->pending_len >= network->layers[0].num_neurons) {
+		error("Session file doesn't match the network\n");
+		return -1;
+	}
+
+	if(file_length != sizeof(session_file_header) + sizeof(double) * (header->state_len + header->pending_len)) {
+		error("Session file malformed: wrong length\n");
+		return -1;
+	}
+
+	double* state = (double*)&file_buf[sizeof(session_file_header)];
+
+	memcpy(context->outputs[0], state, sizeof(double) * network->layers[0].num_neurons);
+	state += network->layers[0].num_neurons;
+
+	for(int i = 0; i < network->num_layers; i += 1) {
+		if(context->history[i]) {
+			size_t len = layer_history_len(&network->layers[i]);
+			memcpy(context->history[i], state, sizeof(double) * len);
+			state += len;
+		}
+	}
+
+	memcpy(session->pending, state, sizeof(double) * header->pending_len);
+	session->pending_len = header->pending_len;
+	session->num_steps = header->num_steps;
+	return 0;
+}
+
+int import_session(inference_session* session, char* filename) {
+	size_t file_length;
+	char* file_buf;
+
+	int ret = read_file(filename, &file_buf, &file_length);
+	if(ret != 0) {
+		return -1;
+	}
+
+	ret = parse_session(session, file_buf, file_length);
+	free(file_buf);
+	return ret;
+}
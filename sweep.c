@@ -0,0 +1,365 @@
+#include <includes/common.h>
+#include <includes/sweep.h>
+#include <includes/rng.h>
+
+typedef enum {
+	SWEEP_LEARN_RATE,
+	SWEEP_ITERATIONS,
+	SWEEP_BATCH,
+	SWEEP_LAYERS,
+	SWEEP_NUM_KEYS,
+} sweep_key;
+
+static const char* key_names[SWEEP_NUM_KEYS] = {"a", "i", "batch", "n"};
+
+/* The values given for a key, NULL when it wasn't given */
+typedef struct {
+	char** values;
+	size_t num_values;
+} sweep_axis;
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Read a value as a range, low and high being the same for a single value */
+static int parse_range(sweep_key key, char* value, double* low, double* high) {
+	char* end;
+	*low = strtod(value, &end);
+	*high = *low;
+	if(*end == ':') {
+		*high = strtod(end + 1, &end);
+	}
+
+	/* Learning rates and iterations have to be positive, a batch of 0 is the whole training set */
+	bool valid = *end == '\0' && end != value && *high >= *low;
+	if(key != SWEEP_BATCH) {
+		valid = valid && *low > 0;
+	}
+	else {
+		valid = valid && *low >= 0;
+	}
+
+	if(!valid) {
+		error("Invalid sweep value\n");
+		return -1;
+	}
+	return 0;
+}
+
+/* Set a key of a config, drawing from a range with u */
+static void set_value(sweep_config* config, sweep_key key, char* value, double u) {
+	if(key == SWEEP_LAYERS) {
+		config->layers = value;
+		return;
+	}
+
+	double low, high;
+	parse_range(key, value, &low, &high);
+
+	switch(key) {
+	case SWEEP_LEARN_RATE:
+		config->learn_rate = low == high ? low : exp(log(low) + u * (log(high) - log(low)));
+		break;
+	case SWEEP_ITERATIONS:
+		config->num_iterations = low + u * (high - low + 1);
+		if(config->num_iterations > high) {
+			config->num_iterations = high;
+		}
+		break;
+	case SWEEP_BATCH:
+		config->batch_size = low + u * (high - low + 1);
+		if(config->batch_size > high) {
+			config->batch_size = high;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+static void free_axes(sweep_axis* axes) {
+	for(int k = 0; k < SWEEP_NUM_KEYS; k += 1) {
+		free(axes[k].values);
+	}
+}
+
+/* Split the spec in place into each keys values, checking every value as we go */
+static int parse_axes(char* spec, bool allow_ranges, sweep_axis* axes) {
+	char* key_save;
+	for(char* token = strtok_r(spec, ";", &key_save); token != NULL; token = strtok_r(NULL, ";", &key_save)) {
+		char* equals = strchr(token, '=');
+		if(!equals) {
+			error("Sweep keys need values\n");
+			return -1;
+		}
+		*equals = '\0';
+
+		int key = 0;
+		while(key < SWEEP_NUM_KEYS && strcmp(token, key_names[key]) != 0) {
+			key += 1;
+		}
+		if(key == SWEEP_NUM_KEYS) {
+			error("Unknown sweep key\n");
+			return -1;
+		}
+		if(axes[key].values) {
+			error("Sweep key given more than once\n");
+			return -1;
+		}
+
+		size_t max_values = 1;
+		for(char* c = equals + 1; *c; c += 1) {
+			max_values += *c == '|';
+		}
+		axes[key].values = malloc(sizeof(char*) * max_values);
+		if(!axes[key].values) {
+			error("Failed to allocate sweep values\n");
+			return -1;
+		}
+
+		char* value_save;
+		for(char* value = strtok_r(equals + 1, "|", &value_save); value != NULL; value = strtok_r(NULL, "|", &value_save)) {
+			if(key != SWEEP_LAYERS) {
+				double low, high;
+				if(parse_range(key, value, &low, &high) != 0) {
+					return -1;
+				}
+				if(low != high && !allow_ranges) {
+					error("Sweep ranges can only be sampled at random\n");
+					return -1;
+				}
+			}
+			axes[key].values[axes[key].num_values] = value;
+			axes[key].num_values += 1;
+		}
+
+		if(axes[key].num_values == 0) {
+			error("Sweep keys need values\n");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+sweep_config* sweep_parse(char* spec, size_t num_trials, uint64_t seed, sweep_config* defaults, size_t* num_configs) {
+	sweep_axis axes[SWEEP_NUM_KEYS] = {0};
+	if(parse_axes(spec, num_trials > 0, axes) != 0) {
+		free_axes(axes);
+		return NULL;
+	}
+
+	/* A grid has a candidate for every combination of values */
+	*num_configs = num_trials;
+	if(num_trials == 0) {
+		*num_configs = 1;
+		for(int k = 0; k < SWEEP_NUM_KEYS; k += 1) {
+			if(axes[k].values) {
+				*num_configs *= axes[k].num_values;
+			}
+			if(*num_configs > SWEEP_MAX_CANDIDATES) {
+				break;
+			}
+		}
+	}
+
+	if(*num_configs > SWEEP_MAX_CANDIDATES) {
+		error("Too many sweep candidates\n");
+		free_axes(axes);
+		return NULL;
+	}
+
+	sweep_config* configs = calloc(*num_configs, sizeof(sweep_config));
+	if(!configs) {
+		error("Failed to allocate sweep candidates\n");
+		free_axes(axes);
+		return NULL;
+	}
+
+	for(size_t i = 0; i < *num_configs; i += 1) {
+		configs[i] = *defaults;
+
+		/* Random trials pick each value from their own stream, grid candidates count through the values last key first */
+		size_t remaining = i;
+		for(int k = SWEEP_NUM_KEYS - 1; k >= 0; k -= 1) {
+			if(!axes[k].values) {
+				continue;
+			}
+
+			size_t choice;
+			double u = 0;
+			if(num_trials) {
+				choice = rng_uniform(seed, i, k * 2) * axes[k].num_values;
+				u = rng_uniform(seed, i, k * 2 + 1);
+			}
+			else {
+				choice = remaining % axes[k].num_values;
+				remaining /= axes[k].num_values;
+			}
+			set_value(&configs[i], k, axes[k].values[choice], u);
+		}
+
+		/* Every config owns its layers, as they're split up when the network is made */
+		if(configs[i].layers) {
+			configs[i].layers = strdup(configs[i].layers);
+			if(!configs[i].layers) {
+				error("Failed to allocate sweep layers\n");
+				sweep_configs_free(configs, i);
+				free_axes(axes);
+				return NULL;
+			}
+		}
+	}
+
+	free_axes(axes);
+	return configs;
+}
+
+void sweep_configs_free(sweep_config* configs, size_t num_configs) {
+	for(size_t i = 0; i < num_configs; i += 1) {
+		free(configs[i].layers);
+	}
+	free(configs);
+}
+
+typedef struct {
+	sweep_candidate* candidates;
+	test_case* train_cases;
+	size_t num_train_cases;
+	test_case* held_out_cases;
+	size_t num_held_out_cases;
+	sample_mode sampling;
+	uint64_t seed;
+} sweep_training;
+
+static int train_candidate(sweep_training* sweep, sweep_candidate* candidate) {
+	sweep_config* config = &candidate->config;
+
+	sampler* case_sampler = sampler_create(sweep->num_train_cases, sweep->sampling, sweep->seed);
+	if(!case_sampler) {
+		return -1;
+	}
+
+	size_t* batch;
+	size_t batch_len;
+	for(int i = 0; i < config->num_iterations; i += 1) {
+		sampler_start_epoch(case_sampler);
+
+		while((batch_len = sampler_next_batch(case_sampler, config->batch_size, &batch)) > 0) {
+			if(accumulate_derivatives(candidate->network, sweep->train_cases, batch, batch_len) != 0) {
+				sampler_free(case_sampler);
+				return -1;
+			}
+			apply_derivatives(candidate->network, config->learn_rate);
+		}
+	}
+
+	sampler_free(case_sampler);
+	return 0;
+}
+
+/* The mean squared error of every held out output */
+static double held_out_loss(sweep_training* sweep, neural_network* network) {
+	double total = 0;
+	size_t num_outputs = 0;
+
+	for(size_t i = 0; i < sweep->num_held_out_cases; i += 1) {
+		test_case* curr_case = &sweep->held_out_cases[i];
+
+		double* output = propogate_case_forward(network, curr_case->input, curr_case->input_len, curr_case->output_len);
+		if(!output) {
+			return NAN;
+		}
+
+		for(size_t j = 0; j < curr_case->output_len; j += 1) {
+			total += pow(output[j] - curr_case->expected_output[j], 2);
+		}
+		num_outputs += curr_case->output_len;
+		free(output);
+	}
+
+	return num_outputs ? total / num_outputs : NAN;
+}
+
+static void train_candidates(size_t start, size_t end, void* arg) {
+	sweep_training* sweep = arg;
+
+	for(size_t i = start; i < end; i += 1) {
+		sweep_candidate* candidate = &sweep->candidates[i];
+
+		uint64_t start_ns = now_ns();
+		candidate->loss = train_candidate(sweep, candidate) == 0 ? held_out_loss(sweep, candidate->network) : NAN;
+		candidate->seconds = (now_ns() - start_ns) / 1e9;
+
+		info("[*] Sweep candidate %zu finished with a loss of %f\n", i, candidate->loss);
+	}
+}
+
+int sweep_run(sweep_candidate* candidates, size_t num_candidates, test_case* cases, size_t num_cases, sample_mode sampling, uint64_t seed) {
+	if(num_candidates == 0 || num_cases == 0) {
+		error("Nothing to sweep\n");
+		return -1;
+	}
+
+	sweep_training sweep = {.candidates=candidates, .sampling=sampling, .seed=seed};
+
+	/* The split only copies each cases pointers, every candidate reads the same data */
+	sweep.train_cases = malloc(sizeof(test_case) * num_cases);
+	sweep.held_out_cases = malloc(sizeof(test_case) * num_cases);
+	if(!sweep.train_cases || !sweep.held_out_cases) {
+		error("Failed to allocate sweep cases\n");
+		free(sweep.train_cases);
+		free(sweep.held_out_cases);
+		return -1;
+	}
+
+	for(size_t i = 0; i < num_cases; i += 1) {
+		if(num_cases >= SWEEP_HOLDOUT && i % SWEEP_HOLDOUT == SWEEP_HOLDOUT - 1) {
+			sweep.held_out_cases[sweep.num_held_out_cases++] = cases[i];
+		}
+		else {
+			sweep.train_cases[sweep.num_train_cases++] = cases[i];
+		}
+	}
+
+	/* Too few cases to hold any out, so candidates are scored on what they trained on */
+	if(sweep.num_held_out_cases == 0) {
+		memcpy(sweep.held_out_cases, cases, sizeof(test_case) * num_cases);
+		sweep.num_held_out_cases = num_cases;
+	}
+
+	/* Candidates run a worker each, and only split their own training over threads when there are workers to spare */
+	thread_pool* pool = thread_pool_global();
+	size_t num_workers = pool ? pool->num_workers : 1;
+	size_t max_replicas = num_workers / num_candidates;
+	for(size_t i = 0; i < num_candidates; i += 1) {
+		candidates[i].network->max_replicas = max_replicas ? max_replicas : 1;
+	}
+
+	thread_pool_parallel_for(pool, num_candidates, 1, train_candidates, &sweep);
+
+	free(sweep.train_cases);
+	free(sweep.held_out_cases);
+
+	int best = -1;
+	for(size_t i = 0; i < num_candidates; i += 1) {
+		if(!isnan(candidates[i].loss) && (best < 0 || candidates[i].loss < candidates[best].loss)) {
+			best = i;
+		}
+	}
+
+	if(best < 0) {
+		error("Every sweep candidate failed\n");
+	}
+	return best;
+}
+
+void sweep_print_results(sweep_candidate* candidates, size_t num_candidates, int best) {
+	printf("[*] candidate  learn_rate  iterations  batch   loss          time(s)   layers\n");
+	for(size_t i = 0; i < num_candidates; i += 1) {
+		sweep_config* config = &candidates[i].config;
+		printf("[*] %-9zu  %-10g  %-10d  %-6zu  %-12.6g  %-8.3f  %s%s\n", i, config->learn_rate, config->num_iterations, config->batch_size, candidates[i].loss, candidates[i].seconds, config->layers ? config->layers : "-", (int)i == best ? "  (best)" : "");
+	}
+}
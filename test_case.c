@@ -1,4 +1,8 @@
 #include <includes/common.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 void test_case_free(test_case case_to_free) {
 	free(case_to_free.input);
@@ -13,7 +17,8 @@ void test_cases_free(test_case* cases_to_free, size_t num_cases) {
 }
 
 
-int export_training_data(char** input_filenames, char** expected_output_filenames, char* output_filename, size_t num_cases) {
+/* Raw byte files keep inputs as they are and pack the expected output bits, rather than storing a double per bit */
+int export_training_data(char** input_filenames, char** expected_output_filenames, char* output_filename, size_t num_cases, bool raw_bytes) {
 
 	/* First open the output file */
 	FILE* output_file = fopen(output_filename, "wb");
@@ -24,7 +29,7 @@ int export_training_data(char** input_filenames, char** expected_output_filename
 	}
 
 	/* Write in our file header */
-	training_data_header header = {.magic=TRAINING_DATA_MAGIC, .num_test_cases=num_cases};
+	training_data_header header = {.magic=raw_bytes ? TRAINING_DATA_RAW_MAGIC : TRAINING_DATA_MAGIC, .num_test_cases=num_cases};
 
 	fwrite(&header, sizeof(training_data_header), 1, output_file);
 
@@ -33,7 +38,7 @@ int export_training_data(char** input_filenames, char** expected_output_filename
 	for(int i = 0; i < num_cases; i += 1) {
 		file_test_case test_case;
 
-		test_case.input_len = get_file_size(input_filenames[i]) * 8;
+		test_case.input_len = get_file_size(input_filenames[i]) * (raw_bytes ? 1 : 8);
 		if(!test_case.input_len) {
 			fclose(output_file);
 			return -1;
@@ -64,6 +69,12 @@ int export_training_data(char** input_filenames, char** expected_output_filename
 				return -1;
 			}
 
+			/* Which is already in the form raw byte files want */
+			if(raw_bytes) {
+				fwrite(file_buf, file_len, 1, output_file);
+				free(file_buf);
+				continue;
+			}
 
 			/* Convert to bits */
 			double* bit_buf = buf_to_bits(file_buf, &bit_len, file_len);
@@ -86,20 +97,79 @@ int export_training_data(char** input_filenames, char** expected_output_filename
 }
 
 
-int import_training_data(char* filename, test_case** ret_cases, size_t* num_cases) {
-	size_t file_length;
+typedef struct {
+	test_case* cases;
+	file_test_case* case_info;
 	char* file_buf;
+	size_t* case_offsets;
+	bool raw_bytes;
+	atomic_bool failed;
+} case_load_job;
+
+/* How many bytes a cases input and output take up in a file */
+static size_t case_data_len(training_data_header* header, file_test_case* info) {
+	if(header->magic == TRAINING_DATA_RAW_MAGIC) {
+		return info->input_len + (info->output_len + 7) / 8;
+	}
+	return (info->input_len + info->output_len) * sizeof(double);
+}
 
-	int ret = read_file(filename, &file_buf, &file_length);
-	if(ret != 0) {
-		return -1;
+/* Expand a raw byte case, a double per input byte and per output bit */
+static void expand_raw_case(test_case* curr_case, unsigned char* data) {
+	for(size_t i = 0; i < curr_case->input_len; i += 1) {
+		curr_case->input[i] = data[i];
+	}
+
+	unsigned char* output = &data[curr_case->input_len];
+	for(size_t i = 0; i < curr_case->output_len; i += 1) {
+		curr_case->expected_output[i] = (output[i / 8] >> (7 - i % 8)) & 1;
+	}
+}
+
+static void load_cases(size_t start, size_t end, void* arg) {
+	case_load_job* job = arg;
+
+	for(size_t i = start; i < end; i += 1) {
+
+		/* Set the current cases input and output length */
+		test_case* curr_case = &job->cases[i];
+
+		curr_case->input_len = job->case_info[i].input_len;
+		curr_case->output_len = job->case_info[i].output_len;
+
+		/* Allocate our input and expected output */
+		curr_case->input = malloc(curr_case->input_len * sizeof(double));
+		curr_case->expected_output = malloc(curr_case->output_len * sizeof(double));
+		if(!curr_case->input || !curr_case->expected_output) {
+			atomic_store(&job->failed, true);
+			return;
+		}
+
+		/* Copy our input and expected output into place */
+		size_t file_offset = job->case_offsets[i];
+		if(job->raw_bytes) {
+			expand_raw_case(curr_case, (unsigned char*)&job->file_buf[file_offset]);
+			continue;
+		}
+
+		memcpy(curr_case->input, &job->file_buf[file_offset], curr_case->input_len * sizeof(double));
+		file_offset += curr_case->input_len * sizeof(double);
+
+		memcpy(curr_case->expected_output, &job->file_buf[file_offset], curr_case->output_len * sizeof(double));
 	}
+}
+
+int import_training_data(char* filename, test_case** ret_cases, size_t* num_cases) {
+	return import_training_data_shard(filename, 0, 1, ret_cases, num_cases);
+}
+
+/* Check a training file is well formed, and find the case table */
+static file_test_case* check_training_data(char* file_buf, size_t file_length) {
 
 	/* Verify we can fit a file header at least */
 	if(file_length < sizeof(training_data_header)) {
 		error("File too small\n");
-		free(file_buf);
-		return -1;
+		return NULL;
 
 	}
 
@@ -107,10 +177,9 @@ int import_training_data(char* filename, test_case** ret_cases, size_t* num_case
 	training_data_header* header = (training_data_header*)file_buf;
 
 	/* Verify file magic */
-	if(header->magic != TRAINING_DATA_MAGIC) {
+	if(header->magic != TRAINING_DATA_MAGIC && header->magic != TRAINING_DATA_RAW_MAGIC) {
 		error("Bad magic file\n");		
-		free(file_buf);
-		return -1;
+		return NULL;
 	}
 
 	/* Calculate the end of the file */
@@ -119,71 +188,101 @@ int import_training_data(char* filename, test_case** ret_cases, size_t* num_case
 
 	if(file_length < file_end) {
 		error("File too small\n");		
-		free(file_buf);
-		return -1;
+		return NULL;
 	}
 
 	file_test_case* test_case_info = (file_test_case*)&file_buf[sizeof(training_data_header)];
 
 	/* Update the end of the file */
 	for(int i = 0; i < header->num_test_cases; i += 1) {
-		file_end += test_case_info[i].input_len * sizeof(double);
-		file_end += test_case_info[i].output_len * sizeof(double);
+		file_end += case_data_len(header, &test_case_info[i]);
 	}
 
 	/* Verify we're safe */
 	if(file_length < file_end) {
 		error("File too small\n");		
+		return NULL;
+	}
+
+	return test_case_info;
+}
+
+/* Work out where each case starts in the file */
+static size_t* training_data_offsets(training_data_header* header, file_test_case* test_case_info) {
+	size_t* case_offsets = malloc(header->num_test_cases * sizeof(size_t));
+	if(!case_offsets) {
+		error("Failed to allocate test case offsets\n");
+		return NULL;
+	}
+
+	size_t file_offset = sizeof(training_data_header) + sizeof(file_test_case) * header->num_test_cases;
+
+	for(int i = 0; i < header->num_test_cases; i += 1) {
+		case_offsets[i] = file_offset;
+		file_offset += case_data_len(header, &test_case_info[i]);
+	}
+	return case_offsets;
+}
+
+/* Import the cases for one of num_shards contiguous shards of a training file */
+int import_training_data_shard(char* filename, size_t shard, size_t num_shards, test_case** ret_cases, size_t* num_cases) {
+	size_t file_length;
+	char* file_buf;
+
+	int ret = read_file(filename, &file_buf, &file_length);
+	if(ret != 0) {
+		return -1;
+	}
+
+	file_test_case* test_case_info = check_training_data(file_buf, file_length);
+	if(!test_case_info) {
 		free(file_buf);
 		return -1;
 	}
 
+	training_data_header* header = (training_data_header*)file_buf;
+
+	/* Work out which cases belong to our shard */
+	size_t first_case = (header->num_test_cases * shard) / num_shards;
+	size_t last_case = (header->num_test_cases * (shard + 1)) / num_shards;
+	*num_cases = last_case - first_case;
+
 	/* Allocate our test cases */
-	*ret_cases = malloc(header->num_test_cases * sizeof(test_case));
+	*ret_cases = malloc(*num_cases * sizeof(test_case));
 	if(!*ret_cases) {
 		error("Failed to allocate test case buffer\n");		
 		free(file_buf);
 		return -1;
 	}
-	*num_cases = header->num_test_cases;
-	
-	size_t file_offset = sizeof(training_data_header) + sizeof(file_test_case) * header->num_test_cases;
+	bzero(*ret_cases, *num_cases * sizeof(test_case));
 
-	for(int i = 0; i < header->num_test_cases; i += 1) {
-
-		/* Set the current cases input and output length */
-		test_case* curr_case = &(*ret_cases[i]);
-
-		curr_case->input_len = test_case_info[i].input_len;
-		curr_case->output_len = test_case_info[i].output_len;
-
-		/* Allocate our input */
-		curr_case->input = malloc(curr_case->input_len * sizeof(double));
-		if(!curr_case->input) {
-			error("Failed to allocate test case buffer\n");		
-			test_cases_free(*ret_cases, i);
-			free(file_buf);
-			return -1;
-		}
+	/* Load every case on the thread pool */
+	size_t* case_offsets = training_data_offsets(header, test_case_info);
+	if(!case_offsets) {
+		free(*ret_cases);
+		free(file_buf);
+		return -1;
+	}
 
-		/* Allocate our expected output */
-		curr_case->expected_output = malloc(curr_case->output_len * sizeof(double));
-		if(!curr_case->expected_output) {
-			error("Failed to allocate test case buffer\n");
-			free(curr_case->input);	
-			test_cases_free(*ret_cases, i);
-			free(file_buf);
-			return -1;
-		}
+	case_load_job job = {.cases=*ret_cases, .case_info=&test_case_info[first_case], .file_buf=file_buf, .case_offsets=&case_offsets[first_case]};
+	job.raw_bytes = header->magic == TRAINING_DATA_RAW_MAGIC;
+	atomic_init(&job.failed, false);
 
-		/* Copy our input and expected output into place */
-		memcpy(curr_case->input, &file_buf[file_offset], test_case_info[i].input_len * sizeof(double));
-		file_offset += test_case_info[i].input_len * sizeof(double);
+	thread_pool_parallel_for(thread_pool_global(), *num_cases, 1, load_cases, &job);
+	free(case_offsets);
 
-		memcpy(curr_case->expected_output, &file_buf[file_offset], test_case_info[i].output_len * sizeof(double));
-		file_offset += test_case_info[i].output_len * sizeof(double);
+	if(atomic_load(&job.failed)) {
+		error("Failed to allocate test case buffer\n");
+		test_cases_free(*ret_cases, *num_cases);
+		free(*ret_cases);
+		free(file_buf);
+		return -1;
+	}
 
 #ifdef INFO
+	for(int i = 0; i < *num_cases; i += 1) {
+		test_case* curr_case = &(*ret_cases)[i];
+
 		printf("[*] Case input: ");
 		for(int j = 0; j < curr_case->input_len; j += 1) {
 			printf("%f ", curr_case->input[j]);
@@ -195,12 +294,95 @@ int import_training_data(char* filename, test_case** ret_cases, size_t* num_case
 			printf("%f ", curr_case->expected_output[j]);
 		}
 		printf("\n");
-
-#endif
-
 	}
+#endif
 
 
 	free(file_buf);
 	return 0;
 }
+
+/* Map a shard of a training file, pointing the cases straight at their data rather than copying it */
+mapped_training_data* map_training_data_shard(char* filename, size_t shard, size_t num_shards) {
+	int fd = open(filename, O_RDONLY);
+	if(fd < 0) {
+		error("Failed to open training data\n");
+		return NULL;
+	}
+
+	struct stat file_stat;
+	if(fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+		error("Failed to stat training data\n");
+		close(fd);
+		return NULL;
+	}
+
+	char* mapping = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(mapping == MAP_FAILED) {
+		error("Failed to map training data\n");
+		return NULL;
+	}
+
+	file_test_case* test_case_info = check_training_data(mapping, file_stat.st_size);
+	if(!test_case_info) {
+		munmap(mapping, file_stat.st_size);
+		return NULL;
+	}
+
+	training_data_header* header = (training_data_header*)mapping;
+
+	/* Raw byte cases have to be expanded, so there's nothing to point at */
+	if(header->magic == TRAINING_DATA_RAW_MAGIC) {
+		error("Raw byte training data can't be mapped\n");
+		munmap(mapping, file_stat.st_size);
+		return NULL;
+	}
+
+	mapped_training_data* ret = malloc(sizeof(mapped_training_data));
+	if(!ret) {
+		error("Failed to allocate mapped training data\n");
+		munmap(mapping, file_stat.st_size);
+		return NULL;
+	}
+	ret->mapping = mapping;
+	ret->mapping_len = file_stat.st_size;
+
+	/* Work out which cases belong to our shard */
+	size_t first_case = (header->num_test_cases * shard) / num_shards;
+	size_t last_case = (header->num_test_cases * (shard + 1)) / num_shards;
+	ret->num_cases = last_case - first_case;
+
+	size_t* case_offsets = training_data_offsets(header, test_case_info);
+	ret->cases = malloc(ret->num_cases * sizeof(test_case));
+	if(!case_offsets || !ret->cases) {
+		error("Failed to allocate test case buffer\n");
+		free(case_offsets);
+		free(ret->cases);
+		free(ret);
+		munmap(mapping, file_stat.st_size);
+		return NULL;
+	}
+
+	for(size_t i = 0; i < ret->num_cases; i += 1) {
+		test_case* curr_case = &ret->cases[i];
+		size_t file_offset = case_offsets[first_case + i];
+
+		curr_case->input_len = test_case_info[first_case + i].input_len;
+		curr_case->output_len = test_case_info[first_case + i].output_len;
+		curr_case->input = (double*)&mapping[file_offset];
+		curr_case->expected_output = (double*)&mapping[file_offset + curr_case->input_len * sizeof(double)];
+	}
+	free(case_offsets);
+
+	/* Cases are usually visited in a shuffled order, so don't bother reading ahead */
+	madvise(mapping, ret->mapping_len, MADV_RANDOM);
+
+	return ret;
+}
+
+void unmap_training_data(mapped_training_data* data) {
+	munmap(data->mapping, data->mapping_len);
+	free(data->cases);
+	free(data);
+}
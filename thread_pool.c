@@ -0,0 +1,575 @@
+#define _GNU_SOURCE
+#include <includes/common.h>
+#include <sched.h>
+#include <dirent.h>
+#include <unistd.h>
+
+#define INITIAL_QUEUE_CAPACITY 64
+#define MAX_CHUNKS_PER_WORKER 4
+
+static thread_pool* global_pool = NULL;
+static pthread_mutex_t global_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The worker the current thread belongs to, NULL for threads outside of a pool */
+static _Thread_local pool_worker* current_worker = NULL;
+
+static uint64_t time_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Parse a sysfs cpu list such as "0-3,8-11" into a cpu to node map */
+static void parse_cpu_list(char* list, int node, int* cpu_nodes, int max_cpus) {
+	char* token = strtok(list, ",\n");
+	while(token != NULL) {
+		int first, last;
+		int matched = sscanf(token, "%d-%d", &first, &last);
+		if(matched == 1) {
+			last = first;
+		}
+
+		for(int cpu = first; matched >= 1 && cpu <= last && cpu < max_cpus; cpu += 1) {
+			if(cpu >= 0) {
+				cpu_nodes[cpu] = node;
+			}
+		}
+		token = strtok(NULL, ",\n");
+	}
+}
+
+/* Read the NUMA topology from sysfs, every cpu defaults to node 0 */
+static void read_cpu_nodes(int* cpu_nodes, int max_cpus) {
+	bzero(cpu_nodes, sizeof(int) * max_cpus);
+
+	DIR* dir = opendir("/sys/devices/system/node");
+	if(!dir) {
+		return;
+	}
+
+	struct dirent* entry;
+	while((entry = readdir(dir)) != NULL) {
+		int node;
+		if(sscanf(entry->d_name, "node%d", &node) != 1) {
+			continue;
+		}
+
+		char path[256];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+
+		FILE* f = fopen(path, "r");
+		if(!f) {
+			continue;
+		}
+
+		char list[1024];
+		if(fgets(list, sizeof(list), f)) {
+			parse_cpu_list(list, node, cpu_nodes, max_cpus);
+		}
+		fclose(f);
+	}
+	closedir(dir);
+}
+
+size_t thread_pool_default_size(void) {
+	cpu_set_t set;
+	if(sched_getaffinity(0, sizeof(set), &set) == 0) {
+		return CPU_COUNT(&set);
+	}
+
+	long online = sysconf(_SC_NPROCESSORS_ONLN);
+	return online > 0 ? online : 1;
+}
+
+int thread_pool_current_node(void) {
+	if(current_worker) {
+		return current_worker->node;
+	}
+
+	/* Work it out from the cpu we're running on */
+	unsigned int cpu, node;
+	if(getcpu(&cpu, &node) != 0) {
+		return 0;
+	}
+	return node;
+}
+
+/* Place workers on the cpus we may run on, filling one NUMA node before moving onto the next */
+static void place_workers(thread_pool* pool) {
+	int cpu_nodes[CPU_SETSIZE];
+	read_cpu_nodes(cpu_nodes, CPU_SETSIZE);
+
+	cpu_set_t allowed;
+	if(sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+		CPU_ZERO(&allowed);
+		for(int cpu = 0; cpu < CPU_SETSIZE; cpu += 1) {
+			CPU_SET(cpu, &allowed);
+		}
+	}
+
+	/* Build a list of allowed cpus ordered by node */
+	int ordered[CPU_SETSIZE];
+	size_t num_cpus = 0;
+	for(int node = 0; node < CPU_SETSIZE && num_cpus < CPU_COUNT(&allowed); node += 1) {
+		for(int cpu = 0; cpu < CPU_SETSIZE; cpu += 1) {
+			if(CPU_ISSET(cpu, &allowed) && cpu_nodes[cpu] == node) {
+				ordered[num_cpus] = cpu;
+				num_cpus += 1;
+			}
+		}
+	}
+
+	for(size_t i = 0; i < pool->num_workers; i += 1) {
+		if(num_cpus == 0) {
+			pool->workers[i].cpu = -1;
+			pool->workers[i].node = 0;
+			continue;
+		}
+		pool->workers[i].cpu = ordered[i % num_cpus];
+		pool->workers[i].node = cpu_nodes[pool->workers[i].cpu];
+	}
+}
+
+static int queue_push(pool_worker* worker, pool_task* task) {
+	pthread_mutex_lock(&worker->lock);
+
+	/* Grow the ring buffer if it's full */
+	if(worker->num_tasks == worker->capacity) {
+		size_t new_capacity = worker->capacity * 2;
+		pool_task* new_tasks = malloc(sizeof(pool_task) * new_capacity);
+		if(!new_tasks) {
+			pthread_mutex_unlock(&worker->lock);
+			error("Failed to grow worker task queue\n");
+			return -1;
+		}
+
+		for(size_t i = 0; i < worker->num_tasks; i += 1) {
+			new_tasks[i] = worker->tasks[(worker->head + i) % worker->capacity];
+		}
+
+		free(worker->tasks);
+		worker->tasks = new_tasks;
+		worker->head = 0;
+		worker->capacity = new_capacity;
+	}
+
+	worker->tasks[(worker->head + worker->num_tasks) % worker->capacity] = *task;
+	worker->num_tasks += 1;
+
+	pthread_mutex_unlock(&worker->lock);
+	return 0;
+}
+
+/* The owner takes the newest task, thieves take the oldest */
+static bool queue_pop(pool_worker* worker, pool_task* task, bool steal) {
+	pthread_mutex_lock(&worker->lock);
+
+	if(worker->num_tasks == 0) {
+		pthread_mutex_unlock(&worker->lock);
+		return false;
+	}
+
+	if(steal) {
+		*task = worker->tasks[worker->head];
+		worker->head = (worker->head + 1) % worker->capacity;
+	}
+	else {
+		*task = worker->tasks[(worker->head + worker->num_tasks - 1) % worker->capacity];
+	}
+	worker->num_tasks -= 1;
+
+	pthread_mutex_unlock(&worker->lock);
+	return true;
+}
+
+static bool find_task(thread_pool* pool, pool_worker* self, pool_task* task, bool* stolen) {
+
+	*stolen = false;
+
+	if(atomic_load(&pool->num_queued) == 0) {
+		return false;
+	}
+
+	/* Check our own queue first */
+	if(self && queue_pop(self, task, false)) {
+		atomic_fetch_sub(&pool->num_queued, 1);
+		return true;
+	}
+
+	/* Try to steal, preferring workers on our own NUMA node */
+	size_t start = self ? self->index + 1 : 0;
+	for(int pass = 0; pass < 2; pass += 1) {
+		for(size_t i = 0; i < pool->num_workers; i += 1) {
+			pool_worker* victim = &pool->workers[(start + i) % pool->num_workers];
+			if(victim == self) {
+				continue;
+			}
+
+			bool same_node = !self || victim->node == self->node;
+			if(same_node != (pass == 0)) {
+				continue;
+			}
+
+			if(queue_pop(victim, task, true)) {
+				atomic_fetch_sub(&pool->num_queued, 1);
+				*stolen = true;
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+static void run_task(pool_worker* worker, pool_task* task, bool stolen) {
+	uint64_t start = time_ns();
+
+	task->func(task->arg);
+
+	/* Record our statistics */
+	if(worker) {
+		pthread_mutex_lock(&worker->lock);
+		worker->stats.busy_ns += time_ns() - start;
+		worker->stats.tasks_run += 1;
+		worker->stats.tasks_stolen += stolen;
+		pthread_mutex_unlock(&worker->lock);
+	}
+
+	/* Let anyone waiting on the group know we're done */
+	task_group* group = task->group;
+	pthread_mutex_lock(&group->lock);
+	group->pending -= 1;
+	if(group->pending == 0) {
+		pthread_cond_broadcast(&group->done);
+	}
+	pthread_mutex_unlock(&group->lock);
+}
+
+static void* worker_main(void* arg) {
+	pool_worker* worker = arg;
+	thread_pool* pool = worker->pool;
+
+	current_worker = worker;
+
+	while(true) {
+		pool_task task;
+		bool stolen;
+
+		if(find_task(pool, worker, &task, &stolen)) {
+			run_task(worker, &task, stolen);
+			continue;
+		}
+
+		/* Sleep until there's more work */
+		pthread_mutex_lock(&pool->lock);
+		while(atomic_load(&pool->num_queued) == 0 && !pool->shutdown) {
+			pthread_cond_wait(&pool->work_available, &pool->lock);
+		}
+
+		bool exit = pool->shutdown && atomic_load(&pool->num_queued) == 0;
+		pthread_mutex_unlock(&pool->lock);
+
+		if(exit) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+thread_pool* thread_pool_create(size_t num_workers, bool pin_workers) {
+
+	if(num_workers == 0) {
+		num_workers = thread_pool_default_size();
+	}
+
+	thread_pool* pool = malloc(sizeof(thread_pool));
+	if(!pool) {
+		error("Failed to allocate thread pool\n");
+		return NULL;
+	}
+	bzero(pool, sizeof(thread_pool));
+
+	pool->workers = malloc(sizeof(pool_worker) * num_workers);
+	if(!pool->workers) {
+		error("Failed to allocate thread pool workers\n");
+		free(pool);
+		return NULL;
+	}
+	bzero(pool->workers, sizeof(pool_worker) * num_workers);
+
+	pool->num_workers = num_workers;
+	pool->start_ns = time_ns();
+	atomic_init(&pool->num_queued, 0);
+	atomic_init(&pool->next_worker, 0);
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work_available, NULL);
+
+	place_workers(pool);
+
+	/* Setup every workers queue before any of them start stealing */
+	for(size_t i = 0; i < num_workers; i += 1) {
+		pool_worker* worker = &pool->workers[i];
+		worker->pool = pool;
+		worker->index = i;
+		worker->capacity = INITIAL_QUEUE_CAPACITY;
+		pthread_mutex_init(&worker->lock, NULL);
+
+		worker->tasks = malloc(sizeof(pool_task) * worker->capacity);
+		if(!worker->tasks) {
+			error("Failed to allocate worker task queue\n");
+			pool->num_workers = i;
+			thread_pool_free(pool);
+			return NULL;
+		}
+	}
+
+	for(size_t i = 0; i < num_workers; i += 1) {
+		pool_worker* worker = &pool->workers[i];
+
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+
+		/* Pin the worker to its cpu */
+		if(pin_workers && worker->cpu >= 0) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(worker->cpu, &set);
+			pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+		}
+
+		int ret = pthread_create(&worker->thread, &attr, worker_main, worker);
+		pthread_attr_destroy(&attr);
+
+		if(ret != 0) {
+			error("Failed to create worker thread\n");
+
+			/* Only join the threads we managed to start */
+			for(size_t j = i; j < num_workers; j += 1) {
+				free(pool->workers[j].tasks);
+				pthread_mutex_destroy(&pool->workers[j].lock);
+			}
+			pool->num_workers = i;
+			thread_pool_free(pool);
+			return NULL;
+		}
+	}
+
+	return pool;
+}
+
+void thread_pool_free(thread_pool* pool) {
+
+	/* Wake everyone up and tell them to exit */
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = true;
+	pthread_cond_broadcast(&pool->work_available);
+	pthread_mutex_unlock(&pool->lock);
+
+	for(size_t i = 0; i < pool->num_workers; i += 1) {
+		pool_worker* worker = &pool->workers[i];
+		if(worker->thread) {
+			pthread_join(worker->thread, NULL);
+		}
+		free(worker->tasks);
+		pthread_mutex_destroy(&worker->lock);
+	}
+
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->work_available);
+	free(pool->workers);
+	free(pool);
+}
+
+int thread_pool_init_global(size_t num_workers) {
+	pthread_mutex_lock(&global_pool_lock);
+
+	/* Replace any pool created lazily before we were configured */
+	if(global_pool) {
+		thread_pool_free(global_pool);
+	}
+
+	global_pool = thread_pool_create(num_workers, true);
+	pthread_mutex_unlock(&global_pool_lock);
+
+	return global_pool ? 0 : -1;
+}
+
+thread_pool* thread_pool_global(void) {
+	pthread_mutex_lock(&global_pool_lock);
+
+	/* Lazily create a pool with a worker per cpu */
+	if(!global_pool) {
+		global_pool = thread_pool_create(0, true);
+	}
+
+	thread_pool* ret = global_pool;
+	pthread_mutex_unlock(&global_pool_lock);
+	return ret;
+}
+
+void thread_pool_free_global(void) {
+	pthread_mutex_lock(&global_pool_lock);
+	if(global_pool) {
+		thread_pool_free(global_pool);
+		global_pool = NULL;
+	}
+	pthread_mutex_unlock(&global_pool_lock);
+}
+
+void task_group_init(task_group* group) {
+	group->pending = 0;
+	pthread_mutex_init(&group->lock, NULL);
+	pthread_cond_init(&group->done, NULL);
+}
+
+void task_group_destroy(task_group* group) {
+	pthread_mutex_destroy(&group->lock);
+	pthread_cond_destroy(&group->done);
+}
+
+void task_group_wait(thread_pool* pool, task_group* group) {
+	while(true) {
+		pthread_mutex_lock(&group->lock);
+		bool finished = group->pending == 0;
+		pthread_mutex_unlock(&group->lock);
+
+		if(finished) {
+			return;
+		}
+
+		/* Help out rather than blocking, so nested waits can't deadlock the pool */
+		pool_task task;
+		bool stolen;
+		if(find_task(pool, current_worker, &task, &stolen)) {
+			run_task(current_worker, &task, stolen);
+			continue;
+		}
+
+		/* Nothing to run, so wait for the group (or more work) for a short while */
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += 1000000;
+		if(deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec += 1;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		pthread_mutex_lock(&group->lock);
+		if(group->pending > 0) {
+			pthread_cond_timedwait(&group->done, &group->lock, &deadline);
+		}
+		pthread_mutex_unlock(&group->lock);
+	}
+}
+
+int thread_pool_submit(thread_pool* pool, task_group* group, task_func func, void* arg) {
+	pool_task task = {.func=func, .arg=arg, .group=group};
+
+	/* Workers push onto their own queue, everyone else spreads tasks round robin */
+	pool_worker* target = current_worker;
+	if(!target || target->pool != pool) {
+		target = &pool->workers[atomic_fetch_add(&pool->next_worker, 1) % pool->num_workers];
+	}
+
+	pthread_mutex_lock(&group->lock);
+	group->pending += 1;
+	pthread_mutex_unlock(&group->lock);
+
+	/* Count the task before it's visible, so a thief can never take the count below zero */
+	atomic_fetch_add(&pool->num_queued, 1);
+
+	if(queue_push(target, &task) != 0) {
+		atomic_fetch_sub(&pool->num_queued, 1);
+		pthread_mutex_lock(&group->lock);
+		group->pending -= 1;
+		pthread_mutex_unlock(&group->lock);
+		return -1;
+	}
+
+	/* Wake a sleeping worker */
+	pthread_mutex_lock(&pool->lock);
+	pthread_cond_signal(&pool->work_available);
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+typedef struct {
+	range_func func;
+	void* arg;
+	size_t start;
+	size_t end;
+} range_chunk;
+
+static void run_range_chunk(void* arg) {
+	range_chunk* chunk = arg;
+	chunk->func(chunk->start, chunk->end, chunk->arg);
+}
+
+void thread_pool_parallel_for(thread_pool* pool, size_t count, size_t grain, range_func func, void* arg) {
+
+	if(grain == 0) {
+		grain = 1;
+	}
+
+	/* Small loops aren't worth splitting up */
+	if(!pool || pool->num_workers < 2 || count <= grain) {
+		func(0, count, arg);
+		return;
+	}
+
+	/* Split the range up into chunks of at least grain iterations */
+	size_t max_chunks = pool->num_workers * MAX_CHUNKS_PER_WORKER;
+	size_t chunk_size = (count + max_chunks - 1) / max_chunks;
+	if(chunk_size < grain) {
+		chunk_size = grain;
+	}
+	size_t num_chunks = (count + chunk_size - 1) / chunk_size;
+
+	range_chunk* chunks = malloc(sizeof(range_chunk) * num_chunks);
+	if(!chunks) {
+		func(0, count, arg);
+		return;
+	}
+
+	task_group group;
+	task_group_init(&group);
+
+	for(size_t i = 0; i < num_chunks; i += 1) {
+		chunks[i].func = func;
+		chunks[i].arg = arg;
+		chunks[i].start = i * chunk_size;
+		chunks[i].end = (i + 1) * chunk_size > count ? count : (i + 1) * chunk_size;
+
+		/* If we can't queue it, do it ourselves */
+		if(thread_pool_submit(pool, &group, run_range_chunk, &chunks[i]) != 0) {
+			run_range_chunk(&chunks[i]);
+		}
+	}
+
+	task_group_wait(pool, &group);
+	task_group_destroy(&group);
+	free(chunks);
+}
+
+void thread_pool_get_stats(thread_pool* pool, size_t worker_index, worker_stats* stats) {
+	pool_worker* worker = &pool->workers[worker_index];
+
+	pthread_mutex_lock(&worker->lock);
+	*stats = worker->stats;
+	pthread_mutex_unlock(&worker->lock);
+}
+
+void thread_pool_print_stats(thread_pool* pool) {
+	uint64_t elapsed = time_ns() - pool->start_ns;
+
+	printf("[*] Thread pool: %zu workers, %.3fs elapsed\n", pool->num_workers, elapsed / 1e9);
+	printf("[*] worker  cpu  node  tasks      stolen     busy(s)    utilisation\n");
+
+	for(size_t i = 0; i < pool->num_workers; i += 1) {
+		worker_stats stats;
+		thread_pool_get_stats(pool, i, &stats);
+
+		double utilisation = elapsed ? (100.0 * stats.busy_ns) / elapsed : 0;
+		printf("[*] %-7zu %-4d %-5d %-10lu %-10lu %-10.3f %.1f%%\n", i, pool->workers[i].cpu, pool->workers[i].node, stats.tasks_run, stats.tasks_stolen, stats.busy_ns / 1e9, utilisation);
+	}
+}